@@ -22,7 +22,9 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/asio/ssl.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
+#include <deque>
 #include <list>
 
 using namespace std;
@@ -90,6 +92,84 @@ void RPCTypeCheck(const Object& o,
     }
 }
 
+void CJSONStreamWriter::Separate()
+{
+    if (fAfterKey)
+        fAfterKey = false;
+    else if (!vEmpty.empty())
+    {
+        if (!vEmpty.back())
+            stream << ',';
+        vEmpty.back() = false;
+    }
+}
+
+void CJSONStreamWriter::BeginObject()
+{
+    Separate();
+    stream << '{';
+    vEmpty.push_back(true);
+}
+
+void CJSONStreamWriter::EndObject()
+{
+    vEmpty.pop_back();
+    stream << '}';
+}
+
+void CJSONStreamWriter::BeginArray()
+{
+    Separate();
+    stream << '[';
+    vEmpty.push_back(true);
+}
+
+void CJSONStreamWriter::EndArray()
+{
+    vEmpty.pop_back();
+    stream << ']';
+}
+
+void CJSONStreamWriter::Key(const string& strKey)
+{
+    Separate();
+    write_stream(Value(strKey), stream, false);
+    stream << ':';
+    fAfterKey = true;
+}
+
+void CJSONStreamWriter::Write(const Value& value)
+{
+    Separate();
+    write_stream(value, stream, false);
+}
+
+// Values are added to the innermost open object or array only, so the
+// pointers to the enclosing ones stay valid
+Value* CJSONValueWriter::Add(const Value& value)
+{
+    if (vOpen.empty())
+    {
+        result = value;
+        return &result;
+    }
+    Value& parent = *vOpen.back();
+    if (parent.type() == obj_type)
+    {
+        parent.get_obj().push_back(Pair(strKey, value));
+        return &parent.get_obj().back().value_;
+    }
+    parent.get_array().push_back(value);
+    return &parent.get_array().back();
+}
+
+Value RPCStreamToValue(rpcstreamfn_type pfn, const Array& params, bool fHelp)
+{
+    CJSONValueWriter writer;
+    pfn(params, fHelp, writer);
+    return writer.GetValue();
+}
+
 int64 AmountFromValue(const Value& value)
 {
     double dAmount = value.get_real();
@@ -189,6 +269,115 @@ Value stop(const Array& params, bool fHelp)
 }
 
 
+//
+// Call statistics
+//
+
+/** Calls, errors and latencies of one RPC method. Latency bucket i counts the
+ *  calls that took less than 2^i microseconds (and at least 2^(i-1)); the last
+ *  bucket counts all slower calls. */
+class CRPCMethodStats
+{
+public:
+    static const int BUCKETS = 24;
+
+    uint64 nCalls;
+    uint64 nErrors;
+    int64 nTotalMicros;
+    int64 nMaxMicros;
+    uint64 vBuckets[BUCKETS];
+
+    CRPCMethodStats() : nCalls(0), nErrors(0), nTotalMicros(0), nMaxMicros(0)
+    {
+        memset(vBuckets, 0, sizeof(vBuckets));
+    }
+
+    void Add(int64 nMicros, bool fError)
+    {
+        nCalls++;
+        if (fError)
+            nErrors++;
+        nTotalMicros += nMicros;
+        nMaxMicros = std::max(nMaxMicros, nMicros);
+        int nBucket = 0;
+        while (nBucket < BUCKETS - 1 && nMicros >= ((int64)1 << nBucket))
+            nBucket++;
+        vBuckets[nBucket]++;
+    }
+};
+
+static CCriticalSection cs_rpcStats;
+static map<string, CRPCMethodStats> mapRPCStats;
+
+/** Records the duration of a call when it goes out of scope */
+class CRPCCallTimer
+{
+private:
+    const string& strMethod;
+    int64 nStart;
+
+public:
+    bool fError;
+
+    CRPCCallTimer(const string& strMethodIn) : strMethod(strMethodIn), nStart(GetTimeMicros()), fError(true) {}
+
+    ~CRPCCallTimer()
+    {
+        int64 nMicros = GetTimeMicros() - nStart;
+        LOCK(cs_rpcStats);
+        mapRPCStats[strMethod].Add(nMicros, fError);
+    }
+};
+
+Value getrpcstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getrpcstats [reset=false]\n"
+            "Returns the number of calls and errors and a latency histogram for each RPC method\n"
+            "called since startup. If reset is true, the statistics are cleared afterwards.");
+
+    bool fReset = false;
+    if (params.size() > 0)
+        fReset = params[0].get_bool();
+
+    map<string, CRPCMethodStats> mapStats;
+    {
+        LOCK(cs_rpcStats);
+        mapStats = mapRPCStats;
+        if (fReset)
+            mapRPCStats.clear();
+    }
+
+    Object ret;
+    for (map<string, CRPCMethodStats>::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it)
+    {
+        const CRPCMethodStats& stats = (*it).second;
+        Object obj;
+        obj.push_back(Pair("calls", (boost::uint64_t)stats.nCalls));
+        obj.push_back(Pair("errors", (boost::uint64_t)stats.nErrors));
+        obj.push_back(Pair("avgms", stats.nCalls ? (double)stats.nTotalMicros / stats.nCalls / 1000 : 0.0));
+        obj.push_back(Pair("maxms", (double)stats.nMaxMicros / 1000));
+        Array histogram;
+        for (int i = 0; i < CRPCMethodStats::BUCKETS; i++)
+        {
+            if (!stats.vBuckets[i])
+                continue;
+            Object bucket;
+            if (i < CRPCMethodStats::BUCKETS - 1)
+                bucket.push_back(Pair("belowus", (boost::int64_t)1 << i));
+            else
+                bucket.push_back(Pair("atleastus", (boost::int64_t)1 << (i - 1)));
+            bucket.push_back(Pair("count", (boost::uint64_t)stats.vBuckets[i]));
+            histogram.push_back(bucket);
+        }
+        obj.push_back(Pair("histogram", histogram));
+        ret.push_back(Pair((*it).first, obj));
+    }
+    return ret;
+}
+
+
 
 //
 // Call Table
@@ -196,22 +385,22 @@ Value stop(const Array& params, bool fHelp)
 
 
 static const CRPCCommand vRPCCommands[] =
-{ //  name                      actor (function)         okSafeMode threadSafe reqWallet
-  //  ------------------------  -----------------------  ---------- ---------- ---------
+{ //  name                      actor (function)         okSafeMode threadSafe reqWallet  streamActor
+  //  ------------------------  -----------------------  ---------- ---------- ---------  --------------
     { "help",                   &help,                   true,      true,       false },
     { "stop",                   &stop,                   true,      true,       false },
-    { "getblockcount",          &getblockcount,          true,      false,      false },
-    { "getbestblockhash",       &getbestblockhash,       true,      false,      false },
+    { "getblockcount",          &getblockcount,          true,      true,       false },
+    { "getbestblockhash",       &getbestblockhash,       true,      true,       false },
     { "getchains",              &getchains,              true,      false,      false },
     { "getconnectioncount",     &getconnectioncount,     true,      false,      false },
-    { "getpeerinfo",            &getpeerinfo,            true,      false,      false },
+    { "getpeerinfo",            &getpeerinfo,            true,      true,       false,      &getpeerinfo },
     { "addnode",                &addnode,                true,      true,       false },
     { "getaddednodeinfo",       &getaddednodeinfo,       true,      true,       false },
     { "getdifficulty",          &getdifficulty,          true,      false,      false },
     { "getnetworkhashps",       &getnetworkhashps,       true,      false,      false },
     { "gethashespersec",        &gethashespersec,        true,      false,      false },
     { "getinfo",                &getinfo,                true,      false,      false },
-    { "getmininginfo",          &getmininginfo,          true,      false,      false },
+    { "getmininginfo",          &getmininginfo,          true,      true,       false },
     { "getnewaddress",          &getnewaddress,          true,      false,      true },
     { "getaccountaddress",      &getaccountaddress,      true,      false,      true },
     { "setaccount",             &setaccount,             true,      false,      true },
@@ -235,11 +424,11 @@ static const CRPCCommand vRPCCommands[] =
     { "sendmany",               &sendmany,               false,     false,      true },
     { "addmultisigaddress",     &addmultisigaddress,     false,     false,      true },
     { "createmultisig",         &createmultisig,         true,      true ,      false },
-    { "getrawmempool",          &getrawmempool,          true,      false,      false },
-    { "getblock",               &getblock,               false,     false,      false },
-    { "getblockhash",           &getblockhash,           false,     false,      false },
+    { "getrawmempool",          &getrawmempool,          true,      true,       false,      &getrawmempool },
+    { "getblock",               &getblock,               false,     true,       false,      &getblock },
+    { "getblockhash",           &getblockhash,           false,     true,       false },
     { "gettransaction",         &gettransaction,         false,     false,      true },
-    { "listtransactions",       &listtransactions,       false,     false,      true },
+    { "listtransactions",       &listtransactions,       false,     true,       true,       &listtransactions },
     { "listaddressgroupings",   &listaddressgroupings,   false,     false,      true },
     { "signmessage",            &signmessage,            false,     false,      true },
     { "verifymessage",          &verifymessage,          false,     false,      false },
@@ -252,8 +441,8 @@ static const CRPCCommand vRPCCommands[] =
     { "setmininput",            &setmininput,            false,     false,      false },
     { "listsinceblock",         &listsinceblock,         false,     false,      true },
     { "dumpprivkey",            &dumpprivkey,            true,      false,      true },
-    { "importprivkey",          &importprivkey,          false,     false,      true },
-    { "listunspent",            &listunspent,            false,     false,      true },
+    { "importprivkey",          &importprivkey,          false,     true,       true },
+    { "listunspent",            &listunspent,            false,     true,       true,       &listunspent },
     { "getrawtransaction",      &getrawtransaction,      false,     false,      false },
     { "createrawtransaction",   &createrawtransaction,   false,     false,      false },
     { "decoderawtransaction",   &decoderawtransaction,   false,     false,      false },
@@ -261,7 +450,12 @@ static const CRPCCommand vRPCCommands[] =
     { "sendrawtransaction",     &sendrawtransaction,     false,     false,      false },
     { "getnormalizedtxid",      &getnormalizedtxid,      true,      true,       false },
     { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
-    { "gettxout",               &gettxout,               true,      false,      false },
+    { "dumptxoutset",           &dumptxoutset,           true,      true,       false },
+    { "gettxout",               &gettxout,               true,      true,       false },
+    { "getaddresshistory",      &getaddresshistory,      true,      true,       false },
+    { "getaddressunspent",      &getaddressunspent,      true,      true,       false },
+    { "getdbstats",             &getdbstats,             true,      true,       false },
+    { "getrpcstats",            &getrpcstats,            true,      true,       false },
     { "lockunspent",            &lockunspent,            false,     false,      true },
     { "listlockunspent",        &listlockunspent,        false,     false,      true },
     { "verifychain",            &verifychain,            true,      false,      false },
@@ -368,6 +562,84 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
         strMsg.c_str());
 }
 
+static string HTTPReplyChunkedHeader(bool keepalive)
+{
+    return strprintf(
+            "HTTP/1.1 200 OK\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "Content-Type: application/json\r\n"
+            "Server: motocoin-json-rpc/%s\r\n"
+            "\r\n",
+        rfc1123Time().c_str(),
+        keepalive ? "keep-alive" : "close",
+        FormatFullVersion().c_str());
+}
+
+/** Sends what is written to it as the body of a chunked HTTP/1.1 reply.
+ *  Nothing, not even the header, is sent before the first chunk is full,
+ *  so up to that point the reply can still be replaced by an error reply. */
+class CHTTPChunkedBuf : public std::streambuf
+{
+private:
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    std::ostream& stream;
+    bool fKeepAlive;
+    bool fStarted;
+    std::vector<char> vBuf;
+
+    bool SendChunk()
+    {
+        if (!fStarted)
+        {
+            stream << HTTPReplyChunkedHeader(fKeepAlive);
+            fStarted = true;
+        }
+        size_t nSize = pptr() - pbase();
+        if (nSize > 0)
+        {
+            stream << strprintf("%" PRIszx "\r\n", nSize);
+            stream.write(pbase(), nSize);
+            stream << "\r\n";
+        }
+        setp(&vBuf[0], &vBuf[0] + vBuf.size());
+        return stream.good();
+    }
+
+protected:
+    int overflow(int c)
+    {
+        if (!SendChunk())
+            return traits_type::eof();
+        if (c != traits_type::eof())
+        {
+            *pptr() = c;
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+public:
+    CHTTPChunkedBuf(std::ostream& streamIn, bool fKeepAliveIn) :
+        stream(streamIn), fKeepAlive(fKeepAliveIn), fStarted(false), vBuf(CHUNK_SIZE)
+    {
+        setp(&vBuf[0], &vBuf[0] + vBuf.size());
+    }
+
+    bool Started() const { return fStarted; }
+
+    // Send the rest and the terminating empty chunk
+    bool Finish()
+    {
+        if (!SendChunk())
+            return false;
+        stream << "0\r\n\r\n" << std::flush;
+        return stream.good();
+    }
+};
+
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
                          string& http_method, string& http_uri)
 {
@@ -443,6 +715,32 @@ int ReadHTTPHeaders(std::basic_istream<char>& stream, map<string, string>& mapHe
     return nLen;
 }
 
+static bool ReadHTTPChunks(std::basic_istream<char>& stream, string& strMessageRet)
+{
+    loop
+    {
+        string str;
+        std::getline(stream, str);
+        if (!stream.good())
+            return false;
+        // Chunk extensions after the size are ignored
+        size_t nChunk = strtoul(str.c_str(), NULL, 16);
+        if (nChunk == 0)
+            break;
+        if (nChunk > MAX_SIZE || strMessageRet.size() + nChunk > MAX_SIZE)
+            return false;
+        size_t nOffset = strMessageRet.size();
+        strMessageRet.resize(nOffset + nChunk);
+        stream.read(&strMessageRet[nOffset], nChunk);
+        std::getline(stream, str); // end of chunk
+    }
+
+    // Skip the trailer
+    map<string, string> mapTrailers;
+    ReadHTTPHeaders(stream, mapTrailers);
+    return stream.good();
+}
+
 int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
                     string>& mapHeadersRet, string& strMessageRet,
                     int nProto)
@@ -456,7 +754,12 @@ int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
         return HTTP_INTERNAL_SERVER_ERROR;
 
     // Read message
-    if (nLen > 0)
+    if (mapHeadersRet["transfer-encoding"] == "chunked")
+    {
+        if (!ReadHTTPChunks(stream, strMessageRet))
+            return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    else if (nLen > 0)
     {
         vector<char> vch(nLen);
         stream.read(&vch[0], nLen);
@@ -523,14 +826,21 @@ string JSONRPCReply(const Value& result, const Value& error, const Value& id)
     return write_string(Value(reply), false) + "\n";
 }
 
-void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
+static int JSONRPCErrorReply(const Object& objError, const Value& id, string& strReply)
 {
-    // Send error reply from json-rpc error object
     int nStatus = HTTP_INTERNAL_SERVER_ERROR;
     int code = find_value(objError, "code").get_int();
     if (code == RPC_INVALID_REQUEST) nStatus = HTTP_BAD_REQUEST;
     else if (code == RPC_METHOD_NOT_FOUND) nStatus = HTTP_NOT_FOUND;
-    string strReply = JSONRPCReply(Value::null, objError, id);
+    strReply = JSONRPCReply(Value::null, objError, id);
+    return nStatus;
+}
+
+void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
+{
+    // Send error reply from json-rpc error object
+    string strReply;
+    int nStatus = JSONRPCErrorReply(objError, id, strReply);
     stream << HTTPReply(nStatus, strReply, false) << std::flush;
 }
 
@@ -610,16 +920,6 @@ private:
     asio::ssl::stream<typename Protocol::socket>& stream;
 };
 
-class AcceptedConnection
-{
-public:
-    virtual ~AcceptedConnection() {}
-
-    virtual std::iostream& stream() = 0;
-    virtual std::string peer_address_to_string() const = 0;
-    virtual void close() = 0;
-};
-
 template <typename Protocol>
 class AcceptedConnectionImpl : public AcceptedConnection
 {
@@ -657,8 +957,6 @@ private:
     iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
 };
 
-void ServiceConnection(AcceptedConnection *conn);
-
 // Forward declaration required for RPCListen
 template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
@@ -845,6 +1143,7 @@ void StartRPCThreads()
     rpc_worker_group = new boost::thread_group();
     for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
         rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
+    StartRPCWorkQueue(GetArg("-rpcthreads", 4));
 }
 
 void StopRPCThreads()
@@ -855,6 +1154,7 @@ void StopRPCThreads()
     if (rpc_worker_group != NULL)
         rpc_worker_group->join_all();
     delete rpc_worker_group; rpc_worker_group = NULL;
+    StopRPCWorkQueue();
     delete rpc_ssl_context; rpc_ssl_context = NULL;
     delete rpc_io_service; rpc_io_service = NULL;
 }
@@ -924,101 +1224,501 @@ static Object JSONRPCExecOne(const Value& req)
     return rpc_result;
 }
 
-static string JSONRPCExecBatch(const Array& vReq)
+// The command a request calls, NULL if it is not a well-formed single call
+static const CRPCCommand* JSONRPCCommand(const Value& req)
 {
-    Array ret;
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    if (req.type() != obj_type)
+        return NULL;
+    const Value& valMethod = find_value(req.get_obj(), "method");
+    if (valMethod.type() != str_type)
+        return NULL;
+    return tableRPC[valMethod.get_str()];
+}
 
-    return write_string(Value(ret), false) + "\n";
+// Thread-safe calls that change the node or the wallet, or write files.
+// They run one at a time and in the order they were sent.
+static const char* const pszSequentialCalls[] = { "stop", "addnode", "importprivkey", "dumptxoutset" };
+
+// Thread-safe calls that read under cs_main. A run of them shares one lock.
+static const char* const pszMainCalls[] = { "gettxout", "getdbstats", "getblock" };
+
+// Thread-safe calls that read under cs_main and the wallet lock. They only
+// take the locks to copy what they report, so that a streamed reply is not
+// written while holding them; in a batch, they share the locks with their
+// neighbours like the calls that are not thread safe.
+static const char* const pszWalletCalls[] = { "listtransactions", "listunspent" };
+
+static bool IsInList(const string& strMethod, const char* const* ppsz, unsigned int nSize)
+{
+    for (unsigned int i = 0; i < nSize; i++)
+        if (strMethod == ppsz[i])
+            return true;
+    return false;
 }
 
-void ServiceConnection(AcceptedConnection *conn)
+static RPCBatchMode JSONRPCBatchMode(const Value& req)
 {
-    bool fRun = true;
-    while (fRun)
-    {
-        int nProto = 0;
-        map<string, string> mapHeaders;
-        string strRequest, strMethod, strURI;
+    // A nested batch takes the locks itself, but may contain anything
+    if (req.type() == array_type)
+        return RPC_BATCH_SEQUENTIAL;
+    // Anything else that is not a call only produces an error
+    const CRPCCommand *pcmd = JSONRPCCommand(req);
+    if (!pcmd)
+        return RPC_BATCH_CONCURRENT;
+    if (!pcmd->threadSafe)
+        return RPC_BATCH_LOCKED;
+    if (IsInList(pcmd->name, pszSequentialCalls, ARRAYLEN(pszSequentialCalls)))
+        return RPC_BATCH_SEQUENTIAL;
+    if (IsInList(pcmd->name, pszMainCalls, ARRAYLEN(pszMainCalls)))
+        return RPC_BATCH_MAIN;
+    if (IsInList(pcmd->name, pszWalletCalls, ARRAYLEN(pszWalletCalls)))
+        return RPC_BATCH_LOCKED;
+    return RPC_BATCH_CONCURRENT;
+}
 
-        // Read HTTP request line
-        if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
+static const unsigned int RPC_CALLS_PER_THREAD = 16;
 
-        // Read HTTP message headers and body
-        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto);
+static void RPCRunCalls(const boost::function<void(unsigned int)>& fn, const vector<unsigned int>& vCall)
+{
+    BOOST_FOREACH(unsigned int i, vCall)
+        fn(i);
+}
 
-        if (strURI != "/") {
-            conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
-            break;
+/** Consecutive thread-safe calls of a batch. The calling thread and the
+ *  work queue threads that join it take the next call that nobody has
+ *  started yet, until none is left. */
+class CRPCConcurrentCalls
+{
+private:
+    boost::function<void(unsigned int)> fn;
+    vector<unsigned int> vCall;
+    boost::mutex mutex;
+    boost::condition_variable condDone;
+    unsigned int nNext;
+    unsigned int nDone;
+
+public:
+    CRPCConcurrentCalls(const boost::function<void(unsigned int)>& fnIn, const vector<unsigned int>& vCallIn) :
+        fn(fnIn), vCall(vCallIn), nNext(0), nDone(0) {}
+
+    void Work()
+    {
+        while (true)
+        {
+            unsigned int i;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (nNext == vCall.size())
+                    return;
+                i = vCall[nNext++];
+            }
+            try
+            {
+                fn(i);
+            }
+            catch (std::exception& e) {
+                PrintExceptionContinue(&e, "RPC batch call");
+            } catch (...) {
+                PrintExceptionContinue(NULL, "RPC batch call");
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (++nDone == vCall.size())
+                condDone.notify_all();
         }
+    }
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
+    void Wait()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (nDone < vCall.size())
+            condDone.wait(lock);
+    }
+};
+
+/** Threads that help with the thread-safe calls of batches. They are
+ *  separate from the threads of rpc_io_service, which may all be waiting
+ *  for the calls of their connections. */
+class CRPCWorkQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    // One entry per thread asked to help; the calls may be done by the time
+    // a thread gets to them, and then it just moves on
+    std::deque<boost::shared_ptr<CRPCConcurrentCalls> > queue;
+    boost::thread_group threads;
+    unsigned int nThreads;
+    bool fStop;
+
+    void Thread()
+    {
+        RenameThread("motocoin-rpcwork");
+        while (true)
         {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            boost::shared_ptr<CRPCConcurrentCalls> calls;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && queue.empty())
+                    cond.wait(lock);
+                if (fStop)
+                    return;
+                calls = queue.front();
+                queue.pop_front();
+            }
+            calls->Work();
         }
-        if (!HTTPAuthorized(mapHeaders))
+    }
+
+public:
+    CRPCWorkQueue(unsigned int nThreadsIn) : nThreads(nThreadsIn), fStop(false)
+    {
+        for (unsigned int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CRPCWorkQueue::Thread, this));
+    }
+
+    ~CRPCWorkQueue()
+    {
         {
-            printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
-            /* Deter brute-forcing short passwords.
-               If this results in a DoS the user really
-               shouldn't have their RPC port exposed. */
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
-
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
         }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+        cond.notify_all();
+        threads.join_all();
+    }
 
-        JSONRequest jreq;
-        try
+    unsigned int Threads() const { return nThreads; }
+
+    void Push(const boost::shared_ptr<CRPCConcurrentCalls>& calls, unsigned int nHelpers)
+    {
         {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+            boost::unique_lock<boost::mutex> lock(mutex);
+            for (unsigned int i = 0; i < nHelpers; i++)
+                queue.push_back(calls);
+        }
+        cond.notify_all();
+    }
+};
 
-            string strReply;
+static CRPCWorkQueue* rpc_work_queue = NULL;
 
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
+void StartRPCWorkQueue(int nThreads)
+{
+    assert(rpc_work_queue == NULL);
+    rpc_work_queue = new CRPCWorkQueue(std::max(nThreads, 0));
+}
+
+void StopRPCWorkQueue()
+{
+    delete rpc_work_queue;
+    rpc_work_queue = NULL;
+}
+
+static void RPCRunConcurrent(const boost::function<void(unsigned int)>& fn, const vector<unsigned int>& vCall)
+{
+    // Small runs are not worth waking threads for
+    unsigned int nHelpers = 0;
+    if (rpc_work_queue)
+        nHelpers = std::min(rpc_work_queue->Threads(), (unsigned int)(vCall.size() / RPC_CALLS_PER_THREAD));
+    if (nHelpers == 0)
+    {
+        RPCRunCalls(fn, vCall);
+        return;
+    }
 
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+    boost::shared_ptr<CRPCConcurrentCalls> calls(new CRPCConcurrentCalls(fn, vCall));
+    rpc_work_queue->Push(calls, nHelpers);
+    calls->Work();
+    calls->Wait();
+}
 
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
+// Calls that run under cs_main, taken once for a run of them
+static bool RPCBatchNeedsMain(RPCBatchMode mode)
+{
+    return mode == RPC_BATCH_MAIN || mode == RPC_BATCH_LOCKED;
+}
 
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+void RPCRunBatch(const vector<RPCBatchMode>& vMode, const boost::function<void(unsigned int)>& fn)
+{
+    unsigned int nBegin = 0;
+    while (nBegin < vMode.size())
+    {
+        RPCBatchMode mode = vMode[nBegin];
+        vector<unsigned int> vCall;
+        bool fWallet = false;
+        for (unsigned int i = nBegin; i < vMode.size(); i++)
+        {
+            if (RPCBatchNeedsMain(mode) ? !RPCBatchNeedsMain(vMode[i]) : vMode[i] != mode)
+                break;
+            fWallet |= (vMode[i] == RPC_BATCH_LOCKED);
+            vCall.push_back(i);
+        }
+        nBegin += vCall.size();
+
+        if (mode == RPC_BATCH_CONCURRENT)
+            RPCRunConcurrent(fn, vCall);
+        else if (mode == RPC_BATCH_SEQUENTIAL)
+            RPCRunCalls(fn, vCall);
+        else if (!fWallet || !pwalletMain) {
+            LOCK(cs_main);
+            RPCRunCalls(fn, vCall);
+        } else {
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            RPCRunCalls(fn, vCall);
+        }
+    }
+}
+
+static void JSONRPCExecBatchCall(const Array* pvReq, vector<Object>* pvReply, unsigned int i)
+{
+    (*pvReply)[i] = JSONRPCExecOne((*pvReq)[i]);
+}
+
+static string JSONRPCExecBatch(const Array& vReq)
+{
+    vector<RPCBatchMode> vMode;
+    BOOST_FOREACH(const Value& req, vReq)
+        vMode.push_back(JSONRPCBatchMode(req));
+
+    vector<Object> vReply(vReq.size());
+    RPCRunBatch(vMode, boost::bind(&JSONRPCExecBatchCall, &vReq, &vReply, _1));
+
+    Array ret(vReply.begin(), vReply.end());
+    return write_string(Value(ret), false) + "\n";
+}
+
+/** Executes a request, which is a single call or a batch. Returns the HTTP
+ *  status of the reply and sets strReply to its body. */
+static int JSONRPCExecRequest(const Value& valRequest, bool fParsed, string& strReply)
+{
+    JSONRequest jreq;
+    try
+    {
+        if (!fParsed)
+            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+
+        // singleton request
+        if (valRequest.type() == obj_type) {
+            jreq.parse(valRequest);
+
+            Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+            strReply = JSONRPCReply(result, Value::null, jreq.id);
+
+        // array of requests
+        } else if (valRequest.type() == array_type)
+            strReply = JSONRPCExecBatch(valRequest.get_array());
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+        return HTTP_OK;
+    }
+    catch (Object& objError)
+    {
+        return JSONRPCErrorReply(objError, jreq.id, strReply);
+    }
+    catch (std::exception& e)
+    {
+        return JSONRPCErrorReply(JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id, strReply);
+    }
+}
 
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
+/** Sends the reply to a single request while it is generated. Returns false
+ *  if the connection has to be dropped because the reply was cut off.
+ *  The streaming methods are thread safe: they copy what they report under
+ *  the locks they need, and write it after releasing them, since a slow
+ *  client must not hold up the node. A streaming method that ran under
+ *  cs_main and the wallet lock would write its reply to memory instead,
+ *  which is sent once the locks are released. */
+static bool JSONRPCStreamReply(std::iostream& stream, const JSONRequest& jreq, bool fKeepAlive)
+{
+    CHTTPChunkedBuf buf(stream, fKeepAlive);
+    std::ostream os(&buf);
+    const CRPCCommand *pcmd = tableRPC[jreq.strMethod];
+    bool fBuffered = pcmd && !pcmd->threadSafe;
+    ostringstream ssBuffer;
+    CJSONStreamWriter writer(fBuffered ? ssBuffer : os);
+    try
+    {
+        writer.BeginObject();
+        writer.Key("result");
+        tableRPC.execute(jreq.strMethod, jreq.params, writer);
+        writer.WritePair("error", Value::null);
+        writer.WritePair("id", jreq.id);
+        writer.EndObject();
+        if (fBuffered)
+        {
+            string strBuffer = ssBuffer.str();
+            os.write(strBuffer.data(), strBuffer.size());
         }
-        catch (Object& objError)
+        os << "\n";
+    }
+    catch (...)
+    {
+        // If nothing was sent yet the caller gives the usual error reply
+        if (!buf.Started())
+            throw;
+        printf("ThreadRPCServer %s failed after its reply was started\n", jreq.strMethod.c_str());
+        return false;
+    }
+    return buf.Finish();
+}
+
+/** Reads a request from the connection. Returns HTTP_OK and the body of an
+ *  authorized request, the status to refuse it with, or 0 if no request
+ *  could be read. */
+static int ReadRPCRequest(AcceptedConnection *conn, int& nProto, string& strRequest, bool& fKeepAlive)
+{
+    map<string, string> mapHeaders;
+    string strMethod, strURI;
+
+    // Read HTTP request line
+    if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
+        return 0;
+
+    // Read HTTP message headers and body
+    ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto);
+
+    if (strURI != "/")
+        return HTTP_NOT_FOUND;
+
+    // Check authorization
+    if (mapHeaders.count("authorization") == 0)
+        return HTTP_UNAUTHORIZED;
+    if (!HTTPAuthorized(mapHeaders))
+    {
+        printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
+        /* Deter brute-forcing short passwords.
+           If this results in a DoS the user really
+           shouldn't have their RPC port exposed. */
+        if (mapArgs["-rpcpassword"].size() < 20)
+            MilliSleep(250);
+
+        return HTTP_UNAUTHORIZED;
+    }
+    if (mapHeaders["connection"] == "close")
+        fKeepAlive = false;
+    return HTTP_OK;
+}
+
+static const unsigned int MAX_PIPELINED_REQUESTS = 256;
+
+static void JSONRPCExecPipelined(const vector<Value>* pvRequest, const vector<bool>* pvParsed,
+                                 vector<int>* pvStatus, vector<string>* pvReply, unsigned int i)
+{
+    (*pvStatus)[i] = JSONRPCExecRequest((*pvRequest)[i], (*pvParsed)[i], (*pvReply)[i]);
+}
+
+/** Serves a request together with the requests the client already sent
+ *  behind it without waiting for replies (HTTP/1.1 pipelining). They are
+ *  executed like the calls of a batch; the replies go out in order.
+ *  Unlike a single request, an error reply does not close the connection:
+ *  the requests behind it have already run, and the client needs their
+ *  replies to know that. Returns false if the connection is to be closed. */
+static bool ServicePipelinedRequests(AcceptedConnection *conn, const string& strFirst, int nProto, bool& fRun)
+{
+    vector<string> vRequest(1, strFirst);
+    int nRefused = HTTP_OK;
+    while (fRun && vRequest.size() < MAX_PIPELINED_REQUESTS && conn->stream().rdbuf()->in_avail() > 0)
+    {
+        string strRequest;
+        nRefused = ReadRPCRequest(conn, nProto, strRequest, fRun);
+        if (nRefused != HTTP_OK)
+            break;
+        vRequest.push_back(strRequest);
+    }
+
+    vector<Value> vValue(vRequest.size());
+    vector<bool> vParsed;
+    vector<RPCBatchMode> vMode;
+    for (unsigned int i = 0; i < vRequest.size(); i++)
+    {
+        vParsed.push_back(read_string(vRequest[i], vValue[i]));
+        vMode.push_back(vParsed.back() ? JSONRPCBatchMode(vValue[i]) : RPC_BATCH_CONCURRENT);
+    }
+
+    vector<int> vStatus(vRequest.size());
+    vector<string> vReply(vRequest.size());
+    RPCRunBatch(vMode, boost::bind(&JSONRPCExecPipelined, &vValue, &vParsed, &vStatus, &vReply, _1));
+
+    for (unsigned int i = 0; i < vRequest.size(); i++)
+    {
+        bool fLast = (i + 1 == vRequest.size() && nRefused == HTTP_OK);
+        conn->stream() << HTTPReply(vStatus[i], vReply[i], !fLast || fRun);
+    }
+    if (nRefused != HTTP_OK)
+    {
+        if (nRefused != 0)
+            conn->stream() << HTTPReply(nRefused, "", false);
+        fRun = false;
+    }
+    conn->stream() << std::flush;
+    return fRun;
+}
+
+void ServiceConnection(AcceptedConnection *conn)
+{
+    bool fRun = true;
+    while (fRun)
+    {
+        int nProto = 0;
+        string strRequest;
+
+        int nStatus = ReadRPCRequest(conn, nProto, strRequest, fRun);
+        if (nStatus != HTTP_OK)
         {
-            ErrorReply(conn->stream(), objError, jreq.id);
+            if (nStatus != 0)
+                conn->stream() << HTTPReply(nStatus, "", false) << std::flush;
             break;
         }
-        catch (std::exception& e)
+
+        // More requests already waiting
+        if (fRun && conn->stream().rdbuf()->in_avail() > 0)
+        {
+            if (!ServicePipelinedRequests(conn, strRequest, nProto, fRun))
+                break;
+            continue;
+        }
+
+        Value valRequest;
+        bool fParsed = read_string(strRequest, valRequest);
+
+        // Stream large replies to HTTP/1.1 clients
+        const CRPCCommand *pcmd = fParsed ? JSONRPCCommand(valRequest) : NULL;
+        if (pcmd && pcmd->streamActor && nProto >= 1)
+        {
+            JSONRequest jreq;
+            try
+            {
+                jreq.parse(valRequest);
+                if (!JSONRPCStreamReply(conn->stream(), jreq, fRun))
+                    break;
+            }
+            catch (Object& objError)
+            {
+                ErrorReply(conn->stream(), objError, jreq.id);
+                break;
+            }
+            catch (std::exception& e)
+            {
+                ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+                break;
+            }
+            continue;
+        }
+
+        string strReply;
+        nStatus = JSONRPCExecRequest(valRequest, fParsed, strReply);
+        if (nStatus != HTTP_OK)
         {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+            conn->stream() << HTTPReply(nStatus, strReply, false) << std::flush;
             break;
         }
+        conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
     }
 }
 
-json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+const CRPCCommand* CRPCTable::find(const std::string &strMethod) const
 {
     // Find method
-    const CRPCCommand *pcmd = tableRPC[strMethod];
+    const CRPCCommand *pcmd = (*this)[strMethod];
     if (!pcmd)
         throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
     if (pcmd->reqWallet && !pwalletMain)
@@ -1029,7 +1729,14 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
     if (strWarning != "" && !GetBoolArg("-disablesafemode") &&
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
+    return pcmd;
+}
+
+json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+{
+    const CRPCCommand *pcmd = find(strMethod);
 
+    CRPCCallTimer timer(pcmd->name);
     try
     {
         // Execute
@@ -1045,6 +1752,7 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
                 result = pcmd->actor(params, false);
             }
         }
+        timer.fError = false;
         return result;
     }
     catch (std::exception& e)
@@ -1053,6 +1761,35 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
     }
 }
 
+void CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params, CJSONWriter& writer) const
+{
+    const CRPCCommand *pcmd = find(strMethod);
+    if (!pcmd->streamActor)
+    {
+        writer.Write(execute(strMethod, params));
+        return;
+    }
+
+    CRPCCallTimer timer(pcmd->name);
+    try
+    {
+        if (pcmd->threadSafe)
+            pcmd->streamActor(params, false, writer);
+        else if (!pwalletMain) {
+            LOCK(cs_main);
+            pcmd->streamActor(params, false, writer);
+        } else {
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            pcmd->streamActor(params, false, writer);
+        }
+        timer.fError = false;
+    }
+    catch (std::exception& e)
+    {
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    }
+}
+
 
 Object CallRPC(const string& strMethod, const Array& params)
 {
@@ -1189,9 +1926,14 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "sendrawtransaction"     && n > 1) ConvertTo<bool>(params[1], true);
     if (strMethod == "gettxout"               && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "gettxout"               && n > 2) ConvertTo<bool>(params[2]);
+    if (strMethod == "getaddresshistory"      && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "getaddresshistory"      && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "getaddressunspent"      && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "getaddressunspent"      && n > 2) ConvertTo<boost::int64_t>(params[2]);
     if (strMethod == "lockunspent"            && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "lockunspent"            && n > 1) ConvertTo<Array>(params[1]);
     if (strMethod == "importprivkey"          && n > 2) ConvertTo<bool>(params[2]);
+    if (strMethod == "getrpcstats"            && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "verifychain"            && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "verifychain"            && n > 1) ConvertTo<boost::int64_t>(params[1]);
 
@@ -9,6 +9,9 @@
 #include <string>
 #include <list>
 #include <map>
+#include <vector>
+
+#include <boost/function.hpp>
 
 class CBlockIndex;
 class CReserveKey;
@@ -72,6 +75,44 @@ void StartRPCThreads();
 void StopRPCThreads();
 int CommandLineRPC(int argc, char *argv[]);
 
+/** A client connection of the RPC server */
+class AcceptedConnection
+{
+public:
+    virtual ~AcceptedConnection() {}
+
+    virtual std::iostream& stream() = 0;
+    virtual std::string peer_address_to_string() const = 0;
+    virtual void close() = 0;
+};
+
+/** Serves the requests of a connection until it is closed */
+void ServiceConnection(AcceptedConnection *conn);
+
+/** Start and stop the threads that run thread-safe calls of batches and
+ *  pipelined requests side by side. StartRPCThreads and StopRPCThreads do
+ *  this for the RPC server; without them every call runs on its own
+ *  connection's thread. */
+void StartRPCWorkQueue(int nThreads);
+void StopRPCWorkQueue();
+
+/** How a call of a batch may be run next to the calls around it */
+enum RPCBatchMode
+{
+    RPC_BATCH_CONCURRENT, // thread safe and read only, runs side by side with its neighbours
+    RPC_BATCH_MAIN,       // thread safe, but reads under cs_main
+    RPC_BATCH_LOCKED,     // needs cs_main and the wallet lock
+    RPC_BATCH_SEQUENTIAL  // has side effects, runs alone and takes its own locks
+};
+
+/** Runs fn(i) for the calls i of a batch, with the results of running them
+ *  one after another: a call that is not RPC_BATCH_CONCURRENT starts once
+ *  all calls before it have finished, and the calls after it start once it
+ *  has finished. Consecutive calls that need cs_main share one acquisition
+ *  of it, and of the wallet lock if one of them needs that too; consecutive
+ *  concurrent calls run side by side on the work queue threads. */
+void RPCRunBatch(const std::vector<RPCBatchMode>& vMode, const boost::function<void(unsigned int)>& fn);
+
 /** Convert parameter values for RPC call from strings to command-specific JSON objects. */
 json_spirit::Array RPCConvertValues(const std::string &strMethod, const std::vector<std::string> &strParams);
 
@@ -89,7 +130,75 @@ void RPCTypeCheck(const json_spirit::Array& params,
 void RPCTypeCheck(const json_spirit::Object& o,
                   const std::map<std::string, json_spirit::Value_type>& typesExpected, bool fAllowNull=false);
 
+/** Receives a JSON value piece by piece. RPC methods with large results
+ *  produce them through this interface, so that the reply can be sent while
+ *  it is generated instead of being built as a whole first. */
+class CJSONWriter
+{
+public:
+    virtual ~CJSONWriter() {}
+    virtual void BeginObject() = 0;
+    virtual void EndObject() = 0;
+    virtual void BeginArray() = 0;
+    virtual void EndArray() = 0;
+    // Name of the next member of the current object
+    virtual void Key(const std::string& strKey) = 0;
+    // A complete value: the whole result, an array element or a member after Key()
+    virtual void Write(const json_spirit::Value& value) = 0;
+
+    void WritePair(const std::string& strKey, const json_spirit::Value& value)
+    {
+        Key(strKey);
+        Write(value);
+    }
+};
+
+/** Writes JSON text to a stream as it is produced. */
+class CJSONStreamWriter : public CJSONWriter
+{
+private:
+    std::ostream& stream;
+    std::vector<bool> vEmpty; // for each open object or array: nothing is in it yet
+    bool fAfterKey;
+
+    void Separate();
+
+public:
+    CJSONStreamWriter(std::ostream& streamIn) : stream(streamIn), fAfterKey(false) {}
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    void Key(const std::string& strKey);
+    void Write(const json_spirit::Value& value);
+};
+
+/** Builds a json_spirit::Value, for callers that need the result as a whole. */
+class CJSONValueWriter : public CJSONWriter
+{
+private:
+    json_spirit::Value result;
+    std::vector<json_spirit::Value*> vOpen; // innermost last
+    std::string strKey;
+
+    json_spirit::Value* Add(const json_spirit::Value& value);
+
+public:
+    void BeginObject() { vOpen.push_back(Add(json_spirit::Object())); }
+    void EndObject() { vOpen.pop_back(); }
+    void BeginArray() { vOpen.push_back(Add(json_spirit::Array())); }
+    void EndArray() { vOpen.pop_back(); }
+    void Key(const std::string& strKeyIn) { strKey = strKeyIn; }
+    void Write(const json_spirit::Value& value) { Add(value); }
+    const json_spirit::Value& GetValue() const { return result; }
+};
+
 typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
+typedef void(*rpcstreamfn_type)(const json_spirit::Array& params, bool fHelp, CJSONWriter& result);
+
+/** Runs a streaming method and returns what it wrote as a whole; the plain
+ *  actor of a streaming method is a call to this. */
+json_spirit::Value RPCStreamToValue(rpcstreamfn_type pfn, const json_spirit::Array& params, bool fHelp);
 
 class CRPCCommand
 {
@@ -99,6 +208,7 @@ public:
     bool okSafeMode;
     bool threadSafe;
     bool reqWallet;
+    rpcstreamfn_type streamActor; // optional, NULL if the method does not stream
 };
 
 /**
@@ -108,6 +218,7 @@ class CRPCTable
 {
 private:
     std::map<std::string, const CRPCCommand*> mapCommands;
+    const CRPCCommand* find(const std::string& method) const;
 public:
     CRPCTable();
     const CRPCCommand* operator[](std::string name) const;
@@ -121,6 +232,14 @@ public:
      * @throws an exception (json_spirit::Value) when an error happens.
      */
     json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
+
+    /**
+     * Execute a method, passing the result to writer. Methods that stream
+     * write their result while it is generated.
+     * @throws an exception (json_spirit::Value) when an error happens; part of
+     *         the result may have been written already.
+     */
+    void execute(const std::string &method, const json_spirit::Array &params, CJSONWriter& writer) const;
 };
 
 extern const CRPCTable tableRPC;
@@ -138,6 +257,7 @@ extern void EnsureWalletIsUnlocked();
 
 extern json_spirit::Value getconnectioncount(const json_spirit::Array& params, bool fHelp); // in rpcnet.cpp
 extern json_spirit::Value getpeerinfo(const json_spirit::Array& params, bool fHelp);
+extern void getpeerinfo(const json_spirit::Array& params, bool fHelp, CJSONWriter& result);
 extern json_spirit::Value addnode(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getaddednodeinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value dumpprivkey(const json_spirit::Array& params, bool fHelp); // in rpcdump.cpp
@@ -170,6 +290,7 @@ extern json_spirit::Value createmultisig(const json_spirit::Array& params, bool
 extern json_spirit::Value listreceivedbyaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listreceivedbyaccount(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listtransactions(const json_spirit::Array& params, bool fHelp);
+extern void listtransactions(const json_spirit::Array& params, bool fHelp, CJSONWriter& result);
 extern json_spirit::Value listaddressgroupings(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listaccounts(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listsinceblock(const json_spirit::Array& params, bool fHelp);
@@ -185,6 +306,7 @@ extern json_spirit::Value getinfo(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getrawtransaction(const json_spirit::Array& params, bool fHelp); // in rcprawtransaction.cpp
 extern json_spirit::Value listunspent(const json_spirit::Array& params, bool fHelp);
+extern void listunspent(const json_spirit::Array& params, bool fHelp, CJSONWriter& result);
 extern json_spirit::Value lockunspent(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listlockunspent(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value createrawtransaction(const json_spirit::Array& params, bool fHelp);
@@ -199,10 +321,17 @@ extern json_spirit::Value getdifficulty(const json_spirit::Array& params, bool f
 extern json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value setmininput(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
+extern void getrawmempool(const json_spirit::Array& params, bool fHelp, CJSONWriter& result);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
+extern void getblock(const json_spirit::Array& params, bool fHelp, CJSONWriter& result);
 extern json_spirit::Value gettxoutsetinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value dumptxoutset(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxout(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddresshistory(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddressunspent(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getdbstats(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getrpcstats(const json_spirit::Array& params, bool fHelp); // in bitcoinrpc.cpp
 extern json_spirit::Value verifychain(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getchains (const json_spirit::Array& params, bool fHelp);
 
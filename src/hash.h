@@ -123,4 +123,7 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** SipHash-2-4 of a 256-bit value, keyed with (k0, k1) */
+uint64 SipHashUint256(uint64 k0, uint64 k1, const uint256& val);
+
 #endif
@@ -27,6 +27,7 @@ using namespace boost;
 
 CWallet* pwalletMain;
 CClientUIInterface uiInterface;
+static CCoinsViewBackgroundFlush *pcoinswriter = NULL;
 
 #ifdef WIN32
 // Win32 LevelDB doesn't use filedescriptors, and the ones used for
@@ -88,8 +89,6 @@ bool ShutdownRequested()
     return fRequestShutdown;
 }
 
-static CCoinsViewDB *pcoinsdbview;
-
 void Shutdown()
 {
     printf("Shutdown : In progress...\n");
@@ -105,6 +104,7 @@ void Shutdown()
     if (pwalletMain)
         bitdb.Flush(false);
     StopNode();
+    StopSnapshotValidation();
     {
         LOCK(cs_main);
         if (pwalletMain)
@@ -114,6 +114,7 @@ void Shutdown()
         if (pcoinsTip)
             pcoinsTip->Flush();
         delete pcoinsTip; pcoinsTip = NULL;
+        delete pcoinswriter; pcoinswriter = NULL; // waits for the last batch to be written
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
     }
@@ -124,6 +125,7 @@ void Shutdown()
     if (pwalletMain)
         delete pwalletMain;
     printf("Shutdown : done\n");
+    StopDebugLogWriter();
 }
 
 //
@@ -305,6 +307,14 @@ std::string HelpMessage()
         "  -gen                   " + _("Generate coins (default: 0)") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -coinsdbblockcache=<n> " + _("Percentage of the chainstate database cache used for the block cache, the rest goes to write buffers (default: 50)") + "\n" +
+        "  -coinsdbmaxopenfiles=<n> " + _("Maximum number of files the chainstate database keeps open (default: 64)") + "\n" +
+        "  -coinsdbcompression    " + _("Compress the chainstate database with snappy, needs a build with USE_SNAPPY=1 (default: 0)") + "\n" +
+        "  -coinsdbchecksums      " + _("Verify checksums of all chainstate database reads (default: 1)") + "\n" +
+        "  -blockdbblockcache=<n> " + _("Same as -coinsdbblockcache, for the block index database") + "\n" +
+        "  -blockdbmaxopenfiles=<n> " + _("Same as -coinsdbmaxopenfiles, for the block index database") + "\n" +
+        "  -blockdbcompression    " + _("Same as -coinsdbcompression, for the block index database") + "\n" +
+        "  -blockdbchecksums      " + _("Same as -coinsdbchecksums, for the block index database") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -344,6 +354,7 @@ std::string HelpMessage()
 #endif
         "  -testnet               " + _("Use the test network") + "\n" +
         "  -debug                 " + _("Output extra debugging information. Implies all other -debug* options") + "\n" +
+        "  -debug=<category>      " + _("Output debugging information only for <category> (net, mempool, lock, qt)") + "\n" +
         "  -debugnet              " + _("Output extra network debugging information") + "\n" +
         "  -logtimestamps         " + _("Prepend debug output with timestamp (default: 1)") + "\n" +
         "  -shrinkdebugfile       " + _("Shrink debug.log file on client startup (default: 1 when no -debug)") + "\n" +
@@ -369,10 +380,17 @@ std::string HelpMessage()
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 288, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-4, default: 3)") + "\n" +
+        "  -checkmempool          " + _("Stop if a transaction in the memory pool spends an input that is missing when creating a block") + "\n" +
         "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n" +
+        "  -addrindex             " + _("Maintain an index of outputs by address, for getaddresshistory (default: 0)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
+        "  -prune=<n>             " + _("Delete old block and undo files to keep them under <n> megabytes (default: 0 = disabled, minimum: 550). Incompatible with -txindex and -addrindex") + "\n" +
+        "  -loadsnapshot=<file>   " + _("Start from a UTXO snapshot written by dumptxoutset, and validate the blocks below it in the background") + "\n" +
         "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -sigcachesize=<n>      " + _("Memory used by the cache of verified signatures in megabytes (0 = off, default: 8, at most 1024)") + "\n" +
+        "  -readcachesize=<n>     " + _("Size of the cache of recently read blocks and transactions in megabytes (default: 16)") + "\n" +
+        "  -maxorphantxsize=<n>   " + _("Memory used by transactions waiting for their parents in megabytes (default: 5)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -560,7 +578,8 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     // ********************************************************* Step 3: parameter-to-internal-flags
 
-    fDebug = GetBoolArg("-debug");
+    // -debug and -debug=1 enable every category, -debug=<category> only the named ones
+    fDebug = mapArgs.count("-debug") && mapArgs["-debug"] != "0";
     fBenchmark = GetBoolArg("-benchmark");
 
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
@@ -572,8 +591,31 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    if (!LevelDBHasCompression() && (GetBoolArg("-coinsdbcompression") || GetBoolArg("-blockdbcompression")))
+        return InitError(_("This build has no snappy support, so -coinsdbcompression and -blockdbcompression are not available"));
+
+    InitSignatureCache();
+    blockReadCache.SetMaxSize(std::max((int64)0, GetArg("-readcachesize", DEFAULT_READ_CACHE_SIZE)) << 20);
+    orphanTxPool.SetLimits(MAX_ORPHAN_TRANSACTIONS, std::max((int64)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TX_SIZE)) << 20);
+
+    int64 nPruneArg = GetArg("-prune", 0);
+    if (nPruneArg < 0)
+        return InitError(_("-prune cannot be negative"));
+    if (nPruneArg > 0) {
+        // The indexes point into the block files
+        if (GetBoolArg("-txindex", false) || GetBoolArg("-addrindex", false))
+            return InitError(_("-prune cannot be combined with -txindex or -addrindex"));
+        if ((uint64)nPruneArg < MIN_PRUNE_TARGET)
+            return InitError(strprintf(_("-prune must be at least %" PRI64u " megabytes"), MIN_PRUNE_TARGET));
+        fPruneMode = true;
+        nPruneTarget = (uint64)nPruneArg << 20;
+        // Peers cannot download the block chain from us any more
+        nLocalServices &= ~NODE_NETWORK;
+        printf("Prune mode: keeping block and undo files under %" PRI64d " MiB\n", nPruneArg);
+    }
+
     // -debug implies fDebug*
-    if (fDebug)
+    if (LogAcceptCategory("net"))
         fDebugNet = true;
     else
         fDebugNet = GetBoolArg("-debugnet");
@@ -651,6 +693,7 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     if (GetBoolArg("-shrinkdebugfile", !fDebug))
         ShrinkDebugFile();
+    StartDebugLogWriter();
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("Motocoin version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     printf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
@@ -831,12 +874,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (nTotalCache < (1 << 22))
         nTotalCache = (1 << 22); // total cache cannot be less than 4 MiB
     size_t nBlockTreeDBCache = nTotalCache / 8;
-    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
+    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false) && !GetBoolArg("-addrindex", false))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache / 2; // the other half is for the batch being written in the background
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -850,12 +893,14 @@ bool AppInit2(boost::thread_group& threadGroup)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
+                delete pcoinswriter;
                 delete pcoinsdbview;
                 delete pblocktree;
 
-                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+                pblocktree = new CBlockTreeDB(GetLevelDBOptions("blockdb", nBlockTreeDBCache), false, fReindex);
+                pcoinsdbview = new CCoinsViewDB(GetLevelDBOptions("coinsdb", nCoinDBCache), false, fReindex);
+                pcoinswriter = new CCoinsViewBackgroundFlush(*pcoinsdbview);
+                pcoinsTip = new CCoinsViewCache(*pcoinswriter);
 
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
@@ -882,6 +927,18 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
+                // Check for changed -addrindex state
+                if (fAddrIndex != GetBoolArg("-addrindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -addrindex");
+                    break;
+                }
+
+                // Pruned blocks can only be had again by downloading them
+                if (fHavePruned && !fPruneMode) {
+                    strLoadError = _("You need to rebuild the database using -reindex to go back to unpruned mode");
+                    break;
+                }
+
                 uiInterface.InitMessage(_("Verifying blocks..."));
                 if (!VerifyDB(GetArg("-checklevel", 3),
                               GetArg( "-checkblocks", 288))) {
@@ -924,6 +981,25 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     printf(" block index %15" PRI64d "ms\n", GetTimeMillis() - nStart);
 
+    if (mapArgs.count("-loadsnapshot"))
+    {
+        filesystem::path pathSnapshot(mapArgs["-loadsnapshot"]);
+        if (fReindex)
+            return InitError(_("-loadsnapshot cannot be combined with -reindex"));
+        if (fAddrIndex)
+            return InitError(_("The address index cannot be built from a UTXO snapshot"));
+        if (nBestHeight > 0)
+            printf("Block chain is not empty, -loadsnapshot ignored\n");
+        else {
+            uiInterface.InitMessage(_("Loading UTXO snapshot..."));
+            nStart = GetTimeMillis();
+            CSnapshotHeader header;
+            if (!LoadSnapshot(pathSnapshot, header))
+                return InitError(strprintf(_("Failed to load the UTXO snapshot %s, see debug.log"), pathSnapshot.string().c_str()));
+            printf(" snapshot %15" PRI64d "ms\n", GetTimeMillis() - nStart);
+        }
+    }
+
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree"))
     {
         PrintBlockTree();
@@ -1027,20 +1103,18 @@ bool AppInit2(boost::thread_group& threadGroup)
         if (GetBoolArg("-rescan"))
             pindexRescan = pindexGenesisBlock;
         else
-        {
-            CWalletDB walletdb("wallet.dat");
-            CBlockLocator locator;
-            if (walletdb.ReadBestBlock(locator))
-                pindexRescan = locator.GetBlockIndex();
-            else
-                pindexRescan = pindexGenesisBlock;
-        }
+            pindexRescan = pwalletMain->GetRescanStart();
         if (pindexBest && pindexBest != pindexRescan)
         {
+            // The blocks to rescan may have been pruned
+            if (HavePrunedBlocksSince(pindexRescan))
+                return InitError(_("The blocks to rescan the wallet with have been pruned. You need to rebuild the database using -reindex, which downloads them again"));
+
             uiInterface.InitMessage(_("Rescanning..."));
             printf("Rescanning last %i blocks (from block %i)...\n", pindexBest->nHeight - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
-            pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+            if (pwalletMain->ScanForWalletTransactions(pindexRescan, true, true) < 0)
+                return InitError(_("Failed to read a block while rescanning the wallet. You need to rebuild the database using -reindex"));
             printf(" rescan      %15" PRI64d "ms\n", GetTimeMillis() - nStart);
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
             nWalletDBUpdated++;
@@ -1062,6 +1136,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
 
+    // blocks below a loaded UTXO snapshot
+    StartSnapshotValidation();
+
     // ********************************************************* Step 10: load peers
 
     uiInterface.InitMessage(_("Loading addresses..."));
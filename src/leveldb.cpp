@@ -12,6 +12,8 @@
 
 #include <boost/filesystem.hpp>
 
+#include <sstream>
+
 void HandleError(const leveldb::Status &status) throw(leveldb_error) {
     if (status.ok())
         return;
@@ -24,23 +26,76 @@ void HandleError(const leveldb::Status &status) throw(leveldb_error) {
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize) {
+// Forwards to a regular LRU cache, counting lookups that hit and miss
+class CLevelDBCache : public leveldb::Cache
+{
+private:
+    leveldb::Cache *pcache;
+
+public:
+    boost::atomic<uint64> nHits;
+    boost::atomic<uint64> nMisses;
+
+    CLevelDBCache(size_t nCapacity) : pcache(leveldb::NewLRUCache(nCapacity)), nHits(0), nMisses(0) {}
+    ~CLevelDBCache() { delete pcache; }
+
+    Handle* Insert(const leveldb::Slice& key, void* value, size_t charge,
+                   void (*deleter)(const leveldb::Slice& key, void* value)) {
+        return pcache->Insert(key, value, charge, deleter);
+    }
+
+    Handle* Lookup(const leveldb::Slice& key) {
+        Handle *handle = pcache->Lookup(key);
+        if (handle)
+            nHits++;
+        else
+            nMisses++;
+        return handle;
+    }
+
+    void Release(Handle* handle) { pcache->Release(handle); }
+    void* Value(Handle* handle) { return pcache->Value(handle); }
+    void Erase(const leveldb::Slice& key) { pcache->Erase(key); }
+    uint64_t NewId() { return pcache->NewId(); }
+};
+
+bool LevelDBHasCompression() {
+#ifdef USE_SNAPPY
+    return true;
+#else
+    return false;
+#endif
+}
+
+CLevelDBOptions GetLevelDBOptions(const std::string &strName, size_t nCacheSize) {
+    CLevelDBOptions dboptions(nCacheSize);
+    dboptions.nBlockCachePercent = std::max(0, std::min(100, (int)GetArg("-" + strName + "blockcache", dboptions.nBlockCachePercent)));
+    dboptions.nMaxOpenFiles = std::max(16, (int)GetArg("-" + strName + "maxopenfiles", dboptions.nMaxOpenFiles));
+    dboptions.fCompression = GetBoolArg("-" + strName + "compression", dboptions.fCompression);
+    dboptions.fVerifyChecksums = GetBoolArg("-" + strName + "checksums", dboptions.fVerifyChecksums);
+    return dboptions;
+}
+
+static leveldb::Options GetOptions(const CLevelDBOptions &dboptions, CLevelDBCache *pcache) {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
+    options.block_cache = pcache;
+    // up to two write buffers may be held in memory simultaneously
+    options.write_buffer_size = dboptions.nCacheSize * (100 - dboptions.nBlockCachePercent) / 200;
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.compression = dboptions.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = dboptions.nMaxOpenFiles;
     return options;
 }
 
-CLevelDB::CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory, bool fWipe) {
+CLevelDB::CLevelDB(const boost::filesystem::path &path, const CLevelDBOptions &dboptions, bool fMemory, bool fWipe) :
+    nReads(0), nWrites(0), nWriteMicros(0), nSlowWrites(0), nSlowWriteMicros(0) {
     penv = NULL;
-    readoptions.verify_checksums = true;
-    iteroptions.verify_checksums = true;
+    readoptions.verify_checksums = dboptions.fVerifyChecksums;
+    iteroptions.verify_checksums = dboptions.fVerifyChecksums;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    pcache = new CLevelDBCache(dboptions.nCacheSize * dboptions.nBlockCachePercent / 100);
+    options = GetOptions(dboptions, pcache);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -56,7 +111,9 @@ CLevelDB::CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     if (!status.ok())
         throw std::runtime_error(strprintf("CLevelDB(): error opening database environment %s", status.ToString().c_str()));
-    printf("Opened LevelDB successfully\n");
+    printf("Opened LevelDB successfully (cache %" PRIszu " KiB, %d%% block cache, max %d open files, compression %s, checksums %s)\n",
+           dboptions.nCacheSize >> 10, dboptions.nBlockCachePercent, dboptions.nMaxOpenFiles,
+           dboptions.fCompression ? "on" : "off", dboptions.fVerifyChecksums ? "on" : "off");
 }
 
 CLevelDB::~CLevelDB() {
@@ -64,14 +121,58 @@ CLevelDB::~CLevelDB() {
     pdb = NULL;
     delete options.filter_policy;
     options.filter_policy = NULL;
-    delete options.block_cache;
+    delete pcache;
+    pcache = NULL;
     options.block_cache = NULL;
     delete penv;
     options.env = NULL;
 }
 
+void CLevelDB::GetStats(CLevelDBStats &stats) {
+    stats.nReads = nReads;
+    stats.nCacheHits = pcache->nHits;
+    stats.nCacheMisses = pcache->nMisses;
+    stats.nWrites = nWrites;
+    stats.nWriteMicros = nWriteMicros;
+    stats.nSlowWrites = nSlowWrites;
+    stats.nSlowWriteMicros = nSlowWriteMicros;
+
+    stats.vFilesPerLevel.clear();
+    for (int nLevel = 0; ; nLevel++) {
+        std::string strFiles;
+        if (!pdb->GetProperty(strprintf("leveldb.num-files-at-level%d", nLevel), &strFiles))
+            break;
+        stats.vFilesPerLevel.push_back(atoi(strFiles.c_str()));
+    }
+
+    // The compaction table has one line per level:
+    // "Level  Files Size(MB) Time(sec) Read(MB) Write(MB)"
+    stats.dCompactionSeconds = stats.dCompactionReadMB = stats.dCompactionWriteMB = 0.0;
+    if (pdb->GetProperty("leveldb.stats", &stats.strLevelDBStats)) {
+        std::istringstream ss(stats.strLevelDBStats);
+        std::string strLine;
+        while (std::getline(ss, strLine)) {
+            int nLevel, nFiles;
+            double dSize, dTime, dRead, dWrite;
+            if (sscanf(strLine.c_str(), "%d %d %lf %lf %lf %lf", &nLevel, &nFiles, &dSize, &dTime, &dRead, &dWrite) == 6) {
+                stats.dCompactionSeconds += dTime;
+                stats.dCompactionReadMB += dRead;
+                stats.dCompactionWriteMB += dWrite;
+            }
+        }
+    }
+}
+
 bool CLevelDB::WriteBatch(CLevelDBBatch &batch, bool fSync) throw(leveldb_error) {
+    int64 nStart = GetTimeMicros();
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
+    int64 nTime = GetTimeMicros() - nStart;
+    nWrites++;
+    nWriteMicros += nTime;
+    if (nTime > 1000) {
+        nSlowWrites++;
+        nSlowWriteMicros += nTime;
+    }
     if (!status.ok()) {
         printf("LevelDB write failure: %s\n", status.ToString().c_str());
         HandleError(status);
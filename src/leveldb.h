@@ -10,6 +10,7 @@
 #include <leveldb/write_batch.h>
 
 #include <boost/filesystem/path.hpp>
+#include <boost/atomic.hpp>
 
 class leveldb_error : public std::runtime_error
 {
@@ -19,6 +20,61 @@ public:
 
 void HandleError(const leveldb::Status &status) throw(leveldb_error);
 
+/** Tuning knobs for a single CLevelDB instance.
+ *  Each database (chainstate, block index) gets its own profile so they can be
+ *  sized independently; see GetLevelDBOptions() for the matching command line options.
+ */
+class CLevelDBOptions
+{
+public:
+    // total memory budget: block cache plus (up to two) write buffers
+    size_t nCacheSize;
+    // share of nCacheSize given to the block cache, in percent
+    int nBlockCachePercent;
+    int nMaxOpenFiles;
+    // snappy compression; see LevelDBHasCompression()
+    bool fCompression;
+    // verify block checksums on every read and iteration
+    bool fVerifyChecksums;
+
+    CLevelDBOptions(size_t nCacheSizeIn = 0) {
+        nCacheSize = nCacheSizeIn;
+        nBlockCachePercent = 50;
+        nMaxOpenFiles = 64;
+        fCompression = false;
+        fVerifyChecksums = true;
+    }
+};
+
+/** Build the options for a database from -<strName>* arguments (e.g. -coinsdbmaxopenfiles). */
+CLevelDBOptions GetLevelDBOptions(const std::string &strName, size_t nCacheSize);
+
+/** Whether LevelDB was built with snappy. Without it, LevelDB silently stores blocks uncompressed. */
+bool LevelDBHasCompression();
+
+/** Runtime statistics of a CLevelDB instance */
+struct CLevelDBStats
+{
+    uint64 nReads;
+    uint64 nCacheHits;
+    uint64 nCacheMisses;
+    uint64 nWrites;
+    uint64 nWriteMicros;
+    // writes that took longer than 1 ms, i.e. were throttled or stalled by
+    // compaction, or waited for a sync
+    uint64 nSlowWrites;
+    uint64 nSlowWriteMicros;
+    double dCompactionSeconds;
+    double dCompactionReadMB;
+    double dCompactionWriteMB;
+    std::vector<int> vFilesPerLevel;
+    std::string strLevelDBStats;
+
+    CLevelDBStats() : nReads(0), nCacheHits(0), nCacheMisses(0), nWrites(0), nWriteMicros(0),
+                      nSlowWrites(0), nSlowWriteMicros(0), dCompactionSeconds(0.0),
+                      dCompactionReadMB(0.0), dCompactionWriteMB(0.0) {}
+};
+
 // Batch of changes queued to be written to a CLevelDB
 class CLevelDBBatch
 {
@@ -52,6 +108,8 @@ public:
     }
 };
 
+class CLevelDBCache;
+
 class CLevelDB
 {
 private:
@@ -76,10 +134,21 @@ private:
     // the database itself
     leveldb::DB *pdb;
 
+    // block cache, wrapped to count hits and misses
+    CLevelDBCache *pcache;
+
+    boost::atomic<uint64> nReads;
+    boost::atomic<uint64> nWrites;
+    boost::atomic<uint64> nWriteMicros;
+    boost::atomic<uint64> nSlowWrites;
+    boost::atomic<uint64> nSlowWriteMicros;
+
 public:
-    CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDB(const boost::filesystem::path &path, const CLevelDBOptions &dboptions, bool fMemory = false, bool fWipe = false);
     ~CLevelDB();
 
+    void GetStats(CLevelDBStats &stats);
+
     template<typename K, typename V> bool Read(const K& key, V& value) throw(leveldb_error) {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
@@ -87,6 +156,7 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         std::string strValue;
+        nReads++;
         leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
@@ -116,6 +186,7 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         std::string strValue;
+        nReads++;
         leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
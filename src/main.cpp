@@ -14,6 +14,8 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 using namespace std;
 using namespace boost;
@@ -52,7 +54,11 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
-unsigned int nCoinCacheSize = 5000;
+bool fAddrIndex = false;
+bool fPruneMode = false;
+bool fHavePruned = false;
+uint64 nPruneTarget = 0;
+size_t nCoinCacheUsage = 5000 * 300;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 int64 CTransaction::nMinTxFee = 100000;
@@ -64,8 +70,16 @@ CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
-map<uint256, CTransaction> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+COrphanTxPool orphanTxPool;
+
+// The block a UTXO snapshot was loaded at, and the hash_set its coins must
+// come out with, for as long as the blocks below it are not all validated
+static CBlockIndex* pindexSnapshot = NULL;
+static uint256 hashSnapshotSet = 0;
+// The last block below pindexSnapshot that has been validated
+static CBlockIndex* pindexSnapshotValidated = NULL;
+// Blocks below pindexSnapshot asked from peers: hash -> (peer id, time of the request)
+static map<uint256, pair<int, int64> > mapSnapshotBlocksInFlight;
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -168,6 +182,67 @@ void static ResendWalletTransactions()
 
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// CMuHash3072
+//
+
+// 2^3072 - 1103717, the largest 3072-bit safe prime
+static const CBigNum &MuHashModulus()
+{
+    static const CBigNum bnModulus = (CBigNum(1) << 3072) - CBigNum(1103717);
+    return bnModulus;
+}
+
+static CBigNum MuHashElement(const uint256 &hash)
+{
+    // Expand to 3072 bits: the hashes of (hash, counter) for 12 counters
+    std::vector<unsigned char> vch;
+    vch.reserve(3072 / 8 + 1);
+    for (unsigned char nCounter = 0; nCounter < 3072 / 256; nCounter++)
+    {
+        uint256 hashPart = Hash(hash.begin(), hash.end(), &nCounter, &nCounter + 1);
+        vch.insert(vch.end(), hashPart.begin(), hashPart.end());
+    }
+    vch.push_back(0); // setvch is little endian with a sign bit
+    CBigNum bn;
+    bn.setvch(vch);
+    return bn;
+}
+
+static void MuHashMultiply(CBigNum &bn, const uint256 &hash)
+{
+    CAutoBN_CTX pctx;
+    CBigNum bnElement = MuHashElement(hash);
+    if (!BN_mod_mul(&bn, &bn, &bnElement, &MuHashModulus(), pctx))
+        throw bignum_error("MuHashMultiply() : BN_mod_mul failed");
+}
+
+void CMuHash3072::Insert(const uint256 &hash)
+{
+    MuHashMultiply(bnNumerator, hash);
+}
+
+void CMuHash3072::Remove(const uint256 &hash)
+{
+    MuHashMultiply(bnDenominator, hash);
+}
+
+uint256 CMuHash3072::GetHash() const
+{
+    CAutoBN_CTX pctx;
+    CBigNum bnInverse;
+    if (!BN_mod_inverse(&bnInverse, &bnDenominator, &MuHashModulus(), pctx))
+        throw bignum_error("CMuHash3072::GetHash() : BN_mod_inverse failed");
+    CBigNum bnResult;
+    if (!BN_mod_mul(&bnResult, &bnNumerator, &bnInverse, &MuHashModulus(), pctx))
+        throw bignum_error("CMuHash3072::GetHash() : BN_mod_mul failed");
+    std::vector<unsigned char> vch = bnResult.getvch();
+    return Hash(vch.begin(), vch.end());
+}
+
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // CCoinsView implementations
@@ -178,7 +253,7 @@ bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return fal
 bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
 CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
+bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
 
 
@@ -189,43 +264,137 @@ bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(t
 CBlockIndex *CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
 bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestBlock(pindex); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
+CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) { }
+
+// Rough estimate of what the allocator hands out for a request of nAlloc bytes
+static inline size_t MallocUsage(size_t nAlloc)
+{
+    if (nAlloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((nAlloc + 31) >> 4) << 4;
+    return ((nAlloc + 15) >> 3) << 3;
+}
+
+size_t CCoins::DynamicMemoryUsage() const {
+    size_t nUsage = MallocUsage(vout.capacity() * sizeof(CTxOut));
+    BOOST_FOREACH(const CTxOut &out, vout)
+        nUsage += MallocUsage(out.scriptPubKey.capacity());
+    return nUsage;
+}
+
+// Memory used by a cache entry: the hash table node, its LRU list node and the coins themselves
+static inline size_t CacheEntryUsage(const CCoinsCacheEntry &entry)
+{
+    static const size_t nNodeUsage = MallocUsage(sizeof(CCoinsMap::value_type) + 2 * sizeof(void*)) +
+                                     MallocUsage(sizeof(uint256) + 2 * sizeof(void*));
+    return nNodeUsage + entry.coins.DynamicMemoryUsage() + entry.coinsBase.DynamicMemoryUsage();
+}
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL), cachedCoinsUsage(0) { }
 
 bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
-    if (cacheCoins.count(txid)) {
-        coins = cacheCoins[txid];
-        return true;
-    }
-    if (base->GetCoins(txid, coins)) {
-        cacheCoins[txid] = coins;
+    CCoinsMap::iterator it = FetchCoins(txid);
+    if (it != cacheCoins.end()) {
+        coins = it->second.coins;
         return true;
     }
     return false;
 }
 
-std::map<uint256,CCoins>::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = cacheCoins.lower_bound(txid);
-    if (it != cacheCoins.end() && it->first == txid)
+CCoinsMap::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = cacheCoins.find(txid);
+    if (it != cacheCoins.end()) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            lruClean.splice(lruClean.begin(), lruClean, it->second.itClean);
         return it;
+    }
     CCoins tmp;
     if (!base->GetCoins(txid,tmp))
         return cacheCoins.end();
-    std::map<uint256,CCoins>::iterator ret = cacheCoins.insert(it, std::make_pair(txid, CCoins()));
-    tmp.swap(ret->second);
+    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
+    tmp.swap(ret->second.coins);
+    if (ret->second.coins.IsPruned()) {
+        // The parent only has an empty entry for this txid; if we spend it
+        // again, there is nothing it needs to be told about.
+        ret->second.flags = CCoinsCacheEntry::FRESH;
+    }
+    ret->second.itClean = lruClean.insert(lruClean.begin(), txid);
+    cachedCoinsUsage += CacheEntryUsage(ret->second);
     return ret;
 }
 
+void CCoinsViewCache::MarkDirty(CCoinsCacheEntry &entry) {
+    if (!(entry.flags & CCoinsCacheEntry::DIRTY)) {
+        lruClean.erase(entry.itClean);
+        entry.flags |= CCoinsCacheEntry::DIRTY;
+        // Keep what the parent has, so the coin database can update its
+        // statistics without reading the coins back. A clean entry is never
+        // MODIFIABLE, so its usage is in the accounting.
+        if (!(entry.flags & CCoinsCacheEntry::FRESH)) {
+            entry.coinsBase = entry.coins;
+            entry.flags |= CCoinsCacheEntry::BASE;
+            cachedCoinsUsage += entry.coinsBase.DynamicMemoryUsage();
+        }
+    }
+}
+
+void CCoinsViewCache::EraseEntry(CCoinsMap::iterator it) {
+    assert(!(it->second.flags & CCoinsCacheEntry::MODIFIABLE));
+    if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+        lruClean.erase(it->second.itClean);
+    cachedCoinsUsage -= CacheEntryUsage(it->second);
+    cacheCoins.erase(it);
+}
+
+void CCoinsViewCache::SettleUsage() {
+    BOOST_FOREACH(CCoinsCacheEntry *pentry, vModifiable) {
+        pentry->flags &= ~CCoinsCacheEntry::MODIFIABLE;
+        cachedCoinsUsage += CacheEntryUsage(*pentry);
+    }
+    vModifiable.clear();
+}
+
 CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = FetchCoins(txid);
+    CCoinsMap::iterator it = FetchCoins(txid);
     assert(it != cacheCoins.end());
-    return it->second;
+    MarkDirty(it->second);
+    // The caller may grow or shrink the coins behind our back; take them
+    // out of the accounting until the next SettleUsage().
+    if (!(it->second.flags & CCoinsCacheEntry::MODIFIABLE)) {
+        cachedCoinsUsage -= CacheEntryUsage(it->second);
+        it->second.flags |= CCoinsCacheEntry::MODIFIABLE;
+        vModifiable.push_back(&it->second);
+    }
+    return it->second.coins;
+}
+
+const CCoins &CCoinsViewCache::AccessCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = FetchCoins(txid);
+    assert(it != cacheCoins.end());
+    return it->second.coins;
 }
 
 bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins) {
-    cacheCoins[txid] = coins;
+    return SetCoins(txid, coins, false);
+}
+
+bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins, bool fFresh) {
+    CCoinsMap::iterator it = cacheCoins.find(txid);
+    if (it == cacheCoins.end()) {
+        it = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
+        it->second.flags = CCoinsCacheEntry::DIRTY | (fFresh ? CCoinsCacheEntry::FRESH : 0);
+    } else {
+        MarkDirty(it->second);
+        if (!(it->second.flags & CCoinsCacheEntry::MODIFIABLE))
+            cachedCoinsUsage -= CacheEntryUsage(it->second);
+    }
+    it->second.coins = coins;
+    if (!(it->second.flags & CCoinsCacheEntry::MODIFIABLE))
+        cachedCoinsUsage += CacheEntryUsage(it->second);
     return true;
 }
 
@@ -244,24 +413,200 @@ bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        cacheCoins[it->first] = it->second;
+bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    SettleUsage();
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue; // unmodified, nothing to merge
+        bool fFresh = it->second.flags & CCoinsCacheEntry::FRESH;
+        CCoinsMap::iterator itUs = cacheCoins.find(it->first);
+        if (itUs == cacheCoins.end()) {
+            // Created and spent in the child without ever existing here
+            if (fFresh && it->second.coins.IsPruned())
+                continue;
+            // What the child took for our version is our parent's as well
+            CCoinsCacheEntry &entry = cacheCoins[it->first];
+            entry.coins.swap(it->second.coins);
+            entry.coinsBase.swap(it->second.coinsBase);
+            entry.flags = CCoinsCacheEntry::DIRTY | (it->second.flags & (CCoinsCacheEntry::FRESH | CCoinsCacheEntry::BASE));
+            cachedCoinsUsage += CacheEntryUsage(entry);
+        } else if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
+            // Our parent does not know this txid either, so just forget it
+            EraseEntry(itUs);
+        } else {
+            MarkDirty(itUs->second);
+            cachedCoinsUsage -= CacheEntryUsage(itUs->second);
+            itUs->second.coins.swap(it->second.coins);
+            cachedCoinsUsage += CacheEntryUsage(itUs->second);
+        }
+    }
+    mapCoins.clear();
     pindexTip = pindex;
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
+    SettleUsage();
+    // Set the unmodified entries aside; the base only consumes dirty ones
+    // and empties the map it is given.
+    CCoinsMap mapClean;
+    BOOST_FOREACH(const uint256 &txid, lruClean) {
+        CCoinsMap::iterator it = cacheCoins.find(txid);
+        CCoinsCacheEntry &entry = mapClean[txid];
+        entry.coins.swap(it->second.coins);
+        entry.flags = it->second.flags;
+        entry.itClean = it->second.itClean;
+    }
     bool fOk = base->BatchWrite(cacheCoins, pindexTip);
-    if (fOk)
-        cacheCoins.clear();
+    cacheCoins.clear();
+    cacheCoins.swap(mapClean);
+    cachedCoinsUsage = 0;
+    for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++)
+        cachedCoinsUsage += CacheEntryUsage(it->second);
     return fOk;
 }
 
+void CCoinsViewCache::Trim(size_t nTargetUsage) {
+    SettleUsage();
+    while (!lruClean.empty() && cachedCoinsUsage + cacheCoins.bucket_count() * sizeof(void*) > nTargetUsage) {
+        CCoinsMap::iterator it = cacheCoins.find(lruClean.back());
+        assert(it != cacheCoins.end());
+        EraseEntry(it);
+    }
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() {
     return cacheCoins.size();
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() {
+    SettleUsage();
+    return cachedCoinsUsage + cacheCoins.bucket_count() * sizeof(void*);
+}
+
+CCoinsViewBackgroundFlush::CCoinsViewBackgroundFlush(CCoinsView &baseIn) : CCoinsViewBacked(baseIn), pindexWriting(NULL), fWriting(false), fFailed(false), fStop(false) {
+    pthreadWrite = new boost::thread(boost::bind(&CCoinsViewBackgroundFlush::ThreadWrite, this));
+}
+
+CCoinsViewBackgroundFlush::~CCoinsViewBackgroundFlush() {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        cond.notify_all();
+    }
+    // The thread finishes the batch in flight before it exits
+    pthreadWrite->join();
+    delete pthreadWrite;
+    if (fFailed)
+        printf("ERROR: CCoinsViewBackgroundFlush : a write to the coin database failed\n");
+}
+
+void CCoinsViewBackgroundFlush::ThreadWrite() {
+    RenameThread("motocoin-coinwriter");
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (true) {
+        while (!fWriting && !fStop)
+            cond.wait(lock);
+        if (!fWriting)
+            return;
+
+        // Readers may look into mapWriting concurrently, so neither side
+        // modifies it until the write has completed.
+        lock.unlock();
+        int64 nStart = GetTimeMicros();
+        bool fOk = false;
+        try {
+            fOk = base->BatchWrite(mapWriting, pindexWriting);
+        } catch (std::exception &e) {
+            PrintExceptionContinue(&e, "CCoinsViewBackgroundFlush::ThreadWrite()");
+        }
+        if (fBenchmark)
+            printf("- Background flush: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
+        lock.lock();
+
+        mapWriting.clear();
+        fWriting = false;
+        if (!fOk)
+            fFailed = true;
+        cond.notify_all();
+    }
+}
+
+bool CCoinsViewBackgroundFlush::Sync() {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (fWriting)
+        cond.wait(lock);
+    return !fFailed;
+}
+
+bool CCoinsViewBackgroundFlush::GetCoins(const uint256 &txid, CCoins &coins) {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fWriting) {
+            CCoinsMap::const_iterator it = mapWriting.find(txid);
+            if (it != mapWriting.end() && (it->second.flags & CCoinsCacheEntry::DIRTY)) {
+                coins = it->second.coins;
+                return true;
+            }
+        }
+    }
+    // Coins outside the batch in flight are not touched by the write
+    return base->GetCoins(txid, coins);
+}
+
+bool CCoinsViewBackgroundFlush::HaveCoins(const uint256 &txid) {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fWriting) {
+            CCoinsMap::const_iterator it = mapWriting.find(txid);
+            if (it != mapWriting.end() && (it->second.flags & CCoinsCacheEntry::DIRTY))
+                return true;
+        }
+    }
+    return base->HaveCoins(txid);
+}
+
+bool CCoinsViewBackgroundFlush::SetCoins(const uint256 &txid, const CCoins &coins) {
+    if (!Sync())
+        return false;
+    return base->SetCoins(txid, coins);
+}
+
+CBlockIndex *CCoinsViewBackgroundFlush::GetBestBlock() {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fWriting)
+            return pindexWriting;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewBackgroundFlush::SetBestBlock(CBlockIndex *pindex) {
+    if (!Sync())
+        return false;
+    return base->SetBestBlock(pindex);
+}
+
+bool CCoinsViewBackgroundFlush::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (fWriting)
+        cond.wait(lock);
+    if (fFailed)
+        return false;
+    mapWriting.swap(mapCoins);
+    mapCoins.clear();
+    pindexWriting = pindex;
+    fWriting = true;
+    cond.notify_all();
+    return true;
+}
+
+bool CCoinsViewBackgroundFlush::GetStats(CCoinsStats &stats) {
+    if (!Sync())
+        return false;
+    return base->GetStats(stats);
+}
+
 /** CCoinsView that brings transactions from a memorypool into view.
     It does not check for spendings by memory pool transactions. */
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
@@ -286,13 +631,94 @@ CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
-// mapOrphanTransactions
+// CBlockIndex storage
 //
 
-bool AddOrphanTx(const CTransaction& tx)
+// Block index entries are carved out of large slabs instead of being
+// allocated one by one. They are never freed individually, only all at once
+// when the block index is unloaded.
+static const unsigned int BLOCKINDEX_SLAB_SIZE = 4096;
+static std::vector<CBlockIndex*> vBlockIndexSlabs;
+static unsigned int nBlockIndexSlabUsed = 0;
+
+// Returns uninitialized memory for one CBlockIndex; construct it with placement new
+static void *AllocateBlockIndex()
+{
+    if (vBlockIndexSlabs.empty() || nBlockIndexSlabUsed == BLOCKINDEX_SLAB_SIZE) {
+        vBlockIndexSlabs.push_back(static_cast<CBlockIndex*>(::operator new(sizeof(CBlockIndex) * BLOCKINDEX_SLAB_SIZE)));
+        nBlockIndexSlabUsed = 0;
+    }
+    return &vBlockIndexSlabs.back()[nBlockIndexSlabUsed++];
+}
+
+static void FreeBlockIndexSlabs()
+{
+    for (unsigned int i = 0; i < vBlockIndexSlabs.size(); i++) {
+        unsigned int nUsed = (i + 1 == vBlockIndexSlabs.size()) ? nBlockIndexSlabUsed : BLOCKINDEX_SLAB_SIZE;
+        for (unsigned int j = 0; j < nUsed; j++)
+            vBlockIndexSlabs[i][j].~CBlockIndex();
+        ::operator delete(vBlockIndexSlabs[i]);
+    }
+    vBlockIndexSlabs.clear();
+    nBlockIndexSlabUsed = 0;
+}
+
+bool CBlockIndex::ReadPoW(MotoPoW &pow) const
+{
+    CDiskBlockIndex diskindex;
+    if (!pblocktree->ReadBlockIndex(GetBlockHash(), diskindex))
+        return error("CBlockIndex::ReadPoW() : block %s not found in block tree", GetBlockHash().ToString().c_str());
+    pow = diskindex.Nonce;
+    return true;
+}
+
+CBlockHeader CBlockIndex::GetBlockHeader() const
+{
+    CBlockHeader block;
+    block.nVersion       = nVersion;
+    if (pprev)
+        block.hashPrevBlock = pprev->GetBlockHash();
+    block.hashMerkleRoot = hashMerkleRoot;
+    block.nTime          = nTime;
+    block.nBits          = nBits;
+    if (!ReadPoW(block.Nonce)) {
+        // Still hashes correctly, but cannot be replayed
+        block.Nonce.Nonce = nNonce;
+        block.Nonce.NumFrames = nFrames;
+    }
+    return block;
+}
+
+// Rewrite the stored entry of a block whose status or file positions changed.
+// The proof of work is not kept in memory, so it is carried over from disk.
+static bool UpdateBlockIndex(CBlockIndex *pindex)
+{
+    MotoPoW pow;
+    if (!pindex->ReadPoW(pow))
+        return false;
+    return pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex, pow));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// COrphanTxPool
+//
+
+COrphanTxPool::COrphanTxPool() : nSize(0), nMaxCount(MAX_ORPHAN_TRANSACTIONS),
+    nMaxSize(DEFAULT_MAX_ORPHAN_TX_SIZE << 20)
+{
+}
+
+void COrphanTxPool::SetLimits(unsigned int nMaxCountIn, size_t nMaxSizeIn)
+{
+    nMaxCount = nMaxCountIn;
+    nMaxSize = nMaxSizeIn;
+}
+
+bool COrphanTxPool::Add(const CTransaction &tx, int nPeer)
 {
     uint256 hash = tx.GetHash();
-    if (mapOrphanTransactions.count(hash))
+    if (mapTx.count(hash))
         return false;
 
     // Ignore big transactions, to avoid a
@@ -300,54 +726,110 @@ bool AddOrphanTx(const CTransaction& tx)
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
     unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
-    if (sz > 5000)
+    if (sz > MAX_ORPHAN_TX_SIZE)
     {
         printf("ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString().c_str());
         return false;
     }
 
-    mapOrphanTransactions[hash] = tx;
+    CEntry &entry = mapTx[hash];
+    entry.tx = tx;
+    entry.nPeer = nPeer;
+    entry.nTime = GetTime();
+    entry.nSize = sz;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapByPrev[txin.prevout.hash].insert(hash);
+    CPeer &peer = mapPeers[nPeer];
+    peer.nSize += sz;
+    peer.setOrphans.insert(make_pair(entry.nTime, hash));
+    setByTime.insert(make_pair(entry.nTime, hash));
+    nSize += sz;
 
     printf("stored orphan tx %s (mapsz %" PRIszu ")\n", hash.ToString().c_str(),
-        mapOrphanTransactions.size());
+        mapTx.size());
     return true;
 }
 
-void static EraseOrphanTx(uint256 hash)
+bool COrphanTxPool::Erase(const uint256 &hash)
 {
-    if (!mapOrphanTransactions.count(hash))
-        return;
-    const CTransaction& tx = mapOrphanTransactions[hash];
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    map<uint256, CEntry>::iterator it = mapTx.find(hash);
+    if (it == mapTx.end())
+        return false;
+    const CEntry &entry = it->second;
+    BOOST_FOREACH(const CTxIn& txin, entry.tx.vin)
     {
-        mapOrphanTransactionsByPrev[txin.prevout.hash].erase(hash);
-        if (mapOrphanTransactionsByPrev[txin.prevout.hash].empty())
-            mapOrphanTransactionsByPrev.erase(txin.prevout.hash);
-    }
-    mapOrphanTransactions.erase(hash);
+        map<uint256, set<uint256> >::iterator mi = mapByPrev.find(txin.prevout.hash);
+        if (mi == mapByPrev.end())
+            continue;
+        mi->second.erase(hash);
+        if (mi->second.empty())
+            mapByPrev.erase(mi);
+    }
+    map<int, CPeer>::iterator pi = mapPeers.find(entry.nPeer);
+    pi->second.nSize -= entry.nSize;
+    pi->second.setOrphans.erase(make_pair(entry.nTime, hash));
+    if (pi->second.setOrphans.empty())
+        mapPeers.erase(pi);
+    setByTime.erase(make_pair(entry.nTime, hash));
+    nSize -= entry.nSize;
+    mapTx.erase(it);
+    return true;
 }
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+unsigned int COrphanTxPool::Limit()
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+    int64 nExpire = GetTime() - ORPHAN_TX_EXPIRE_TIME;
+    while (!setByTime.empty() && setByTime.begin()->first <= nExpire)
     {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, CTransaction>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+        Erase(setByTime.begin()->second);
+        ++nEvicted;
+    }
+    while (mapTx.size() > nMaxCount || nSize > nMaxSize)
+    {
+        // Evict the oldest orphan of the peer holding the most bytes
+        map<int, CPeer>::iterator itMax = mapPeers.begin();
+        for (map<int, CPeer>::iterator pi = mapPeers.begin(); pi != mapPeers.end(); ++pi)
+            if (pi->second.nSize > itMax->second.nSize)
+                itMax = pi;
+        Erase(itMax->second.setOrphans.begin()->second);
         ++nEvicted;
     }
     return nEvicted;
 }
 
+void COrphanTxPool::Clear()
+{
+    mapTx.clear();
+    mapByPrev.clear();
+    mapPeers.clear();
+    setByTime.clear();
+    nSize = 0;
+}
+
+const CTransaction *COrphanTxPool::Get(const uint256 &hash) const
+{
+    map<uint256, CEntry>::const_iterator it = mapTx.find(hash);
+    if (it == mapTx.end())
+        return NULL;
+    return &it->second.tx;
+}
+
+void COrphanTxPool::GetChildren(const uint256 &hashParent, vector<uint256> &vChildren) const
+{
+    vChildren.clear();
+    map<uint256, set<uint256> >::const_iterator mi = mapByPrev.find(hashParent);
+    if (mi != mapByPrev.end())
+        vChildren.assign(mi->second.begin(), mi->second.end());
+}
+
+size_t COrphanTxPool::PeerSize(int nPeer) const
+{
+    map<int, CPeer>::const_iterator pi = mapPeers.find(nPeer);
+    return pi == mapPeers.end() ? 0 : pi->second.nSize;
+}
+
 
 
 
@@ -785,8 +1267,7 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
             // At default rate it would take over a month to fill 1GB
             if (dFreeCount >= GetArg("-limitfreerelay", 15)*10*1000)
                 return error("CTxMemPool::accept() : free transaction rejected by rate limiter");
-            if (fDebug)
-                printf("Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
+            LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
             dFreeCount += nSize;
         }
 
@@ -976,6 +1457,163 @@ bool CWalletTx::AcceptWalletTransaction(bool fCheckInputs)
 }
 
 
+CBlockReadCache blockReadCache;
+
+CBlockReadCache::CBlockReadCache() : nSize(0), nMaxSize(DEFAULT_READ_CACHE_SIZE << 20),
+    nBlockHits(0), nBlockMisses(0), nTxHits(0), nTxMisses(0)
+{
+}
+
+void CBlockReadCache::Insert(bool fBlock, const uint256 &hash, CEntry &entry)
+{
+    std::map<uint256, CEntry> &map = fBlock ? mapBlocks : mapTxs;
+    if (map.count(hash))
+        Remove(fBlock, hash);
+    if (entry.nSize > nMaxSize / 4)
+        return; // would push out too much else
+    entry.itLRU = listLRU.insert(listLRU.begin(), std::make_pair(fBlock, hash));
+    map.insert(std::make_pair(hash, entry));
+    nSize += entry.nSize;
+    Shrink();
+}
+
+void CBlockReadCache::Remove(bool fBlock, const uint256 &hash)
+{
+    std::map<uint256, CEntry> &map = fBlock ? mapBlocks : mapTxs;
+    std::map<uint256, CEntry>::iterator it = map.find(hash);
+    if (it == map.end())
+        return;
+    nSize -= it->second.nSize;
+    listLRU.erase(it->second.itLRU);
+    map.erase(it);
+}
+
+void CBlockReadCache::Touch(CEntry &entry)
+{
+    listLRU.splice(listLRU.begin(), listLRU, entry.itLRU);
+}
+
+void CBlockReadCache::Shrink()
+{
+    while (nSize > nMaxSize && !listLRU.empty()) {
+        std::pair<bool, uint256> item = listLRU.back();
+        Remove(item.first, item.second);
+    }
+}
+
+void CBlockReadCache::SetMaxSize(size_t nMaxSizeIn)
+{
+    LOCK(cs);
+    nMaxSize = nMaxSizeIn;
+    Shrink();
+}
+
+bool CBlockReadCache::GetBlock(const uint256 &hash, CBlock &block, bool fCheckPoW)
+{
+    boost::shared_ptr<const CBlock> pblock;
+    {
+        LOCK(cs);
+        std::map<uint256, CEntry>::iterator it = mapBlocks.find(hash);
+        if (it == mapBlocks.end() || (fCheckPoW && !it->second.fCheckedPoW)) {
+            nBlockMisses++;
+            return false;
+        }
+        nBlockHits++;
+        Touch(it->second);
+        pblock = it->second.pblock;
+    }
+    // Copy outside the lock; cached blocks are never modified
+    block = *pblock;
+    return true;
+}
+
+void CBlockReadCache::AddBlock(const CBlock &block, bool fCheckedPoW)
+{
+    {
+        // Do not copy anything when the cache is off
+        LOCK(cs);
+        if (nMaxSize == 0)
+            return;
+    }
+    CEntry entry;
+    entry.pblock.reset(new CBlock(block));
+    entry.fCheckedPoW = fCheckedPoW;
+    entry.nSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+    uint256 hash = block.GetHash();
+
+    LOCK(cs);
+    std::map<uint256, CEntry>::iterator it = mapBlocks.find(hash);
+    if (it != mapBlocks.end() && it->second.fCheckedPoW && !fCheckedPoW)
+        return;
+    Insert(true, hash, entry);
+}
+
+bool CBlockReadCache::GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
+{
+    boost::shared_ptr<const CTransaction> ptx;
+    {
+        LOCK(cs);
+        std::map<uint256, CEntry>::iterator it = mapTxs.find(hash);
+        if (it == mapTxs.end()) {
+            nTxMisses++;
+            return false;
+        }
+        nTxHits++;
+        Touch(it->second);
+        ptx = it->second.ptx;
+        hashBlock = it->second.hashBlock;
+    }
+    tx = *ptx;
+    return true;
+}
+
+void CBlockReadCache::AddTransaction(const CTransaction &tx, const uint256 &hashBlock)
+{
+    {
+        LOCK(cs);
+        if (nMaxSize == 0)
+            return;
+    }
+    CEntry entry;
+    entry.ptx.reset(new CTransaction(tx));
+    entry.hashBlock = hashBlock;
+    entry.fCheckedPoW = false;
+    entry.nSize = ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+
+    LOCK(cs);
+    Insert(false, tx.GetHash(), entry);
+}
+
+void CBlockReadCache::EraseBlock(const CBlock &block)
+{
+    LOCK(cs);
+    Remove(true, block.GetHash());
+    BOOST_FOREACH(const CTransaction &tx, block.vtx)
+        Remove(false, tx.GetHash());
+}
+
+void CBlockReadCache::Clear()
+{
+    LOCK(cs);
+    mapBlocks.clear();
+    mapTxs.clear();
+    listLRU.clear();
+    nSize = 0;
+}
+
+void CBlockReadCache::GetStats(Stats &stats) const
+{
+    LOCK(cs);
+    stats.nBlocks = mapBlocks.size();
+    stats.nTxs = mapTxs.size();
+    stats.nSize = nSize;
+    stats.nMaxSize = nMaxSize;
+    stats.nBlockHits = nBlockHits;
+    stats.nBlockMisses = nBlockMisses;
+    stats.nTxHits = nTxHits;
+    stats.nTxMisses = nTxMisses;
+}
+
 // Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -991,6 +1629,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
             }
         }
 
+        if ((fTxIndex || fAllowSlow) && blockReadCache.GetTransaction(hash, txOut, hashBlock))
+            return true;
+
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
@@ -1006,6 +1647,7 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
                 hashBlock = header.GetHash();
                 if (txOut.GetHash() != hash)
                     return error("%s() : txid mismatch", __PRETTY_FUNCTION__);
+                blockReadCache.AddTransaction(txOut, hashBlock);
                 return true;
             }
         }
@@ -1030,6 +1672,7 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
                 if (tx.GetHash() == hash) {
                     txOut = tx;
                     hashBlock = pindexSlow->GetBlockHash();
+                    blockReadCache.AddTransaction(txOut, hashBlock);
                     return true;
                 }
             }
@@ -1049,30 +1692,73 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
-CBlockIndex* FindBlockByHeight(int nHeight)
+// Published copy of the chain tip and the active chain by height. Writers hold
+// cs_main as well; readers only take cs_chainTip, and only for a moment.
+static boost::shared_mutex cs_chainTip;
+static boost::shared_ptr<const CChainTip> pchainTip(new CChainTip());
+static std::vector<CBlockIndex*> vActiveChain;
+
+boost::shared_ptr<const CChainTip> GetChainTip()
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs_chainTip);
+    return pchainTip;
+}
+
+bool GetActiveBlockHash(int nHeight, uint256& hashRet)
+{
+    CBlockIndex* pindex = FindBlockByHeight(nHeight);
+    if (!pindex)
+        return false;
+    hashRet = pindex->GetBlockHash();
+    return true;
+}
+
+// Requires cs_main
+static void PublishChainTip(CBlockIndex* pindexNew)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
+    boost::shared_ptr<CChainTip> ptip(new CChainTip());
+    if (pindexNew)
+    {
+        ptip->nHeight = pindexNew->nHeight;
+        ptip->hashBlock = pindexNew->GetBlockHash();
+        ptip->nTime = pindexNew->GetBlockTime();
+        ptip->nBits = pindexNew->nBits;
+    }
+
+    boost::unique_lock<boost::shared_mutex> lock(cs_chainTip);
+    if (!pindexNew)
+        vActiveChain.clear();
     else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    {
+        // Replace the entries above the fork point
+        vActiveChain.resize(pindexNew->nHeight + 1, NULL);
+        for (CBlockIndex* pindex = pindexNew; pindex && vActiveChain[pindex->nHeight] != pindex; pindex = pindex->pprev)
+            vActiveChain[pindex->nHeight] = pindex;
+    }
+    pchainTip = ptip;
 }
 
-bool CBlock::ReadFromDisk(const CBlockIndex* pindex)
+CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    if (!ReadFromDisk(pindex->GetBlockPos()))
+    boost::shared_lock<boost::shared_mutex> lock(cs_chainTip);
+    if (nHeight < 0 || nHeight >= (int)vActiveChain.size())
+        return NULL;
+    return vActiveChain[nHeight];
+}
+
+bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fCheckPoW)
+{
+    if (blockReadCache.GetBlock(pindex->GetBlockHash(), *this, fCheckPoW))
+        return true;
+    // Below a loaded snapshot there can be blocks of which only the header
+    // is known, and in prune mode old blocks are deleted
+    if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+        return false;
+    if (!ReadFromDisk(pindex->GetBlockPos(), fCheckPoW))
         return false;
     if (GetHash() != pindex->GetBlockHash())
         return error("CBlock::ReadFromDisk() : GetHash() doesn't match index");
+    blockReadCache.AddBlock(*this, fCheckPoW);
     return true;
 }
 
@@ -1187,7 +1873,7 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
 
         for (int i = 0; pindexFirst && i < blockstogoback; i++)
         {
-            Times[i] = pindexFirst->Nonce.NumFrames;
+            Times[i] = pindexFirst->nFrames;
             Sum += Times[i];
             pindexFirst = pindexFirst->pprev;
         }
@@ -1252,7 +1938,7 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
             pindexFirst = pindexLast;
             for (int i = 0; pindexFirst && i < nAntiwarpInterval; i++)
             {
-              Sum += pindexFirst->Nonce.NumFrames;
+              Sum += pindexFirst->nFrames;
               pindexFirst = pindexFirst->pprev;
             }
             assert(pindexFirst);
@@ -1346,7 +2032,7 @@ void static InvalidChainFound(CBlockIndex* pindexNew)
 
 void static InvalidBlockFound(CBlockIndex *pindex) {
     pindex->nStatus |= BLOCK_FAILED_VALID;
-    pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex));
+    UpdateBlockIndex(pindex);
     setBlockIndexValid.erase(pindex);
 	printf("INVALID BLOCK\n");
     InvalidChainFound(pindex);
@@ -1380,7 +2066,7 @@ bool ConnectBestBlock(CValidationState &state) {
                 while (pindexTest != pindexFailed) {
                     pindexFailed->nStatus |= BLOCK_FAILED_CHILD;
                     setBlockIndexValid.erase(pindexFailed);
-                    pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexFailed));
+                    UpdateBlockIndex(pindexFailed);
                     pindexFailed = pindexFailed->pprev;
                 }
                 printf("INVALID ANCESTRY\n");
@@ -1430,7 +2116,7 @@ void CBlockHeader::UpdateTime(const CBlockIndex* pindexPrev)
 
 const CTxOut &CTransaction::GetOutputFor(const CTxIn& input, CCoinsViewCache& view)
 {
-    const CCoins &coins = view.GetCoins(input.prevout.hash);
+    const CCoins &coins = view.AccessCoins(input.prevout.hash);
     assert(coins.IsAvailable(input.prevout.n));
     return coins.vout[input.prevout.n];
 }
@@ -1476,8 +2162,11 @@ void CTransaction::UpdateCoins(CValidationState &state, CCoinsViewCache &inputs,
         }
     }
 
-    // add outputs
-    assert(inputs.SetCoins(txhash, CCoins(*this, nHeight)));
+    // add outputs; the caller made sure there are no unspent ones for this
+    // txid already (BIP30 in ConnectBlock, and the memory pool only has new
+    // transactions), so they need not reach the database if spent before the
+    // next flush
+    assert(inputs.SetCoins(txhash, CCoins(*this, nHeight), true));
 }
 
 bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
@@ -1493,7 +2182,7 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
         // then check whether the actual outputs are available
         for (unsigned int i = 0; i < vin.size(); i++) {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
             if (!coins.IsAvailable(prevout.n))
                 return false;
         }
@@ -1503,7 +2192,7 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, pcache.get()))
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().c_str());
     return true;
 }
@@ -1533,7 +2222,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
             // If prev is coinbase, check that it's matured
             if (coins.IsCoinBase()) {
@@ -1567,12 +2256,17 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // Inputs share most of their signature hash computation
+            boost::shared_ptr<const CSignatureHashCache> pcache;
+            if (vin.size() > 1)
+                pcache.reset(new CSignatureHashCache(*this));
+
             for (unsigned int i = 0; i < vin.size(); i++) {
                 const COutPoint &prevout = vin[i].prevout;
-                const CCoins &coins = inputs.GetCoins(prevout.hash);
+                const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
                 // Verify signature
-                CScriptCheck check(coins, *this, i, flags, 0);
+                CScriptCheck check(coins, *this, i, flags, 0, pcache);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1580,7 +2274,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
                     if (flags & SCRIPT_VERIFY_STRICTENC) {
                         // For now, check whether the failure was caused by non-canonical
                         // encodings or not; if so, don't trigger DoS protection.
-                        CScriptCheck check(coins, *this, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0);
+                        CScriptCheck check(coins, *this, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0, pcache);
                         if (check())
                             return state.Invalid();
                     }
@@ -1594,23 +2288,73 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
 }
 
 
-bool CBlock::CheckPoW()
+bool CBlockHeader::CheckPoWFast() const
 {
     if (GetHash() == hashGenesisBlock)
         return true;
+	if(!motoCheckInputs(&Nonce)) {
+		printf("Bad inputs!\n");
+		return false;
+	}
 	if(Nonce.NumFrames > (nBits & MOTO_TARGET_MASK)) {
 		printf("Bad frame count!\n");
 		return false;
 	}
-	if(!motoCheck((const uint8_t*)&nVersion, &Nonce)) {
+	if(!motoCheckWork((const uint8_t*)&nVersion, Nonce.Nonce)) {
+		printf("Bad work!\n");
+		return false;
+	}
+    return true;
+}
+
+static bool fMockReplay = false; // For unit testing
+
+void SetMockReplay(bool fMock)
+{
+    fMockReplay = fMock;
+}
+
+bool CBlock::CheckPoW()
+{
+    if (GetHash() == hashGenesisBlock)
+        return true;
+    // Generating the world and replaying the game is by far the most
+    // expensive part, so only get there if the cheap checks pass; they are
+    // not repeated
+    if (!CheckPoWFast())
+        return false;
+    if (fMockReplay)
+        return true;
+	if(!motoCheckReplay((const uint8_t*)&nVersion, &Nonce)) {
 		printf("Bad Check!\n");
 		return false;
 	}
     return true;
 }
 
-
-bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &view, bool *pfClean)
+
+uint160 GetAddrIndexHash(const CScript &scriptPubKey)
+{
+    CTxDestination dest;
+    if (ExtractDestination(scriptPubKey, dest)) {
+        CScript script;
+        script.SetDestination(dest);
+        return Hash160(script.begin(), script.end());
+    }
+    return Hash160(scriptPubKey.begin(), scriptPubKey.end());
+}
+
+bool CAddrIndexUpdate::Get(const CAddrIndexKey &key, CAddrIndexValue &value) const
+{
+    std::map<CAddrIndexKey, CAddrIndexValue>::const_iterator it = mapEntries.find(key);
+    if (it != mapEntries.end()) {
+        value = it->second;
+        return !value.IsNull();
+    }
+    return pblocktree->ReadAddrIndex(key, value);
+}
+
+bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &view, bool *pfClean, CAddrIndexUpdate *paddrindex)
 {
     assert(pindex == view.GetBestBlock());
 
@@ -1637,7 +2381,8 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
         // check that all outputs are available
         if (!view.HaveCoins(hash)) {
             fClean = fClean && error("DisconnectBlock() : outputs still spent? database corrupted");
-            view.SetCoins(hash, CCoins());
+            // The view just found nothing for it
+            view.SetCoins(hash, CCoins(), true);
         }
         CCoins &outs = view.GetCoins(hash);
 
@@ -1652,6 +2397,9 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
 
         // remove outputs
         outs = CCoins();
+        if (paddrindex)
+            for (unsigned int j = 0; j < tx.vout.size(); j++)
+                paddrindex->Erase(CAddrIndexKey(GetAddrIndexHash(tx.vout[j].scriptPubKey), pindex->nHeight, hash, j));
 
         // restore inputs
         if (i > 0) { // not coinbases
@@ -1682,6 +2430,15 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
                 coins.vout[out.n] = undo.txout;
                 if (!view.SetCoins(out.hash, coins))
                     return error("DisconnectBlock() : cannot restore coin inputs");
+                if (paddrindex) {
+                    CAddrIndexKey key(GetAddrIndexHash(undo.txout.scriptPubKey), coins.nHeight, out.hash, out.n);
+                    CAddrIndexValue value;
+                    if (paddrindex->Get(key, value)) {
+                        value.SetSpent(0, 0, 0);
+                        paddrindex->Set(key, value);
+                    } else
+                        fClean = fClean && error("DisconnectBlock() : spent output missing from address index");
+                }
             }
         }
     }
@@ -1721,6 +2478,10 @@ void static FlushBlockFile(bool fFinalize = false)
 }
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
+bool static PruneBlockFiles();
+
+// Set when the block files grew, so that the next flush checks the -prune target
+static bool fCheckForPruning = false;
 
 static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
 
@@ -1729,10 +2490,10 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
-bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck)
+bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck, CAddrIndexUpdate *paddrindex, bool fCheckPoW)
 {
     // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(state, !fJustCheck, !fJustCheck))
+    if (!CheckBlock(state, !fJustCheck && fCheckPoW, !fJustCheck))
         return false;
 
     // verify that the view's current state corresponds to the previous block
@@ -1765,7 +2526,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     if (fEnforceBIP30) {
         for (unsigned int i=0; i<vtx.size(); i++) {
             uint256 hash = GetTxHash(i);
-            if (view.HaveCoins(hash) && !view.GetCoins(hash).IsPruned())
+            if (view.HaveCoins(hash) && !view.AccessCoins(hash).IsPruned())
                 return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"));
         }
     }
@@ -1817,10 +2578,27 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
             if (!tx.CheckInputs(state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
+
+            if (paddrindex) {
+                for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                    const COutPoint &prevout = tx.vin[j].prevout;
+                    const CCoins &coins = view.AccessCoins(prevout.hash);
+                    CAddrIndexKey key(GetAddrIndexHash(coins.vout[prevout.n].scriptPubKey), coins.nHeight, prevout.hash, prevout.n);
+                    CAddrIndexValue value;
+                    if (paddrindex->Get(key, value)) {
+                        value.SetSpent(GetTxHash(i), j, pindex->nHeight);
+                        paddrindex->Set(key, value);
+                    } else
+                        error("ConnectBlock() : spent output missing from address index");
+                }
+            }
         }
 
         CTxUndo txundo;
         tx.UpdateCoins(state, view, txundo, pindex->nHeight, GetTxHash(i));
+        if (paddrindex)
+            for (unsigned int j = 0; j < tx.vout.size(); j++)
+                paddrindex->Set(CAddrIndexKey(GetAddrIndexHash(tx.vout[j].scriptPubKey), pindex->nHeight, GetTxHash(i), j), CAddrIndexValue(pos, tx.vout[j].nValue));
         if (!tx.IsCoinBase())
             blockundo.vtxundo.push_back(txundo);
 
@@ -1860,8 +2638,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
 
         pindex->nStatus = (pindex->nStatus & ~BLOCK_VALID_MASK) | BLOCK_VALID_SCRIPTS;
 
-        CDiskBlockIndex blockindex(pindex);
-        if (!pblocktree->WriteBlockIndex(blockindex))
+        if (!UpdateBlockIndex(pindex))
             return state.Abort(_("Failed to write block index"));
     }
 
@@ -1916,6 +2693,9 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         printf("REORGANIZE: Connect %" PRIszu " blocks; ..%s\n", vConnect.size(), pindexNew->GetBlockHash().ToString().c_str());
     }
 
+    // Address index changes, written together once all blocks are connected
+    CAddrIndexUpdate addrindex;
+
     // Disconnect shorter branch
     vector<CTransaction> vResurrect;
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect) {
@@ -1923,8 +2703,9 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         if (!block.ReadFromDisk(pindex))
             return state.Abort(_("Failed to read block"));
         int64 nStart = GetTimeMicros();
-        if (!block.DisconnectBlock(state, pindex, view))
+        if (!block.DisconnectBlock(state, pindex, view, NULL, fAddrIndex ? &addrindex : NULL))
             return error("SetBestBlock() : DisconnectBlock %s failed", pindex->GetBlockHash().ToString().c_str());
+        blockReadCache.EraseBlock(block);
         if (fBenchmark)
             printf("- Disconnect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
 
@@ -1943,7 +2724,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         if (!block.ReadFromDisk(pindex))
             return state.Abort(_("Failed to read block"));
         int64 nStart = GetTimeMicros();
-        if (!block.ConnectBlock(state, pindex, view)) {
+        if (!block.ConnectBlock(state, pindex, view, false, fAddrIndex ? &addrindex : NULL)) {
             if (state.IsInvalid()) {
 				printf("SETBESTINVALID");
                 InvalidChainFound(pindexNew);
@@ -1959,6 +2740,9 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
             vDelete.push_back(tx);
     }
 
+    if (fAddrIndex && !pblocktree->WriteAddrIndex(addrindex))
+        return state.Abort(_("Failed to write address index"));
+
     // Flush changes to global coin state
     int64 nStart = GetTimeMicros();
     int nModified = view.GetCacheSize();
@@ -1967,20 +2751,32 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     if (fBenchmark)
         printf("- Flush %i transactions: %.2fms (%.4fms/tx)\n", nModified, 0.001 * nTime, 0.001 * nTime / nModified);
 
-    // Make sure it's successfully written to disk before changing memory structure
+    // Keep the coin cache within its memory budget. Unmodified entries can
+    // simply be dropped; modified ones have to be written out first.
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
-        // Typical CCoins structures on disk are around 100 bytes in size.
-        // Pushing a new one to the database can cause it to be written
-        // twice (once in the log, and once in the tables). This is already
-        // an overestimation, as most will delete an existing entry or
-        // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
+    size_t nCacheUsage = pcoinsTip->DynamicMemoryUsage();
+    if (nCacheUsage > nCoinCacheUsage) {
+        pcoinsTip->Trim(nCoinCacheUsage * 9 / 10);
+        nCacheUsage = pcoinsTip->DynamicMemoryUsage();
+    }
+    bool fFlushForPrune = fPruneMode && fCheckForPruning && !fReindex;
+    if (!fIsInitialDownload || nCacheUsage > nCoinCacheUsage || fFlushForPrune) {
+        // CCoins structures on disk are smaller than in memory. Pushing a
+        // new one to the database can cause it to be written twice (once in
+        // the log, and once in the tables). This is already an overestimation,
+        // as most will delete an existing entry or overwrite one. Still, use
+        // a conservative safety factor of 2.
+        if (!CheckDiskSpace(2 * nCacheUsage))
             return state.Error();
+        // Block files and index must be on disk before the coin database
+        // may refer to them. The coins themselves are written in the
+        // background; a failure surfaces at the next flush.
         FlushBlockFile();
         pblocktree->Sync();
         if (!pcoinsTip->Flush())
             return state.Abort(_("Failed to write to coin database"));
+        if (fFlushForPrune && !PruneBlockFiles())
+            return state.Abort(_("Failed to prune block files"));
     }
 
     // At this point, all changes have been done to the database.
@@ -2010,18 +2806,20 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         mempool.removeConflicts(tx);
     }
 
-    // Update best block in wallet (so we can detect restored wallets)
+    // New best block
+    hashBestChain = pindexNew->GetBlockHash();
+    pindexBest = pindexNew;
+    nBestHeight = pindexBest->nHeight;
+    PublishChainTip(pindexNew);
+
+    // Update best block in wallet (so we can detect restored wallets). The
+    // locator looks blocks up by height in the active chain, so it is only
+    // built once that chain ends at the new tip.
     if ((pindexNew->nHeight % 20160) == 0 || (!fIsInitialDownload && (pindexNew->nHeight % 144) == 0))
     {
         const CBlockLocator locator(pindexNew);
         ::SetBestChain(locator);
     }
-
-    // New best block
-    hashBestChain = pindexNew->GetBlockHash();
-    pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
-    nBestHeight = pindexBest->nHeight;
     nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
@@ -2068,8 +2866,7 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
         return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString().c_str()));
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(*this);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = new (AllocateBlockIndex()) CBlockIndex(*this);
     map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
     map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
@@ -2087,7 +2884,7 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
     pindexNew->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
     setBlockIndexValid.insert(pindexNew);
 
-    if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew)))
+    if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew, Nonce)))
         return state.Abort(_("Failed to write block index"));
 
     // New best?
@@ -2150,6 +2947,7 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
                     AllocateFileRange(file, pos.nPos, nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos);
                     fclose(file);
                 }
+                fCheckForPruning = true;
             }
             else
                 return state.Error();
@@ -2196,6 +2994,7 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
                 AllocateFileRange(file, pos.nPos, nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos);
                 fclose(file);
             }
+            fCheckForPruning = true;
         }
         else
             return state.Error();
@@ -2214,10 +3013,6 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
         return state.DoS(100, error("CheckBlock() : size limits failed"));
 
-    // Check proof of work matches claimed amount
-    if (fCheckPOW && !CheckPoW())
-        return state.DoS(50, error("CheckBlock() : proof of work failed"));
-
     // Check timestamp
     if (GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
         return state.Invalid(error("CheckBlock() : block timestamp too far in the future"));
@@ -2260,6 +3055,63 @@ bool CBlock::CheckBlock(CValidationState &state, bool fCheckPOW, bool fCheckMerk
     if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
         return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
+    // Check proof of work matches claimed amount. This replays the game, so
+    // it comes after everything else that can be checked without context
+    if (fCheckPOW && !CheckPoW())
+        return state.DoS(50, error("CheckBlock() : proof of work failed"));
+
+    return true;
+}
+
+bool CheckBlockHeader(const CBlockHeader &header, CValidationState &state)
+{
+    uint256 hash = header.GetHash();
+    if (hash == hashGenesisBlock)
+        return true;
+
+    if (!header.CheckPoWFast())
+        return state.DoS(50, error("CheckBlockHeader() : proof of work failed"));
+
+    if (header.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return state.Invalid(error("CheckBlockHeader() : block timestamp too far in the future"));
+
+    // With the parent at hand, the target the block must meet is known too
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(header.hashPrevBlock);
+    if (mi != mapBlockIndex.end()) {
+        CBlockIndex* pindexPrev = (*mi).second;
+        int nHeight = pindexPrev->nHeight+1;
+
+        if (header.nBits != GetNextWorkRequired(pindexPrev, &header))
+            return state.DoS(100, error("CheckBlockHeader() : incorrect proof of work"));
+
+        if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+            return state.Invalid(error("CheckBlockHeader() : block's timestamp is too early"));
+
+        if (!Checkpoints::CheckBlock(nHeight, hash))
+            return state.DoS(100, error("CheckBlockHeader() : rejected by checkpoint lock-in at %d", nHeight));
+
+        CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+        if (pcheckpoint && nHeight < pcheckpoint->nHeight)
+            return state.DoS(100, error("CheckBlockHeader() : forked chain older than last checkpoint (height %d)", nHeight));
+    }
+
+    return true;
+}
+
+// Checks of the transactions of a block that depend on its height
+bool static ContextualCheckBlock(const CBlock &block, CValidationState &state, int nHeight)
+{
+    // Check that all transactions are finalized
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        if (!tx.IsFinal(nHeight, block.GetBlockTime()))
+            return state.DoS(10, error("ContextualCheckBlock() : contains a non-final transaction"));
+
+    // Enforce rule that the coinbase starts with serialized block height
+    CScript expect = CScript() << nHeight;
+    if (block.vtx[0].vin[0].scriptSig.size() < expect.size() ||
+        !std::equal(expect.begin(), expect.end(), block.vtx[0].vin[0].scriptSig.begin()))
+        return state.DoS(100, error("ContextualCheckBlock() : block height mismatch in coinbase"));
+
     return true;
 }
 
@@ -2288,11 +3140,6 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
         if (GetBlockTime() <= pindexPrev->GetMedianTimePast())
             return state.Invalid(error("AcceptBlock() : block's timestamp is too early"));
 
-        // Check that all transactions are finalized
-        BOOST_FOREACH(const CTransaction& tx, vtx)
-            if (!tx.IsFinal(nHeight, GetBlockTime()))
-                return state.DoS(10, error("AcceptBlock() : contains a non-final transaction"));
-
         // Check that the block chain matches the known block chain up to a checkpoint
         if (!Checkpoints::CheckBlock(nHeight, hash))
             return state.DoS(100, error("AcceptBlock() : rejected by checkpoint lock-in at %d", nHeight));
@@ -2302,11 +3149,8 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
         if (pcheckpoint && nHeight < pcheckpoint->nHeight)
             return state.DoS(100, error("AcceptBlock() : forked chain older than last checkpoint (height %d)", nHeight));
 
-        // Enforce rule that the coinbase starts with serialized block height
-        CScript expect = CScript() << nHeight;
-        if (vtx[0].vin[0].scriptSig.size() < expect.size() ||
-            !std::equal(expect.begin(), expect.end(), vtx[0].vin[0].scriptSig.begin()))
-            return state.DoS(100, error("AcceptBlock() : block height mismatch in coinbase"));
+        if (!ContextualCheckBlock(*this, state, nHeight))
+            return false;
     }
 
     // Write block to history file
@@ -2320,6 +3164,8 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
         if (dbp == NULL)
             if (!WriteToDisk(blockPos))
                 return state.Abort(_("Failed to write block"));
+        // Connecting the block and relaying it will read it back right away
+        blockReadCache.AddBlock(*this, true);
         if (!AddToBlockIndex(state, blockPos))
             return error("AcceptBlock() : AddToBlockIndex failed");
     } catch(std::runtime_error &e) {
@@ -2339,6 +3185,33 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
     return true;
 }
 
+bool CBlock::AcceptBlockData(CValidationState &state, CBlockIndex *pindex)
+{
+    // The header is known already; what is left is to check that the
+    // transactions belong to it. The proof of play is replayed when the block
+    // is connected.
+    if (!CheckBlock(state, false))
+        return error("AcceptBlockData() : CheckBlock FAILED");
+
+    try {
+        unsigned int nBlockSize = ::GetSerializeSize(*this, SER_DISK, CLIENT_VERSION);
+        CDiskBlockPos blockPos;
+        if (!FindBlockPos(state, blockPos, nBlockSize+8, pindex->nHeight, nTime))
+            return error("AcceptBlockData() : FindBlockPos failed");
+        if (!WriteToDisk(blockPos))
+            return state.Abort(_("Failed to write block"));
+        pindex->nTx = vtx.size();
+        pindex->nFile = blockPos.nFile;
+        pindex->nDataPos = blockPos.nPos;
+        pindex->nStatus |= BLOCK_HAVE_DATA;
+        if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex, Nonce)))
+            return state.Abort(_("Failed to write block index"));
+    } catch(std::runtime_error &e) {
+        return state.Abort(_("System error: ") + e.what());
+    }
+    return true;
+}
+
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
 {
     // Litecoin: temporarily disable v2 block lockin until we are ready for v2 transition
@@ -2353,18 +3226,44 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+// Token bucket of orphan block replays: MAX_ORPHAN_BLOCK_REPLAYS at once, one
+// more every ORPHAN_BLOCK_REPLAY_INTERVAL seconds
+bool static AllowOrphanBlockReplay(CNode* pfrom)
+{
+    int64 nNow = GetTime();
+    pfrom->dOrphanBlockReplays = std::min((double)MAX_ORPHAN_BLOCK_REPLAYS, pfrom->dOrphanBlockReplays + (double)(nNow - pfrom->nLastOrphanBlockReplay) / ORPHAN_BLOCK_REPLAY_INTERVAL);
+    pfrom->nLastOrphanBlockReplay = nNow;
+    if (pfrom->dOrphanBlockReplays < 1.0)
+        return false;
+    pfrom->dOrphanBlockReplays -= 1.0;
+    return true;
+}
+
+// Whether pindex is below the loaded snapshot and still needs its transactions
+bool static IsSnapshotBlockNeeded(const CBlockIndex *pindex)
+{
+    return pindexSnapshot && !(pindex->nStatus & BLOCK_HAVE_DATA) &&
+           pindex->nHeight <= pindexSnapshot->nHeight && pindex->IsInMainChain();
+}
+
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp, bool fCheckPoW)
 {
     // Check for duplicate
     uint256 hash = pblock->GetHash();
-    if (mapBlockIndex.count(hash))
-        return state.Invalid(error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString().c_str()));
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end()) {
+        if (IsSnapshotBlockNeeded(mi->second)) {
+            mapSnapshotBlocksInFlight.erase(hash);
+            return pblock->AcceptBlockData(state, mi->second);
+        }
+        return state.Invalid(error("ProcessBlock() : already have block %d %s", mi->second->nHeight, hash.ToString().c_str()));
+    }
     if (mapOrphanBlocks.count(hash))
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString().c_str()));
 
-    // Preliminary checks
-    if (!pblock->CheckBlock(state))
-        return error("ProcessBlock() : CheckBlock FAILED");
+    // Cheap checks first, so that junk never gets as far as the replay
+    if (!CheckBlockHeader(*pblock, state))
+        return error("ProcessBlock() : CheckBlockHeader FAILED");
 
     CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
     if (pcheckpoint && pblock->hashPrevBlock != hashBestChain)
@@ -2383,6 +3282,15 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         }
     }
 
+    // Without the parent nothing ties the block to the target it claims, so
+    // limit how often each peer can make us replay such blocks
+    if (pfrom && pblock->hashPrevBlock != 0 && !mapBlockIndex.count(pblock->hashPrevBlock) && !AllowOrphanBlockReplay(pfrom))
+        return state.Invalid(error("ProcessBlock() : too many orphan blocks from peer=%s", pfrom->addrName.c_str()));
+
+    // Preliminary checks
+    if (!pblock->CheckBlock(state, fCheckPoW))
+        return error("ProcessBlock() : CheckBlock FAILED");
+
 
     // If we don't already have its previous block, shunt it off to holding area until we get it
     if (pblock->hashPrevBlock != 0 && !mapBlockIndex.count(pblock->hashPrevBlock))
@@ -2464,6 +3372,38 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 }
 
 
+CCompactBlock::CCompactBlock(const CBlock& block)
+{
+    header = block.GetBlockHeader();
+    nNonce = GetRand(std::numeric_limits<uint64>::max());
+
+    CPrefilledTransaction prefilled;
+    prefilled.nIndex = 0;
+    prefilled.tx = block.vtx[0];
+    vPrefilled.push_back(prefilled);
+
+    uint64 k0, k1;
+    GetShortIdKeys(k0, k1);
+    vShortIds.reserve(block.vtx.size() - 1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        vShortIds.push_back(GetShortId(k0, k1, block.vtx[i].GetHash()));
+}
+
+void CCompactBlock::GetShortIdKeys(uint64 &k0, uint64 &k1) const
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << header << nNonce;
+    uint256 hash = ss.GetHash();
+    k0 = hash.Get64(0);
+    k1 = hash.Get64(1);
+}
+
+uint64 CCompactBlock::GetShortId(uint64 k0, uint64 k1, const uint256 &txid)
+{
+    return SipHashUint256(k0, k1, txid) & 0xffffffffffffULL;
+}
+
+
 
 
 
@@ -2613,11 +3553,16 @@ CCriticalSection cs_LastBlockFile;
 CBlockFileInfo infoLastBlockFile;
 int nLastBlockFile = 0;
 
+boost::filesystem::path static GetBlockFilePath(int nFile, const char *prefix)
+{
+    return GetDataDir() / "blocks" / strprintf("%s%05u.dat", prefix, nFile);
+}
+
 FILE* OpenDiskFile(const CDiskBlockPos &pos, const char *prefix, bool fReadOnly)
 {
     if (pos.IsNull())
         return NULL;
-    boost::filesystem::path path = GetDataDir() / "blocks" / strprintf("%s%05u.dat", prefix, pos.nFile);
+    boost::filesystem::path path = GetBlockFilePath(pos.nFile, prefix);
     boost::filesystem::create_directories(path.parent_path());
     FILE* file = fopen(path.string().c_str(), "rb+");
     if (!file && !fReadOnly)
@@ -2644,6 +3589,112 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly) {
     return OpenDiskFile(pos, "rev", fReadOnly);
 }
 
+void static RemovePrunedFiles(int nFile)
+{
+    boost::system::error_code ec;
+    boost::filesystem::remove(GetBlockFilePath(nFile, "blk"), ec);
+    boost::filesystem::remove(GetBlockFilePath(nFile, "rev"), ec);
+}
+
+void FindFilesToPrune(const vector<CBlockFileInfo> &vInfo, int nPruneHeight, uint64 nTarget, set<int> &setFilesToPrune)
+{
+    uint64 nUsage = 0;
+    BOOST_FOREACH(const CBlockFileInfo &info, vInfo)
+        nUsage += info.nSize + info.nUndoSize;
+
+    // Leave room for the chunks the next blocks allocate
+    uint64 nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    for (int nFile = 0; nFile + 1 < (int)vInfo.size() && nUsage + nBuffer >= nTarget; nFile++) {
+        const CBlockFileInfo &info = vInfo[nFile];
+        if (info.nSize == 0 || (int)info.nHeightLast > nPruneHeight)
+            continue;
+        nUsage -= info.nSize + info.nUndoSize;
+        setFilesToPrune.insert(nFile);
+    }
+}
+
+// Delete the oldest block and undo files while they take more than
+// nPruneTarget. Blocks less than MIN_BLOCKS_TO_KEEP below the best block
+// of the coin database on disk are kept, so that they can still be
+// disconnected, and connected again after a crash.
+bool static PruneBlockFiles()
+{
+    fCheckForPruning = false;
+
+    // The blocks below a loaded snapshot are still to be replayed
+    if (pindexSnapshot)
+        return true;
+
+    CBlockIndex *pindexFlushed = pcoinsdbview->GetBestBlock();
+    int nPruneHeight = std::min(nBestHeight, pindexFlushed ? pindexFlushed->nHeight : 0) - MIN_BLOCKS_TO_KEEP;
+    if (nPruneHeight <= 0)
+        return true;
+
+    vector<CBlockFileInfo> vInfo;
+    {
+        LOCK(cs_LastBlockFile);
+        vInfo.resize(nLastBlockFile + 1);
+        for (int nFile = 0; nFile < nLastBlockFile; nFile++)
+            pblocktree->ReadBlockFileInfo(nFile, vInfo[nFile]);
+        vInfo[nLastBlockFile] = infoLastBlockFile;
+    }
+
+    set<int> setFilesToPrune;
+    FindFilesToPrune(vInfo, nPruneHeight, nPruneTarget, setFilesToPrune);
+    if (setFilesToPrune.empty())
+        return true;
+
+    // Files that got blocks out of order can have too low a last height
+    // recorded, so go by the blocks themselves
+    vector<CBlockIndex*> vPruned;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex) {
+        CBlockIndex *pindex = item.second;
+        if (!(pindex->nStatus & BLOCK_HAVE_MASK) || !setFilesToPrune.count(pindex->nFile))
+            continue;
+        if (pindex->nHeight > nPruneHeight)
+            setFilesToPrune.erase(pindex->nFile);
+        else
+            vPruned.push_back(pindex);
+    }
+
+    BOOST_FOREACH(CBlockIndex *pindex, vPruned) {
+        if (!setFilesToPrune.count(pindex->nFile))
+            continue;
+        pindex->nStatus &= ~BLOCK_HAVE_MASK;
+        pindex->nFile = 0;
+        pindex->nDataPos = 0;
+        pindex->nUndoPos = 0;
+        if (!UpdateBlockIndex(pindex))
+            return error("PruneBlockFiles() : failed to write block index");
+    }
+    BOOST_FOREACH(int nFile, setFilesToPrune) {
+        vInfo[nFile].SetPruned();
+        if (!pblocktree->WriteBlockFileInfo(nFile, vInfo[nFile]))
+            return error("PruneBlockFiles() : failed to write file info");
+    }
+
+    // The index must no longer refer to the files when they are deleted;
+    // files left behind by a crash are deleted at the next start
+    fHavePruned = true;
+    if (!pblocktree->WriteFlag("prunedblockfiles", true) || !pblocktree->Sync())
+        return error("PruneBlockFiles() : failed to write block index");
+    BOOST_FOREACH(int nFile, setFilesToPrune) {
+        printf("PruneBlockFiles() : deleting blk%05u.dat and rev%05u.dat: %s\n", nFile, nFile, vInfo[nFile].ToString().c_str());
+        RemovePrunedFiles(nFile);
+    }
+    return true;
+}
+
+bool HavePrunedBlocksSince(const CBlockIndex *pindexFrom)
+{
+    if (!fHavePruned)
+        return false;
+    const CBlockIndex *pindex = pindexBest;
+    while (pindex && pindex->nHeight >= pindexFrom->nHeight && (pindex->nStatus & BLOCK_HAVE_DATA))
+        pindex = pindex->pprev;
+    return pindex && pindex->nHeight >= pindexFrom->nHeight;
+}
+
 CBlockIndex * InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
@@ -2655,15 +3706,32 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = new (AllocateBlockIndex()) CBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
+// Make pindexNew the tip of the best chain as loaded from disk, and link the
+// blocks leading to it
+void static SetBestChainIndex(CBlockIndex *pindexNew)
+{
+    pindexBest = pindexNew;
+    hashBestChain = pindexBest->GetBlockHash();
+    nBestHeight = pindexBest->nHeight;
+    nBestChainWork = pindexBest->nChainWork;
+    PublishChainTip(pindexBest);
+
+    // set 'next' pointers in best chain
+    CBlockIndex *pindex = pindexBest;
+    while(pindex != NULL && pindex->pprev != NULL) {
+         CBlockIndex *pindexPrev = pindex->pprev;
+         pindexPrev->pnext = pindex;
+         pindex = pindexPrev;
+    }
+}
+
 bool static LoadBlockIndexDB()
 {
     if (!pblocktree->LoadBlockIndexGuts())
@@ -2695,6 +3763,19 @@ bool static LoadBlockIndexDB()
     if (pblocktree->ReadBlockFileInfo(nLastBlockFile, infoLastBlockFile))
         printf("LoadBlockIndexDB(): last block file info: %s\n", infoLastBlockFile.ToString().c_str());
 
+    // Check whether block files have been pruned, and delete those that
+    // were still there when the node stopped
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned) {
+        printf("LoadBlockIndexDB(): block files have been pruned\n");
+        for (int nFile = 0; nFile < nLastBlockFile; nFile++) {
+            CBlockFileInfo info;
+            if (pblocktree->ReadBlockFileInfo(nFile, info) && info.IsPruned())
+                RemovePrunedFiles(nFile);
+        }
+    }
+    fCheckForPruning = true;
+
     // Load nBestInvalidWork, OK if it doesn't exist
     CBigNum bnBestInvalidWork;
     pblocktree->ReadBestInvalidWork(bnBestInvalidWork);
@@ -2708,22 +3789,30 @@ bool static LoadBlockIndexDB()
     // Check whether we have a transaction index
     pblocktree->ReadFlag("txindex", fTxIndex);
     printf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
+    pblocktree->ReadFlag("addrindex", fAddrIndex);
+    printf("LoadBlockIndexDB(): address index %s\n", fAddrIndex ? "enabled" : "disabled");
+
+    // A snapshot that was only partly loaded leaves the databases unusable
+    bool fSnapshotLoading = false;
+    pblocktree->ReadFlag("snapshotloading", fSnapshotLoading);
+    if (fSnapshotLoading)
+        return error("LoadBlockIndexDB() : loading a UTXO snapshot was interrupted");
+
+    // Check whether the blocks below a loaded snapshot are still to be validated
+    uint256 hashSnapshotBlock;
+    if (pblocktree->ReadSnapshotBase(hashSnapshotBlock, hashSnapshotSet)) {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashSnapshotBlock);
+        if (mi == mapBlockIndex.end())
+            return error("LoadBlockIndexDB() : snapshot block %s not found", hashSnapshotBlock.ToString().c_str());
+        pindexSnapshot = mi->second;
+        printf("LoadBlockIndexDB(): blocks below the snapshot at height %d not validated yet\n", pindexSnapshot->nHeight);
+    }
 
     // Load hashBestChain pointer to end of best chain
-    pindexBest = pcoinsTip->GetBestBlock();
-    if (pindexBest == NULL)
+    CBlockIndex *pindex = pcoinsTip->GetBestBlock();
+    if (pindex == NULL)
         return true;
-    hashBestChain = pindexBest->GetBlockHash();
-    nBestHeight = pindexBest->nHeight;
-    nBestChainWork = pindexBest->nChainWork;
-
-    // set 'next' pointers in best chain
-    CBlockIndex *pindex = pindexBest;
-    while(pindex != NULL && pindex->pprev != NULL) {
-         CBlockIndex *pindexPrev = pindex->pprev;
-         pindexPrev->pnext = pindex;
-         pindex = pindexPrev;
-    }
+    SetBestChainIndex(pindex);
     printf("LoadBlockIndexDB(): hashBestChain=%s  height=%d date=%s\n",
         hashBestChain.ToString().c_str(), nBestHeight,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str());
@@ -2753,6 +3842,12 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
         boost::this_thread::interruption_point();
         if (pindex->nHeight < nBestHeight-nCheckDepth)
             break;
+        // Nothing to check below a loaded snapshot until the blocks are
+        // there, nor in pruned block files
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            printf("VerifyDB(): block data not available at height %d, stopping\n", pindex->nHeight);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!block.ReadFromDisk(pindex))
@@ -2770,7 +3865,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!block.DisconnectBlock(state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
@@ -2807,6 +3902,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
 void UnloadBlockIndex()
 {
     mapBlockIndex.clear();
+    FreeBlockIndexSlabs();
     setBlockIndexValid.clear();
     pindexGenesisBlock = NULL;
     nBestHeight = 0;
@@ -2814,6 +3910,12 @@ void UnloadBlockIndex()
     nBestInvalidWork = 0;
     hashBestChain = 0;
     pindexBest = NULL;
+    PublishChainTip(NULL);
+    pindexSnapshot = NULL;
+    hashSnapshotSet = 0;
+    pindexSnapshotValidated = NULL;
+    mapSnapshotBlocksInFlight.clear();
+    fHavePruned = false;
 }
 
 static CBlock getGenesisBlock()
@@ -2880,56 +3982,433 @@ bool LoadBlockIndex()
 }
 
 
-bool InitBlockIndex() {
-    // Check whether we're already initialized
-    if (pindexGenesisBlock != NULL)
-        return true;
+bool InitBlockIndex() {
+    // Check whether we're already initialized
+    if (pindexGenesisBlock != NULL)
+        return true;
+
+    hashGenesisBlock = getGenesisBlock().GetHash();
+    hashGenesisMerkleRoot = getGenesisBlock().hashMerkleRoot;
+
+    // Use the provided settings for -txindex and -addrindex in the new database
+    fTxIndex = GetBoolArg("-txindex", false);
+    pblocktree->WriteFlag("txindex", fTxIndex);
+    fAddrIndex = GetBoolArg("-addrindex", false);
+    pblocktree->WriteFlag("addrindex", fAddrIndex);
+    printf("Initializing databases...\n");
+
+    // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
+    if (!fReindex) {
+        // Genesis Block:
+        // CBlock(hash=12a765e31ffd4059bada, PoW=0000050c34a64b415b6b, ver=1, hashPrevBlock=00000000000000000000, hashMerkleRoot=97ddfbbae6, nTime=1317972665, nBits=1e0ffff0, nNonce=2084524493, vtx=1)
+        //   CTransaction(hash=97ddfbbae6, ver=1, vin.size=1, vout.size=1, nLockTime=0)
+        //     CTxIn(COutPoint(0000000000, -1), coinbase 04ffff001d0104404e592054696d65732030352f4f63742f32303131205374657665204a6f62732c204170706c65e280997320566973696f6e6172792c2044696573206174203536)
+        //     CTxOut(nValue=50.00000000, scriptPubKey=040184710fa689ad5023690c80f3a4)
+        //   vMerkleTree: 97ddfbbae6
+
+        // Genesis block,
+        CBlock block = getGenesisBlock();
+
+        //// debug print
+        uint256 hash = block.GetHash();
+        printf("%s\n", hash.ToString().c_str());
+        printf("%s\n", hashGenesisBlock.ToString().c_str());
+        printf("%s\n", block.hashMerkleRoot.ToString().c_str());
+        assert(block.hashMerkleRoot == hashGenesisMerkleRoot);
+        block.print();
+        assert(hash == hashGenesisBlock);
+
+        // Start new block file
+        try {
+            unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+            CDiskBlockPos blockPos;
+            CValidationState state;
+            if (!FindBlockPos(state, blockPos, nBlockSize+8, 0, block.nTime))
+                return error("LoadBlockIndex() : FindBlockPos failed");
+            if (!block.WriteToDisk(blockPos))
+                return error("LoadBlockIndex() : writing genesis block to disk failed");
+            if (!block.AddToBlockIndex(state, blockPos))
+                return error("LoadBlockIndex() : genesis block not accepted");
+        } catch(std::runtime_error &e) {
+            return error("LoadBlockIndex() : failed to initialize block database: %s", e.what());
+        }
+    }
+
+    return true;
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// UTXO snapshots
+//
+
+bool DumpSnapshot(const boost::filesystem::path &path, CSnapshotHeader &header)
+{
+    vector<CBlockIndex*> vChain;
+    CCoinsViewDBCursor *pcursor;
+    {
+        LOCK(cs_main);
+        // Get the coins of the best block into the database, and wait for
+        // the background write to finish
+        CCoinsStats stats;
+        if (!pcoinsTip->Flush() || !pcoinsTip->GetStats(stats))
+            return error("DumpSnapshot() : failed to flush the coin database");
+        if (stats.hashBlock != hashBestChain)
+            return error("DumpSnapshot() : coin database is not at the best block");
+
+        header.SetNull();
+        header.hashBlock = hashBestChain;
+        header.nHeight = nBestHeight;
+        header.nTransactions = stats.nTransactions;
+        header.nTransactionOutputs = stats.nTransactionOutputs;
+        header.nTotalAmount = stats.nTotalAmount;
+        header.hashSet = stats.hashSet.GetHash();
+        for (CBlockIndex* pindex = pindexBest; pindex; pindex = pindex->pprev)
+            vChain.push_back(pindex);
+        // The rest is read from a consistent view of the database, without cs_main
+        pcursor = pcoinsdbview->Cursor();
+    }
+    reverse(vChain.begin(), vChain.end());
+    boost::scoped_ptr<CCoinsViewDBCursor> cursor(pcursor);
+
+    boost::filesystem::path pathTmp = path.string() + ".tmp";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpSnapshot() : cannot open %s", pathTmp.string().c_str());
+
+    CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+    try {
+        fileout << FLATDATA(pchMessageStart) << header;
+        hasher << FLATDATA(pchMessageStart) << header;
+        BOOST_FOREACH(CBlockIndex* pindex, vChain) {
+            CBlockHeader block = pindex->GetBlockHeader();
+            if (block.GetHash() != pindex->GetBlockHash())
+                return error("DumpSnapshot() : cannot read the header of block %d", pindex->nHeight);
+            fileout << block;
+            hasher << block;
+        }
+        uint256 txid;
+        CCoins coins;
+        uint64 nCount = 0;
+        while (cursor->Next(txid, coins)) {
+            fileout << txid << coins;
+            hasher << txid << coins;
+            nCount++;
+        }
+        if (nCount != header.nTransactions)
+            return error("DumpSnapshot() : coin database has %" PRI64u " entries, its statistics %" PRI64u, nCount, header.nTransactions);
+        fileout << hasher.GetHash();
+    } catch (std::exception &e) {
+        return error("DumpSnapshot() : I/O error %s", e.what());
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+    if (!RenameOver(pathTmp, path))
+        return error("DumpSnapshot() : cannot rename %s", pathTmp.string().c_str());
+    return true;
+}
+
+// Read a snapshot file front to back. Without fLoad only its structure and
+// checksum are checked. With fLoad the block headers are checked and added
+// to the block index, and the coins are written to pcoinsTip.
+bool static ReadSnapshot(const boost::filesystem::path &path, CSnapshotHeader &header, bool fLoad)
+{
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("ReadSnapshot() : cannot open %s", path.string().c_str());
+
+    CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+    try {
+        unsigned char pchMagic[4];
+        filein >> FLATDATA(pchMagic) >> header;
+        hasher << FLATDATA(pchMagic) << header;
+        if (memcmp(pchMagic, pchMessageStart, sizeof(pchMagic)))
+            return error("ReadSnapshot() : not a snapshot of this network");
+        if (header.nVersion != CSnapshotHeader::CURRENT_VERSION)
+            return error("ReadSnapshot() : unknown version %d", header.nVersion);
+        if (header.nHeight < 0)
+            return error("ReadSnapshot() : bad height %d", header.nHeight);
+
+        // The headers of the chain up to the snapshot block
+        CBlockIndex* pindexPrev = NULL;
+        uint256 hashPrev = 0;
+        for (int nHeight = 0; nHeight <= header.nHeight; nHeight++) {
+            boost::this_thread::interruption_point();
+            CBlockHeader block;
+            filein >> block;
+            hasher << block;
+            uint256 hash = block.GetHash();
+            if (block.hashPrevBlock != hashPrev || (nHeight == 0 && hash != hashGenesisBlock))
+                return error("ReadSnapshot() : block headers do not form a chain at height %d", nHeight);
+            hashPrev = hash;
+            if (!fLoad)
+                continue;
+            if (nHeight == 0) {
+                pindexPrev = pindexGenesisBlock;
+                continue;
+            }
+
+            // Everything short of replaying the proof of play, which the
+            // background validation does when it gets to the block
+            CValidationState state;
+            if (!CheckBlockHeader(block, state))
+                return error("ReadSnapshot() : bad header of block %d %s", nHeight, hash.ToString().c_str());
+            CBlockIndex* pindexNew = new (AllocateBlockIndex()) CBlockIndex(block);
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+            pindexNew->phashBlock = &((*mi).first);
+            pindexNew->pprev = pindexPrev;
+            pindexNew->nHeight = nHeight;
+            pindexNew->nChainWork = pindexPrev->nChainWork + pindexNew->GetBlockWork().getuint256();
+            pindexNew->nChainTx = pindexPrev->nChainTx;
+            pindexNew->nStatus = BLOCK_VALID_TREE;
+            if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew, block.Nonce)))
+                return error("ReadSnapshot() : failed to write block index");
+            pindexPrev = pindexNew;
+        }
+        if (hashPrev != header.hashBlock)
+            return error("ReadSnapshot() : block headers do not end at the snapshot block");
+
+        // The coins, in the order of the coin database
+        uint256 txidPrev = 0;
+        for (uint64 i = 0; i < header.nTransactions; i++) {
+            if (i % 10000 == 0)
+                boost::this_thread::interruption_point();
+            uint256 txid;
+            CCoins coins;
+            filein >> txid >> coins;
+            hasher << txid << coins;
+            if (i > 0 && memcmp(txidPrev.begin(), txid.begin(), txid.size()) >= 0)
+                return error("ReadSnapshot() : coins out of order");
+            if (coins.IsPruned())
+                return error("ReadSnapshot() : spent coins");
+            txidPrev = txid;
+            if (!fLoad)
+                continue;
+            // The coin database holds nothing else but the spent genesis coins
+            pcoinsTip->SetCoins(txid, coins, true);
+            if (pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage) {
+                if (!pcoinsTip->Flush())
+                    return error("ReadSnapshot() : failed to write to coin database");
+                pcoinsTip->Trim(0);
+            }
+        }
+
+        uint256 hashFile;
+        filein >> hashFile;
+        if (hashFile != hasher.GetHash())
+            return error("ReadSnapshot() : checksum mismatch");
+    } catch (std::exception &e) {
+        return error("ReadSnapshot() : deserialize or I/O error %s", e.what());
+    }
+    return true;
+}
+
+bool VerifySnapshot(const boost::filesystem::path &path, CSnapshotHeader &header)
+{
+    return ReadSnapshot(path, header, false);
+}
+
+bool LoadSnapshot(const boost::filesystem::path &path, CSnapshotHeader &header)
+{
+    LOCK(cs_main);
+    if (pindexBest != pindexGenesisBlock || mapBlockIndex.size() != 1)
+        return error("LoadSnapshot() : the block chain must have only the genesis block");
+
+    // Reject truncated and corrupted files before anything is changed
+    if (!VerifySnapshot(path, header))
+        return false;
+    if (header.nHeight == 0)
+        return error("LoadSnapshot() : snapshot of the genesis block");
+    printf("Loading UTXO snapshot of block %s at height %d...\n", header.hashBlock.ToString().c_str(), header.nHeight);
+
+    // From here on, a failure leaves the databases to be rebuilt
+    boost::filesystem::remove_all(GetDataDir() / "chainstate_verify");
+    if (!pblocktree->WriteFlag("snapshotloading", true) || !pblocktree->Sync())
+        return error("LoadSnapshot() : failed to write block index");
+
+    // The coins of the genesis block are in the snapshot if they are still unspent
+    CBlock genesis;
+    if (!genesis.ReadFromDisk(pindexGenesisBlock))
+        return error("LoadSnapshot() : cannot read the genesis block");
+    BOOST_FOREACH(const CTransaction& tx, genesis.vtx)
+        if (pcoinsTip->HaveCoins(tx.GetHash()))
+            pcoinsTip->GetCoins(tx.GetHash()) = CCoins();
+
+    if (!ReadSnapshot(path, header, true))
+        return false;
+
+    // The statistics of the coin database are computed from what was
+    // written to it, not taken from the file
+    CCoinsStats stats;
+    if (!pcoinsTip->Flush() || !pcoinsTip->GetStats(stats))
+        return error("LoadSnapshot() : failed to write to coin database");
+    if (stats.nTransactions != header.nTransactions || stats.nTransactionOutputs != header.nTransactionOutputs ||
+        stats.nTotalAmount != header.nTotalAmount || stats.hashSet.GetHash() != header.hashSet)
+        return error("LoadSnapshot() : coins do not match the snapshot header");
+
+    CBlockIndex* pindex = mapBlockIndex[header.hashBlock];
+    pcoinsTip->SetBestBlock(pindex);
+    if (!pcoinsTip->Flush() || !pcoinsTip->GetStats(stats))
+        return error("LoadSnapshot() : failed to write to coin database");
+    SetBestChainIndex(pindex);
+    pindexSnapshot = pindex;
+    hashSnapshotSet = header.hashSet;
+    pindexSnapshotValidated = NULL;
+    if (!pblocktree->WriteSnapshotBase(header.hashBlock, header.hashSet) ||
+        !pblocktree->WriteFlag("snapshotloading", false) || !pblocktree->Sync())
+        return error("LoadSnapshot() : failed to write block index");
+
+    printf("LoadSnapshot() : %" PRI64u " transactions with %" PRI64u " outputs at height %d\n",
+        header.nTransactions, header.nTransactionOutputs, header.nHeight);
+    return true;
+}
+
+static boost::thread* pthreadSnapshotValidation = NULL;
+
+// Write out the chain state of the background validation. The undo data and
+// block index entries that it has written go to disk first.
+bool static FlushSnapshotValidation(CCoinsViewCache &view)
+{
+    FlushBlockFile();
+    return pblocktree->Sync() && view.Flush();
+}
 
-    hashGenesisBlock = getGenesisBlock().GetHash();
-    hashGenesisMerkleRoot = getGenesisBlock().hashMerkleRoot;
+bool ValidateSnapshotBlocks(CCoinsView &viewdb, CCoinsViewCache &view, std::string &strError)
+{
+    while (true) {
+        boost::this_thread::interruption_point();
 
-    // Use the provided setting for -txindex in the new database
-    fTxIndex = GetBoolArg("-txindex", false);
-    pblocktree->WriteFlag("txindex", fTxIndex);
-    printf("Initializing databases...\n");
+        CBlockIndex* pindex;
+        CDiskBlockPos pos;
+        {
+            LOCK(cs_main);
+            pindex = pindexSnapshotValidated ? pindexSnapshotValidated->pnext : pindexGenesisBlock;
+            if (pindex->nStatus & BLOCK_HAVE_DATA)
+                pos = pindex->GetBlockPos();
+        }
+        if (pos.IsNull()) {
+            // Not downloaded yet
+            MilliSleep(100);
+            continue;
+        }
 
-    // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
-    if (!fReindex) {
-        // Genesis Block:
-        // CBlock(hash=12a765e31ffd4059bada, PoW=0000050c34a64b415b6b, ver=1, hashPrevBlock=00000000000000000000, hashMerkleRoot=97ddfbbae6, nTime=1317972665, nBits=1e0ffff0, nNonce=2084524493, vtx=1)
-        //   CTransaction(hash=97ddfbbae6, ver=1, vin.size=1, vout.size=1, nLockTime=0)
-        //     CTxIn(COutPoint(0000000000, -1), coinbase 04ffff001d0104404e592054696d65732030352f4f63742f32303131205374657665204a6f62732c204170706c65e280997320566973696f6e6172792c2044696573206174203536)
-        //     CTxOut(nValue=50.00000000, scriptPubKey=040184710fa689ad5023690c80f3a4)
-        //   vMerkleTree: 97ddfbbae6
+        // Replaying the proof of play is the bulk of the work, and needs no lock
+        CBlock block;
+        CValidationState state;
+        if (!block.ReadFromDisk(pos, false) || block.GetHash() != pindex->GetBlockHash()) {
+            strError = _("Error: Failed to read a block below the UTXO snapshot");
+            return false;
+        }
+        if (!block.CheckBlock(state) || !ContextualCheckBlock(block, state, pindex->nHeight)) {
+            strError = strprintf(_("Error: Block %d below the UTXO snapshot is invalid. Rebuild the block database with -reindex."), pindex->nHeight);
+            return false;
+        }
 
-        // Genesis block,
-        CBlock block = getGenesisBlock();
+        // A half connected block must not be flushed
+        boost::this_thread::disable_interruption di;
+        LOCK(cs_main);
+        if (!block.ConnectBlock(state, pindex, view, false, NULL, false)) {
+            if (!state.IsError())
+                strError = strprintf(_("Error: Block %d below the UTXO snapshot is invalid. Rebuild the block database with -reindex."), pindex->nHeight);
+            return false;
+        }
+        pindexSnapshotValidated = pindex;
+        if (pindex != pindexSnapshot) {
+            if (view.DynamicMemoryUsage() > nCoinCacheUsage && !FlushSnapshotValidation(view)) {
+                strError = _("Failed to write to coin database");
+                return false;
+            }
+            continue;
+        }
 
-        //// debug print
-        uint256 hash = block.GetHash();
-        printf("%s\n", hash.ToString().c_str());
-        printf("%s\n", hashGenesisBlock.ToString().c_str());
-        printf("%s\n", block.hashMerkleRoot.ToString().c_str());
-        assert(block.hashMerkleRoot == hashGenesisMerkleRoot);
-        block.print();
-        assert(hash == hashGenesisBlock);
+        // The whole history up to the snapshot is valid. So are the coins
+        // of the snapshot, if they are the ones that history leads to.
+        CCoinsStats stats;
+        if (!FlushSnapshotValidation(view) || !viewdb.GetStats(stats)) {
+            strError = _("Failed to write to coin database");
+            return false;
+        }
+        if (stats.hashSet.GetHash() != hashSnapshotSet) {
+            strError = _("Error: The coins of the UTXO snapshot do not match the block chain. Rebuild the block database with -reindex.");
+            return false;
+        }
+        if (!pblocktree->EraseSnapshotBase() || !pblocktree->Sync()) {
+            strError = _("Failed to write block index");
+            return false;
+        }
+        pindexSnapshot = NULL;
+        mapSnapshotBlocksInFlight.clear();
+        printf("ValidateSnapshotBlocks() : blocks up to the snapshot at height %d validated, coins match\n", pindex->nHeight);
+        return true;
+    }
+}
 
-        // Start new block file
+void static ThreadSnapshotValidation()
+{
+    RenameThread("bitcoin-snapval");
+
+    boost::filesystem::path pathVerify = GetDataDir() / "chainstate_verify";
+    bool fDone = false;
+    try {
+        CCoinsViewDB viewdb(GetLevelDBOptions("coinsdb", 8 << 20), false, false, "chainstate_verify");
+        CCoinsViewCache view(viewdb);
+        {
+            LOCK(cs_main);
+            pindexSnapshotValidated = view.GetBestBlock();
+            if (pindexSnapshotValidated && !pindexSnapshotValidated->IsInMainChain()) {
+                AbortNode(_("Error: The chain state of the UTXO snapshot validation is not on the best chain. Rebuild the block database with -reindex."));
+                return;
+            }
+            printf("ThreadSnapshotValidation() : validating blocks %d to %d\n",
+                pindexSnapshotValidated ? pindexSnapshotValidated->nHeight + 1 : 0, pindexSnapshot->nHeight);
+        }
         try {
-            unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
-            CDiskBlockPos blockPos;
-            CValidationState state;
-            if (!FindBlockPos(state, blockPos, nBlockSize+8, 0, block.nTime))
-                return error("LoadBlockIndex() : FindBlockPos failed");
-            if (!block.WriteToDisk(blockPos))
-                return error("LoadBlockIndex() : writing genesis block to disk failed");
-            if (!block.AddToBlockIndex(state, blockPos))
-                return error("LoadBlockIndex() : genesis block not accepted");
-        } catch(std::runtime_error &e) {
-            return error("LoadBlockIndex() : failed to initialize block database: %s", e.what());
+            std::string strError;
+            fDone = ValidateSnapshotBlocks(viewdb, view, strError);
+            if (!fDone && !strError.empty())
+                AbortNode(strError);
+        } catch (boost::thread_interrupted) {
+            // Keep the progress for the next start
+            LOCK(cs_main);
+            if (!FlushSnapshotValidation(view))
+                printf("ThreadSnapshotValidation() : failed to write to coin database\n");
         }
+    } catch (std::exception &e) {
+        PrintExceptionContinue(&e, "ThreadSnapshotValidation()");
+        AbortNode(_("Error: system error: ") + e.what());
+        return;
     }
+    if (fDone)
+        boost::filesystem::remove_all(pathVerify);
+}
+
+void StartSnapshotValidation()
+{
+    if (pindexSnapshot == NULL || pthreadSnapshotValidation != NULL)
+        return;
+    pthreadSnapshotValidation = new boost::thread(&ThreadSnapshotValidation);
+}
+
+void StopSnapshotValidation()
+{
+    if (pthreadSnapshotValidation == NULL)
+        return;
+    pthreadSnapshotValidation->interrupt();
+    pthreadSnapshotValidation->join();
+    delete pthreadSnapshotValidation;
+    pthreadSnapshotValidation = NULL;
+}
 
+bool GetSnapshotValidationProgress(int &nHeightSnapshot, int &nHeightValidated)
+{
+    LOCK(cs_main);
+    if (pindexSnapshot == NULL)
+        return false;
+    nHeightSnapshot = pindexSnapshot->nHeight;
+    nHeightValidated = pindexSnapshotValidated ? pindexSnapshotValidated->nHeight : -1;
     return true;
 }
 
@@ -3005,22 +4484,73 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+// Bytes of blocks read from a file that are not connected yet
+static const size_t MAX_IMPORT_BYTES_IN_FLIGHT = 32 << 20;
+
+/** Import pipeline behind LoadExternalBlockFile. A reader thread finds the
+ *  blocks in the file, worker threads deserialize and check them, replaying
+ *  their proof of play, and the calling thread connects them in file order. */
+class CBlockImporter
 {
-    int64 nStart = GetTimeMillis();
+private:
+    struct CItem
+    {
+        uint64 nPos;                // offset of the block in the file
+        unsigned int nSize;
+        std::vector<char> vData;    // serialized block, until a worker has it
+        CBlock block;
+        bool fDone;                 // a worker is through with it
+        bool fValid;                // deserialized and passed CheckBlock
+    };
+    typedef boost::shared_ptr<CItem> CItemRef;
+
+    FILE* fileIn;
+    uint64 nStartByte;
+
+    boost::mutex mutex;
+    boost::condition_variable condWork;     // item to check, reader done or quit
+    boost::condition_variable condDone;     // item checked or reader done
+    boost::condition_variable condSpace;    // item connected or quit
+    std::deque<CItemRef> queueCheck;        // items for the workers
+    std::deque<CItemRef> queueConnect;      // all items in flight, in file order
+    size_t nBytesInFlight;
+    bool fReaderDone;
+    bool fQuit;
+
+    bool Push(const CItemRef &item);
+    void ThreadRead();
+    void ThreadCheck();
+    void Stop(boost::thread_group &threads);
 
-    int nLoaded = 0;
+public:
+    CBlockImporter(FILE* fileInIn, uint64 nStartByteIn) : fileIn(fileInIn), nStartByte(nStartByteIn),
+        nBytesInFlight(0), fReaderDone(false), fQuit(false) {}
+
+    // Returns the number of blocks accepted
+    int Run(CDiskBlockPos *dbp);
+};
+
+bool CBlockImporter::Push(const CItemRef &item)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!fQuit && !queueConnect.empty() && nBytesInFlight + item->nSize > MAX_IMPORT_BYTES_IN_FLIGHT)
+        condSpace.wait(lock);
+    if (fQuit)
+        return false;
+    nBytesInFlight += item->nSize;
+    queueCheck.push_back(item);
+    queueConnect.push_back(item);
+    condWork.notify_one();
+    return true;
+}
+
+void CBlockImporter::ThreadRead()
+{
+    RenameThread("bitcoin-blkread");
     try {
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64 nStartByte = 0;
-        if (dbp) {
-            // (try to) skip already indexed part
-            CBlockFileInfo info;
-            if (pblocktree->ReadBlockFileInfo(dbp->nFile, info)) {
-                nStartByte = info.nSize;
-                blkdat.Seek(info.nSize);
-            }
-        }
+        if (nStartByte)
+            blkdat.Seek(nStartByte);
         uint64 nRewind = blkdat.GetPos();
         while (blkdat.good() && !blkdat.eof()) {
             boost::this_thread::interruption_point();
@@ -3046,32 +4576,176 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 break;
             }
             try {
-                // read block
-                uint64 nBlockPos = blkdat.GetPos();
-                blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
+                // read block, the workers deserialize it
+                CItemRef item(new CItem());
+                item->nPos = blkdat.GetPos();
+                item->nSize = nSize;
+                item->fDone = item->fValid = false;
+                item->vData.resize(nSize);
+                blkdat.SetLimit(item->nPos + nSize);
+                blkdat.read(&item->vData[0], nSize);
                 nRewind = blkdat.GetPos();
 
-                // process block
-                if (nBlockPos >= nStartByte) {
+                if (item->nPos >= nStartByte && !Push(item))
+                    break;
+            } catch (std::exception &e) {
+                printf("%s() : I/O error caught during load\n", __PRETTY_FUNCTION__);
+            }
+        }
+    } catch (std::runtime_error &e) {
+        AbortNode(_("Error: system error: ") + e.what());
+    } catch (boost::thread_interrupted) {
+    }
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReaderDone = true;
+    }
+    condWork.notify_all();
+    condDone.notify_all();
+}
+
+void CBlockImporter::ThreadCheck()
+{
+    RenameThread("bitcoin-blkchk");
+    while (true) {
+        CItemRef item;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fQuit && !fReaderDone && queueCheck.empty())
+                condWork.wait(lock);
+            if (fQuit || queueCheck.empty())
+                return;
+            item = queueCheck.front();
+            queueCheck.pop_front();
+        }
+
+        bool fValid = false;
+        try {
+            CDataStream ss(item->vData, SER_DISK, CLIENT_VERSION);
+            ss >> item->block;
+            fValid = true;
+        } catch (std::exception &e) {
+            printf("%s() : Deserialize error caught during load\n", __PRETTY_FUNCTION__);
+        }
+        std::vector<char>().swap(item->vData);
+
+        if (fValid) {
+            try {
+                // Blocks we already have are turned away by ProcessBlock; do
+                // not replay them for nothing
+                uint256 hash = item->block.GetHash();
+                bool fHave;
+                {
                     LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
+                    fHave = mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash);
                 }
+                CValidationState state;
+                if (!fHave && !item->block.CheckBlock(state))
+                    fValid = false;
             } catch (std::exception &e) {
-                printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+                printf("%s() : Check error caught during load: %s\n", __PRETTY_FUNCTION__, e.what());
+                fValid = false;
             }
         }
-        fclose(fileIn);
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            item->fValid = fValid;
+            item->fDone = true;
+        }
+        condDone.notify_all();
+    }
+}
+
+void CBlockImporter::Stop(boost::thread_group &threads)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+    }
+    condWork.notify_all();
+    condSpace.notify_all();
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+int CBlockImporter::Run(CDiskBlockPos *dbp)
+{
+    // The workers share the tables of the proof of play engine
+    initTables();
+
+    boost::thread_group threads;
+    threads.create_thread(boost::bind(&CBlockImporter::ThreadRead, this));
+    for (int i = 0; i < std::max(nScriptCheckThreads, 1); i++)
+        threads.create_thread(boost::bind(&CBlockImporter::ThreadCheck, this));
+
+    int nLoaded = 0;
+    try {
+        while (true) {
+            CItemRef item;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueConnect.empty() ? !fReaderDone : !queueConnect.front()->fDone)
+                    condDone.wait(lock);
+                if (queueConnect.empty())
+                    break;
+                item = queueConnect.front();
+                queueConnect.pop_front();
+                nBytesInFlight -= item->nSize;
+            }
+            condSpace.notify_all();
+
+            if (!item->fValid)
+                continue;
+
+            // process block; its proof of play was checked by the worker
+            try {
+                LOCK(cs_main);
+                if (dbp)
+                    dbp->nPos = item->nPos;
+                CValidationState state;
+                if (ProcessBlock(state, NULL, &item->block, dbp, false))
+                    nLoaded++;
+                if (state.IsError())
+                    break;
+            } catch (std::exception &e) {
+                printf("%s() : I/O error caught during load: %s\n", __PRETTY_FUNCTION__, e.what());
+            }
+        }
+    } catch (...) {
+        // the threads use this object; they must be gone before it is
+        Stop(threads);
+        throw;
+    }
+    Stop(threads);
+    return nLoaded;
+}
+
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+{
+    int64 nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    try {
+        uint64 nStartByte = 0;
+        if (dbp) {
+            // (try to) skip already indexed part
+            CBlockFileInfo info;
+            if (pblocktree->ReadBlockFileInfo(dbp->nFile, info))
+                nStartByte = info.nSize;
+        }
+
+        CBlockImporter importer(fileIn, nStartByte);
+        nLoaded = importer.Run(dbp);
     } catch(std::runtime_error &e) {
         AbortNode(_("Error: system error: ") + e.what());
+    } catch (...) {
+        // interrupted
+        fclose(fileIn);
+        throw;
     }
+    fclose(fileIn);
+
     if (nLoaded > 0)
         printf("Loaded %i blocks from external file in %" PRI64d "ms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
@@ -3166,7 +4840,7 @@ bool static AlreadyHave(const CInv& inv)
                 LOCK(mempool.cs);
                 txInMap = mempool.exists(inv.hash);
             }
-            return txInMap || mapOrphanTransactions.count(inv.hash) ||
+            return txInMap || orphanTxPool.Exists(inv.hash) ||
                 pcoinsTip->HaveCoins(inv.hash);
         }
     case MSG_BLOCK:
@@ -3208,7 +4882,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = true;
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
@@ -3226,6 +4900,12 @@ void static ProcessGetData(CNode* pfrom)
                          send = false;
                        }
                     }
+                    // Below a loaded snapshot we may only have the header,
+                    // and pruned blocks are gone
+                    if (!(((*mi).second)->nStatus & BLOCK_HAVE_DATA)) {
+                        vNotFound.push_back(inv);
+                        send = false;
+                    }
                 } else {
                     send = false;
                 }
@@ -3236,6 +4916,15 @@ void static ProcessGetData(CNode* pfrom)
                     block.ReadFromDisk((*mi).second);
                     if (inv.type == MSG_BLOCK)
                         pfrom->PushMessage("block", block);
+                    else if (inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        // The receiver's memory pool is only likely to have the
+                        // transactions of recent blocks
+                        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION && (*mi).second->nHeight > nBestHeight - MAX_CMPCT_BLOCK_DEPTH)
+                            pfrom->PushMessage("cmpctblock", CCompactBlock(block));
+                        else
+                            pfrom->PushMessage("block", block);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
@@ -3302,7 +4991,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -3321,11 +5010,38 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// Hand a block received from pfrom, in full or rebuilt from a compact block, to ProcessBlock
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+
+    CValidationState state;
+    if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
+        mapAlreadyAskedFor.erase(inv);
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+        if (nDoS > 0)
+            pfrom->Misbehaving(nDoS);
+}
+
+// Process a rebuilt compact block. If a short id matched the wrong memory pool
+// transaction, the merkle root is off; that is not the peer's fault, so fall
+// back to asking it for the full block.
+void static FinishCompactBlock(CNode* pfrom, CBlock& block)
+{
+    if (block.BuildMerkleTree() != block.hashMerkleRoot) {
+        printf("compact block %s does not match its merkle root, requesting full block\n", block.GetHash().ToString().c_str());
+        pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, block.GetHash())));
+        return;
+    }
+    ProcessReceivedBlock(pfrom, block);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
-    if (fDebug)
-        printf("received: %s (%" PRIszu " bytes)\n", strCommand.c_str(), vRecv.size());
+    LogPrint("net", "received: %s (%" PRIszu " bytes)\n", strCommand.c_str(), vRecv.size());
     if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
     {
         printf("dropmessagestest DROPPING RECV MESSAGE\n");
@@ -3538,8 +5254,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             pfrom->AddInventoryKnown(inv);
 
             bool fAlreadyHave = AlreadyHave(inv);
-            if (fDebug)
-                printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
+            LogPrint("net", "  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave) {
                 if (!fImporting && !fReindex)
@@ -3551,8 +5266,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 // the last block in an inv bundle sent in response to getblocks. Try to detect
                 // this situation and push another getblocks to continue.
                 pfrom->PushGetBlocks(mapBlockIndex[inv.hash], uint256(0));
-                if (fDebug)
-                    printf("force request: %s\n", inv.ToString().c_str());
+                LogPrint("net", "force request: %s\n", inv.ToString().c_str());
             }
 
             // Track requests for our stuff
@@ -3603,6 +5317,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 printf("  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
                 break;
             }
+            // Don't offer blocks we cannot send
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            {
+                printf("  getblocks stopping at %d %s, block data not available\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+                break;
+            }
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             if (--nLimit <= 0)
             {
@@ -3656,7 +5376,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CDataStream vMsg(vRecv);
         CTransaction tx;
         vRecv >> tx;
@@ -3671,7 +5390,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             RelayTransaction(tx, inv.hash);
             mapAlreadyAskedFor.erase(inv);
             vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
 
             printf("AcceptToMemoryPool: %s %s : accepted %s (poolsz %" PRIszu ")\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
@@ -3681,47 +5399,49 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             // Recursively process any orphan transactions that depended on this one
             for (unsigned int i = 0; i < vWorkQueue.size(); i++)
             {
-                uint256 hashPrev = vWorkQueue[i];
-                for (set<uint256>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
+                vector<uint256> vChildren;
+                orphanTxPool.GetChildren(vWorkQueue[i], vChildren);
+                BOOST_FOREACH(const uint256& orphanHash, vChildren)
                 {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash];
+                    // Orphans are erased as soon as they are settled, so children
+                    // of several accepted parents are only processed once
+                    const CTransaction* porphanTx = orphanTxPool.Get(orphanHash);
+                    if (!porphanTx)
+                        continue;
+                    CTransaction orphanTx = *porphanTx;
                     bool fMissingInputs2 = false;
                     // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
                     // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
                     // anyone relaying LegitTxX banned)
                     CValidationState stateDummy;
 
-                    if (tx.AcceptToMemoryPool(stateDummy, true, true, &fMissingInputs2))
+                    if (orphanTx.AcceptToMemoryPool(stateDummy, true, true, &fMissingInputs2))
                     {
                         printf("   accepted orphan tx %s\n", orphanHash.ToString().c_str());
                         RelayTransaction(orphanTx, orphanHash);
                         mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
                         vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
+                        orphanTxPool.Erase(orphanHash);
                     }
                     else if (!fMissingInputs2)
                     {
                         // invalid or too-little-fee orphan
-                        vEraseQueue.push_back(orphanHash);
+                        orphanTxPool.Erase(orphanHash);
                         printf("   removed orphan tx %s\n", orphanHash.ToString().c_str());
                     }
                 }
             }
 
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            orphanTxPool.Erase(inv.hash);
         }
         else if (fMissingInputs)
         {
-            AddOrphanTx(tx);
+            orphanTxPool.Add(tx, pfrom->id);
 
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+            // DoS prevention: do not allow the orphan pool to grow unbounded
+            unsigned int nEvicted = orphanTxPool.Limit();
             if (nEvicted > 0)
-                printf("mapOrphan overflow, removed %u tx\n", nEvicted);
+                printf("orphan pool overflow, removed %u tx\n", nEvicted);
         }
         int nDoS = 0;
         if (state.IsInvalid(nDoS))
@@ -3742,16 +5462,144 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         printf("received block %s\n", block.GetHash().ToString().c_str());
         // block.print();
 
-        CInv inv(MSG_BLOCK, block.GetHash());
-        pfrom->AddInventoryKnown(inv);
+        ProcessReceivedBlock(pfrom, block);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
 
+        uint256 hash = cmpctblock.header.GetHash();
+        printf("received compact block %s\n", hash.ToString().c_str());
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+
+        unsigned int nTx = cmpctblock.GetTxCount();
+        if (nTx == 0 || nTx > MAX_BLOCK_SIZE / 60) {
+            pfrom->Misbehaving(100);
+            return error("message cmpctblock with %u transactions", nTx);
+        }
+
+        // Do not spend time rebuilding a block whose header is bad
         CValidationState state;
-        if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
-            mapAlreadyAskedFor.erase(inv);
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-            if (nDoS > 0)
+        if (!mapBlockIndex.count(hash) && !CheckBlockHeader(cmpctblock.header, state)) {
+            int nDoS = 0;
+            if (state.IsInvalid(nDoS) && nDoS > 0)
                 pfrom->Misbehaving(nDoS);
+            return error("message cmpctblock with bad header");
+        }
+
+        if (!mapBlockIndex.count(hash) && !mapOrphanBlocks.count(hash))
+        {
+            CBlock block;
+            static_cast<CBlockHeader&>(block) = cmpctblock.header;
+            block.vtx.resize(nTx);
+            vector<bool> vHave(nTx, false);
+            BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilled) {
+                if (prefilled.nIndex >= nTx || vHave[prefilled.nIndex]) {
+                    pfrom->Misbehaving(100);
+                    return error("message cmpctblock with bad prefilled index");
+                }
+                block.vtx[prefilled.nIndex] = prefilled.tx;
+                vHave[prefilled.nIndex] = true;
+            }
+
+            // The short ids fill the remaining positions in order
+            map<uint64, unsigned int> mapShortIds;
+            bool fCollision = false;
+            for (unsigned int i = 0, j = 0; i < nTx; i++)
+                if (!vHave[i] && !mapShortIds.insert(make_pair(cmpctblock.vShortIds[j++], i)).second)
+                    fCollision = true;
+
+            if (fCollision) {
+                printf("compact block %s has colliding short ids, requesting full block\n", hash.ToString().c_str());
+                pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hash)));
+            } else {
+                uint64 k0, k1;
+                cmpctblock.GetShortIdKeys(k0, k1);
+                {
+                    LOCK(mempool.cs);
+                    for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end() && !mapShortIds.empty(); ++mi) {
+                        map<uint64, unsigned int>::iterator it = mapShortIds.find(CCompactBlock::GetShortId(k0, k1, mi->first));
+                        if (it == mapShortIds.end())
+                            continue;
+                        unsigned int i = it->second;
+                        if (vHave[i]) {
+                            // Two candidates; ask for the real one
+                            vHave[i] = false;
+                            block.vtx[i] = CTransaction();
+                            mapShortIds.erase(it);
+                        } else {
+                            block.vtx[i] = mi->second;
+                            vHave[i] = true;
+                        }
+                    }
+                }
+
+                boost::shared_ptr<CPartialBlock> ppartial(new CPartialBlock());
+                for (unsigned int i = 0; i < nTx; i++)
+                    if (!vHave[i])
+                        ppartial->vMissing.push_back(i);
+                if (ppartial->vMissing.empty()) {
+                    FinishCompactBlock(pfrom, block);
+                } else {
+                    LogPrint("net", "compact block %s: %u of %u transactions missing\n", hash.ToString().c_str(), (unsigned int)ppartial->vMissing.size(), nTx);
+                    CBlockTxnRequest req;
+                    req.hashBlock = hash;
+                    req.vIndexes = ppartial->vMissing;
+                    ppartial->block = block;
+                    pfrom->ppartialblock = ppartial;
+                    pfrom->PushMessage("getblocktxn", req);
+                }
+            }
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTxnRequest req;
+        vRecv >> req;
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.hashBlock);
+        CBlock block;
+        if (mi == mapBlockIndex.end() || !((*mi).second->nStatus & BLOCK_HAVE_DATA) || !block.ReadFromDisk((*mi).second, false)) {
+            printf("getblocktxn for unknown block %s\n", req.hashBlock.ToString().c_str());
+        } else {
+            CBlockTxnResponse resp;
+            resp.hashBlock = req.hashBlock;
+            resp.vtx.reserve(req.vIndexes.size());
+            BOOST_FOREACH(unsigned int nIndex, req.vIndexes) {
+                if (nIndex >= block.vtx.size()) {
+                    pfrom->Misbehaving(100);
+                    return error("message getblocktxn with out of range index %u", nIndex);
+                }
+                resp.vtx.push_back(block.vtx[nIndex]);
+            }
+            pfrom->PushMessage("blocktxn", resp);
+        }
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTxnResponse resp;
+        vRecv >> resp;
+
+        boost::shared_ptr<CPartialBlock> ppartial = pfrom->ppartialblock;
+        if (!ppartial || ppartial->block.GetHash() != resp.hashBlock) {
+            printf("unexpected blocktxn for %s\n", resp.hashBlock.ToString().c_str());
+        } else {
+            pfrom->ppartialblock.reset();
+            if (resp.vtx.size() != ppartial->vMissing.size()) {
+                pfrom->Misbehaving(100);
+                return error("message blocktxn with %u transactions, %u asked for", (unsigned int)resp.vtx.size(), (unsigned int)ppartial->vMissing.size());
+            }
+            for (unsigned int i = 0; i < resp.vtx.size(); i++)
+                ppartial->block.vtx[ppartial->vMissing[i]] = resp.vtx[i];
+            FinishCompactBlock(pfrom, ppartial->block);
+        }
     }
 
 
@@ -4030,6 +5878,40 @@ bool ProcessMessages(CNode* pfrom)
 }
 
 
+// Ask pto for blocks below the loaded snapshot that the background
+// validation will need soon, spreading them over the peers that have them
+void static RequestSnapshotBlocks(CNode* pto, vector<CInv>& vGetData)
+{
+    if (pindexSnapshot == NULL || pto->fClient || pto->fDisconnect)
+        return;
+
+    int64 nNow = GetTime();
+    unsigned int nInFlight = 0;
+    map<uint256, pair<int, int64> >::iterator it = mapSnapshotBlocksInFlight.begin();
+    while (it != mapSnapshotBlocksInFlight.end()) {
+        if (it->second.second < nNow - SNAPSHOT_BLOCK_TIMEOUT)
+            mapSnapshotBlocksInFlight.erase(it++);
+        else {
+            if (it->second.first == pto->id)
+                nInFlight++;
+            it++;
+        }
+    }
+
+    CBlockIndex* pindex = pindexSnapshotValidated ? pindexSnapshotValidated->pnext : pindexGenesisBlock;
+    for (int i = 0; pindex && i < MAX_SNAPSHOT_BLOCKS_AHEAD && nInFlight < MAX_SNAPSHOT_BLOCKS_IN_FLIGHT; i++, pindex = pindex->pnext) {
+        if (pindex->nHeight > pindexSnapshot->nHeight || pindex->nHeight > pto->nStartingHeight)
+            break;
+        if ((pindex->nStatus & BLOCK_HAVE_DATA) || mapSnapshotBlocksInFlight.count(pindex->GetBlockHash()))
+            continue;
+        if (fDebugNet)
+            printf("requesting block %d below the snapshot from peer=%d\n", pindex->nHeight, pto->id);
+        vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+        mapSnapshotBlocksInFlight[pindex->GetBlockHash()] = make_pair(pto->id, nNow);
+        nInFlight++;
+    }
+}
+
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
     TRY_LOCK(cs_main, lockMain);
@@ -4173,6 +6055,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         vector<CInv> vGetData;
         int64 nNow = GetTime() * 1000000;
+        // Ask for new blocks in compact form when the peer supports it
+        bool fCompactBlocks = pto->nVersion >= COMPACT_BLOCKS_VERSION && !pto->mapAskFor.empty() && !IsInitialBlockDownload();
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
         {
             const CInv& inv = (*pto->mapAskFor.begin()).second;
@@ -4180,7 +6064,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 if (fDebugNet)
                     printf("sending getdata: %s\n", inv.ToString().c_str());
-                vGetData.push_back(inv);
+                if (inv.type == MSG_BLOCK && fCompactBlocks)
+                    vGetData.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                else
+                    vGetData.push_back(inv);
                 if (vGetData.size() >= 1000)
                 {
                     pto->PushMessage("getdata", vGetData);
@@ -4189,6 +6076,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
+        RequestSnapshotBlocks(pto, vGetData);
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
@@ -4352,7 +6240,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                     if (!mempool.mapTx.count(txin.prevout.hash))
                     {
                         printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
+                        if (fDebug || GetBoolArg("-checkmempool")) assert("mempool transaction missing input" == 0);
                         fMissingInputs = true;
                         if (porphan)
                             vOrphan.pop_back();
@@ -4371,7 +6259,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                     nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
                     continue;
                 }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
+                const CCoins &coins = view.AccessCoins(txin.prevout.hash);
 
                 int64 nValueIn = coins.vout[txin.prevout.n].nValue;
                 nTotalIn += nValueIn;
@@ -4682,10 +6570,8 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        FreeBlockIndexSlabs();
 
         // orphan blocks
         std::map<uint256, CBlock*>::iterator it2 = mapOrphanBlocks.begin();
@@ -4694,6 +6580,6 @@ public:
         mapOrphanBlocks.clear();
 
         // orphan transactions
-        mapOrphanTransactions.clear();
+        orphanTxPool.Clear();
     }
 } instance_of_cmaincleanup;
@@ -15,6 +15,9 @@
 
 #include <list>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
@@ -41,6 +44,24 @@ static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 /** The maximum number of orphan transactions kept in memory */
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** Default for -maxorphantxsize, the serialized size of orphan transactions kept in memory in megabytes */
+static const unsigned int DEFAULT_MAX_ORPHAN_TX_SIZE = 5;
+/** Larger orphan transactions are not kept */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** Seconds an orphan transaction waits for its parents before it is dropped */
+static const int64 ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Blocks deeper than this are sent in full when asked for in compact form */
+static const int MAX_CMPCT_BLOCK_DEPTH = 10;
+/** Number of blocks with an unknown parent whose proof of play a peer can make us replay in a burst */
+static const int MAX_ORPHAN_BLOCK_REPLAYS = 20;
+/** Seconds it takes a peer to earn back one such replay */
+static const int64 ORPHAN_BLOCK_REPLAY_INTERVAL = 6;
+/** How far ahead of their validation the blocks below a loaded UTXO snapshot are downloaded */
+static const int MAX_SNAPSHOT_BLOCKS_AHEAD = 1024;
+/** Number of blocks below a loaded UTXO snapshot requested from one peer at a time */
+static const unsigned int MAX_SNAPSHOT_BLOCKS_IN_FLIGHT = 16;
+/** Seconds after which such a block is requested from another peer */
+static const int64 SNAPSHOT_BLOCK_TIMEOUT = 60;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
@@ -49,6 +70,10 @@ static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Number of blocks below the best block whose data is never pruned, so that reorganizations stay possible */
+static const int MIN_BLOCKS_TO_KEEP = 288;
+/** Smallest -prune target in MiB: a few full block files with their undo data */
+static const uint64 MIN_PRUNE_TARGET = 550;
 /** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 /** Dust Soft Limit, allowed with additional fee per output */
@@ -104,7 +129,11 @@ extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
-extern unsigned int nCoinCacheSize;
+extern bool fAddrIndex;
+extern bool fPruneMode;
+extern bool fHavePruned;
+extern uint64 nPruneTarget;
+extern size_t nCoinCacheUsage;
 
 // Settings
 extern int64 nTransactionFee;
@@ -124,6 +153,9 @@ class CCoinsView;
 class CCoinsViewCache;
 class CScriptCheck;
 class CValidationState;
+class CBlockHeader;
+class CSnapshotHeader;
+class CBlockFileInfo;
 
 struct CBlockTemplate;
 
@@ -133,14 +165,24 @@ void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false);
+/** Checks of a block header that are cheap compared to replaying its proof of play */
+bool CheckBlockHeader(const CBlockHeader &header, CValidationState &state);
+/** Accept proofs of play that pass the cheap checks without replaying them.
+ *  For the unit tests only, which have no way to play the game. */
+void SetMockReplay(bool fMock);
 /** Process an incoming block */
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL, bool fCheckPoW = true);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Open an undo file (rev?????.dat) */
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
+/** Select the oldest block files to delete until the files in vInfo, indexed by file number, take
+ *  less than nTarget bytes. Files holding blocks above nPruneHeight and the last file are kept. */
+void FindFilesToPrune(const std::vector<CBlockFileInfo> &vInfo, int nPruneHeight, uint64 nTarget, std::set<int> &setFilesToPrune);
+/** Whether blocks of the best chain from pindexFrom up have been pruned */
+bool HavePrunedBlocksSince(const CBlockIndex *pindexFrom);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
 /** Initialize a new block tree database + block data on disk */
@@ -151,10 +193,45 @@ bool LoadBlockIndex();
 void UnloadBlockIndex();
 /** Verify consistency of the block and coin databases */
 bool VerifyDB(int nCheckLevel, int nCheckDepth);
+/** Write the coin database at the best block to a UTXO snapshot file */
+bool DumpSnapshot(const boost::filesystem::path &path, CSnapshotHeader &header);
+/** Check the structure and checksum of a snapshot file without loading it */
+bool VerifySnapshot(const boost::filesystem::path &path, CSnapshotHeader &header);
+/** Load a snapshot into a chain that has only the genesis block, and make its block the best block */
+bool LoadSnapshot(const boost::filesystem::path &path, CSnapshotHeader &header);
+/** Start validating the blocks below a loaded snapshot in the background, if there is one */
+void StartSnapshotValidation();
+/** Stop the background validation of the blocks below a loaded snapshot */
+void StopSnapshotValidation();
+/** Connect the blocks below the loaded snapshot to the chain state in view, waiting
+ *  for those not downloaded yet. True once the coins at the snapshot block are found
+ *  to match; otherwise strError says why, unless the node was already aborted. */
+bool ValidateSnapshotBlocks(CCoinsView &viewdb, CCoinsViewCache &view, std::string &strError);
+/** Height of the loaded snapshot and of the last block below it that has been validated.
+ *  False if no snapshot is waiting for validation. */
+bool GetSnapshotValidationProgress(int &nHeightSnapshot, int &nHeightValidated);
 /** Print the loaded block tree */
 void PrintBlockTree();
-/** Find a block by height in the currently-connected chain */
+/** Find a block by height in the currently-connected chain, NULL if there
+ *  is none. Constant time, and safe without cs_main. */
 CBlockIndex* FindBlockByHeight(int nHeight);
+
+/** Summary of the active chain tip for readers that must not wait for cs_main,
+ *  such as the read-only RPC calls. A new copy is published on every tip change. */
+struct CChainTip
+{
+    int nHeight;
+    uint256 hashBlock;
+    int64 nTime;
+    unsigned int nBits;
+
+    CChainTip() : nHeight(-1), hashBlock(0), nTime(0), nBits(0) {}
+};
+
+/** The current chain tip summary, never NULL */
+boost::shared_ptr<const CChainTip> GetChainTip();
+/** Hash of the block at nHeight in the active chain, without taking cs_main */
+bool GetActiveBlockHash(int nHeight, uint256& hashRet);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
 /** Send queued protocol messages to be sent to a give node */
@@ -257,6 +334,119 @@ struct CDiskTxPos : public CDiskBlockPos
 };
 
 
+/** Key of an address index entry (-addrindex). There is one entry for every
+ *  transaction output, grouped by the hash of the output script. The height
+ *  is stored big-endian so that the entries of a script sort by height. */
+struct CAddrIndexKey
+{
+    uint160 hashScript;
+    int nHeight;
+    uint256 txid;
+    unsigned int n;
+
+    CAddrIndexKey() : nHeight(0), n(0) {}
+    CAddrIndexKey(const uint160 &hashScriptIn, int nHeightIn, const uint256 &txidIn, unsigned int nIn) :
+        hashScript(hashScriptIn), nHeight(nHeightIn), txid(txidIn), n(nIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 20 + 4 + 32 + 4;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const
+    {
+        ::Serialize(s, hashScript, nType, nVersion);
+        unsigned char pch[4] = { (unsigned char)(nHeight >> 24), (unsigned char)(nHeight >> 16),
+                                 (unsigned char)(nHeight >> 8), (unsigned char)nHeight };
+        s.write((const char*)pch, 4);
+        ::Serialize(s, txid, nType, nVersion);
+        ::Serialize(s, n, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion)
+    {
+        ::Unserialize(s, hashScript, nType, nVersion);
+        unsigned char pch[4];
+        s.read((char*)pch, 4);
+        nHeight = (pch[0] << 24) | (pch[1] << 16) | (pch[2] << 8) | pch[3];
+        ::Unserialize(s, txid, nType, nVersion);
+        ::Unserialize(s, n, nType, nVersion);
+    }
+
+    friend bool operator<(const CAddrIndexKey &a, const CAddrIndexKey &b)
+    {
+        if (a.hashScript != b.hashScript)
+            return a.hashScript < b.hashScript;
+        if (a.nHeight != b.nHeight)
+            return a.nHeight < b.nHeight;
+        if (a.txid != b.txid)
+            return a.txid < b.txid;
+        return a.n < b.n;
+    }
+};
+
+/** Value of an address index entry: where the output's transaction is
+ *  stored, its amount, and the input that spent it, if any */
+struct CAddrIndexValue
+{
+    CDiskTxPos pos;
+    int64 nValue;
+    uint256 hashSpentBy; // 0 while unspent
+    unsigned int nSpentIn;
+    int nSpentHeight;
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(pos);
+        READWRITE(VARINT(nValue));
+        READWRITE(hashSpentBy);
+        READWRITE(VARINT(nSpentIn));
+        READWRITE(VARINT(nSpentHeight));
+    )
+
+    CAddrIndexValue() {
+        SetNull();
+    }
+
+    CAddrIndexValue(const CDiskTxPos &posIn, int64 nValueIn) : pos(posIn), nValue(nValueIn) {
+        SetSpent(0, 0, 0);
+    }
+
+    void SetNull() {
+        pos.SetNull();
+        nValue = 0;
+        SetSpent(0, 0, 0);
+    }
+
+    bool IsNull() const { return pos.IsNull(); }
+    bool IsSpent() const { return hashSpentBy != 0; }
+
+    void SetSpent(const uint256 &hash, unsigned int nIn, int nHeight) {
+        hashSpentBy = hash;
+        nSpentIn = nIn;
+        nSpentHeight = nHeight;
+    }
+};
+
+/** Changes to the address index collected while connecting and disconnecting
+ *  blocks, so that they can be written to the block tree in one batch */
+class CAddrIndexUpdate
+{
+public:
+    // Null values are entries to erase
+    std::map<CAddrIndexKey, CAddrIndexValue> mapEntries;
+
+    // Read an entry, looking at the pending changes first
+    bool Get(const CAddrIndexKey &key, CAddrIndexValue &value) const;
+    void Set(const CAddrIndexKey &key, const CAddrIndexValue &value) { mapEntries[key] = value; }
+    void Erase(const CAddrIndexKey &key) { mapEntries[key] = CAddrIndexValue(); }
+};
+
+/** Hash under which outputs to scriptPubKey are found in the address index.
+ *  Outputs paying to a public key are filed under its address. */
+uint160 GetAddrIndexHash(const CScript &scriptPubKey);
+
 /** An inpoint - a combination of a transaction and an index n into its vin */
 class CInPoint
 {
@@ -942,6 +1132,9 @@ public:
         return !(a == b);
     }
 
+    // Heap memory used by this object, in bytes
+    size_t DynamicMemoryUsage() const;
+
     // calculate number of bytes for the bitmask, and its number of non-zero bytes
     // each bit in the bitmask represents the availability of one output, but the
     // availabilities of the first two outputs are encoded separately
@@ -1102,12 +1295,15 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    // Shared by the checks of all inputs of the transaction, possibly in different threads
+    boost::shared_ptr<const CSignatureHashCache> pcache;
 
 public:
     CScriptCheck() {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHashCache> &pcacheIn = boost::shared_ptr<const CSignatureHashCache>()) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), pcache(pcacheIn) { }
 
     bool operator()() const;
 
@@ -1117,6 +1313,7 @@ public:
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        pcache.swap(check.pcache);
     }
 };
 
@@ -1337,6 +1534,9 @@ public:
     }
 
     void UpdateTime(const CBlockIndex* pindexPrev);
+
+    // Proof of play checks that need neither the world nor a replay
+    bool CheckPoWFast() const;
 };
 
 class CBlock : public CBlockHeader
@@ -1468,7 +1668,7 @@ public:
         return true;
     }
 
-    bool ReadFromDisk(const CDiskBlockPos &pos)
+    bool ReadFromDisk(const CDiskBlockPos &pos, bool fCheckPoW = true)
     {
         SetNull();
 
@@ -1486,7 +1686,7 @@ public:
         }
 
         // Check the header
-        if (!CheckPoW())
+        if (fCheckPoW && !CheckPoW())
             return error("CBlock::ReadFromDisk() : errors in block header");
 
         return true;
@@ -1519,14 +1719,18 @@ public:
     /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
      *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
      *  will be true if no problems were found. Otherwise, the return value will be false in case
-     *  of problems. Note that in any case, coins may be modified. */
-    bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL);
+     *  of problems. Note that in any case, coins may be modified.
+     *  The matching address index changes are added to paddrindex if provided. */
+    bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL, CAddrIndexUpdate *paddrindex = NULL);
 
-    // Apply the effects of this block (with given index) on the UTXO set represented by coins
-    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false);
+    // Apply the effects of this block (with given index) on the UTXO set represented by coins,
+    // and add the matching address index changes to paddrindex if provided.
+    // fCheckPoW is for callers that have just replayed the proof of play themselves.
+    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false, CAddrIndexUpdate *paddrindex = NULL, bool fCheckPoW = true);
 
-    // Read a block from disk
-    bool ReadFromDisk(const CBlockIndex* pindex);
+    // Read a block from disk. Its hash is checked against the index entry; the proof of
+    // work, which was checked when the block was accepted, is only replayed if fCheckPoW
+    bool ReadFromDisk(const CBlockIndex* pindex, bool fCheckPoW = true);
 
     // Add this block to the block index, and if necessary, switch the active block chain to this
     bool AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos);
@@ -1537,6 +1741,10 @@ public:
     // Store block on disk
     // if dbp is provided, the file is known to already reside on disk
     bool AcceptBlock(CValidationState &state, CDiskBlockPos *dbp = NULL);
+
+    // Store the transactions of a block of which only the header is in the
+    // index, such as one below a loaded UTXO snapshot
+    bool AcceptBlockData(CValidationState &state, CBlockIndex *pindex);
 };
 
 
@@ -1579,7 +1787,18 @@ public:
      }
 
      std::string ToString() const {
-         return strprintf("CBlockFileInfo(blocks=%u, size=%u, heights=%u...%u, time=%s...%s)", nBlocks, nSize, nHeightFirst, nHeightLast, DateTimeStrFormat("%Y-%m-%d", nTimeFirst).c_str(), DateTimeStrFormat("%Y-%m-%d", nTimeLast).c_str());
+         return strprintf("CBlockFileInfo(blocks=%u, size=%u, heights=%u...%u, time=%s...%s%s)", nBlocks, nSize, nHeightFirst, nHeightLast, DateTimeStrFormat("%Y-%m-%d", nTimeFirst).c_str(), DateTimeStrFormat("%Y-%m-%d", nTimeLast).c_str(), IsPruned() ? ", pruned" : "");
+     }
+
+     // a pruned file has had its blocks, but its block and undo files were deleted
+     bool IsPruned() const {
+         return nBlocks > 0 && nSize == 0;
+     }
+
+     // mark the file as pruned, keeping the statistics of the blocks it had
+     void SetPruned() {
+         nSize = 0;
+         nUndoSize = 0;
      }
 
      // update statistics (does not update nSize)
@@ -1589,7 +1808,7 @@ public:
          if (nBlocks==0 || nTimeFirst > nTimeIn)
              nTimeFirst = nTimeIn;
          nBlocks++;
-         if (nHeightIn > nHeightFirst)
+         if (nHeightIn > nHeightLast)
              nHeightLast = nHeightIn;
          if (nTimeIn > nTimeLast)
              nTimeLast = nTimeIn;
@@ -1628,6 +1847,8 @@ enum BlockStatus {
 class CBlockIndex
 {
 public:
+    // Fields used while walking the chain come first, so that they share cache lines.
+
     // pointer to the hash of the block, if any. memory is owned by this CBlockIndex
     const uint256* phashBlock;
 
@@ -1640,6 +1861,17 @@ public:
     // height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
+    // Verification status of this block. See enum BlockStatus
+    unsigned int nStatus;
+
+    // block header: target, time and the number of frames of the proof of work
+    unsigned int nBits;
+    unsigned int nTime;
+    unsigned short nFrames;
+
+    // (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
+    uint256 nChainWork;
+
     // Which # file this block is stored in (blk?????.dat)
     int nFile;
 
@@ -1649,9 +1881,6 @@ public:
     // Byte offset within rev?????.dat where this block's undo data is stored
     unsigned int nUndoPos;
 
-    // (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
-    uint256 nChainWork;
-
     // Number of transactions in this block.
     // Note: in a potential headers-first mode, this number cannot be relied upon
     unsigned int nTx;
@@ -1659,15 +1888,12 @@ public:
     // (memory only) Number of transactions in the chain up to and including this block
     unsigned int nChainTx; // change to 64-bit type when necessary; won't happen before 2030
 
-    // Verification status of this block. See enum BlockStatus
-    unsigned int nStatus;
-
-    // block header
+    // block header: the remaining fields covered by the block hash. The player
+    // input of the proof of work is only needed to replay it, so it stays in the
+    // block tree database; see ReadPoW().
     int nVersion;
+    unsigned int nNonce;
     uint256 hashMerkleRoot;
-    unsigned int nTime;
-    unsigned int nBits;
-    MotoPoW Nonce;
 
 
     CBlockIndex()
@@ -1676,19 +1902,20 @@ public:
         pprev = NULL;
         pnext = NULL;
         nHeight = 0;
+        nStatus = 0;
+        nBits = 0;
+        nTime = 0;
+        nFrames = 0;
+        nChainWork = 0;
         nFile = 0;
         nDataPos = 0;
         nUndoPos = 0;
-        nChainWork = 0;
         nTx = 0;
         nChainTx = 0;
-        nStatus = 0;
 
         nVersion       = 0;
+        nNonce         = 0;
         hashMerkleRoot = 0;
-        nTime          = 0;
-        nBits          = 0;
-        motoInitPoW(&Nonce);
     }
 
     CBlockIndex(CBlockHeader& block)
@@ -1697,21 +1924,25 @@ public:
         pprev = NULL;
         pnext = NULL;
         nHeight = 0;
+        nStatus = 0;
+        nBits = block.nBits;
+        nTime = block.nTime;
+        nFrames = block.Nonce.NumFrames;
+        nChainWork = 0;
         nFile = 0;
         nDataPos = 0;
         nUndoPos = 0;
-        nChainWork = 0;
         nTx = 0;
         nChainTx = 0;
-        nStatus = 0;
 
         nVersion       = block.nVersion;
+        nNonce         = block.Nonce.Nonce;
         hashMerkleRoot = block.hashMerkleRoot;
-        nTime          = block.nTime;
-        nBits          = block.nBits;
-        Nonce          = block.Nonce;
     }
 
+    // Load the full proof of work of this block from the block tree database
+    bool ReadPoW(MotoPoW &pow) const;
+
     CDiskBlockPos GetBlockPos() const {
         CDiskBlockPos ret;
         if (nStatus & BLOCK_HAVE_DATA) {
@@ -1730,18 +1961,8 @@ public:
         return ret;
     }
 
-    CBlockHeader GetBlockHeader() const
-    {
-        CBlockHeader block;
-        block.nVersion       = nVersion;
-        if (pprev)
-            block.hashPrevBlock = pprev->GetBlockHash();
-        block.hashMerkleRoot = hashMerkleRoot;
-        block.nTime          = nTime;
-        block.nBits          = nBits;
-        block.Nonce          = Nonce;
-        return block;
-    }
+    // Reconstruct the block header; this reads the proof of work from disk
+    CBlockHeader GetBlockHeader() const;
 
     uint256 GetBlockHash() const
     {
@@ -1842,13 +2063,16 @@ class CDiskBlockIndex : public CBlockIndex
 {
 public:
     uint256 hashPrev;
+    MotoPoW Nonce;
 
     CDiskBlockIndex() {
         hashPrev = 0;
+        motoInitPoW(&Nonce);
     }
 
-    explicit CDiskBlockIndex(CBlockIndex* pindex) : CBlockIndex(*pindex) {
+    CDiskBlockIndex(CBlockIndex* pindex, const MotoPoW &pow) : CBlockIndex(*pindex) {
         hashPrev = (pprev ? pprev->GetBlockHash() : 0);
+        Nonce = pow;
     }
 
     IMPLEMENT_SERIALIZE
@@ -2018,9 +2242,13 @@ public:
         {
             vHave.push_back(pindex->GetBlockHash());
 
-            // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            // Exponentially larger steps back; on the active chain the
+            // block is looked up by height instead of walked to
+            if (pindex->IsInMainChain())
+                pindex = FindBlockByHeight(pindex->nHeight - nStep);
+            else
+                for (int i = 0; pindex && i < nStep; i++)
+                    pindex = pindex->pprev;
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -2130,6 +2358,33 @@ public:
 
 extern CTxMemPool mempool;
 
+/** Order-independent hash of a set: the product of the elements, expanded
+ *  to 3072 bits, modulo a prime (MuHash). Elements can be inserted and
+ *  removed in any order; removals are multiplied into a denominator, which
+ *  is only inverted when the hash is read. */
+class CMuHash3072
+{
+private:
+    CBigNum bnNumerator;
+    CBigNum bnDenominator;
+
+public:
+    CMuHash3072() : bnNumerator(1), bnDenominator(1) {}
+
+    void Insert(const uint256 &hash);
+    void Remove(const uint256 &hash);
+    uint256 GetHash() const;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(bnNumerator);
+        READWRITE(bnDenominator);
+    )
+};
+
+/** Statistics about the unspent transaction output set. The coin database
+ *  keeps them up to date with every write, and stores them along with the
+ *  best block. */
 struct CCoinsStats
 {
     int nHeight;
@@ -2137,12 +2392,103 @@ struct CCoinsStats
     uint64 nTransactions;
     uint64 nTransactionOutputs;
     uint64 nSerializedSize;
-    uint256 hashSerialized;
+    CMuHash3072 hashSet; // of all unspent outputs
+    int64 nTotalAmount;
+
+    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(nTransactions);
+        READWRITE(nTransactionOutputs);
+        READWRITE(nSerializedSize);
+        READWRITE(hashSet);
+        READWRITE(nTotalAmount);
+    )
+};
+
+/** Header of a UTXO snapshot file (dumptxoutset, -loadsnapshot).
+ *
+ *  The file starts with pchMessageStart and this header. It goes on with the
+ *  headers of the blocks from the genesis block up to hashBlock, then the
+ *  nTransactions (txid, CCoins) entries of the coin database in key order,
+ *  and ends with the double SHA-256 of everything before it.
+ */
+class CSnapshotHeader
+{
+public:
+    static const int CURRENT_VERSION = 1;
+    int nVersion;
+    uint256 hashBlock;
+    int nHeight;
+    uint64 nTransactions;
+    uint64 nTransactionOutputs;
     int64 nTotalAmount;
+    uint256 hashSet; // CCoinsStats::hashSet.GetHash(), as in gettxoutsetinfo
+
+    CSnapshotHeader()
+    {
+        SetNull();
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(this->nVersion);
+        nVersion = this->nVersion;
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(nTransactions);
+        READWRITE(nTransactionOutputs);
+        READWRITE(nTotalAmount);
+        READWRITE(hashSet);
+    )
+
+    void SetNull()
+    {
+        nVersion = CSnapshotHeader::CURRENT_VERSION;
+        hashBlock = 0;
+        nHeight = -1;
+        nTransactions = 0;
+        nTransactionOutputs = 0;
+        nTotalAmount = 0;
+        hashSet = 0;
+    }
+};
 
-    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
+/** Hashes txids with a per-instance random salt, so that peers cannot
+ *  construct transaction ids that all land in the same hash bucket. */
+class CCoinsKeyHasher
+{
+private:
+    uint256 salt;
+
+public:
+    CCoinsKeyHasher();
+    size_t operator()(const uint256& key) const {
+        return key.GetHash(salt);
+    }
 };
 
+struct CCoinsCacheEntry
+{
+    CCoins coins;
+    CCoins coinsBase; // The version in the parent view; only valid while BASE
+    unsigned char flags;
+    std::list<uint256>::iterator itClean; // Position in the LRU list; only valid while not DIRTY
+
+    enum Flags {
+        DIRTY = (1 << 0), // This entry may differ from the version in the parent view.
+        FRESH = (1 << 1), // The parent view has no (or only a pruned) entry for this txid.
+        MODIFIABLE = (1 << 2), // Handed out by reference; its memory usage has yet to be re-measured.
+        BASE = (1 << 3), // A DIRTY entry whose parent version was kept in coinsBase.
+    };
+
+    CCoinsCacheEntry() : coins(), flags(0) {}
+};
+
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
@@ -2163,8 +2509,9 @@ public:
     // Modify the currently active block index
     virtual bool SetBestBlock(CBlockIndex *pindex);
 
-    // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    // Do a bulk modification (multiple SetCoins + one SetBestBlock).
+    // Only entries flagged DIRTY are applied; the contents of mapCoins may be swapped out.
+    virtual bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
@@ -2187,7 +2534,7 @@ public:
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
 };
 
@@ -2196,7 +2543,16 @@ class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
     CBlockIndex *pindexTip;
-    std::map<uint256,CCoins> cacheCoins;
+    CCoinsMap cacheCoins;
+
+    // Memory used by the entries in cacheCoins, not counting those in vModifiable
+    size_t cachedCoinsUsage;
+
+    // Entries handed out by GetCoins() since the last call to SettleUsage()
+    std::vector<CCoinsCacheEntry*> vModifiable;
+
+    // Txids of all entries that are not DIRTY, least recently used last
+    std::list<uint256> lruClean;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
@@ -2207,22 +2563,76 @@ public:
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
+
+    // Like SetCoins, for callers that know the base has no unspent coins for
+    // txid. The entry is then marked fresh without looking the txid up, and
+    // dropped instead of written if it is spent before the next flush.
+    bool SetCoins(const uint256 &txid, const CCoins &coins, bool fFresh);
 
     // Return a modifiable reference to a CCoins. Check HaveCoins first.
     // Many methods explicitly require a CCoinsViewCache because of this method, to reduce
-    // copying.
+    // copying. The entry is marked dirty, so use AccessCoins for read-only access.
     CCoins &GetCoins(const uint256 &txid);
 
-    // Push the modifications applied to this cache to its base.
+    // Return a read-only reference to a CCoins. Check HaveCoins first.
+    const CCoins &AccessCoins(const uint256 &txid);
+
+    // Push the modifications applied to this cache to its base. Unmodified entries stay cached.
     // Failure to call this method before destruction will cause the changes to be forgotten.
     bool Flush();
 
+    // Evict unmodified entries, least recently used first, until at most nTargetUsage bytes are used
+    void Trim(size_t nTargetUsage);
+
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize();
 
+    // Calculate the size of the cache (in bytes)
+    size_t DynamicMemoryUsage();
+
 private:
-    std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
+    CCoinsMap::iterator FetchCoins(const uint256 &txid);
+    void MarkDirty(CCoinsCacheEntry &entry);
+    void EraseEntry(CCoinsMap::iterator it);
+    void SettleUsage();
+};
+
+/** CCoinsView that writes batches to its base from a background thread.
+ *  While a batch is being written, reads of the coins in it are answered
+ *  from the frozen batch, so validation can continue against the cache above.
+ *  Only one batch is in flight at a time; BatchWrite waits for the previous
+ *  one to finish. The base must not modify the batch it is handed. */
+class CCoinsViewBackgroundFlush : public CCoinsViewBacked
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    boost::thread *pthreadWrite;
+
+    CCoinsMap mapWriting;
+    CBlockIndex *pindexWriting;
+    bool fWriting;
+    bool fFailed;
+    bool fStop;
+
+    void ThreadWrite();
+
+public:
+    CCoinsViewBackgroundFlush(CCoinsView &baseIn);
+    ~CCoinsViewBackgroundFlush();
+
+    bool GetCoins(const uint256 &txid, CCoins &coins);
+    bool SetCoins(const uint256 &txid, const CCoins &coins);
+    bool HaveCoins(const uint256 &txid);
+    CBlockIndex *GetBestBlock();
+    bool SetBestBlock(CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
+    bool GetStats(CCoinsStats &stats);
+
+    // Wait until the batch being written (if any) has reached the base.
+    // Returns false if any background write failed.
+    bool Sync();
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
@@ -2244,6 +2654,121 @@ extern CCoinsViewCache *pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Default for -readcachesize, in megabytes */
+static const unsigned int DEFAULT_READ_CACHE_SIZE = 16;
+
+/** Cache of recently read blocks and transactions, shared by RPC calls and
+ *  peer requests so that repeated reads of recent blocks do not go to disk.
+ *  Its size is bounded by the serialized size of the entries; the least
+ *  recently used ones are dropped first, and those of disconnected blocks
+ *  as soon as the chain is reorganized. */
+class CBlockReadCache
+{
+private:
+    struct CEntry
+    {
+        boost::shared_ptr<const CBlock> pblock;     // set for blocks
+        boost::shared_ptr<const CTransaction> ptx;  // set for transactions
+        uint256 hashBlock;                          // block containing ptx
+        bool fCheckedPoW;                           // whether the block's proof of play was verified
+        size_t nSize;
+        std::list<std::pair<bool, uint256> >::iterator itLRU;
+    };
+
+    mutable CCriticalSection cs;
+    std::map<uint256, CEntry> mapBlocks;
+    std::map<uint256, CEntry> mapTxs;
+    std::list<std::pair<bool, uint256> > listLRU; // (is block, hash), most recently used first
+    size_t nSize;
+    size_t nMaxSize;
+    uint64 nBlockHits, nBlockMisses, nTxHits, nTxMisses;
+
+    void Insert(bool fBlock, const uint256 &hash, CEntry &entry);
+    void Remove(bool fBlock, const uint256 &hash);
+    void Touch(CEntry &entry);
+    void Shrink();
+
+public:
+    struct Stats
+    {
+        size_t nBlocks, nTxs, nSize, nMaxSize;
+        uint64 nBlockHits, nBlockMisses, nTxHits, nTxMisses;
+    };
+
+    CBlockReadCache();
+
+    void SetMaxSize(size_t nMaxSizeIn);
+
+    // A cached block is only returned if its proof of play was checked, or fCheckPoW is false
+    bool GetBlock(const uint256 &hash, CBlock &block, bool fCheckPoW);
+    void AddBlock(const CBlock &block, bool fCheckedPoW);
+    bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
+    void AddTransaction(const CTransaction &tx, const uint256 &hashBlock);
+
+    // Forget a block and its transactions, when it is disconnected
+    void EraseBlock(const CBlock &block);
+    void Clear();
+    void GetStats(Stats &stats) const;
+};
+
+extern CBlockReadCache blockReadCache;
+
+/** Transactions whose inputs we have not seen yet, kept until their parents
+ *  arrive. The pool is bounded both in number and in serialized size. When
+ *  it is full, the oldest orphans of the peer holding the most bytes go
+ *  first, so a peer flooding us pushes out its own orphans rather than
+ *  those of others. Orphans expire after ORPHAN_TX_EXPIRE_TIME.
+ *  Protected by cs_main. */
+class COrphanTxPool
+{
+private:
+    struct CEntry
+    {
+        CTransaction tx;
+        int nPeer;
+        int64 nTime;
+        unsigned int nSize;
+    };
+
+    struct CPeer
+    {
+        size_t nSize;
+        std::set<std::pair<int64, uint256> > setOrphans; // oldest first
+    };
+
+    std::map<uint256, CEntry> mapTx;
+    std::map<uint256, std::set<uint256> > mapByPrev; // parent txid -> orphans spending it
+    std::map<int, CPeer> mapPeers;
+    std::set<std::pair<int64, uint256> > setByTime;
+    size_t nSize;
+    unsigned int nMaxCount;
+    size_t nMaxSize;
+
+public:
+    COrphanTxPool();
+
+    void SetLimits(unsigned int nMaxCountIn, size_t nMaxSizeIn);
+
+    // Returns false if the transaction is already there or too large
+    bool Add(const CTransaction &tx, int nPeer);
+    bool Erase(const uint256 &hash);
+    // Drop expired orphans, then evict until the pool is within its limits.
+    // Returns the number of orphans removed.
+    unsigned int Limit();
+    void Clear();
+
+    bool Exists(const uint256 &hash) const { return mapTx.count(hash) > 0; }
+    const CTransaction *Get(const uint256 &hash) const;
+    // Orphans spending outputs of hashParent
+    void GetChildren(const uint256 &hashParent, std::vector<uint256> &vChildren) const;
+
+    unsigned int Count() const { return mapTx.size(); }
+    size_t Size() const { return nSize; }
+    size_t PeerSize(int nPeer) const;
+};
+
+extern COrphanTxPool orphanTxPool;
+
 struct CBlockTemplate
 {
     CBlock block;
@@ -2286,4 +2811,120 @@ public:
     )
 };
 
+
+/** Transaction sent in full inside a compact block, with its index in the block */
+struct CPrefilledTransaction
+{
+    unsigned int nIndex;
+    CTransaction tx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(VARINT(nIndex));
+        READWRITE(tx);
+    )
+};
+
+/** Used to relay new blocks as the header, with its proof of play, and short
+ *  transaction ids ("cmpctblock") to peers that ask for MSG_CMPCT_BLOCK. The
+ *  receiver rebuilds the block from its memory pool and asks for what it is
+ *  missing with "getblocktxn". Short ids are the low 48 bits of SipHash of
+ *  the txid, keyed with the header and a random nonce.
+ */
+class CCompactBlock
+{
+public:
+    CBlockHeader header;
+    uint64 nNonce;
+    std::vector<uint64> vShortIds;              // of the transactions not prefilled, in block order
+    std::vector<CPrefilledTransaction> vPrefilled; // ordered by index
+
+    CCompactBlock() : nNonce(0) {}
+
+    // The coinbase is prefilled, as no peer can have it yet
+    CCompactBlock(const CBlock& block);
+
+    unsigned int GetTxCount() const { return vShortIds.size() + vPrefilled.size(); }
+    void GetShortIdKeys(uint64 &k0, uint64 &k1) const;
+    static uint64 GetShortId(uint64 k0, uint64 k1, const uint256 &txid);
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return ::GetSerializeSize(header, nType, nVersion) + sizeof(nNonce) +
+               GetSizeOfCompactSize(vShortIds.size()) + 6 * vShortIds.size() +
+               ::GetSerializeSize(vPrefilled, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const
+    {
+        ::Serialize(s, header, nType, nVersion);
+        ::Serialize(s, nNonce, nType, nVersion);
+        WriteCompactSize(s, vShortIds.size());
+        for (unsigned int i = 0; i < vShortIds.size(); i++) {
+            unsigned char pch[6];
+            for (int j = 0; j < 6; j++)
+                pch[j] = vShortIds[i] >> (8 * j);
+            s.write((const char*)pch, 6);
+        }
+        ::Serialize(s, vPrefilled, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion)
+    {
+        ::Unserialize(s, header, nType, nVersion);
+        ::Unserialize(s, nNonce, nType, nVersion);
+        uint64 nShortIds = ReadCompactSize(s);
+        if (nShortIds > MAX_BLOCK_SIZE / 6)
+            throw std::ios_base::failure("CCompactBlock::Unserialize() : too many short ids");
+        vShortIds.resize(nShortIds);
+        for (unsigned int i = 0; i < vShortIds.size(); i++) {
+            unsigned char pch[6];
+            s.read((char*)pch, 6);
+            vShortIds[i] = 0;
+            for (int j = 0; j < 6; j++)
+                vShortIds[i] |= (uint64)pch[j] << (8 * j);
+        }
+        ::Unserialize(s, vPrefilled, nType, nVersion);
+    }
+};
+
+/** Indexes of the transactions of a compact block that the receiver could
+ *  not find in its memory pool ("getblocktxn") */
+class CBlockTxnRequest
+{
+public:
+    uint256 hashBlock;
+    std::vector<unsigned int> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vIndexes);
+    )
+};
+
+/** The transactions asked for by a "getblocktxn", in the same order ("blocktxn") */
+class CBlockTxnResponse
+{
+public:
+    uint256 hashBlock;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vtx);
+    )
+};
+
+/** A compact block waiting for the "blocktxn" that completes it */
+class CPartialBlock
+{
+public:
+    CBlock block;
+    std::vector<unsigned int> vMissing;
+};
+
 #endif
@@ -116,7 +116,6 @@ void initTables()
 {
 	if (g_TablesInitialized)
 		return;
-	g_TablesInitialized = true;
 
 	for (int64_t i = 0; i < 0x10000; i++)
 	{
@@ -126,6 +125,9 @@ void initTables()
 
 	for (int i = 0; i < g_SqrtTableSize; i++)
 		g_inv_sqrt[i] = (int32_t)(17592186036224/isqrt((i + 1)*68719476736));
+
+	/* Only now, so that nobody uses the tables half filled. */
+	g_TablesInitialized = true;
 }
 
 static int16_t at8192_4096(const MotoWorld* pWorld, int16_t grad[2], const int32_t P[2])
@@ -688,7 +690,8 @@ bool motoGenerateGoodWorld(MotoWorld* pWorld, MotoState* pState, const MotoWork*
 	return false;
 }
 
-bool motoGenerateWorld(MotoWorld* pWorld, MotoState* pState, const uint8_t* pWork, uint32_t Nonce)
+/* motoGenerateWorld without checking the work. */
+static bool generateWorld(MotoWorld* pWorld, MotoState* pState, const uint8_t* pWork, uint32_t Nonce)
 {
 	initTables();
 
@@ -696,12 +699,6 @@ bool motoGenerateWorld(MotoWorld* pWorld, MotoState* pState, const uint8_t* pWor
 	memcpy(BlockPlusNonce + 1, &Nonce, sizeof(uint32_t));
 	memcpy(BlockPlusNonce + 1 + sizeof(uint32_t), pWork, MOTO_WORK_SIZE);
 
-	uint32_t nBits = (pWork[MOTO_WORK_SIZE-1] << 24) | (pWork[MOTO_WORK_SIZE-2] << 16) | (pWork[MOTO_WORK_SIZE-3] << 8) | (pWork[MOTO_WORK_SIZE-4]);
-	uint32_t work = nBits & ~MOTO_TARGET_MASK;
-  
-	if(!payWork(BlockPlusNonce, work, Nonce)) return false;
-
-
 	for (int i = 0; i < 2*MOTO_MAP_SIZE*MOTO_MAP_SIZE/(512/8); i++)
 	{
 		BlockPlusNonce[0] = i;
@@ -734,18 +731,63 @@ bool motoGenerateWorld(MotoWorld* pWorld, MotoState* pState, const uint8_t* pWor
 	return true;
 }
 
-bool motoCheck(const uint8_t* pWork, MotoPoW* pPoW)
+bool motoGenerateWorld(MotoWorld* pWorld, MotoState* pState, const uint8_t* pWork, uint32_t Nonce)
+{
+	if (!motoCheckWork(pWork, Nonce))
+		return false;
+	return generateWorld(pWorld, pState, pWork, Nonce);
+}
+
+bool motoCheckInputs(const MotoPoW* pPoW)
 {
 	if (pPoW->NumUpdates > MOTO_MAX_INPUTS)
 		return false;
+	if (pPoW->NumFrames == 0 || pPoW->NumFrames > MOTO_MAX_FRAMES + 10)
+		return false;
+
+	/* Same walk over the updates as motoReplay, without the physics. */
+	int16_t iFrame = 0;
+	EMotoAccel Accel = MOTO_IDLE;
+	for (unsigned int i = 0; i < pPoW->NumUpdates; i++)
+	{
+		uint16_t iFrameDelta = pPoW->Updates[i] / 12;
+		iFrame += iFrameDelta;
+		if (iFrame >= pPoW->NumFrames)
+			return false;
+
+		EMotoAccel NewAccel = (EMotoAccel)(pPoW->Updates[i] % 4);
+		EMotoRot NewRotation = (EMotoRot)((pPoW->Updates[i] % 12) / 4);
+		if (iFrameDelta != 5460 && NewAccel == Accel && NewRotation == MOTO_NO_ROTATION)
+			return false;
+		Accel = NewAccel;
+	}
+	return true;
+}
+
+bool motoCheckWork(const uint8_t* pWork, uint32_t Nonce)
+{
+	uint8_t BlockPlusNonce[MOTO_WORK_SIZE + 1 + sizeof(uint32_t)];
+	memcpy(BlockPlusNonce + 1, &Nonce, sizeof(uint32_t));
+	memcpy(BlockPlusNonce + 1 + sizeof(uint32_t), pWork, MOTO_WORK_SIZE);
+
+	uint32_t nBits = (pWork[MOTO_WORK_SIZE-1] << 24) | (pWork[MOTO_WORK_SIZE-2] << 16) | (pWork[MOTO_WORK_SIZE-3] << 8) | (pWork[MOTO_WORK_SIZE-4]);
+	return payWork(BlockPlusNonce, nBits & ~MOTO_TARGET_MASK, Nonce);
+}
 
+bool motoCheckReplay(const uint8_t* pWork, MotoPoW* pPoW)
+{
 	MotoWorld World;
 	MotoState State;
-	if(!motoGenerateWorld(&World, &State, pWork, pPoW->Nonce))
+	if(!generateWorld(&World, &State, pWork, pPoW->Nonce))
 		return false;
 	return motoReplay(&State, pPoW, &World, MOTO_MAX_FRAMES + 10);
 }
 
+bool motoCheck(const uint8_t* pWork, MotoPoW* pPoW)
+{
+	return motoCheckInputs(pPoW) && motoCheckWork(pWork, pPoW->Nonce) && motoCheckReplay(pWork, pPoW);
+}
+
 bool motoReplay(MotoState* pState, MotoPoW* pPoW, const MotoWorld* pWorld, int16_t iToFrame)
 {
 	int16_t iFrame = 0;
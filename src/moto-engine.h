@@ -207,6 +207,38 @@ void motoInitPoW(MotoPoW* pPoW);
 */
 bool motoCheck(const uint8_t* pBlock, MotoPoW* pPoW);
 
+/** \brief Check that player input can be replayed.
+*
+* Cheap part of motoCheck: rejects input that motoReplay would reject whatever the world looks like.
+*
+* @param pPoW (in) - All player input + selected nonce.
+*
+* @return false if the proof-of-play can not be valid.
+*/
+bool motoCheckInputs(const MotoPoW* pPoW);
+
+/** \brief Check that nonce pays the hash part of the work.
+*
+* Single SHA-512, done before the world is generated by motoGenerateWorld.
+*
+* @param pBlock (in) - Random data (block data) to generate world.
+* @param Nonce  (in) - Selected nonce.
+*
+* @return true if hash of block and nonce meets the work encoded in nBits.
+*/
+bool motoCheckWork(const uint8_t* pBlock, uint32_t Nonce);
+
+/** \brief Generate world and replay player input.
+*
+* Expensive part of motoCheck, for input that already passed motoCheckInputs and motoCheckWork.
+*
+* @param pBlock (in) - Random data (block data) to generate world.
+* @param pPoW (in) - All player input + selected nonce.
+*
+* @return true if game was completed in less than TimeTarget frames.
+*/
+bool motoCheckReplay(const uint8_t* pBlock, MotoPoW* pPoW);
+
 /** \brief Generate pseudo-random world.
 *
 * @param pWorld (out) - Variable to store generated world.
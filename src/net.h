@@ -8,6 +8,7 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
@@ -24,6 +25,7 @@
 
 class CNode;
 class CBlockIndex;
+class CPartialBlock;
 extern int nBestHeight;
 
 
@@ -178,6 +180,7 @@ public:
     CAddress addr;
     std::string addrName;
     CService addrLocal;
+    int id; // unique for the lifetime of the process
     int nVersion;
     // strSubVer is whatever byte array we read from the wire. However, this field is intended 
     // to be printed out, displayed to humans in various forms and so on. So we sanitize it and
@@ -207,8 +210,14 @@ protected:
     static CCriticalSection cs_setBanned;
     int nMisbehavior;
 
+    static int nLastNodeId;
+    static CCriticalSection cs_nLastNodeId;
+
 public:
     uint256 hashContinue;
+    boost::shared_ptr<CPartialBlock> ppartialblock; // compact block waiting for "blocktxn" (protected by cs_main)
+    double dOrphanBlockReplays; // replays of blocks with an unknown parent left to this peer (protected by cs_main)
+    int64 nLastOrphanBlockReplay;
     CBlockIndex* pindexLastGetBlocksBegin;
     uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
@@ -252,6 +261,8 @@ public:
         nSendSize = 0;
         nSendOffset = 0;
         hashContinue = 0;
+        dOrphanBlockReplays = 0;
+        nLastOrphanBlockReplay = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
@@ -260,6 +271,10 @@ public:
         nMisbehavior = 0;
         fRelayTxes = false;
         setInventoryKnown.max_size(SendBufferSize() / 1000);
+        {
+            LOCK(cs_nLastNodeId);
+            id = nLastNodeId++;
+        }
         pfilter = new CBloomFilter();
 
         // Be shy and don't send version until we hear
@@ -392,8 +407,7 @@ public:
         ENTER_CRITICAL_SECTION(cs_vSend);
         assert(ssSend.size() == 0);
         ssSend << CMessageHeader(pszCommand, 0);
-        if (fDebug)
-            printf("sending: %s ", pszCommand);
+        LogPrint("net", "sending: %s ", pszCommand);
     }
 
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
@@ -403,8 +417,7 @@ public:
 
         LEAVE_CRITICAL_SECTION(cs_vSend);
 
-        if (fDebug)
-            printf("(aborted)\n");
+        LogPrint("net", "(aborted)\n");
     }
 
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
@@ -431,9 +444,7 @@ public:
         assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
         memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
 
-        if (fDebug) {
-            printf("(%d bytes)\n", nSize);
-        }
+        LogPrint("net", "(%d bytes)\n", nSize);
 
         std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
         ssSend.GetAndClear(*it);
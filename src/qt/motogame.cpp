@@ -173,6 +173,11 @@ void watchReplay(bool LowQ, bool OGL3, bool Fullscreen, int nHeight)
     if (!pIndex)
         return;
 
+    // The player input is not kept in memory; fetch it for the replay
+    MotoPoW PoW;
+    if (!pIndex->ReadPoW(PoW))
+        return;
+
     struct
     {
         int nVersion;
@@ -188,7 +193,7 @@ void watchReplay(bool LowQ, bool OGL3, bool Fullscreen, int nHeight)
     BlockHeader.hashMerkleRoot = pIndex->hashMerkleRoot;
     BlockHeader.nTime = pIndex->nTime;
     BlockHeader.nBits = pIndex->nBits;
-    BlockHeader.Nonce = pIndex->Nonce;
+    BlockHeader.Nonce = PoW;
 
     MotoWork Work;
     Work.IsNew = true;
@@ -196,7 +201,7 @@ void watchReplay(bool LowQ, bool OGL3, bool Fullscreen, int nHeight)
     snprintf(Work.Msg, sizeof(Work.Msg), "Block %i.", nHeight);
     memcpy(Work.Block, &BlockHeader, sizeof(Work.Block));
 
-    std::string Msg = motoMessage(Work, pIndex->Nonce);
+    std::string Msg = motoMessage(Work, PoW);
 
     SuicideProcess* pMotogameProcess = new SuicideProcess;
     pMotogameProcess->setWorkingDirectory(QCoreApplication::applicationDirPath());
@@ -82,7 +82,7 @@ void dumpNonce()
 
     for (CBlockIndex* pIndex = pindexGenesisBlock; pIndex; pIndex = pIndex->pnext)
     {
-        QString N = QString("%1,").arg(pIndex->Nonce.Nonce);
+        QString N = QString("%1,").arg(pIndex->nNonce);
         File.write(N.toUtf8());
     }
 }*/
@@ -4,6 +4,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "txdb.h"
+#include "base58.h"
 #include "bitcoinrpc.h"
 
 using namespace json_spirit;
@@ -46,36 +48,59 @@ double GetDifficulty(const CBlockIndex* blockindex)
 }
 
 
-Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
+// What getblock reports about a block besides its contents. It is copied
+// under cs_main, so that the block can be written without holding it.
+struct CBlockChainInfo
 {
-    Object result;
-    result.push_back(Pair("hash", block.GetHash().GetHex()));
-    CMerkleTx txGen(block.vtx[0]);
-    txGen.SetMerkleBranch(&block);
-    result.push_back(Pair("confirmations", (int)txGen.GetDepthInMainChain()));
-    result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
-    result.push_back(Pair("height", blockindex->nHeight));
-    result.push_back(Pair("version", block.nVersion));
-    result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    Array txs;
+    int nHeight;
+    int nConfirmations;
+    double dDifficulty;
+    uint256 hashPrev; // 0 for the genesis block
+    uint256 hashNext; // 0 unless the block is in the main chain below the tip
+
+    CBlockChainInfo() : nHeight(0), nConfirmations(0), dDifficulty(0), hashPrev(0), hashNext(0) {}
+
+    void Set(const CBlock& block, const CBlockIndex* blockindex)
+    {
+        CMerkleTx txGen(block.vtx[0]);
+        txGen.SetMerkleBranch(&block);
+        nHeight = blockindex->nHeight;
+        nConfirmations = txGen.GetDepthInMainChain();
+        dDifficulty = GetDifficulty(blockindex);
+        hashPrev = blockindex->pprev ? blockindex->pprev->GetBlockHash() : 0;
+        hashNext = blockindex->pnext ? blockindex->pnext->GetBlockHash() : 0;
+    }
+};
+
+void blockToJSON(const CBlock& block, const CBlockChainInfo& info, CJSONWriter& result)
+{
+    result.BeginObject();
+    result.WritePair("hash", block.GetHash().GetHex());
+    result.WritePair("confirmations", info.nConfirmations);
+    result.WritePair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    result.WritePair("height", info.nHeight);
+    result.WritePair("version", block.nVersion);
+    result.WritePair("merkleroot", block.hashMerkleRoot.GetHex());
+    result.Key("tx");
+    result.BeginArray();
     BOOST_FOREACH(const CTransaction&tx, block.vtx)
-        txs.push_back(tx.GetHash().GetHex());
-    result.push_back(Pair("tx", txs));
-    result.push_back(Pair("time", (boost::int64_t)block.GetBlockTime()));
-    result.push_back(Pair("nonce", (boost::uint64_t)block.Nonce.Nonce));
-    result.push_back(Pair("frames", (boost::uint64_t)block.Nonce.NumFrames));
+        result.Write(tx.GetHash().GetHex());
+    result.EndArray();
+    result.WritePair("time", (boost::int64_t)block.GetBlockTime());
+    result.WritePair("nonce", (boost::uint64_t)block.Nonce.Nonce);
+    result.WritePair("frames", (boost::uint64_t)block.Nonce.NumFrames);
     Array Inputs;
     for (unsigned int i = 0; i < block.Nonce.NumUpdates; i++)
         Inputs.push_back((boost::uint64_t)block.Nonce.Updates[i]);
-    result.push_back(Pair("inputs", Inputs));
-    result.push_back(Pair("bits", HexBits(block.nBits)));
-    result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
-
-    if (blockindex->pprev)
-        result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    if (blockindex->pnext)
-        result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
-    return result;
+    result.WritePair("inputs", Inputs);
+    result.WritePair("bits", HexBits(block.nBits));
+    result.WritePair("difficulty", info.dDifficulty);
+
+    if (info.hashPrev != 0)
+        result.WritePair("previousblockhash", info.hashPrev.GetHex());
+    if (info.hashNext != 0)
+        result.WritePair("nextblockhash", info.hashNext.GetHex());
+    result.EndObject();
 }
 
 
@@ -86,7 +111,7 @@ Value getblockcount(const Array& params, bool fHelp)
             "getblockcount\n"
             "Returns the number of blocks in the longest block chain.");
 
-    return nBestHeight;
+    return GetChainTip()->nHeight;
 }
 
 Value getbestblockhash(const Array& params, bool fHelp)
@@ -96,7 +121,7 @@ Value getbestblockhash(const Array& params, bool fHelp)
             "getbestblockhash\n"
             "Returns the hash of the best (tip) block in the longest block chain.");
 
-    return hashBestChain.GetHex();
+    return GetChainTip()->hashBlock.GetHex();
 }
 
 Value getdifficulty(const Array& params, bool fHelp)
@@ -126,7 +151,7 @@ Value settxfee(const Array& params, bool fHelp)
     return true;
 }
 
-Value getrawmempool(const Array& params, bool fHelp)
+void getrawmempool(const Array& params, bool fHelp, CJSONWriter& result)
 {
     if (fHelp || params.size() != 0)
         throw runtime_error(
@@ -136,11 +161,15 @@ Value getrawmempool(const Array& params, bool fHelp)
     vector<uint256> vtxid;
     mempool.queryHashes(vtxid);
 
-    Array a;
+    result.BeginArray();
     BOOST_FOREACH(const uint256& hash, vtxid)
-        a.push_back(hash.ToString());
+        result.Write(hash.ToString());
+    result.EndArray();
+}
 
-    return a;
+Value getrawmempool(const Array& params, bool fHelp)
+{
+    return RPCStreamToValue(getrawmempool, params, fHelp);
 }
 
 Value getblockhash(const Array& params, bool fHelp)
@@ -151,14 +180,13 @@ Value getblockhash(const Array& params, bool fHelp)
             "Returns hash of block in best-block-chain at <index>.");
 
     int nHeight = params[0].get_int();
-    if (nHeight < 0 || nHeight > nBestHeight)
+    uint256 hash;
+    if (!GetActiveBlockHash(nHeight, hash))
         throw runtime_error("Block number out of range.");
-
-    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
-    return pblockindex->phashBlock->GetHex();
+    return hash.GetHex();
 }
 
-Value getblock(const Array& params, bool fHelp)
+void getblock(const Array& params, bool fHelp, CJSONWriter& result)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
@@ -174,22 +202,36 @@ Value getblock(const Array& params, bool fHelp)
     if (params.size() > 1)
         fVerbose = params[1].get_bool();
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
-
+    // Only the lookup needs cs_main; the reply is written from the copy
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-    block.ReadFromDisk(pblockindex);
+    CBlockChainInfo info;
+    {
+        LOCK(cs_main);
+        if (mapBlockIndex.count(hash) == 0)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+
+        CBlockIndex* pblockindex = mapBlockIndex[hash];
+        if (!block.ReadFromDisk(pblockindex))
+            throw JSONRPCError(RPC_MISC_ERROR, "Block not available (pruned, or only its header is known)");
+        if (fVerbose)
+            info.Set(block, pblockindex);
+    }
 
     if (!fVerbose)
     {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
         ssBlock << block;
         std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
+        result.Write(strHex);
+        return;
     }
 
-    return blockToJSON(block, pblockindex);
+    blockToJSON(block, info, result);
+}
+
+Value getblock(const Array& params, bool fHelp)
+{
+    return RPCStreamToValue(getblock, params, fHelp);
 }
 
 Value gettxoutsetinfo(const Array& params, bool fHelp)
@@ -197,7 +239,10 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     if (fHelp || params.size() != 0)
         throw runtime_error(
             "gettxoutsetinfo\n"
-            "Returns statistics about the unspent transaction output set.");
+            "Returns statistics about the unspent transaction output set.\n"
+            "They are those of the coin database, which is written at every block\n"
+            "once the initial block download is done. hash_set is an order-independent\n"
+            "hash of all unspent outputs.");
 
     Object ret;
 
@@ -208,9 +253,114 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
         ret.push_back(Pair("transactions", (boost::int64_t)stats.nTransactions));
         ret.push_back(Pair("txouts", (boost::int64_t)stats.nTransactionOutputs));
         ret.push_back(Pair("bytes_serialized", (boost::int64_t)stats.nSerializedSize));
-        ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+        ret.push_back(Pair("hash_set", stats.hashSet.GetHash().GetHex()));
         ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     }
+    int nHeightSnapshot, nHeightValidated;
+    if (GetSnapshotValidationProgress(nHeightSnapshot, nHeightValidated)) {
+        ret.push_back(Pair("snapshot_height", nHeightSnapshot));
+        ret.push_back(Pair("snapshot_validated_height", nHeightValidated));
+    }
+    return ret;
+}
+
+Value dumptxoutset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset <file>\n"
+            "Writes the unspent transaction output set at the best block to <file>,\n"
+            "relative to the data directory unless absolute. A new node started with\n"
+            "-loadsnapshot=<file> begins at that block and validates the blocks\n"
+            "below it in the background.");
+
+    boost::filesystem::path path(params[0].get_str());
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+
+    CSnapshotHeader header;
+    if (!DumpSnapshot(path, header))
+        throw JSONRPCError(RPC_MISC_ERROR, "Failed to write the snapshot, see debug.log");
+
+    Object ret;
+    ret.push_back(Pair("path", path.string()));
+    ret.push_back(Pair("height", header.nHeight));
+    ret.push_back(Pair("bestblock", header.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", (boost::int64_t)header.nTransactions));
+    ret.push_back(Pair("txouts", (boost::int64_t)header.nTransactionOutputs));
+    ret.push_back(Pair("hash_set", header.hashSet.GetHex()));
+    ret.push_back(Pair("total_amount", ValueFromAmount(header.nTotalAmount)));
+    return ret;
+}
+
+static Object DBStatsToJSON(CLevelDBStats &stats)
+{
+    Object ret;
+    ret.push_back(Pair("reads", (boost::int64_t)stats.nReads));
+    ret.push_back(Pair("cachehits", (boost::int64_t)stats.nCacheHits));
+    ret.push_back(Pair("cachemisses", (boost::int64_t)stats.nCacheMisses));
+    uint64 nLookups = stats.nCacheHits + stats.nCacheMisses;
+    ret.push_back(Pair("cachehitrate", nLookups ? (double)stats.nCacheHits / nLookups : 0.0));
+    ret.push_back(Pair("writes", (boost::int64_t)stats.nWrites));
+    ret.push_back(Pair("writetime", (double)stats.nWriteMicros / 1000000));
+    ret.push_back(Pair("slowwrites", (boost::int64_t)stats.nSlowWrites));
+    ret.push_back(Pair("stalltime", (double)stats.nSlowWriteMicros / 1000000));
+    ret.push_back(Pair("compactiontime", stats.dCompactionSeconds));
+    ret.push_back(Pair("compactionread_mb", stats.dCompactionReadMB));
+    ret.push_back(Pair("compactionwrite_mb", stats.dCompactionWriteMB));
+    Array files;
+    BOOST_FOREACH(int nFiles, stats.vFilesPerLevel)
+        files.push_back(nFiles);
+    ret.push_back(Pair("filesperlevel", files));
+    return ret;
+}
+
+Value getdbstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "Returns cache, write and compaction statistics of the chainstate and block index databases,\n"
+            "the memory used by the in-memory coin cache, and the hit rates of the cache of recently\n"
+            "read blocks and transactions.");
+
+    Object ret;
+    if (pcoinsdbview) {
+        CLevelDBStats stats;
+        pcoinsdbview->GetDBStats(stats);
+        ret.push_back(Pair("chainstate", DBStatsToJSON(stats)));
+    }
+    if (pblocktree) {
+        CLevelDBStats stats;
+        pblocktree->GetStats(stats);
+        ret.push_back(Pair("blockindex", DBStatsToJSON(stats)));
+    }
+    {
+        LOCK(cs_main);
+        if (pcoinsTip) {
+            Object cache;
+            cache.push_back(Pair("transactions", (boost::int64_t)pcoinsTip->GetCacheSize()));
+            cache.push_back(Pair("usage", (boost::int64_t)pcoinsTip->DynamicMemoryUsage()));
+            cache.push_back(Pair("limit", (boost::int64_t)nCoinCacheUsage));
+            ret.push_back(Pair("coinscache", cache));
+        }
+    }
+    {
+        CBlockReadCache::Stats stats;
+        blockReadCache.GetStats(stats);
+        Object cache;
+        cache.push_back(Pair("blocks", (boost::int64_t)stats.nBlocks));
+        cache.push_back(Pair("transactions", (boost::int64_t)stats.nTxs));
+        cache.push_back(Pair("usage", (boost::int64_t)stats.nSize));
+        cache.push_back(Pair("limit", (boost::int64_t)stats.nMaxSize));
+        cache.push_back(Pair("blockhits", (boost::int64_t)stats.nBlockHits));
+        cache.push_back(Pair("blockmisses", (boost::int64_t)stats.nBlockMisses));
+        cache.push_back(Pair("txhits", (boost::int64_t)stats.nTxHits));
+        cache.push_back(Pair("txmisses", (boost::int64_t)stats.nTxMisses));
+        ret.push_back(Pair("readcache", cache));
+    }
     return ret;
 }
 
@@ -230,6 +380,8 @@ Value gettxout(const Array& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
+    // The coins cache needs cs_main, but not the wallet lock
+    LOCK(cs_main);
     CCoins coins;
     if (fMempool) {
         LOCK(mempool.cs);
@@ -259,6 +411,84 @@ Value gettxout(const Array& params, bool fHelp)
     return ret;
 }
 
+// Address index lookup shared by getaddresshistory and getaddressunspent
+static Value ListAddrIndex(const Array& params, bool fUnspentOnly)
+{
+    if (!fAddrIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled (restart with -addrindex -reindex)");
+
+    CScript scriptPubKey;
+    CBitcoinAddress address(params[0].get_str());
+    if (address.IsValid())
+        scriptPubKey.SetDestination(address.Get());
+    else if (IsHex(params[0].get_str())) {
+        std::vector<unsigned char> vchScript(ParseHex(params[0].get_str()));
+        scriptPubKey = CScript(vchScript.begin(), vchScript.end());
+    } else
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Motocoin address or script");
+
+    int nSkip = 0, nCount = 100;
+    if (params.size() > 1)
+        nSkip = params[1].get_int();
+    if (params.size() > 2)
+        nCount = params[2].get_int();
+    if (nSkip < 0 || nCount < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative skip or count");
+
+    std::vector<std::pair<CAddrIndexKey, CAddrIndexValue> > vEntries;
+    if (!pblocktree->ReadAddrIndex(GetAddrIndexHash(scriptPubKey), fUnspentOnly, nSkip, nCount, vEntries))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read address index");
+
+    int nBestHeight = GetChainTip()->nHeight;
+    Array ret;
+    for (unsigned int i = 0; i < vEntries.size(); i++) {
+        const CAddrIndexKey &key = vEntries[i].first;
+        const CAddrIndexValue &value = vEntries[i].second;
+        Object entry;
+        entry.push_back(Pair("txid", key.txid.GetHex()));
+        entry.push_back(Pair("vout", (boost::int64_t)key.n));
+        entry.push_back(Pair("height", key.nHeight));
+        uint256 hashBlock;
+        if (GetActiveBlockHash(key.nHeight, hashBlock))
+            entry.push_back(Pair("blockhash", hashBlock.GetHex()));
+        entry.push_back(Pair("confirmations", std::max(0, nBestHeight - key.nHeight + 1)));
+        entry.push_back(Pair("amount", ValueFromAmount(value.nValue)));
+        if (value.IsSpent()) {
+            Object spent;
+            spent.push_back(Pair("txid", value.hashSpentBy.GetHex()));
+            spent.push_back(Pair("vin", (boost::int64_t)value.nSpentIn));
+            spent.push_back(Pair("height", value.nSpentHeight));
+            entry.push_back(Pair("spent", spent));
+        }
+        ret.push_back(entry);
+    }
+    return ret;
+}
+
+Value getaddresshistory(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddresshistory <address or script hex> [skip=0] [count=100]\n"
+            "Returns the outputs ever paid to an address, oldest first, with the\n"
+            "transaction input that spent each of them. Requires -addrindex.\n"
+            "Skips the first [skip] outputs and returns at most [count].");
+
+    return ListAddrIndex(params, false);
+}
+
+Value getaddressunspent(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddressunspent <address or script hex> [skip=0] [count=100]\n"
+            "Returns the unspent outputs of an address in the block chain, oldest\n"
+            "first. Requires -addrindex.\n"
+            "Skips the first [skip] outputs and returns at most [count].");
+
+    return ListAddrIndex(params, true);
+}
+
 Value verifychain(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
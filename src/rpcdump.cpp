@@ -64,16 +64,23 @@ Value importprivkey(const Array& params, bool fHelp)
     {
         LOCK2(cs_main, pwalletMain->cs_wallet);
 
+        // Without the blocks the rescan would miss the transactions of the key
+        if (fRescan && HavePrunedBlocksSince(pindexGenesisBlock))
+            throw JSONRPCError(RPC_WALLET_ERROR, "Blocks to rescan have been pruned; import the key with rescan=false, or rebuild the database with -reindex");
+
         pwalletMain->MarkDirty();
         pwalletMain->SetAddressBookName(vchAddress, strLabel);
 
         if (!pwalletMain->AddKeyPubKey(key, pubkey))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
+    }
 
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
-            pwalletMain->ReacceptWalletTransactions();
-        }
+    // The rescan takes the locks for one batch of blocks at a time, so the
+    // node keeps working while it runs
+    if (fRescan) {
+        if (pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true) < 0)
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read a block while rescanning; rebuild the database with -reindex");
+        pwalletMain->ReacceptWalletTransactions();
     }
 
     return Value::null;
@@ -32,7 +32,7 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
-Value getpeerinfo(const Array& params, bool fHelp)
+void getpeerinfo(const Array& params, bool fHelp, CJSONWriter& result)
 {
     if (fHelp || params.size() != 0)
         throw runtime_error(
@@ -42,8 +42,7 @@ Value getpeerinfo(const Array& params, bool fHelp)
     vector<CNodeStats> vstats;
     CopyNodeStats(vstats);
 
-    Array ret;
-
+    result.BeginArray();
     BOOST_FOREACH(const CNodeStats& stats, vstats) {
         Object obj;
 
@@ -66,10 +65,14 @@ Value getpeerinfo(const Array& params, bool fHelp)
         if (stats.fSyncNode)
             obj.push_back(Pair("syncnode", true));
 
-        ret.push_back(obj);
+        result.Write(obj);
     }
+    result.EndArray();
+}
 
-    return ret;
+Value getpeerinfo(const Array& params, bool fHelp)
+{
+    return RPCStreamToValue(getpeerinfo, params, fHelp);
 }
 
 Value addnode(const Array& params, bool fHelp)
@@ -166,7 +166,22 @@ Value getrawtransaction(const Array& params, bool fHelp)
     return result;
 }
 
-Value listunspent(const Array& params, bool fHelp)
+// An unspent output as listunspent reports it, copied under the wallet lock
+struct CUnspentInfo
+{
+    uint256 txid;
+    int n;
+    CTxOut txout;
+    int nDepth;
+    bool fAccount;
+    std::string strAccount;
+    bool fRedeemScript;
+    CScript redeemScript;
+
+    CUnspentInfo() : n(0), nDepth(0), fAccount(false), fRedeemScript(false) {}
+};
+
+void listunspent(const Array& params, bool fHelp, CJSONWriter& result)
 {
     if (fHelp || params.size() > 3)
         throw runtime_error(
@@ -202,55 +217,65 @@ Value listunspent(const Array& params, bool fHelp)
         }
     }
 
-    Array results;
-    vector<COutput> vecOutputs;
+    // Copy what is reported under the locks, and write the reply without them
+    vector<CUnspentInfo> vUnspent;
     assert(pwalletMain != NULL);
-    pwalletMain->AvailableCoins(vecOutputs, false);
-    BOOST_FOREACH(const COutput& out, vecOutputs)
     {
-        if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
-            continue;
-
-        if (setAddress.size())
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        vector<COutput> vecOutputs;
+        pwalletMain->AvailableCoins(vecOutputs, false);
+        BOOST_FOREACH(const COutput& out, vecOutputs)
         {
-            CTxDestination address;
-            if (!ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
+            if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
                 continue;
 
-            if (!setAddress.count(address))
+            const CScript& pk = out.tx->vout[out.i].scriptPubKey;
+            CTxDestination address;
+            bool fAddress = ExtractDestination(pk, address);
+            if (setAddress.size() && (!fAddress || !setAddress.count(address)))
                 continue;
+
+            vUnspent.push_back(CUnspentInfo());
+            CUnspentInfo& info = vUnspent.back();
+            info.txid = out.tx->GetHash();
+            info.n = out.i;
+            info.txout = out.tx->vout[out.i];
+            info.nDepth = out.nDepth;
+            info.fAccount = fAddress && pwalletMain->mapAddressBook.count(address);
+            if (info.fAccount)
+                info.strAccount = pwalletMain->mapAddressBook[address];
+            if (pk.IsPayToScriptHash() && fAddress)
+                info.fRedeemScript = pwalletMain->GetCScript(boost::get<const CScriptID&>(address), info.redeemScript);
         }
+    }
 
-        int64 nValue = out.tx->vout[out.i].nValue;
-        const CScript& pk = out.tx->vout[out.i].scriptPubKey;
+    result.BeginArray();
+    BOOST_FOREACH(const CUnspentInfo& info, vUnspent)
+    {
+        const CScript& pk = info.txout.scriptPubKey;
         Object entry;
-        entry.push_back(Pair("txid", out.tx->GetHash().GetHex()));
-        entry.push_back(Pair("vout", out.i));
+        entry.push_back(Pair("txid", info.txid.GetHex()));
+        entry.push_back(Pair("vout", info.n));
         CTxDestination address;
-        if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
+        if (ExtractDestination(pk, address))
         {
             entry.push_back(Pair("address", CBitcoinAddress(address).ToString()));
-            if (pwalletMain->mapAddressBook.count(address))
-                entry.push_back(Pair("account", pwalletMain->mapAddressBook[address]));
+            if (info.fAccount)
+                entry.push_back(Pair("account", info.strAccount));
         }
         entry.push_back(Pair("scriptPubKey", HexStr(pk.begin(), pk.end())));
-        if (pk.IsPayToScriptHash())
-        {
-            CTxDestination address;
-            if (ExtractDestination(pk, address))
-            {
-                const CScriptID& hash = boost::get<const CScriptID&>(address);
-                CScript redeemScript;
-                if (pwalletMain->GetCScript(hash, redeemScript))
-                    entry.push_back(Pair("redeemScript", HexStr(redeemScript.begin(), redeemScript.end())));
-            }
-        }
-        entry.push_back(Pair("amount",ValueFromAmount(nValue)));
-        entry.push_back(Pair("confirmations",out.nDepth));
-        results.push_back(entry);
+        if (info.fRedeemScript)
+            entry.push_back(Pair("redeemScript", HexStr(info.redeemScript.begin(), info.redeemScript.end())));
+        entry.push_back(Pair("amount",ValueFromAmount(info.txout.nValue)));
+        entry.push_back(Pair("confirmations",info.nDepth));
+        result.Write(entry);
     }
+    result.EndArray();
+}
 
-    return results;
+Value listunspent(const Array& params, bool fHelp)
+{
+    return RPCStreamToValue(listunspent, params, fHelp);
 }
 
 Value createrawtransaction(const Array& params, bool fHelp)
@@ -492,7 +517,9 @@ Value signrawtransaction(const Array& params, bool fHelp)
 
     bool fHashSingle = ((nHashType & ~SIGHASH_ANYONECANPAY) == SIGHASH_SINGLE);
 
-    // Sign what we can:
+    // Sign what we can; signing only changes signature scripts, so the
+    // signature hash precomputation stays valid throughout:
+    CSignatureHashCache sighashCache(mergedTx);
     for (unsigned int i = 0; i < mergedTx.vin.size(); i++)
     {
         CTxIn& txin = mergedTx.vin[i];
@@ -507,14 +534,14 @@ Value signrawtransaction(const Array& params, bool fHelp)
         txin.scriptSig.clear();
         // Only sign SIGHASH_SINGLE if there's a corresponding output:
         if (!fHashSingle || (i < mergedTx.vout.size()))
-            SignSignature(keystore, prevPubKey, mergedTx, i, nHashType);
+            SignSignature(keystore, prevPubKey, mergedTx, i, nHashType, &sighashCache);
 
         // ... and merge in other signatures:
         BOOST_FOREACH(const CTransaction& txv, txVariants)
         {
             txin.scriptSig = CombineSignatures(prevPubKey, mergedTx, i, txin.scriptSig, txv.vin[i].scriptSig);
         }
-        if (!VerifyScript(txin.scriptSig, prevPubKey, mergedTx, i, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0))
+        if (!VerifyScript(txin.scriptSig, prevPubKey, mergedTx, i, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0, &sighashCache))
             fComplete = false;
     }
 
@@ -1064,7 +1064,7 @@ void AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, Ar
     }
 }
 
-Value listtransactions(const Array& params, bool fHelp)
+void listtransactions(const Array& params, bool fHelp, CJSONWriter& result)
 {
     if (fHelp || params.size() > 3)
         throw runtime_error(
@@ -1086,22 +1086,26 @@ Value listtransactions(const Array& params, bool fHelp)
     if (nFrom < 0)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
 
+    // The entries are at most count + from; they are collected under the
+    // locks, and the reply is written without them
     Array ret;
-
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
-
-    // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
     {
-        CWalletTx *const pwtx = (*it).second.first;
-        if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret);
-        CAccountingEntry *const pacentry = (*it).second.second;
-        if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
-
-        if ((int)ret.size() >= (nCount+nFrom)) break;
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        std::list<CAccountingEntry> acentries;
+        CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
+
+        // iterate backwards until we have nCount items to return:
+        for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+        {
+            CWalletTx *const pwtx = (*it).second.first;
+            if (pwtx != 0)
+                ListTransactions(*pwtx, strAccount, 0, true, ret);
+            CAccountingEntry *const pacentry = (*it).second.second;
+            if (pacentry != 0)
+                AcentryToJSON(*pacentry, strAccount, ret);
+
+            if ((int)ret.size() >= (nCount+nFrom)) break;
+        }
     }
     // ret is newest to oldest
 
@@ -1119,7 +1123,15 @@ Value listtransactions(const Array& params, bool fHelp)
 
     std::reverse(ret.begin(), ret.end()); // Return oldest to newest
 
-    return ret;
+    result.BeginArray();
+    BOOST_FOREACH(const Value& entry, ret)
+        result.Write(entry);
+    result.EndArray();
+}
+
+Value listtransactions(const Array& params, bool fHelp)
+{
+    return RPCStreamToValue(listtransactions, params, fHelp);
 }
 
 Value listaccounts(const Array& params, bool fHelp)
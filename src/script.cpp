@@ -3,7 +3,8 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <openssl/sha.h>
 
 using namespace std;
 using namespace boost;
@@ -16,37 +17,76 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashCache *pcache = NULL);
 
 
 
 typedef vector<unsigned char> valtype;
-static const valtype vchFalse(0);
-static const valtype vchZero(0);
-static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
-static const size_t nMaxNumSize = 4;
 
+namespace {
 
-CBigNum CastToBigNum(const valtype& vch)
+/** Element of the script interpreter's stacks. Values up to INLINE_SIZE bytes,
+ *  which covers signatures, public keys, hashes and numbers, are kept inside
+ *  the element itself; only longer pushes use the heap. */
+class CStackElement
 {
-    if (vch.size() > nMaxNumSize)
-        throw runtime_error("CastToBigNum() : overflow");
-    // Get rid of extra leading zeros
-    return CBigNum(CBigNum(vch).getvch());
+private:
+    static const unsigned int INLINE_SIZE = 80;
+
+    unsigned int nSize;
+    unsigned char vchInline[INLINE_SIZE];
+    valtype vchLarge;
+
+public:
+    CStackElement() : nSize(0) {}
+    CStackElement(const unsigned char *pbegin, const unsigned char *pend) { assign(pbegin, pend - pbegin); }
+    explicit CStackElement(const valtype& vch) { assign(vch.empty() ? NULL : &vch[0], vch.size()); }
+    explicit CStackElement(const CScriptNum& num) { nSize = num.Encode(vchInline); }
+
+    void assign(const unsigned char *pch, size_t nLen)
+    {
+        nSize = nLen;
+        if (nLen <= INLINE_SIZE) {
+            if (nLen > 0)
+                memcpy(vchInline, pch, nLen);
+            vchLarge.clear();
+        } else {
+            vchLarge.assign(pch, pch + nLen);
+        }
+    }
+
+    const unsigned char *begin() const { return nSize > INLINE_SIZE ? &vchLarge[0] : vchInline; }
+    const unsigned char *end() const { return begin() + nSize; }
+    unsigned int size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+    valtype ToVector() const { return valtype(begin(), end()); }
+
+    bool operator==(const CStackElement& b) const
+    {
+        return nSize == b.nSize && memcmp(begin(), b.begin(), nSize) == 0;
+    }
+};
+
+typedef vector<CStackElement> CScriptStack;
+
+static const CStackElement elementFalse;
+static const unsigned char pchTrue[1] = {1};
+static const CStackElement elementTrue(pchTrue, pchTrue + 1);
+
+int64 CastToNum(const CStackElement& element)
+{
+    return CScriptNum(element.begin(), element.end()).GetInt64();
 }
 
-bool CastToBool(const valtype& vch)
+bool CastToBool(const CStackElement& element)
 {
-    for (unsigned int i = 0; i < vch.size(); i++)
+    const unsigned char *pch = element.begin();
+    for (unsigned int i = 0; i < element.size(); i++)
     {
-        if (vch[i] != 0)
+        if (pch[i] != 0)
         {
             // Can be negative zero
-            if (i == vch.size()-1 && vch[i] == 0x80)
+            if (i == element.size()-1 && pch[i] == 0x80)
                 return false;
             return true;
         }
@@ -54,6 +94,8 @@ bool CastToBool(const valtype& vch)
     return false;
 }
 
+} // anon namespace
+
 
 
 //
@@ -62,7 +104,7 @@ bool CastToBool(const valtype& vch)
 //
 #define stacktop(i)  (stack.at(stack.size()+(i)))
 #define altstacktop(i)  (altstack.at(altstack.size()+(i)))
-static inline void popstack(vector<valtype>& stack)
+static inline void popstack(CScriptStack& stack)
 {
     if (stack.empty())
         throw runtime_error("popstack() : stack empty");
@@ -289,16 +331,15 @@ bool IsCanonicalSignature(const valtype &vchSig) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+static bool EvalScript(CScriptStack& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache *pcache)
 {
-    CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
     opcodetype opcode;
     valtype vchPushValue;
     vector<bool> vfExec;
-    vector<valtype> altstack;
+    CScriptStack altstack;
     if (script.size() > 10000)
         return false;
     int nOpCount = 0;
@@ -338,7 +379,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 return false; // Disabled opcodes.
 
             if (fExec && 0 <= opcode && opcode <= OP_PUSHDATA4)
-                stack.push_back(vchPushValue);
+                stack.push_back(CStackElement(vchPushValue));
             else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
             switch (opcode)
             {
@@ -364,8 +405,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
-                    stack.push_back(bn.getvch());
+                    CScriptNum num((int)opcode - (int)(OP_1 - 1));
+                    stack.push_back(CStackElement(num));
                 }
                 break;
 
@@ -387,8 +428,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     {
                         if (stack.size() < 1)
                             return false;
-                        valtype& vch = stacktop(-1);
-                        fValue = CastToBool(vch);
+                        fValue = CastToBool(stacktop(-1));
                         if (opcode == OP_NOTIF)
                             fValue = !fValue;
                         popstack(stack);
@@ -470,8 +510,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch1 = stacktop(-2);
-                    valtype vch2 = stacktop(-1);
+                    CStackElement vch1 = stacktop(-2);
+                    CStackElement vch2 = stacktop(-1);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                 }
@@ -482,9 +522,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
                     if (stack.size() < 3)
                         return false;
-                    valtype vch1 = stacktop(-3);
-                    valtype vch2 = stacktop(-2);
-                    valtype vch3 = stacktop(-1);
+                    CStackElement vch1 = stacktop(-3);
+                    CStackElement vch2 = stacktop(-2);
+                    CStackElement vch3 = stacktop(-1);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                     stack.push_back(vch3);
@@ -496,8 +536,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
                     if (stack.size() < 4)
                         return false;
-                    valtype vch1 = stacktop(-4);
-                    valtype vch2 = stacktop(-3);
+                    CStackElement vch1 = stacktop(-4);
+                    CStackElement vch2 = stacktop(-3);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                 }
@@ -508,8 +548,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
                     if (stack.size() < 6)
                         return false;
-                    valtype vch1 = stacktop(-6);
-                    valtype vch2 = stacktop(-5);
+                    CStackElement vch1 = stacktop(-6);
+                    CStackElement vch2 = stacktop(-5);
                     stack.erase(stack.end()-6, stack.end()-4);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
@@ -531,17 +571,16 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x - 0 | x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
-                    if (CastToBool(vch))
-                        stack.push_back(vch);
+                    if (CastToBool(stacktop(-1)))
+                        stack.push_back(CStackElement(stacktop(-1)));
                 }
                 break;
 
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn(stack.size());
-                    stack.push_back(bn.getvch());
+                    CScriptNum num(stack.size());
+                    stack.push_back(CStackElement(num));
                 }
                 break;
 
@@ -559,7 +598,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x -- x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
+                    CStackElement vch = stacktop(-1);
                     stack.push_back(vch);
                 }
                 break;
@@ -578,7 +617,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-2);
+                    CStackElement vch = stacktop(-2);
                     stack.push_back(vch);
                 }
                 break;
@@ -590,11 +629,11 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint();
+                    int n = CastToNum(stacktop(-1));
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
-                    valtype vch = stacktop(-n-1);
+                    CStackElement vch = stacktop(-n-1);
                     if (opcode == OP_ROLL)
                         stack.erase(stack.end()-n-1);
                     stack.push_back(vch);
@@ -627,7 +666,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-1);
+                    CStackElement vch = stacktop(-1);
                     stack.insert(stack.end()-2, vch);
                 }
                 break;
@@ -638,8 +677,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn(stacktop(-1).size());
-                    stack.push_back(bn.getvch());
+                    CScriptNum num(stacktop(-1).size());
+                    stack.push_back(CStackElement(num));
                 }
                 break;
 
@@ -654,9 +693,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 - bool)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
-                    bool fEqual = (vch1 == vch2);
+                    bool fEqual = (stacktop(-2) == stacktop(-1));
                     // OP_NOTEQUAL is disabled because it would be too easy to say
                     // something like n != 1 and have some wiseguy pass in 1 with extra
                     // zero bytes after it (numerically, 0x01 == 0x0001 == 0x000001)
@@ -664,7 +701,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     //    fEqual = !fEqual;
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(fEqual ? vchTrue : vchFalse);
+                    stack.push_back(fEqual ? elementTrue : elementFalse);
                     if (opcode == OP_EQUALVERIFY)
                     {
                         if (fEqual)
@@ -689,19 +726,19 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    int64 n = CastToNum(stacktop(-1));
                     switch (opcode)
                     {
-                    case OP_1ADD:       bn += bnOne; break;
-                    case OP_1SUB:       bn -= bnOne; break;
-                    case OP_NEGATE:     bn = -bn; break;
-                    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                    case OP_NOT:        bn = (bn == bnZero); break;
-                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    case OP_1ADD:       n += 1; break;
+                    case OP_1SUB:       n -= 1; break;
+                    case OP_NEGATE:     n = -n; break;
+                    case OP_ABS:        if (n < 0) n = -n; break;
+                    case OP_NOT:        n = (n == 0); break;
+                    case OP_0NOTEQUAL:  n = (n != 0); break;
                     default:            assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.push_back(CStackElement(CScriptNum(n)));
                 }
                 break;
 
@@ -722,35 +759,35 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    int64 n1 = CastToNum(stacktop(-2));
+                    int64 n2 = CastToNum(stacktop(-1));
+                    int64 n;
                     switch (opcode)
                     {
                     case OP_ADD:
-                        bn = bn1 + bn2;
+                        n = n1 + n2;
                         break;
 
                     case OP_SUB:
-                        bn = bn1 - bn2;
+                        n = n1 - n2;
                         break;
 
-                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
-                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
-                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
-                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
-                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
-                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
-                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
-                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
-                    case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
-                    case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
-                    default:                     assert(!"invalid opcode"); break;
+                    case OP_BOOLAND:             n = (n1 != 0 && n2 != 0); break;
+                    case OP_BOOLOR:              n = (n1 != 0 || n2 != 0); break;
+                    case OP_NUMEQUAL:            n = (n1 == n2); break;
+                    case OP_NUMEQUALVERIFY:      n = (n1 == n2); break;
+                    case OP_NUMNOTEQUAL:         n = (n1 != n2); break;
+                    case OP_LESSTHAN:            n = (n1 < n2); break;
+                    case OP_GREATERTHAN:         n = (n1 > n2); break;
+                    case OP_LESSTHANOREQUAL:     n = (n1 <= n2); break;
+                    case OP_GREATERTHANOREQUAL:  n = (n1 >= n2); break;
+                    case OP_MIN:                 n = (n1 < n2 ? n1 : n2); break;
+                    case OP_MAX:                 n = (n1 > n2 ? n1 : n2); break;
+                    default:                     assert(!"invalid opcode"); n = 0; break;
                     }
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.push_back(CStackElement(CScriptNum(n)));
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
@@ -767,14 +804,14 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
-                    bool fValue = (bn2 <= bn1 && bn1 < bn3);
+                    int64 n1 = CastToNum(stacktop(-3));
+                    int64 n2 = CastToNum(stacktop(-2));
+                    int64 n3 = CastToNum(stacktop(-1));
+                    bool fValue = (n2 <= n1 && n1 < n3);
                     popstack(stack);
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(fValue ? vchTrue : vchFalse);
+                    stack.push_back(fValue ? elementTrue : elementFalse);
                 }
                 break;
 
@@ -791,26 +828,27 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- hash)
                     if (stack.size() < 1)
                         return false;
-                    valtype& vch = stacktop(-1);
-                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    CStackElement& vch = stacktop(-1);
+                    unsigned char pchHash[32];
+                    unsigned int nHashSize = (opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32;
                     if (opcode == OP_RIPEMD160)
-                        RIPEMD160(&vch[0], vch.size(), &vchHash[0]);
+                        RIPEMD160(vch.begin(), vch.size(), pchHash);
                     else if (opcode == OP_SHA1)
-                        SHA1(&vch[0], vch.size(), &vchHash[0]);
+                        SHA1(vch.begin(), vch.size(), pchHash);
                     else if (opcode == OP_SHA256)
-                        SHA256(&vch[0], vch.size(), &vchHash[0]);
+                        SHA256(vch.begin(), vch.size(), pchHash);
                     else if (opcode == OP_HASH160)
                     {
-                        uint160 hash160 = Hash160(vch);
-                        memcpy(&vchHash[0], &hash160, sizeof(hash160));
+                        uint160 hash160 = Hash160(vch.begin(), vch.end());
+                        memcpy(pchHash, &hash160, sizeof(hash160));
                     }
                     else if (opcode == OP_HASH256)
                     {
                         uint256 hash = Hash(vch.begin(), vch.end());
-                        memcpy(&vchHash[0], &hash, sizeof(hash));
+                        memcpy(pchHash, &hash, sizeof(hash));
                     }
-                    popstack(stack);
-                    stack.push_back(vchHash);
+                    // Replaces the value in place
+                    vch.assign(pchHash, nHashSize);
                 }
                 break;
 
@@ -828,8 +866,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 2)
                         return false;
 
-                    valtype& vchSig    = stacktop(-2);
-                    valtype& vchPubKey = stacktop(-1);
+                    valtype vchSig    = stacktop(-2).ToVector();
+                    valtype vchPubKey = stacktop(-1).ToVector();
 
                     ////// debug print
                     //PrintHex(vchSig.begin(), vchSig.end(), "sig: %s\n");
@@ -843,11 +881,11 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                     bool fSuccess = (!fStrictEncodings || (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
                     if (fSuccess)
-                        fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pcache);
 
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+                    stack.push_back(fSuccess ? elementTrue : elementFalse);
                     if (opcode == OP_CHECKSIGVERIFY)
                     {
                         if (fSuccess)
@@ -867,7 +905,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    int nKeysCount = CastToNum(stacktop(-i));
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
                     nOpCount += nKeysCount;
@@ -878,7 +916,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    int nSigsCount = CastToNum(stacktop(-i));
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -892,20 +930,20 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // Drop the signatures, since there's no way for a signature to sign itself
                     for (int k = 0; k < nSigsCount; k++)
                     {
-                        valtype& vchSig = stacktop(-isig-k);
+                        valtype vchSig = stacktop(-isig-k).ToVector();
                         scriptCode.FindAndDelete(CScript(vchSig));
                     }
 
                     bool fSuccess = true;
                     while (fSuccess && nSigsCount > 0)
                     {
-                        valtype& vchSig    = stacktop(-isig);
-                        valtype& vchPubKey = stacktop(-ikey);
+                        valtype vchSig    = stacktop(-isig).ToVector();
+                        valtype vchPubKey = stacktop(-ikey).ToVector();
 
                         // Check signature
                         bool fOk = (!fStrictEncodings || (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
                         if (fOk)
-                            fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pcache);
 
                         if (fOk) {
                             isig++;
@@ -922,7 +960,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                     while (i-- > 0)
                         popstack(stack);
-                    stack.push_back(fSuccess ? vchTrue : vchFalse);
+                    stack.push_back(fSuccess ? elementTrue : elementFalse);
 
                     if (opcode == OP_CHECKMULTISIGVERIFY)
                     {
@@ -955,6 +993,19 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
     return true;
 }
 
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache *pcache)
+{
+    CScriptStack stackEval;
+    stackEval.reserve(stack.size());
+    BOOST_FOREACH(const valtype& vch, stack)
+        stackEval.push_back(CStackElement(vch));
+    bool fResult = EvalScript(stackEval, script, txTo, nIn, flags, nHashType, pcache);
+    stack.clear();
+    BOOST_FOREACH(const CStackElement& element, stackEval)
+        stack.push_back(element.ToVector());
+    return fResult;
+}
+
 
 
 
@@ -963,64 +1014,137 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
 
 
-uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+namespace {
+
+/** Serializes a transaction the way it is signed, without making a modified
+ *  copy: other inputs' scripts are blanked, and outputs and sequence numbers
+ *  are left out according to nHashType. */
+class CTransactionSignatureSerializer
 {
-    if (nIn >= txTo.vin.size())
+private:
+    const CTransaction &txTo;
+    const CScript &scriptCode;
+    unsigned int nIn;
+    bool fAnyoneCanPay;
+    bool fHashSingle;
+    bool fHashNone;
+
+public:
+    CTransactionSignatureSerializer(const CTransaction &txToIn, const CScript &scriptCodeIn, unsigned int nInIn, int nHashTypeIn) :
+        txTo(txToIn), scriptCode(scriptCodeIn), nIn(nInIn),
+        fAnyoneCanPay(!!(nHashTypeIn & SIGHASH_ANYONECANPAY)),
+        fHashSingle((nHashTypeIn & 0x1f) == SIGHASH_SINGLE),
+        fHashNone((nHashTypeIn & 0x1f) == SIGHASH_NONE) {}
+
+    template<typename Stream>
+    void SerializeInput(Stream &s, unsigned int nInput, int nType, int nVersion) const
     {
-        printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
-        return 1;
+        // With SIGHASH_ANYONECANPAY only the input being signed is serialized
+        if (fAnyoneCanPay)
+            nInput = nIn;
+        ::Serialize(s, txTo.vin[nInput].prevout, nType, nVersion);
+        if (nInput != nIn)
+            WriteCompactSize(s, 0); // blank script
+        else
+            ::Serialize(s, scriptCode, nType, nVersion);
+        // Let the others update at will
+        if (nInput != nIn && (fHashSingle || fHashNone))
+            ::Serialize(s, (unsigned int)0, nType, nVersion);
+        else
+            ::Serialize(s, txTo.vin[nInput].nSequence, nType, nVersion);
     }
-    CTransaction txTmp(txTo);
-
-    // In case concatenating two scripts ends up with two codeseparators,
-    // or an extra one at the end, this prevents all those possible incompatibilities.
-    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
 
-    // Blank out other inputs' signatures
-    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-        txTmp.vin[i].scriptSig = CScript();
-    txTmp.vin[nIn].scriptSig = scriptCode;
+    template<typename Stream>
+    void SerializeOutput(Stream &s, unsigned int nOutput, int nType, int nVersion) const
+    {
+        if (fHashSingle && nOutput != nIn)
+            ::Serialize(s, CTxOut(), nType, nVersion); // null output
+        else
+            ::Serialize(s, txTo.vout[nOutput], nType, nVersion);
+    }
 
-    // Blank out some of the outputs
-    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const
     {
-        // Wildcard payee
-        txTmp.vout.clear();
+        ::Serialize(s, txTo.nVersion, nType, nVersion);
+        unsigned int nInputs = fAnyoneCanPay ? 1 : txTo.vin.size();
+        WriteCompactSize(s, nInputs);
+        for (unsigned int i = 0; i < nInputs; i++)
+            SerializeInput(s, i, nType, nVersion);
+        // SIGHASH_NONE: wildcard payee; SIGHASH_SINGLE: only lock in the output at the same index
+        unsigned int nOutputs = fHashNone ? 0 : (fHashSingle ? nIn + 1 : txTo.vout.size());
+        WriteCompactSize(s, nOutputs);
+        for (unsigned int i = 0; i < nOutputs; i++)
+            SerializeOutput(s, i, nType, nVersion);
+        ::Serialize(s, txTo.nLockTime, nType, nVersion);
+    }
+};
 
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+} // anon namespace
+
+CSignatureHashCache::CSignatureHashCache(const CTransaction& txTo)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    WriteCompactSize(ss, txTo.vin.size());
+
+    CDataStream ssSuffix(SER_GETHASH, 0);
+    vMidstate.reserve(txTo.vin.size());
+    vInputEnd.reserve(txTo.vin.size());
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin) {
+        vMidstate.push_back(ss);
+        unsigned int nBegin = ssSuffix.size();
+        ssSuffix << txin.prevout;
+        WriteCompactSize(ssSuffix, 0);
+        ssSuffix << txin.nSequence;
+        vInputEnd.push_back(ssSuffix.size());
+        ss.write(&ssSuffix[nBegin], ssSuffix.size() - nBegin);
     }
-    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    ssSuffix << txTo.vout << txTo.nLockTime;
+    vchSuffix.assign(ssSuffix.begin(), ssSuffix.end());
+}
+
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache *pcache)
+{
+    if (nIn >= txTo.vin.size())
     {
-        // Only lock-in the txout payee at same index as txin
-        unsigned int nOut = nIn;
-        if (nOut >= txTmp.vout.size())
+        printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
+        return 1;
+    }
+
+    // Check for invalid use of SIGHASH_SINGLE
+    if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    {
+        if (nIn >= txTo.vout.size())
         {
-            printf("ERROR: SignatureHash() : nOut=%d out of range\n", nOut);
+            printf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
             return 1;
         }
-        txTmp.vout.resize(nOut+1);
-        for (unsigned int i = 0; i < nOut; i++)
-            txTmp.vout[i].SetNull();
-
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
     }
 
-    // Blank out other inputs completely, not recommended for open transactions
-    if (nHashType & SIGHASH_ANYONECANPAY)
+    // In case concatenating two scripts ends up with two codeseparators,
+    // or an extra one at the end, this prevents all those possible incompatibilities.
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    // Everything except the input being signed is the same for all inputs
+    // when all inputs and outputs are signed
+    if (pcache && !(nHashType & SIGHASH_ANYONECANPAY) &&
+        (nHashType & 0x1f) != SIGHASH_NONE && (nHashType & 0x1f) != SIGHASH_SINGLE)
     {
-        txTmp.vin[0] = txTmp.vin[nIn];
-        txTmp.vin.resize(1);
+        assert(pcache->vMidstate.size() == txTo.vin.size());
+        const CTxIn& txin = txTo.vin[nIn];
+        CHashWriter ss(pcache->vMidstate[nIn]);
+        ss << txin.prevout << scriptCode << txin.nSequence;
+        const std::vector<unsigned char> &vchSuffix = pcache->vchSuffix;
+        unsigned int nBegin = pcache->vInputEnd[nIn];
+        ss.write((const char*)&vchSuffix[nBegin], vchSuffix.size() - nBegin);
+        ss << nHashType;
+        return ss.GetHash();
     }
 
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
-    ss << txTmp << nHashType;
+    ss << CTransactionSignatureSerializer(txTo, scriptCode, nIn, nHashType) << nHashType;
     return ss.GetHash();
 }
 
@@ -1028,64 +1152,133 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// Entries are salted SHA256 digests of (signature hash, signature, public key)
+// in a fixed size table. Every digest has two possible slots (cuckoo hashing),
+// and the table is split into stripes with a lock each, so the script check
+// threads rarely wait for each other. The salt is only known to this node,
+// which keeps attackers from pre-computing entries that collide in the table.
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    static const unsigned int STRIPES = 64;
+    static const unsigned int MAX_KICKS = 8;
+
+    uint256 nonce;
+    std::vector<uint256> vTable; // 0 = empty slot
+    boost::shared_mutex cs_stripe[STRIPES];
+
+    unsigned int Slot(const uint256 &entry, int n) const
+    {
+        return entry.Get64(n) % vTable.size();
+    }
 
 public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    // Not safe to call while other threads use the cache
+    void Setup(size_t nBytes)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        // Swap rather than assign, so that shrinking releases the memory
+        std::vector<uint256>().swap(vTable);
+        if (nBytes == 0)
+            return;
+        size_t nEntries = std::max(nBytes / sizeof(uint256), (size_t)STRIPES);
+        nEntries -= nEntries % STRIPES;
+        nonce = GetRandHash();
+        std::vector<uint256>(nEntries, 0).swap(vTable);
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+    size_t GetMemoryUsage() const
+    {
+        return vTable.size() * sizeof(uint256);
     }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    void ComputeEntry(uint256 &entry, const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, nonce.begin(), nonce.size());
+        SHA256_Update(&ctx, hash.begin(), hash.size());
+        // The lax signature parser ignores trailing data, so a signature
+        // does not tell where it ends; prefix both with their lengths
+        unsigned int nSize = vchSig.size();
+        SHA256_Update(&ctx, &nSize, sizeof(nSize));
+        if (!vchSig.empty())
+            SHA256_Update(&ctx, &vchSig[0], vchSig.size());
+        nSize = pubkey.size();
+        SHA256_Update(&ctx, &nSize, sizeof(nSize));
+        SHA256_Update(&ctx, pubkey.begin(), pubkey.size());
+        SHA256_Final(entry.begin(), &ctx);
+    }
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+    bool Get(const uint256 &entry)
+    {
+        if (vTable.empty())
+            return false;
+        for (int n = 0; n < 2; n++) {
+            unsigned int nSlot = Slot(entry, n);
+            boost::shared_lock<boost::shared_mutex> lock(cs_stripe[nSlot % STRIPES]);
+            if (vTable[nSlot] == entry)
+                return true;
+        }
+        return false;
+    }
 
-        while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+    void Set(const uint256 &entryIn)
+    {
+        if (vTable.empty())
+            return;
+
+        // Take a free slot if there is one
+        for (int n = 0; n < 2; n++) {
+            unsigned int nSlot = Slot(entryIn, n);
+            boost::unique_lock<boost::shared_mutex> lock(cs_stripe[nSlot % STRIPES]);
+            if (vTable[nSlot] == entryIn)
+                return;
+            if (vTable[nSlot] == 0) {
+                vTable[nSlot] = entryIn;
+                return;
+            }
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        // Otherwise move the occupants to their other slot, a few times at
+        // most. Only one stripe is locked at a time, so a displaced entry can
+        // be missing for a moment; that merely costs a signature check.
+        uint256 entry = entryIn;
+        unsigned int nSlot = Slot(entry, entry.Get64(2) & 1);
+        for (unsigned int nKicks = 0; nKicks < MAX_KICKS; nKicks++) {
+            {
+                boost::unique_lock<boost::shared_mutex> lock(cs_stripe[nSlot % STRIPES]);
+                std::swap(vTable[nSlot], entry);
+            }
+            if (entry == 0)
+                return;
+            unsigned int nSlot0 = Slot(entry, 0);
+            nSlot = (nSlot == nSlot0 ? Slot(entry, 1) : nSlot0);
+        }
+        // The last displaced entry is dropped
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+static CSignatureCache signatureCache;
+
+size_t InitSignatureCache()
 {
-    static CSignatureCache signatureCache;
+    // -maxsigcachesize used to be a number of entries, and old configuration
+    // files still contain it; convert it unless the new option is given.
+    int64 nBytes;
+    if (mapArgs.count("-maxsigcachesize") && !mapArgs.count("-sigcachesize")) {
+        int64 nMaxEntries = (int64)(MAX_SIG_CACHE_SIZE << 20) / sizeof(uint256);
+        nBytes = std::max((int64)0, std::min(GetArg("-maxsigcachesize", 0), nMaxEntries)) * sizeof(uint256);
+    } else
+        nBytes = std::max((int64)0, std::min(GetArg("-sigcachesize", DEFAULT_SIG_CACHE_SIZE), (int64)MAX_SIG_CACHE_SIZE)) << 20;
+    signatureCache.Setup(nBytes);
+    return signatureCache.GetMemoryUsage();
+}
 
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashCache *pcache)
+{
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
         return false;
@@ -1099,16 +1292,18 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType, pcache);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    uint256 entry;
+    signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
+    if (signatureCache.Get(entry))
         return true;
 
     if (!pubkey.Verify(sighash, vchSig))
         return false;
 
     if (!(flags & SCRIPT_VERIFY_NOCACHE))
-        signatureCache.Set(sighash, vchSig, pubkey);
+        signatureCache.Set(entry);
 
     return true;
 }
@@ -1475,14 +1670,15 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSignatureHashCache *pcache)
 {
-    vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    CScriptStack stack, stackCopy;
+    stack.reserve(16);
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, pcache))
         return false;
     if (flags & SCRIPT_VERIFY_P2SH)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, pcache))
         return false;
     if (stack.empty())
         return false;
@@ -1501,11 +1697,11 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         // an empty stack and the EvalScript above would return false.
         assert(!stackCopy.empty());
 
-        const valtype& pubKeySerialized = stackCopy.back();
+        const CStackElement& pubKeySerialized = stackCopy.back();
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, pcache))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1516,14 +1712,14 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
 }
 
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache *pcache)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
+    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType, pcache);
 
     txnouttype whichType;
     if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
@@ -1537,7 +1733,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         CScript subscript = txin.scriptSig;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType, pcache);
 
         txnouttype subType;
         bool fSolved =
@@ -1548,17 +1744,17 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     }
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0);
+    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0, pcache);
 }
 
-bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache *pcache)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
     assert(txin.prevout.n < txFrom.vout.size());
     const CTxOut& txout = txFrom.vout[txin.prevout.n];
 
-    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
+    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType, pcache);
 }
 
 static CScript PushAll(const vector<valtype>& values)
@@ -5,6 +5,8 @@
 #ifndef H_BITCOIN_SCRIPT
 #define H_BITCOIN_SCRIPT
 
+#include <limits>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -13,11 +15,87 @@
 
 #include "keystore.h"
 #include "bignum.h"
+#include "hash.h"
 
 class CCoins;
 class CTransaction;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
+/** Default for -sigcachesize, the memory used by the signature cache in MiB */
+static const unsigned int DEFAULT_SIG_CACHE_SIZE = 8;
+/** Upper limit of the signature cache in MiB */
+static const unsigned int MAX_SIG_CACHE_SIZE = 1024;
+
+/** Numeric operand of the script opcodes: a little-endian sign-magnitude
+ *  integer of at most nMaxNumSize bytes. Results of arithmetic on such
+ *  operands may be a byte longer, so 64 bits are always enough.
+ */
+class CScriptNum
+{
+private:
+    int64 n;
+
+    void Set(const unsigned char *pbegin, const unsigned char *pend)
+    {
+        if (pend - pbegin > (ptrdiff_t)nMaxNumSize)
+            throw std::runtime_error("CScriptNum() : overflow");
+        n = 0;
+        if (pbegin == pend)
+            return;
+        for (const unsigned char *p = pbegin; p < pend; p++)
+            n |= (int64)(*p) << (8 * (p - pbegin));
+        // The most significant bit of the last byte is the sign
+        int64 nSignBit = (int64)0x80 << (8 * (pend - pbegin - 1));
+        if (n & nSignBit)
+            n = -(n & ~nSignBit);
+    }
+
+public:
+    static const size_t nMaxNumSize = 4;
+    static const size_t nMaxEncodedSize = 9;
+
+    explicit CScriptNum(int64 nIn) : n(nIn) {}
+    CScriptNum(const unsigned char *pbegin, const unsigned char *pend) { Set(pbegin, pend); }
+    explicit CScriptNum(const std::vector<unsigned char>& vch) { Set(vch.empty() ? NULL : &vch[0], vch.empty() ? NULL : &vch[0] + vch.size()); }
+
+    int64 GetInt64() const { return n; }
+
+    int getint() const
+    {
+        if (n > std::numeric_limits<int>::max())
+            return std::numeric_limits<int>::max();
+        if (n < std::numeric_limits<int>::min())
+            return std::numeric_limits<int>::min();
+        return n;
+    }
+
+    // Shortest encoding, the same as CBigNum::getvch(). Writes at most
+    // nMaxEncodedSize bytes to pch and returns how many were written.
+    unsigned int Encode(unsigned char *pch) const
+    {
+        if (n == 0)
+            return 0;
+        bool fNegative = (n < 0);
+        uint64 nAbs = fNegative ? (uint64)0 - (uint64)n : (uint64)n;
+        unsigned int nLen = 0;
+        while (nAbs) {
+            pch[nLen++] = nAbs & 0xff;
+            nAbs >>= 8;
+        }
+        // Add a byte for the sign if the top bit is taken
+        if (pch[nLen - 1] & 0x80)
+            pch[nLen++] = fNegative ? 0x80 : 0x00;
+        else if (fNegative)
+            pch[nLen - 1] |= 0x80;
+        return nLen;
+    }
+
+    std::vector<unsigned char> getvch() const
+    {
+        unsigned char pch[nMaxEncodedSize];
+        return std::vector<unsigned char>(pch, pch + Encode(pch));
+    }
+};
 
 /** Signature hash types/flags */
 enum
@@ -670,8 +748,34 @@ public:
 bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig);
 
-uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+/** Precomputed parts of the signature hashes of all inputs of a transaction,
+ *  for hash types that commit to all inputs and outputs (SIGHASH_ALL).
+ *  Stays valid while the transaction's version, prevouts, sequence numbers,
+ *  outputs and lock time are unchanged; signature scripts may change.
+ */
+class CSignatureHashCache
+{
+private:
+    // Hash state after nVersion, the input count and the blanked inputs before input i
+    std::vector<CHashWriter> vMidstate;
+    // Serialization of all blanked inputs, followed by the outputs and nLockTime
+    std::vector<unsigned char> vchSuffix;
+    // Offset in vchSuffix after blanked input i
+    std::vector<unsigned int> vInputEnd;
+
+    friend uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache *pcache);
+
+public:
+    CSignatureHashCache(const CTransaction& txTo);
+};
+
+
+/** (Re)size the signature cache according to -sigcachesize, or the older
+ *  -maxsigcachesize entry count; call before scripts are checked.
+ *  Returns the memory used by the cache in bytes, 0 if it is off. */
+size_t InitSignatureCache();
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache *pcache = NULL);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache *pcache = NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey);
@@ -679,9 +783,9 @@ bool IsMine(const CKeyStore& keystore, const CScript& scriptPubKey);
 bool IsMine(const CKeyStore& keystore, const CTxDestination &dest);
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet);
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
-bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, const CSignatureHashCache *pcache = NULL);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, const CSignatureHashCache *pcache = NULL);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSignatureHashCache *pcache = NULL);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
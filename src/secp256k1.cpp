@@ -0,0 +1,312 @@
+// Copyright (c) 2014 The Motocoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <assert.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/obj_mac.h>
+
+#include <boost/thread/tss.hpp>
+
+#include "secp256k1.h"
+
+// anonymous namespace with local implementation code (OpenSSL interaction)
+namespace {
+
+/** The curve, shared read-only between all threads */
+class CSecp256k1Group
+{
+public:
+    EC_GROUP *group;
+    BIGNUM *order;
+
+    CSecp256k1Group()
+    {
+        group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+        assert(group != NULL);
+        order = BN_new();
+        BN_CTX *ctx = BN_CTX_new();
+        assert(order != NULL && ctx != NULL);
+        assert(EC_GROUP_get_order(group, order, ctx));
+        // Table of generator multiples, used by every EC_POINT_mul with a scalar for G
+        assert(EC_GROUP_precompute_mult(group, ctx));
+        BN_CTX_free(ctx);
+    }
+
+    ~CSecp256k1Group()
+    {
+        BN_free(order);
+        EC_GROUP_free(group);
+    }
+};
+
+CSecp256k1Group &GetGroup()
+{
+    // Constructed on first use; the first call happens from the main thread
+    // during startup (key checks in AppInit2) before any worker exists.
+    static CSecp256k1Group secp256k1;
+    return secp256k1;
+}
+
+/** Per-thread scratch space */
+class CVerifyContext
+{
+public:
+    BN_CTX *ctx;
+    EC_POINT *pubkey;
+    EC_POINT *point;
+    BIGNUM *x;
+
+    CVerifyContext()
+    {
+        const EC_GROUP *group = GetGroup().group;
+        ctx = BN_CTX_new();
+        pubkey = EC_POINT_new(group);
+        point = EC_POINT_new(group);
+        x = BN_new();
+        assert(ctx != NULL && pubkey != NULL && point != NULL && x != NULL);
+    }
+
+    ~CVerifyContext()
+    {
+        BN_free(x);
+        EC_POINT_free(point);
+        EC_POINT_free(pubkey);
+        BN_CTX_free(ctx);
+    }
+};
+
+boost::thread_specific_ptr<CVerifyContext> verifycontext;
+
+CVerifyContext &GetContext()
+{
+    CVerifyContext *pcontext = verifycontext.get();
+    if (pcontext == NULL) {
+        pcontext = new CVerifyContext();
+        verifycontext.reset(pcontext);
+    }
+    return *pcontext;
+}
+
+// Read a DER length at pch, allowing the long form with any number of
+// leading zero bytes. Returns false if it runs past pend or does not fit.
+bool ParseLaxLength(const unsigned char *&pch, const unsigned char *pend, size_t &nLen)
+{
+    if (pch == pend)
+        return false;
+    unsigned int nLenByte = *pch++;
+    if (!(nLenByte & 0x80)) {
+        nLen = nLenByte;
+        return true;
+    }
+    nLenByte -= 0x80;
+    if (nLenByte > (size_t)(pend - pch))
+        return false;
+    while (nLenByte > 0 && *pch == 0) {
+        pch++;
+        nLenByte--;
+    }
+    if (nLenByte >= 4)
+        return false;
+    nLen = 0;
+    while (nLenByte > 0) {
+        nLen = (nLen << 8) + *pch++;
+        nLenByte--;
+    }
+    return true;
+}
+
+// Find one INTEGER at pch. Its contents are returned in pchInt/nIntLen
+// without the leading zero bytes.
+bool ParseLaxInteger(const unsigned char *&pch, const unsigned char *pend, const unsigned char *&pchInt, size_t &nIntLen)
+{
+    if (pch == pend || *pch != 0x02)
+        return false;
+    pch++;
+    // Only constructed types can have an indefinite length
+    if (pch == pend || *pch == 0x80)
+        return false;
+    if (!ParseLaxLength(pch, pend, nIntLen) || nIntLen > (size_t)(pend - pch))
+        return false;
+    pchInt = pch;
+    pch += nIntLen;
+    while (nIntLen > 0 && pchInt[0] == 0) {
+        pchInt++;
+        nIntLen--;
+    }
+    return true;
+}
+
+// Parse a signature the way OpenSSL did before it started to insist on DER
+// (1.0.0p/1.0.1k), that is d2i_ECDSA_SIG without the re-encoding check.
+// Blocks in the chain may contain such signatures, so this is what consensus
+// has to follow: BER long form lengths, superfluous zero bytes and trailing
+// data after the sequence are all accepted. A sequence of indefinite length
+// must end with an end-of-contents marker right after s. The integers are
+// read as unsigned, like OpenSSL's BIGNUM decoder does, so a missing zero
+// byte in front of a high bit is accepted too. Strict DER is only a relay
+// rule, see IsCanonicalSignature.
+// Returns false if the input cannot be parsed at all. Integers wider than
+// 256 bits leave r and s at zero, which never verifies.
+bool ParseLaxDERSignature(const unsigned char *pchSig, size_t nSigLen, BIGNUM *r, BIGNUM *s)
+{
+    if (pchSig == NULL || nSigLen == 0 || pchSig[0] != 0x30)
+        return false;
+    const unsigned char *pch = pchSig + 1;
+    const unsigned char *pend = pchSig + nSigLen;
+    const unsigned char *pseqend = pend;
+    bool fIndefinite = (pch != pend && *pch == 0x80);
+    if (fIndefinite)
+        pch++;
+    else {
+        size_t nSeqLen;
+        if (!ParseLaxLength(pch, pend, nSeqLen) || nSeqLen > (size_t)(pend - pch))
+            return false;
+        pseqend = pch + nSeqLen;
+    }
+
+    const unsigned char *pchR, *pchS;
+    size_t nLenR, nLenS;
+    if (!ParseLaxInteger(pch, pseqend, pchR, nLenR) ||
+        !ParseLaxInteger(pch, pseqend, pchS, nLenS))
+        return false;
+    if (fIndefinite) {
+        if (pend - pch < 2 || pch[0] != 0x00 || pch[1] != 0x00)
+            return false;
+    } else if (pch != pseqend)
+        return false;
+
+    BN_zero(r);
+    BN_zero(s);
+    if (nLenR > 32 || nLenS > 32)
+        return true;
+    return BN_bin2bn(pchR, nLenR, r) && BN_bin2bn(pchS, nLenS, s);
+}
+
+// 0 < n < order
+bool IsValidScalar(const BIGNUM *n)
+{
+    return !BN_is_zero(n) && !BN_is_negative(n) && BN_ucmp(n, GetGroup().order) < 0;
+}
+
+// Final step of a verification, given sinv = s^-1 mod order:
+// R = (hash * sinv) * G + (r * sinv) * Q, and check that R.x mod order == r.
+bool VerifyWithInverse(CVerifyContext &context, const uint256 &hash, const BIGNUM *r, const BIGNUM *sinv, const EC_POINT *pubkey)
+{
+    const CSecp256k1Group &secp256k1 = GetGroup();
+    BN_CTX *ctx = context.ctx;
+    bool fValid = false;
+
+    BN_CTX_start(ctx);
+    BIGNUM *m = BN_CTX_get(ctx);
+    BIGNUM *u1 = BN_CTX_get(ctx);
+    BIGNUM *u2 = BN_CTX_get(ctx);
+    if (u2 != NULL &&
+        BN_bin2bn((const unsigned char*)&hash, sizeof(hash), m) &&
+        BN_mod_mul(u1, m, sinv, secp256k1.order, ctx) &&
+        BN_mod_mul(u2, r, sinv, secp256k1.order, ctx) &&
+        EC_POINT_mul(secp256k1.group, context.point, u1, pubkey, u2, ctx) &&
+        EC_POINT_get_affine_coordinates_GFp(secp256k1.group, context.point, context.x, NULL, ctx) &&
+        BN_nnmod(u1, context.x, secp256k1.order, ctx))
+    {
+        fValid = (BN_ucmp(u1, r) == 0);
+    }
+    BN_CTX_end(ctx);
+    return fValid;
+}
+
+bool ParsePubKey(CVerifyContext &context, const unsigned char *pchPubKey, size_t nPubKeyLen, EC_POINT *point)
+{
+    if (pchPubKey == NULL || nPubKeyLen == 0)
+        return false;
+    // Rejects points that are not on the curve, like o2i_ECPublicKey
+    return EC_POINT_oct2point(GetGroup().group, point, pchPubKey, nPubKeyLen, context.ctx) == 1;
+}
+
+}; // end of anonymous namespace
+
+bool ECDSAVerify(const uint256 &hash, const unsigned char *pchSig, size_t nSigLen, const unsigned char *pchPubKey, size_t nPubKeyLen)
+{
+    CVerifyContext &context = GetContext();
+    BN_CTX *ctx = context.ctx;
+    bool fValid = false;
+
+    BN_CTX_start(ctx);
+    BIGNUM *r = BN_CTX_get(ctx);
+    BIGNUM *s = BN_CTX_get(ctx);
+    BIGNUM *sinv = BN_CTX_get(ctx);
+    if (sinv != NULL &&
+        ParsePubKey(context, pchPubKey, nPubKeyLen, context.pubkey) &&
+        ParseLaxDERSignature(pchSig, nSigLen, r, s) &&
+        IsValidScalar(r) && IsValidScalar(s) &&
+        BN_mod_inverse(sinv, s, GetGroup().order, ctx))
+    {
+        fValid = VerifyWithInverse(context, hash, r, sinv, context.pubkey);
+    }
+    BN_CTX_end(ctx);
+    return fValid;
+}
+
+bool ECDSAVerifyBatch(std::vector<CECDSAVerifyJob> &vJobs)
+{
+    CVerifyContext &context = GetContext();
+    BN_CTX *ctx = context.ctx;
+    const BIGNUM *order = GetGroup().order;
+    bool fAllValid = true;
+
+    BN_CTX_start(ctx);
+
+    // Parse all signatures; vR/vS/vProd are indexed like vParsed
+    std::vector<unsigned int> vParsed;
+    std::vector<BIGNUM*> vR, vS, vProd;
+    vParsed.reserve(vJobs.size());
+    for (unsigned int i = 0; i < vJobs.size(); i++) {
+        CECDSAVerifyJob &job = vJobs[i];
+        job.fValid = false;
+        BIGNUM *r = BN_CTX_get(ctx);
+        BIGNUM *s = BN_CTX_get(ctx);
+        BIGNUM *prod = BN_CTX_get(ctx);
+        if (prod == NULL)
+            break;
+        if (!ParseLaxDERSignature(job.pchSig, job.nSigLen, r, s) || !IsValidScalar(r) || !IsValidScalar(s))
+            continue;
+        // Running product of all s values so far
+        if (vProd.empty()) {
+            if (!BN_copy(prod, s))
+                continue;
+        } else if (!BN_mod_mul(prod, vProd.back(), s, order, ctx))
+            continue;
+        vParsed.push_back(i);
+        vR.push_back(r);
+        vS.push_back(s);
+        vProd.push_back(prod);
+    }
+
+    // One inversion of the product of all s values, from which every
+    // individual inverse follows with two multiplications.
+    BIGNUM *inv = BN_CTX_get(ctx);
+    BIGNUM *sinv = BN_CTX_get(ctx);
+    if (!vParsed.empty() && sinv != NULL && BN_mod_inverse(inv, vProd.back(), order, ctx)) {
+        for (int n = vParsed.size() - 1; n >= 0; n--) {
+            // inv = (s_0 * ... * s_n)^-1 here
+            if (n > 0) {
+                if (!BN_mod_mul(sinv, inv, vProd[n - 1], order, ctx) ||
+                    !BN_mod_mul(inv, inv, vS[n], order, ctx))
+                    break;
+            } else if (!BN_copy(sinv, inv))
+                break;
+
+            CECDSAVerifyJob &job = vJobs[vParsed[n]];
+            if (ParsePubKey(context, job.pchPubKey, job.nPubKeyLen, context.pubkey))
+                job.fValid = VerifyWithInverse(context, job.hash, vR[n], sinv, context.pubkey);
+        }
+    }
+
+    BN_CTX_end(ctx);
+
+    for (unsigned int i = 0; i < vJobs.size(); i++)
+        fAllValid &= vJobs[i].fValid;
+    return fAllValid;
+}
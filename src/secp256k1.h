@@ -0,0 +1,50 @@
+// Copyright (c) 2014 The Motocoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SECP256K1_H
+#define BITCOIN_SECP256K1_H
+
+#include <stddef.h>
+#include <vector>
+
+#include "uint256.h"
+
+/** ECDSA signature verification over secp256k1.
+ *
+ *  All threads share one curve object that carries a precomputed table of
+ *  multiples of the generator. Each thread keeps its own scratch space
+ *  (big numbers, points, parsed signature), so after the first call a thread
+ *  makes no per-signature setup allocations. Public keys are accepted under
+ *  the same rules as o2i_ECPublicKey (points on the curve), and signatures
+ *  under the lax rules of the OpenSSL versions that accepted BER encodings,
+ *  because this is used for block validation. Strict DER is enforced for
+ *  relay only, by IsCanonicalSignature.
+ */
+
+/** One signature check, for use with ECDSAVerifyBatch */
+struct CECDSAVerifyJob
+{
+    uint256 hash;
+    const unsigned char *pchSig;
+    size_t nSigLen;
+    const unsigned char *pchPubKey;
+    size_t nPubKeyLen;
+
+    // Result, filled in by ECDSAVerifyBatch
+    bool fValid;
+
+    CECDSAVerifyJob() : hash(0), pchSig(NULL), nSigLen(0), pchPubKey(NULL), nPubKeyLen(0), fValid(false) {}
+    CECDSAVerifyJob(const uint256 &hashIn, const unsigned char *pchSigIn, size_t nSigLenIn, const unsigned char *pchPubKeyIn, size_t nPubKeyLenIn) :
+        hash(hashIn), pchSig(pchSigIn), nSigLen(nSigLenIn), pchPubKey(pchPubKeyIn), nPubKeyLen(nPubKeyLenIn), fValid(false) {}
+};
+
+/** Check a DER encoded signature (without hash type byte) of hash against a serialized public key */
+bool ECDSAVerify(const uint256 &hash, const unsigned char *pchSig, size_t nSigLen, const unsigned char *pchPubKey, size_t nPubKeyLen);
+
+/** Check many signatures at once, under the same rules as ECDSAVerify,
+ *  setting fValid on every job. The modular inversions of all signatures are
+ *  shared (Montgomery's trick), so this is cheaper than calling ECDSAVerify
+ *  for each of them. Returns true if all signatures are valid. */
+bool ECDSAVerifyBatch(std::vector<CECDSAVerifyJob> &vJobs);
+
+#endif // BITCOIN_SECP256K1_H
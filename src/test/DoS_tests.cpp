@@ -15,12 +15,6 @@
 
 #include <stdint.h>
 
-// Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-extern std::map<uint256, CTransaction> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
-
 CService ip(uint32_t i)
 {
     struct in_addr s;
@@ -131,13 +125,21 @@ BOOST_AUTO_TEST_CASE(DoS_checknbits)
     BOOST_CHECK(CheckNBits(firstcheck.second, lastcheck.first+60*60*24*365*4, lastcheck.second, lastcheck.first));
 }
 
-CTransaction RandomOrphan()
+CTransaction RandomOrphan(const std::vector<CTransaction>& vOrphans)
+{
+    return vOrphans[GetRand(vOrphans.size())];
+}
+
+CTransaction SmallOrphan(const uint256& hashPrev)
 {
-    std::map<uint256, CTransaction>::iterator it;
-    it = mapOrphanTransactions.lower_bound(GetRandHash());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second;
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].prevout.hash = hashPrev;
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    return tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -146,6 +148,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     key.MakeNewKey(true);
     CBasicKeyStore keystore;
     keystore.AddKey(key);
+    std::vector<CTransaction> vOrphans;
 
     // 50 orphan transactions:
     for (int i = 0; i < 50; i++)
@@ -159,13 +162,14 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx);
+        BOOST_CHECK(orphanTxPool.Add(tx, i % 3));
+        vOrphans.push_back(tx);
     }
 
     // ... and 50 that depend on other orphans:
     for (int i = 0; i < 50; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransaction txPrev = RandomOrphan(vOrphans);
 
         CTransaction tx;
         tx.vin.resize(1);
@@ -176,13 +180,20 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0);
 
-        AddOrphanTx(tx);
+        BOOST_CHECK(orphanTxPool.Add(tx, i % 3));
+        vOrphans.push_back(tx);
+
+        // The parent finds its new child
+        std::vector<uint256> vChildren;
+        orphanTxPool.GetChildren(txPrev.GetHash(), vChildren);
+        BOOST_CHECK(std::find(vChildren.begin(), vChildren.end(), tx.GetHash()) != vChildren.end());
     }
+    BOOST_CHECK(!orphanTxPool.Add(vOrphans[0], 0));
 
     // This really-big orphan should be ignored:
     for (int i = 0; i < 10; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransaction txPrev = RandomOrphan(vOrphans);
 
         CTransaction tx;
         tx.vout.resize(1);
@@ -200,17 +211,86 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx));
+        BOOST_CHECK(!orphanTxPool.Add(tx, 0));
+    }
+
+    // Test COrphanTxPool::Limit():
+    orphanTxPool.SetLimits(40, DEFAULT_MAX_ORPHAN_TX_SIZE << 20);
+    orphanTxPool.Limit();
+    BOOST_CHECK(orphanTxPool.Count() <= 40);
+    orphanTxPool.SetLimits(10, DEFAULT_MAX_ORPHAN_TX_SIZE << 20);
+    orphanTxPool.Limit();
+    BOOST_CHECK(orphanTxPool.Count() <= 10);
+    orphanTxPool.SetLimits(0, DEFAULT_MAX_ORPHAN_TX_SIZE << 20);
+    orphanTxPool.Limit();
+    BOOST_CHECK_EQUAL(orphanTxPool.Count(), 0U);
+    BOOST_CHECK_EQUAL(orphanTxPool.Size(), 0U);
+    BOOST_CHECK_EQUAL(orphanTxPool.PeerSize(0), 0U);
+    BOOST_FOREACH(const CTransaction& tx, vOrphans)
+    {
+        std::vector<uint256> vChildren;
+        orphanTxPool.GetChildren(tx.GetHash(), vChildren);
+        BOOST_CHECK(vChildren.empty());
+    }
+    orphanTxPool.SetLimits(MAX_ORPHAN_TRANSACTIONS, DEFAULT_MAX_ORPHAN_TX_SIZE << 20);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_orphanPoolFairness)
+{
+    // Peer 1 floods, peer 2 sends a few
+    std::vector<CTransaction> vFlood, vFew;
+    for (int i = 0; i < 30; i++)
+    {
+        vFlood.push_back(SmallOrphan(GetRandHash()));
+        BOOST_CHECK(orphanTxPool.Add(vFlood.back(), 1));
+    }
+    for (int i = 0; i < 5; i++)
+    {
+        vFew.push_back(SmallOrphan(GetRandHash()));
+        BOOST_CHECK(orphanTxPool.Add(vFew.back(), 2));
     }
+    unsigned int nTxSize = ::GetSerializeSize(vFew[0], SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK_EQUAL(orphanTxPool.Size(), 35 * nTxSize);
+    BOOST_CHECK_EQUAL(orphanTxPool.PeerSize(2), 5 * nTxSize);
+
+    // Over the byte budget, only the flooding peer loses orphans, oldest first
+    orphanTxPool.SetLimits(MAX_ORPHAN_TRANSACTIONS, 20 * nTxSize);
+    BOOST_CHECK_EQUAL(orphanTxPool.Limit(), 15U);
+    BOOST_CHECK(orphanTxPool.Size() <= 20 * nTxSize);
+    BOOST_CHECK_EQUAL(orphanTxPool.PeerSize(1), 15 * nTxSize);
+    BOOST_FOREACH(const CTransaction& tx, vFew)
+        BOOST_CHECK(orphanTxPool.Exists(tx.GetHash()));
+
+    // Once both hold as much, both lose
+    orphanTxPool.SetLimits(MAX_ORPHAN_TRANSACTIONS, 8 * nTxSize);
+    orphanTxPool.Limit();
+    BOOST_CHECK_EQUAL(orphanTxPool.PeerSize(1), 4 * nTxSize);
+    BOOST_CHECK_EQUAL(orphanTxPool.PeerSize(2), 4 * nTxSize);
+
+    orphanTxPool.SetLimits(MAX_ORPHAN_TRANSACTIONS, DEFAULT_MAX_ORPHAN_TX_SIZE << 20);
+    orphanTxPool.Clear();
+}
 
-    // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
-    BOOST_CHECK(mapOrphanTransactions.empty());
-    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+BOOST_AUTO_TEST_CASE(DoS_orphanPoolExpiry)
+{
+    int64 nStart = GetTime();
+    SetMockTime(nStart);
+    CTransaction txOld = SmallOrphan(GetRandHash());
+    BOOST_CHECK(orphanTxPool.Add(txOld, 1));
+    SetMockTime(nStart + ORPHAN_TX_EXPIRE_TIME / 2);
+    CTransaction txNew = SmallOrphan(GetRandHash());
+    BOOST_CHECK(orphanTxPool.Add(txNew, 1));
+
+    BOOST_CHECK_EQUAL(orphanTxPool.Limit(), 0U);
+    SetMockTime(nStart + ORPHAN_TX_EXPIRE_TIME);
+    BOOST_CHECK_EQUAL(orphanTxPool.Limit(), 1U);
+    BOOST_CHECK(!orphanTxPool.Exists(txOld.GetHash()));
+    BOOST_CHECK(orphanTxPool.Exists(txNew.GetHash()));
+
+    BOOST_CHECK(orphanTxPool.Erase(txNew.GetHash()));
+    BOOST_CHECK(!orphanTxPool.Erase(txNew.GetHash()));
+    BOOST_CHECK_EQUAL(orphanTxPool.Count(), 0U);
+    SetMockTime(0);
 }
 
 BOOST_AUTO_TEST_CASE(DoS_checkSig)
@@ -236,8 +316,6 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
         tx.vout.resize(1);
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
-
-        AddOrphanTx(tx);
     }
 
     // Create a transaction that depends on orphans:
@@ -287,17 +365,38 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
     BOOST_CHECK(!VerifySignature(CCoins(orphans[1], MEMPOOL_HEIGHT), tx, 1, flags, SIGHASH_ALL));
     std::swap(tx.vin[0].scriptSig, tx.vin[1].scriptSig);
 
-    // Exercise -maxsigcachesize code:
-    mapArgs["-maxsigcachesize"] = "10";
-    // Generate a new, different signature for vin[0] to trigger cache clear:
-    CScript oldSig = tx.vin[0].scriptSig;
-    BOOST_CHECK(SignSignature(keystore, orphans[0], tx, 0));
-    BOOST_CHECK(tx.vin[0].scriptSig != oldSig);
-    for (unsigned int j = 0; j < tx.vin.size(); j++)
-        BOOST_CHECK(VerifySignature(CCoins(orphans[j], MEMPOOL_HEIGHT), tx, j, flags, SIGHASH_ALL));
-    mapArgs.erase("-maxsigcachesize");
+    // Exercise the cache size options, with a cache too small to hold all
+    // signatures and with the cache turned off:
+    const char *pszSizes[][2] = {{"-maxsigcachesize", "1"}, {"-sigcachesize", "0"}, {"-maxsigcachesize", "0"}};
+    for (unsigned int i = 0; i < sizeof(pszSizes) / sizeof(pszSizes[0]); i++) {
+        mapArgs[pszSizes[i][0]] = pszSizes[i][1];
+        BOOST_CHECK_EQUAL(InitSignatureCache(), i == 0 ? 64 * sizeof(uint256) : 0);
+        // Generate a new, different signature for vin[0]:
+        CScript oldSig = tx.vin[0].scriptSig;
+        BOOST_CHECK(SignSignature(keystore, orphans[0], tx, 0));
+        BOOST_CHECK(tx.vin[0].scriptSig != oldSig);
+        for (unsigned int j = 0; j < tx.vin.size(); j++) {
+            BOOST_CHECK(VerifySignature(CCoins(orphans[j], MEMPOOL_HEIGHT), tx, j, flags, SIGHASH_ALL));
+            BOOST_CHECK(VerifySignature(CCoins(orphans[j], MEMPOOL_HEIGHT), tx, j, flags, SIGHASH_ALL));
+        }
+        mapArgs.erase(pszSizes[i][0]);
+    }
 
-    LimitOrphanTxSize(0);
+    // Entry counts from old configuration files are converted, not taken as
+    // megabytes, and everything is clamped
+    mapArgs["-maxsigcachesize"] = "50000";
+    BOOST_CHECK_EQUAL(InitSignatureCache(), 49984 * sizeof(uint256));
+    mapArgs["-maxsigcachesize"] = "1000000000000";
+    BOOST_CHECK_EQUAL(InitSignatureCache(), (size_t)MAX_SIG_CACHE_SIZE << 20);
+    mapArgs["-sigcachesize"] = "2";
+    BOOST_CHECK_EQUAL(InitSignatureCache(), (size_t)2 << 20);
+    mapArgs["-sigcachesize"] = "1000000000000";
+    BOOST_CHECK_EQUAL(InitSignatureCache(), (size_t)MAX_SIG_CACHE_SIZE << 20);
+    mapArgs["-sigcachesize"] = "-1";
+    BOOST_CHECK_EQUAL(InitSignatureCache(), 0U);
+    mapArgs.erase("-sigcachesize");
+    mapArgs.erase("-maxsigcachesize");
+    BOOST_CHECK_EQUAL(InitSignatureCache(), (size_t)DEFAULT_SIG_CACHE_SIZE << 20);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,95 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+#include "key.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(addrindex_tests)
+
+BOOST_AUTO_TEST_CASE(addrindex_key_order)
+{
+    // Serialized keys must sort like the keys themselves, so that the
+    // database returns the entries of a script by height
+    uint160 hashScript = Hash160(ParseHex("76a914"));
+    uint256 txid = GetRandHash();
+    int heights[] = { 0, 1, 255, 256, 65536, 0x1000000 };
+    for (unsigned int i = 1; i < sizeof(heights)/sizeof(heights[0]); i++) {
+        CDataStream ssA(SER_DISK, CLIENT_VERSION), ssB(SER_DISK, CLIENT_VERSION);
+        CAddrIndexKey a(hashScript, heights[i-1], txid, 0), b(hashScript, heights[i], txid, 0);
+        ssA << a;
+        ssB << b;
+        BOOST_CHECK(a < b);
+        BOOST_CHECK(ssA.str() < ssB.str());
+
+        CAddrIndexKey c;
+        ssB >> c;
+        BOOST_CHECK(c.nHeight == heights[i] && c.txid == txid && c.hashScript == hashScript);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(addrindex_script_hash)
+{
+    // Outputs paying to a public key are found under its address
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptPubKey, scriptAddress;
+    scriptPubKey << key.GetPubKey() << OP_CHECKSIG;
+    scriptAddress.SetDestination(key.GetPubKey().GetID());
+    BOOST_CHECK(GetAddrIndexHash(scriptPubKey) == GetAddrIndexHash(scriptAddress));
+
+    CScript scriptOther;
+    scriptOther << OP_1;
+    BOOST_CHECK(GetAddrIndexHash(scriptOther) == Hash160(scriptOther.begin(), scriptOther.end()));
+}
+
+BOOST_AUTO_TEST_CASE(addrindex_db)
+{
+    uint160 hashScript = Hash160(GetRandHash().begin(), GetRandHash().end());
+    CDiskTxPos pos(CDiskBlockPos(0, 8), 1);
+
+    CAddrIndexUpdate update;
+    for (int i = 0; i < 10; i++) {
+        CAddrIndexValue value(pos, i * COIN);
+        if (i % 2)
+            value.SetSpent(GetRandHash(), 0, 10 + i);
+        update.Set(CAddrIndexKey(hashScript, 10 - i, GetRandHash(), i), value);
+    }
+    BOOST_CHECK(pblocktree->WriteAddrIndex(update));
+
+    // All entries, by height
+    vector<pair<CAddrIndexKey, CAddrIndexValue> > vEntries;
+    BOOST_CHECK(pblocktree->ReadAddrIndex(hashScript, false, 0, 100, vEntries));
+    BOOST_CHECK_EQUAL(vEntries.size(), 10U);
+    for (unsigned int i = 0; i < vEntries.size(); i++) {
+        BOOST_CHECK_EQUAL(vEntries[i].first.nHeight, (int)i + 1);
+        BOOST_CHECK_EQUAL(vEntries[i].second.nValue, (9 - (int)i) * COIN);
+    }
+
+    // Pages of unspent entries
+    BOOST_CHECK(pblocktree->ReadAddrIndex(hashScript, true, 1, 2, vEntries));
+    BOOST_CHECK_EQUAL(vEntries.size(), 2U);
+    BOOST_CHECK_EQUAL(vEntries[0].first.nHeight, 4);
+    BOOST_CHECK_EQUAL(vEntries[1].first.nHeight, 6);
+    BOOST_CHECK(pblocktree->ReadAddrIndex(hashScript, true, 4, 2, vEntries));
+    BOOST_CHECK_EQUAL(vEntries.size(), 1U);
+
+    // Pending changes take precedence over the database
+    CAddrIndexKey key = vEntries[0].first;
+    CAddrIndexUpdate update2;
+    CAddrIndexValue value;
+    BOOST_CHECK(update2.Get(key, value) && !value.IsSpent());
+    value.SetSpent(GetRandHash(), 1, 20);
+    update2.Set(key, value);
+    BOOST_CHECK(update2.Get(key, value) && value.IsSpent());
+    update2.Erase(key);
+    BOOST_CHECK(!update2.Get(key, value));
+    BOOST_CHECK(pblocktree->WriteAddrIndex(update2));
+    BOOST_CHECK(!pblocktree->ReadAddrIndex(key, value));
+    BOOST_CHECK(pblocktree->ReadAddrIndex(hashScript, false, 0, 100, vEntries));
+    BOOST_CHECK_EQUAL(vEntries.size(), 9U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -63,4 +63,68 @@ BOOST_AUTO_TEST_CASE(May15)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(PoWInputs)
+{
+    MotoPoW pow;
+    motoInitPoW(&pow);
+    pow.NumFrames = 100;
+    pow.NumUpdates = 2;
+    pow.Updates[0] = 10*12 + MOTO_GAS_RIGHT;
+    pow.Updates[1] = 20*12 + MOTO_ROTATE_CW*4 + MOTO_GAS_RIGHT;
+    BOOST_CHECK(motoCheckInputs(&pow));
+
+    // Input that changes nothing
+    pow.Updates[1] = 20*12 + MOTO_GAS_RIGHT;
+    BOOST_CHECK(!motoCheckInputs(&pow));
+    pow.Updates[1] = 20*12 + MOTO_BRAKE;
+    BOOST_CHECK(motoCheckInputs(&pow));
+
+    // Input after the last frame
+    pow.Updates[1] = 90*12 + MOTO_BRAKE;
+    BOOST_CHECK(!motoCheckInputs(&pow));
+
+    pow.Updates[1] = 20*12 + MOTO_BRAKE;
+    pow.NumUpdates = MOTO_MAX_INPUTS + 1;
+    BOOST_CHECK(!motoCheckInputs(&pow));
+    pow.NumUpdates = 2;
+    pow.NumFrames = 0;
+    BOOST_CHECK(!motoCheckInputs(&pow));
+    pow.NumFrames = MOTO_MAX_FRAMES + 11;
+    BOOST_CHECK(!motoCheckInputs(&pow));
+}
+
+BOOST_AUTO_TEST_CASE(HeaderChecks)
+{
+    // A header with an unknown parent passes the cheap checks without a replay
+    CBlockHeader header;
+    header.hashPrevBlock = GetRandHash();
+    header.nTime = GetAdjustedTime();
+    header.nBits = 100;
+    header.Nonce.NumFrames = 50;
+    header.Nonce.NumUpdates = 1;
+    header.Nonce.Updates[0] = 10*12 + MOTO_GAS_LEFT;
+
+    CValidationState state;
+    BOOST_CHECK(CheckBlockHeader(header, state));
+
+    // Slower than the target
+    header.Nonce.NumFrames = 101;
+    int nDoS = 0;
+    BOOST_CHECK(!CheckBlockHeader(header, state));
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 50);
+    header.Nonce.NumFrames = 50;
+
+    // Not enough hash work
+    header.nBits = 0x01010064;
+    state = CValidationState();
+    BOOST_CHECK(!CheckBlockHeader(header, state));
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 50);
+    header.nBits = 100;
+
+    state = CValidationState();
+    header.nTime = GetAdjustedTime() + 3 * 60 * 60;
+    BOOST_CHECK(!CheckBlockHeader(header, state));
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
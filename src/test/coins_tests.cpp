@@ -0,0 +1,331 @@
+#include <map>
+
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+
+namespace
+{
+// In-memory backing store that records how often it was written to.
+// Like the database, it may be read while a background write is going on.
+class CCoinsViewTest : public CCoinsView
+{
+public:
+    CCriticalSection cs;
+    std::map<uint256, CCoins> mapCoins;
+    CBlockIndex *pindexBest;
+    unsigned int nWrites;
+    unsigned int nReads;
+    // Entries written with the version they replace, and how many of those
+    // versions were not the one here
+    unsigned int nBase;
+    unsigned int nBaseWrong;
+
+    CCoinsViewTest() : pindexBest(NULL), nWrites(0), nReads(0), nBase(0), nBaseWrong(0) {}
+
+    bool GetCoins(const uint256 &txid, CCoins &coins) {
+        LOCK(cs);
+        nReads++;
+        std::map<uint256, CCoins>::iterator it = mapCoins.find(txid);
+        if (it == mapCoins.end())
+            return false;
+        coins = it->second;
+        return true;
+    }
+
+    bool HaveCoins(const uint256 &txid) {
+        LOCK(cs);
+        return mapCoins.count(txid) > 0;
+    }
+
+    CBlockIndex *GetBestBlock() { return pindexBest; }
+
+    bool BatchWrite(CCoinsMap &mapIn, CBlockIndex *pindex) {
+        LOCK(cs);
+        for (CCoinsMap::iterator it = mapIn.begin(); it != mapIn.end(); it++) {
+            if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+                continue;
+            if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned())
+                continue;
+            nWrites++;
+            if (it->second.flags & CCoinsCacheEntry::BASE) {
+                nBase++;
+                std::map<uint256, CCoins>::iterator itOld = mapCoins.find(it->first);
+                if (itOld == mapCoins.end() || !(itOld->second == it->second.coinsBase))
+                    nBaseWrong++;
+            }
+            if (it->second.coins.IsPruned())
+                mapCoins.erase(it->first);
+            else
+                mapCoins[it->first] = it->second.coins;
+        }
+        pindexBest = pindex;
+        return true;
+    }
+};
+
+CCoins MakeCoins(int64 nValue)
+{
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.nHeight = 1;
+    coins.vout.resize(1);
+    coins.vout[0].nValue = nValue;
+    coins.vout[0].scriptPubKey << OP_TRUE;
+    return coins;
+}
+}
+
+BOOST_AUTO_TEST_SUITE(coins_tests)
+
+BOOST_AUTO_TEST_CASE(coins_cache_fresh_spent)
+{
+    CCoinsViewTest base;
+    uint256 txid = GetRandHash();
+    {
+        CCoinsViewCache cache(base);
+        cache.SetCoins(txid, MakeCoins(50), true);
+        CTxInUndo undo;
+        BOOST_CHECK(cache.GetCoins(txid).Spend(COutPoint(txid, 0), undo));
+        BOOST_CHECK(cache.Flush());
+    }
+    // Created and spent before the flush: the backing store never hears of it
+    BOOST_CHECK_EQUAL(base.nWrites, 0U);
+    BOOST_CHECK_EQUAL(base.nReads, 0U);
+    BOOST_CHECK(!base.HaveCoins(txid));
+
+    // Without the hint the cache does not look the txid up either, and lets
+    // the store know about the spend
+    uint256 txid2 = GetRandHash();
+    base.mapCoins[txid2] = MakeCoins(10);
+    {
+        CCoinsViewCache cache(base);
+        cache.SetCoins(txid2, MakeCoins(50));
+        BOOST_CHECK_EQUAL(base.nReads, 0U);
+        CTxInUndo undo;
+        BOOST_CHECK(cache.GetCoins(txid2).Spend(COutPoint(txid2, 0), undo));
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK_EQUAL(base.nWrites, 1U);
+    BOOST_CHECK(!base.HaveCoins(txid2));
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_read_only)
+{
+    CCoinsViewTest base;
+    uint256 txid = GetRandHash();
+    base.mapCoins[txid] = MakeCoins(50);
+    {
+        CCoinsViewCache cache(base);
+        BOOST_CHECK(cache.HaveCoins(txid));
+        BOOST_CHECK_EQUAL(cache.AccessCoins(txid).vout[0].nValue, 50);
+        CCoins coins;
+        BOOST_CHECK(cache.GetCoins(txid, coins));
+        BOOST_CHECK(cache.Flush());
+    }
+    // Looking at coins does not make them dirty
+    BOOST_CHECK_EQUAL(base.nWrites, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_layers)
+{
+    CCoinsViewTest base;
+    std::map<uint256, CCoins> mapExpected;
+    std::vector<uint256> vTxids;
+    for (int i = 0; i < 40; i++) {
+        uint256 txid = GetRandHash();
+        vTxids.push_back(txid);
+        if (i % 2 == 0) {
+            base.mapCoins[txid] = MakeCoins(i);
+            mapExpected[txid] = MakeCoins(i);
+        }
+    }
+
+    CCoinsViewCache cacheTop(base);
+    for (int nRound = 0; nRound < 4; nRound++) {
+        CCoinsViewCache cache(cacheTop);
+        for (unsigned int i = nRound; i < vTxids.size(); i += 3) {
+            const uint256 &txid = vTxids[i];
+            if (mapExpected.count(txid)) {
+                CTxInUndo undo;
+                BOOST_CHECK(cache.GetCoins(txid).Spend(COutPoint(txid, 0), undo));
+                mapExpected.erase(txid);
+            } else {
+                cache.SetCoins(txid, MakeCoins(1000 + i));
+                mapExpected[txid] = MakeCoins(1000 + i);
+            }
+        }
+        BOOST_CHECK(cache.Flush());
+        if (nRound % 2 == 1)
+            BOOST_CHECK(cacheTop.Flush());
+    }
+    BOOST_CHECK(cacheTop.Flush());
+
+    // Spent coins reach the store along with the version they replace
+    BOOST_CHECK(base.nBase > 0);
+    BOOST_CHECK_EQUAL(base.nBaseWrong, 0U);
+
+    BOOST_CHECK_EQUAL(base.mapCoins.size(), mapExpected.size());
+    BOOST_FOREACH(const uint256 &txid, vTxids) {
+        CCoins coins;
+        bool fHave = base.GetCoins(txid, coins);
+        BOOST_CHECK_EQUAL(fHave, mapExpected.count(txid) > 0);
+        if (fHave)
+            BOOST_CHECK(coins == mapExpected[txid]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_usage_trim)
+{
+    CCoinsViewTest base;
+    std::vector<uint256> vTxids;
+    for (int i = 0; i < 100; i++) {
+        vTxids.push_back(GetRandHash());
+        base.mapCoins[vTxids.back()] = MakeCoins(i);
+    }
+
+    CCoinsViewCache cache(base);
+    size_t nEmpty = cache.DynamicMemoryUsage();
+    BOOST_FOREACH(const uint256 &txid, vTxids)
+        BOOST_CHECK(cache.HaveCoins(txid));
+    size_t nFull = cache.DynamicMemoryUsage();
+    BOOST_CHECK(nFull > nEmpty);
+
+    // Modifying coins through a reference is picked up by the accounting
+    CCoins &coins = cache.GetCoins(vTxids[0]);
+    coins.vout.resize(50, coins.vout[0]);
+    BOOST_CHECK(cache.DynamicMemoryUsage() > nFull);
+
+    // Touch the first half again, so the second half is least recently used
+    for (int i = 0; i < 50; i++)
+        cache.AccessCoins(vTxids[i]);
+    cache.Trim(0);
+    // Only the modified entry survives
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1U);
+
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(cache.HaveCoins(vTxids[i]));
+    size_t nPerEntry = (cache.DynamicMemoryUsage() - nEmpty) / 100;
+    cache.AccessCoins(vTxids[10]);
+    cache.Trim(cache.DynamicMemoryUsage() - 20 * nPerEntry);
+    BOOST_CHECK(cache.GetCacheSize() < 100U);
+    BOOST_CHECK(cache.GetCacheSize() > 60U);
+    // The recently touched entry is kept, the oldest loaded one is gone
+    unsigned int nSize = cache.GetCacheSize();
+    cache.AccessCoins(vTxids[10]);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), nSize);
+    cache.AccessCoins(vTxids[1]);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), nSize + 1);
+
+    // Flushing writes the modified entry only, and keeps the rest cached
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(base.nWrites, 1U);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), nSize);
+    BOOST_CHECK_EQUAL(base.mapCoins[vTxids[0]].vout.size(), 50U);
+}
+
+BOOST_AUTO_TEST_CASE(coins_background_flush)
+{
+    CCoinsViewTest base;
+    std::map<uint256, CCoins> mapExpected;
+    {
+        CCoinsViewBackgroundFlush writer(base);
+        CCoinsViewCache cache(writer);
+        for (int nRound = 0; nRound < 10; nRound++) {
+            for (int i = 0; i < 20; i++) {
+                uint256 txid = GetRandHash();
+                cache.SetCoins(txid, MakeCoins(i));
+                mapExpected[txid] = MakeCoins(i);
+            }
+            BOOST_CHECK(cache.Flush());
+            // Whatever is still in flight remains readable through the writer
+            for (std::map<uint256, CCoins>::iterator it = mapExpected.begin(); it != mapExpected.end(); it++) {
+                CCoins coins;
+                BOOST_CHECK(writer.GetCoins(it->first, coins));
+                BOOST_CHECK(coins == it->second);
+            }
+        }
+        BOOST_CHECK(writer.Sync());
+    }
+    BOOST_CHECK(base.mapCoins == mapExpected);
+}
+
+BOOST_AUTO_TEST_CASE(coins_muhash)
+{
+    uint256 a = GetRandHash(), b = GetRandHash(), c = GetRandHash();
+    CMuHash3072 empty, abc, cab, ab;
+    abc.Insert(a); abc.Insert(b); abc.Insert(c);
+    cab.Insert(c); cab.Insert(a); cab.Insert(b);
+    ab.Insert(a); ab.Insert(b);
+    BOOST_CHECK(abc.GetHash() == cab.GetHash());
+    BOOST_CHECK(abc.GetHash() != ab.GetHash());
+
+    // Removing is undoing, whatever the order
+    cab.Remove(c);
+    BOOST_CHECK(cab.GetHash() == ab.GetHash());
+    ab.Remove(a); ab.Remove(b);
+    BOOST_CHECK(ab.GetHash() == empty.GetHash());
+    CMuHash3072 early;
+    early.Remove(a);
+    early.Insert(a);
+    BOOST_CHECK(early.GetHash() == empty.GetHash());
+
+    // The state survives serialization
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << abc;
+    CMuHash3072 abc2;
+    ss >> abc2;
+    BOOST_CHECK(abc2.GetHash() == abc.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_stats)
+{
+    CCoinsViewDB db(1 << 20, true);
+    std::vector<uint256> vTxids;
+    for (int nRound = 0; nRound < 4; nRound++) {
+        CCoinsViewCache cache(db);
+        // New coins with a few outputs each
+        for (int i = 0; i < 20; i++) {
+            CCoins coins = MakeCoins(100 * nRound + i);
+            coins.vout.resize(1 + i % 4, coins.vout[0]);
+            coins.nHeight = nRound;
+            vTxids.push_back(GetRandHash());
+            cache.SetCoins(vTxids.back(), coins, true);
+        }
+        // Spend some outputs of earlier ones, and replace one as a whole
+        for (unsigned int i = nRound; i < vTxids.size(); i += 5) {
+            CCoins &coins = cache.GetCoins(vTxids[i]);
+            CTxInUndo undo;
+            for (unsigned int n = 0; n < coins.vout.size(); n += 2)
+                coins.Spend(COutPoint(vTxids[i], n), undo);
+        }
+        cache.SetCoins(vTxids[nRound], MakeCoins(7));
+        BOOST_CHECK(cache.Flush());
+
+        // The running statistics match a count of the whole database
+        CCoinsStats stats, statsScan;
+        BOOST_CHECK(db.GetStats(stats));
+        BOOST_CHECK(db.ScanStats(statsScan));
+        BOOST_CHECK(stats.nTransactions > 0);
+        BOOST_CHECK_EQUAL(stats.nTransactions, statsScan.nTransactions);
+        BOOST_CHECK_EQUAL(stats.nTransactionOutputs, statsScan.nTransactionOutputs);
+        BOOST_CHECK_EQUAL(stats.nSerializedSize, statsScan.nSerializedSize);
+        BOOST_CHECK_EQUAL(stats.nTotalAmount, statsScan.nTotalAmount);
+        BOOST_CHECK(stats.hashSet.GetHash() == statsScan.hashSet.GetHash());
+    }
+
+    // Coins set without the version they replace are counted again
+    {
+        CCoinsViewCache cache(db);
+        cache.SetCoins(vTxids[1], MakeCoins(8));
+        BOOST_CHECK(cache.Flush());
+    }
+    CCoinsStats stats, statsScan;
+    BOOST_CHECK(db.GetStats(stats));
+    BOOST_CHECK(db.ScanStats(statsScan));
+    BOOST_CHECK_EQUAL(stats.nTotalAmount, statsScan.nTotalAmount);
+    BOOST_CHECK(stats.hashSet.GetHash() == statsScan.hashSet.GetHash());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
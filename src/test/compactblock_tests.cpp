@@ -0,0 +1,70 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(compactblock_tests)
+
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Reference SipHash-2-4 output for the key 00..0f and the message 00..1f
+    uint256 val("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, val), 0x7127512f72f27cceULL);
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_roundtrip)
+{
+    CBlock block;
+    block.nTime = 1400615000;
+    for (unsigned int i = 0; i < 20; i++) {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CCompactBlock cmpctblock(block);
+    BOOST_CHECK(cmpctblock.header.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(cmpctblock.GetTxCount(), block.vtx.size());
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilled.size(), 1U);
+    BOOST_CHECK(cmpctblock.vPrefilled[0].nIndex == 0 && cmpctblock.vPrefilled[0].tx.GetHash() == block.vtx[0].GetHash());
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    BOOST_CHECK_EQUAL(ss.size(), cmpctblock.GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_CHECK(ss.size() < ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+
+    CCompactBlock cmpctblock2;
+    ss >> cmpctblock2;
+    BOOST_CHECK(cmpctblock2.header.GetHash() == block.GetHash());
+    BOOST_CHECK(cmpctblock2.nNonce == cmpctblock.nNonce);
+    BOOST_CHECK(cmpctblock2.vShortIds == cmpctblock.vShortIds);
+
+    // The receiver derives the same short ids from the transactions it has
+    uint64 k0, k1;
+    cmpctblock2.GetShortIdKeys(k0, k1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++) {
+        BOOST_CHECK(cmpctblock2.vShortIds[i - 1] == CCompactBlock::GetShortId(k0, k1, block.vtx[i].GetHash()));
+        BOOST_CHECK(cmpctblock2.vShortIds[i - 1] >> 48 == 0);
+    }
+
+    // A new nonce gives new short ids
+    CCompactBlock cmpctblock3(block);
+    BOOST_CHECK(cmpctblock3.vShortIds != cmpctblock.vShortIds);
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_bad_size)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CBlockHeader() << (uint64)0;
+    WriteCompactSize(ss, MAX_BLOCK_SIZE);
+    CCompactBlock cmpctblock;
+    BOOST_CHECK_THROW(ss >> cmpctblock, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
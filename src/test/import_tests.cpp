@@ -0,0 +1,58 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+static void WriteBlock(CAutoFile &file, const CBlock &block)
+{
+    file << FLATDATA(pchMessageStart) << (unsigned int)::GetSerializeSize(block, SER_DISK, CLIENT_VERSION) << block;
+}
+
+BOOST_AUTO_TEST_SUITE(import_tests)
+
+BOOST_AUTO_TEST_CASE(import_pipeline)
+{
+    CBlock genesis;
+    BOOST_CHECK(genesis.ReadFromDisk(pindexGenesisBlock));
+
+    // Blocks that must not get in: well-formed proofs of play that fail the
+    // replay, on top of the genesis block or of an unknown parent
+    vector<CBlock> vBad;
+    for (int i = 0; i < 20; i++) {
+        CBlock block = genesis;
+        block.hashPrevBlock = i % 2 ? genesis.GetHash() : GetRandHash();
+        block.nTime = genesis.nTime + i + 1;
+        block.nBits = 1000;
+        motoInitPoW(&block.Nonce);
+        block.Nonce.Nonce = i;
+        block.Nonce.NumFrames = 1000;
+        BOOST_CHECK(block.CheckPoWFast());
+        vBad.push_back(block);
+    }
+
+    boost::filesystem::path path = GetDataDir() / "import_test.dat";
+    {
+        CAutoFile file(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        const char junk[] = "junk between blocks";
+        file << FLATDATA(junk);
+        WriteBlock(file, genesis);
+        BOOST_FOREACH(const CBlock &block, vBad) {
+            WriteBlock(file, block);
+            file << FLATDATA(junk);
+        }
+        // A record that claims more data than there is
+        file << FLATDATA(pchMessageStart) << (unsigned int)1000 << FLATDATA(junk);
+    }
+
+    int nHeight = nBestHeight;
+    BOOST_CHECK(!LoadExternalBlockFile(fopen(path.string().c_str(), "rb")));
+    BOOST_CHECK_EQUAL(nBestHeight, nHeight);
+    BOOST_FOREACH(const CBlock &block, vBad)
+        BOOST_CHECK(!mapBlockIndex.count(block.GetHash()));
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,58 @@
+#include <boost/test/unit_test.hpp>
+
+#include "leveldb.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(leveldb_tests)
+
+BOOST_AUTO_TEST_CASE(leveldb_options)
+{
+    mapArgs["-testdbcompression"] = "1";
+    mapArgs["-testdbblockcache"] = "150";
+    CLevelDBOptions dboptions = GetLevelDBOptions("testdb", 1 << 20);
+    BOOST_CHECK(dboptions.fCompression);
+    BOOST_CHECK_EQUAL(dboptions.nBlockCachePercent, 100);
+    BOOST_CHECK_EQUAL(dboptions.nCacheSize, 1U << 20);
+    mapArgs.erase("-testdbcompression");
+    mapArgs.erase("-testdbblockcache");
+}
+
+BOOST_AUTO_TEST_CASE(leveldb_compression_roundtrip)
+{
+    // Values that compress well, and random ones that do not
+    vector<string> vValues;
+    for (int i = 0; i < 200; i++) {
+        if (i % 2)
+            vValues.push_back(string(1000 + i, 'a' + i % 26));
+        else {
+            uint256 hash = GetRandHash();
+            vValues.push_back(string((const char*)hash.begin(), 32) + string(i, 'x'));
+        }
+    }
+
+    for (int nCompression = 0; nCompression < 2; nCompression++) {
+        boost::filesystem::path path = GetDataDir() / strprintf("leveldb_test_%d", nCompression);
+        CLevelDBOptions dboptions(1 << 20);
+        dboptions.fCompression = nCompression;
+        {
+            CLevelDB db(path, dboptions, false, true);
+            CLevelDBBatch batch;
+            for (unsigned int i = 0; i < vValues.size(); i++)
+                batch.Write(make_pair('v', i), vValues[i]);
+            BOOST_CHECK(db.WriteBatch(batch, true));
+        }
+
+        // Read back after reopening, so that the values come from the table files
+        CLevelDB db(path, dboptions);
+        for (unsigned int i = 0; i < vValues.size(); i++) {
+            string str;
+            BOOST_CHECK(db.Read(make_pair('v', i), str));
+            BOOST_CHECK(str == vValues[i]);
+        }
+        BOOST_CHECK(!db.Exists(make_pair('v', (unsigned int)vValues.size())));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,106 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+static CBlockFileInfo MakeFileInfo(unsigned int nHeightFirst, unsigned int nHeightLast, unsigned int nSize)
+{
+    CBlockFileInfo info;
+    for (unsigned int nHeight = nHeightFirst; nHeight <= nHeightLast; nHeight++)
+        info.AddBlock(nHeight, 1400000000 + nHeight);
+    info.nSize = nSize;
+    info.nUndoSize = nSize / 8;
+    return info;
+}
+
+BOOST_AUTO_TEST_SUITE(prune_tests)
+
+BOOST_AUTO_TEST_CASE(blockfileinfo_heights)
+{
+    // Blocks can arrive out of order
+    CBlockFileInfo info;
+    info.AddBlock(10, 1000);
+    info.AddBlock(100, 1100);
+    info.AddBlock(50, 1050);
+    info.AddBlock(5, 900);
+    BOOST_CHECK_EQUAL(info.nBlocks, 4U);
+    BOOST_CHECK_EQUAL(info.nHeightFirst, 5U);
+    BOOST_CHECK_EQUAL(info.nHeightLast, 100U);
+    BOOST_CHECK_EQUAL(info.nTimeFirst, 900U);
+    BOOST_CHECK_EQUAL(info.nTimeLast, 1100U);
+
+    info.nSize = 1000;
+    info.nUndoSize = 100;
+    BOOST_CHECK(!info.IsPruned());
+    info.SetPruned();
+    BOOST_CHECK(info.IsPruned());
+    BOOST_CHECK(info.nSize == 0 && info.nUndoSize == 0 && info.nBlocks == 4);
+
+    // A file that never had blocks is not pruned
+    BOOST_CHECK(!CBlockFileInfo().IsPruned());
+
+    // The mark survives the database
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << info;
+    CBlockFileInfo info2;
+    ss >> info2;
+    BOOST_CHECK(info2.IsPruned() && info2.nHeightLast == 100U);
+}
+
+BOOST_AUTO_TEST_CASE(prune_selection)
+{
+    const unsigned int nFileSize = 100 << 20;
+    vector<CBlockFileInfo> vInfo;
+    for (unsigned int i = 0; i < 10; i++)
+        vInfo.push_back(MakeFileInfo(i * 1000, i * 1000 + 999, nFileSize));
+    uint64 nFileUsage = nFileSize + nFileSize / 8;
+
+    // Under the target nothing goes
+    set<int> setFiles;
+    FindFilesToPrune(vInfo, 100000, 20 * nFileUsage, setFiles);
+    BOOST_CHECK(setFiles.empty());
+
+    // The oldest files go first, until the rest fits
+    FindFilesToPrune(vInfo, 100000, 6 * nFileUsage, setFiles);
+    BOOST_CHECK_EQUAL(setFiles.size(), 5U);
+    for (int i = 0; i < 5; i++)
+        BOOST_CHECK(setFiles.count(i));
+
+    // Files with blocks above the prune height are kept, and so is the last file
+    setFiles.clear();
+    FindFilesToPrune(vInfo, 2999, 0, setFiles);
+    BOOST_CHECK_EQUAL(setFiles.size(), 3U);
+    BOOST_CHECK(setFiles.count(2) && !setFiles.count(3));
+    setFiles.clear();
+    FindFilesToPrune(vInfo, 100000, 0, setFiles);
+    BOOST_CHECK_EQUAL(setFiles.size(), 9U);
+    BOOST_CHECK(!setFiles.count(9));
+
+    // Files that were pruned before are skipped
+    vInfo[0].SetPruned();
+    vInfo[2].SetPruned();
+    setFiles.clear();
+    FindFilesToPrune(vInfo, 100000, 6 * nFileUsage, setFiles);
+    BOOST_CHECK_EQUAL(setFiles.size(), 3U);
+    BOOST_CHECK(setFiles.count(1) && setFiles.count(3) && setFiles.count(4));
+}
+
+BOOST_AUTO_TEST_CASE(pruned_blocks_since)
+{
+    LOCK(cs_main);
+    BOOST_CHECK(!HavePrunedBlocksSince(pindexGenesisBlock));
+
+    // A block without its data counts only once files have been pruned
+    unsigned int nStatus = pindexGenesisBlock->nStatus;
+    pindexGenesisBlock->nStatus &= ~BLOCK_HAVE_DATA;
+    BOOST_CHECK(!HavePrunedBlocksSince(pindexGenesisBlock));
+    fHavePruned = true;
+    BOOST_CHECK(HavePrunedBlocksSince(pindexGenesisBlock));
+    pindexGenesisBlock->nStatus = nStatus;
+    BOOST_CHECK(!HavePrunedBlocksSince(pindexGenesisBlock));
+    fHavePruned = false;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,113 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+static CBlock MakeBlock(unsigned int nId, unsigned int nTxs)
+{
+    CBlock block;
+    block.nTime = nId;
+    for (unsigned int i = 0; i < nTxs; i++) {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.n = i;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i;
+        tx.nLockTime = nId;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(readcache_tests)
+
+BOOST_AUTO_TEST_CASE(readcache_blocks)
+{
+    CBlockReadCache cache;
+    CBlock block = MakeBlock(1, 3), blockOut;
+    uint256 hash = block.GetHash();
+
+    BOOST_CHECK(!cache.GetBlock(hash, blockOut, false));
+    cache.AddBlock(block, false);
+    BOOST_CHECK(cache.GetBlock(hash, blockOut, false));
+    BOOST_CHECK(blockOut.GetHash() == hash && blockOut.vtx.size() == 3);
+
+    // Blocks whose proof of play was not checked are not returned to callers that want it checked
+    BOOST_CHECK(!cache.GetBlock(hash, blockOut, true));
+    cache.AddBlock(block, true);
+    BOOST_CHECK(cache.GetBlock(hash, blockOut, true));
+    cache.AddBlock(block, false);
+    BOOST_CHECK(cache.GetBlock(hash, blockOut, true));
+
+    CBlockReadCache::Stats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nBlocks, 1U);
+    BOOST_CHECK_EQUAL(stats.nBlockHits, 3U);
+    BOOST_CHECK_EQUAL(stats.nBlockMisses, 2U);
+    BOOST_CHECK_EQUAL(stats.nSize, ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION));
+}
+
+BOOST_AUTO_TEST_CASE(readcache_eviction)
+{
+    CBlockReadCache cache;
+    vector<CBlock> blocks;
+    for (unsigned int i = 0; i < 10; i++)
+        blocks.push_back(MakeBlock(i, 2));
+    size_t nBlockSize = ::GetSerializeSize(blocks[0], SER_DISK, CLIENT_VERSION);
+    cache.SetMaxSize(nBlockSize * 4);
+
+    CBlock blockOut;
+    for (unsigned int i = 0; i < blocks.size(); i++) {
+        cache.AddBlock(blocks[i], true);
+        // Keep the first block in use
+        BOOST_CHECK(cache.GetBlock(blocks[0].GetHash(), blockOut, true));
+    }
+    CBlockReadCache::Stats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nBlocks, 4U);
+    BOOST_CHECK(stats.nSize <= stats.nMaxSize);
+    BOOST_CHECK(cache.GetBlock(blocks[0].GetHash(), blockOut, true));
+    for (unsigned int i = 7; i < blocks.size(); i++)
+        BOOST_CHECK(cache.GetBlock(blocks[i].GetHash(), blockOut, true));
+    for (unsigned int i = 1; i < 7; i++)
+        BOOST_CHECK(!cache.GetBlock(blocks[i].GetHash(), blockOut, true));
+
+    cache.SetMaxSize(0);
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nBlocks, 0U);
+    BOOST_CHECK_EQUAL(stats.nSize, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(readcache_transactions)
+{
+    CBlockReadCache cache;
+    CBlock block = MakeBlock(1, 3);
+    uint256 hashBlock = block.GetHash();
+    cache.AddBlock(block, true);
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        cache.AddTransaction(block.vtx[i], hashBlock);
+
+    CTransaction tx;
+    uint256 hashBlockOut;
+    BOOST_CHECK(cache.GetTransaction(block.vtx[1].GetHash(), tx, hashBlockOut));
+    BOOST_CHECK(tx.GetHash() == block.vtx[1].GetHash() && hashBlockOut == hashBlock);
+
+    // A disconnected block takes its transactions with it
+    cache.EraseBlock(block);
+    CBlock blockOut;
+    BOOST_CHECK(!cache.GetBlock(hashBlock, blockOut, false));
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(!cache.GetTransaction(block.vtx[i].GetHash(), tx, hashBlockOut));
+
+    CBlockReadCache::Stats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nTxs, 0U);
+    BOOST_CHECK_EQUAL(stats.nSize, 0U);
+    BOOST_CHECK_EQUAL(stats.nTxHits, 1U);
+    BOOST_CHECK_EQUAL(stats.nTxMisses, 3U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,8 +1,11 @@
 #include <boost/algorithm/string.hpp>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
 #include "base58.h"
+#include "main.h"
 #include "util.h"
 #include "bitcoinrpc.h"
 
@@ -168,4 +171,224 @@ BOOST_AUTO_TEST_CASE(rpc_rawsign)
     BOOST_CHECK(find_value(r.get_obj(), "complete").get_bool() == true);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_chaintip)
+{
+    // The read-only calls answer from the published chain tip
+    Value r;
+    BOOST_CHECK_NO_THROW(r=CallRPC("getblockcount"));
+    BOOST_CHECK_EQUAL(r.get_int(), nBestHeight);
+    BOOST_CHECK_NO_THROW(r=CallRPC("getbestblockhash"));
+    BOOST_CHECK_EQUAL(r.get_str(), hashBestChain.GetHex());
+    BOOST_CHECK_NO_THROW(r=CallRPC("getblockhash 0"));
+    BOOST_CHECK_EQUAL(r.get_str(), hashGenesisBlock.GetHex());
+    BOOST_CHECK_THROW(CallRPC(strprintf("getblockhash %d", nBestHeight + 1)), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("getblockhash -1"), runtime_error);
+    BOOST_CHECK(FindBlockByHeight(0) == pindexGenesisBlock);
+    BOOST_CHECK(FindBlockByHeight(nBestHeight) == pindexBest);
+    BOOST_CHECK(FindBlockByHeight(nBestHeight + 1) == NULL);
+    BOOST_CHECK(FindBlockByHeight(-1) == NULL);
+    CBlockLocator locator(pindexBest);
+    BOOST_CHECK(locator.GetBlockIndex() == pindexBest);
+
+    // Calls through the table are counted
+    BOOST_CHECK_NO_THROW(CallRPC("getrpcstats true"));
+    BOOST_CHECK_NO_THROW(tableRPC.execute("getblockcount", Array()));
+    BOOST_CHECK_NO_THROW(tableRPC.execute("getblockcount", Array()));
+    BOOST_CHECK_NO_THROW(r=CallRPC("getrpcstats"));
+    Value stats = find_value(r.get_obj(), "getblockcount");
+    BOOST_CHECK_EQUAL(find_value(stats.get_obj(), "calls").get_int(), 2);
+    BOOST_CHECK_EQUAL(find_value(stats.get_obj(), "errors").get_int(), 0);
+    BOOST_CHECK_EQUAL(find_value(stats.get_obj(), "histogram").get_array().size() > 0, true);
+}
+
+static void WriteSample(CJSONWriter& writer)
+{
+    writer.BeginObject();
+    writer.WritePair("name", "quote\" backslash\\ newline\n");
+    writer.WritePair("amount", ValueFromAmount(1234567));
+    writer.Key("empty");
+    writer.BeginArray();
+    writer.EndArray();
+    writer.Key("list");
+    writer.BeginArray();
+    for (int i = 0; i < 3; i++)
+    {
+        writer.BeginObject();
+        writer.WritePair("n", i);
+        writer.WritePair("odd", i % 2 == 1);
+        writer.EndObject();
+    }
+    writer.Write(Value::null);
+    writer.EndArray();
+    writer.Key("nested");
+    writer.BeginObject();
+    writer.EndObject();
+    writer.EndObject();
+}
+
+BOOST_AUTO_TEST_CASE(rpc_jsonwriter)
+{
+    // Streamed text is exactly what writing the whole value gives
+    CJSONValueWriter valueWriter;
+    WriteSample(valueWriter);
+    Value v = valueWriter.GetValue();
+    BOOST_CHECK_EQUAL(find_value(v.get_obj(), "list").get_array().size(), 4U);
+
+    ostringstream os;
+    CJSONStreamWriter streamWriter(os);
+    WriteSample(streamWriter);
+    BOOST_CHECK_EQUAL(os.str(), write_string(v, false));
+
+    Value parsed;
+    BOOST_CHECK(read_string(os.str(), parsed));
+    BOOST_CHECK_EQUAL(write_string(parsed, false), write_string(v, false));
+
+    // Streaming methods give the same result through both interfaces
+    ostringstream osMempool;
+    CJSONStreamWriter mempoolWriter(osMempool);
+    tableRPC.execute("getrawmempool", Array(), mempoolWriter);
+    BOOST_CHECK_EQUAL(osMempool.str(), write_string(tableRPC.execute("getrawmempool", Array()), false));
+
+    // getblock copies the block under cs_main and writes it without the lock
+    Array paramsBlock;
+    paramsBlock.push_back(hashGenesisBlock.GetHex());
+    ostringstream osBlock;
+    CJSONStreamWriter blockWriter(osBlock);
+    tableRPC.execute("getblock", paramsBlock, blockWriter);
+    BOOST_CHECK(osBlock.str().find("\"height\":0") != string::npos);
+    BOOST_CHECK_EQUAL(osBlock.str(), write_string(tableRPC.execute("getblock", paramsBlock), false));
+}
+
+// When each call of a batch started and finished, on one clock
+struct CBatchLog
+{
+    boost::mutex mutex;
+    int nClock;
+    vector<int> vStart, vEnd;
+    set<boost::thread::id> setThreads;
+    int nRunning, nMaxRunning;
+
+    CBatchLog(unsigned int nCalls) : nClock(0), vStart(nCalls, -1), vEnd(nCalls, -1), nRunning(0), nMaxRunning(0) {}
+};
+
+static void BatchLogCall(CBatchLog* plog, unsigned int i)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(plog->mutex);
+        plog->vStart[i] = plog->nClock++;
+        plog->setThreads.insert(boost::this_thread::get_id());
+        plog->nMaxRunning = std::max(plog->nMaxRunning, ++plog->nRunning);
+    }
+    MilliSleep(1);
+    boost::unique_lock<boost::mutex> lock(plog->mutex);
+    plog->vEnd[i] = plog->nClock++;
+    plog->nRunning--;
+}
+
+BOOST_AUTO_TEST_CASE(rpc_batch_order)
+{
+    // Runs of concurrent calls of different lengths between locked calls,
+    // calls with side effects and calls that read under cs_main
+    vector<RPCBatchMode> vMode;
+    for (unsigned int i = 0; i < 200; i++)
+    {
+        if (i % 50 == 20 || i == 21 || i == 199)
+            vMode.push_back(RPC_BATCH_LOCKED);
+        else if (i % 50 == 30 || i % 50 == 31)
+            vMode.push_back(RPC_BATCH_SEQUENTIAL);
+        else if (i % 50 >= 40 && i % 50 < 44)
+            vMode.push_back(RPC_BATCH_MAIN);
+        else
+            vMode.push_back(RPC_BATCH_CONCURRENT);
+    }
+
+    for (int nThreads = 0; nThreads <= 4; nThreads += 4)
+    {
+        StartRPCWorkQueue(nThreads);
+        CBatchLog log(vMode.size());
+        RPCRunBatch(vMode, boost::bind(&BatchLogCall, &log, _1));
+        StopRPCWorkQueue();
+
+        for (unsigned int i = 0; i < vMode.size(); i++)
+        {
+            BOOST_CHECK(log.vStart[i] >= 0 && log.vEnd[i] > log.vStart[i]);
+            if (vMode[i] == RPC_BATCH_CONCURRENT)
+                continue;
+            // Nothing overlaps any other call or moves across it
+            for (unsigned int j = 0; j < i; j++)
+                BOOST_CHECK(log.vEnd[j] < log.vStart[i]);
+            for (unsigned int j = i + 1; j < vMode.size(); j++)
+                BOOST_CHECK(log.vStart[j] > log.vEnd[i]);
+        }
+
+        if (nThreads == 0)
+        {
+            BOOST_CHECK_EQUAL(log.setThreads.size(), 1U);
+            BOOST_CHECK_EQUAL(log.nMaxRunning, 1);
+        }
+        else
+        {
+            BOOST_CHECK(log.setThreads.size() > 1);
+            BOOST_CHECK(log.nMaxRunning > 1);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rpc_pipelining)
+{
+    mapArgs["-rpcuser"] = "rpctest";
+    mapArgs["-rpcpassword"] = "rpctestpassword";
+    mapArgs["-rpcport"] = "18397";
+    StartRPCThreads();
+
+    // Thread-safe, locked, failing and thread-safe again, all sent at once
+    const char *pszRequests[] = {
+        "{\"method\":\"getblockcount\",\"params\":[],\"id\":1}",
+        "{\"method\":\"getconnectioncount\",\"params\":[],\"id\":2}",
+        "{\"method\":\"nosuchmethod\",\"params\":[],\"id\":3}",
+        "{\"method\":\"getblockhash\",\"params\":[0],\"id\":4}"};
+    const int nRequests = sizeof(pszRequests) / sizeof(pszRequests[0]);
+    string strRequests;
+    for (int i = 0; i < nRequests; i++)
+    {
+        strRequests += strprintf("POST / HTTP/1.1\r\n"
+                                 "Authorization: Basic %s\r\n"
+                                 "Connection: %s\r\n"
+                                 "Content-Length: %" PRIszu "\r\n"
+                                 "\r\n", EncodeBase64("rpctest:rpctestpassword").c_str(),
+                                 i + 1 < nRequests ? "keep-alive" : "close", strlen(pszRequests[i]));
+        strRequests += pszRequests[i];
+    }
+
+    boost::asio::ip::tcp::iostream stream("127.0.0.1", "18397");
+    BOOST_REQUIRE(stream.good());
+    stream << strRequests << std::flush;
+    string strReplies((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+    StopRPCThreads();
+    mapArgs.erase("-rpcuser");
+    mapArgs.erase("-rpcpassword");
+    mapArgs.erase("-rpcport");
+
+    // Every request is answered, in order, and the error does not end the
+    // connection
+    vector<string> vReplies;
+    for (size_t nPos = strReplies.find("HTTP/1.1 "); nPos != string::npos; )
+    {
+        size_t nNext = strReplies.find("HTTP/1.1 ", nPos + 1);
+        vReplies.push_back(strReplies.substr(nPos, nNext == string::npos ? string::npos : nNext - nPos));
+        nPos = nNext;
+    }
+    BOOST_REQUIRE_EQUAL(vReplies.size(), (size_t)nRequests);
+    for (int i = 0; i < nRequests; i++)
+    {
+        const string& strReply = vReplies[i];
+        BOOST_CHECK_EQUAL(atoi(strReply.c_str() + 9), i == 2 ? 404 : 200);
+        BOOST_CHECK(strReply.find(i + 1 < nRequests ? "Connection: keep-alive" : "Connection: close") != string::npos);
+        Value valReply;
+        BOOST_REQUIRE(read_string(strReply.substr(strReply.find("\r\n\r\n") + 4), valReply));
+        BOOST_CHECK_EQUAL(find_value(valReply.get_obj(), "id").get_int(), i + 1);
+        BOOST_CHECK_EQUAL(find_value(valReply.get_obj(), "error").type(), i == 2 ? obj_type : null_type);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,83 @@
+#include <boost/test/unit_test.hpp>
+
+#include <limits>
+
+#include "bignum.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+namespace
+{
+// What the interpreter used to do with numeric operands
+CBigNum CastToBigNum(const vector<unsigned char>& vch)
+{
+    if (vch.size() > CScriptNum::nMaxNumSize)
+        throw runtime_error("CastToBigNum() : overflow");
+    return CBigNum(CBigNum(vch).getvch());
+}
+
+void CheckEncoding(int64 n)
+{
+    CBigNum bn(n);
+    BOOST_CHECK_MESSAGE(CScriptNum(n).getvch() == bn.getvch(), strprintf("%"PRI64d, n));
+}
+
+void CheckDecoding(const vector<unsigned char>& vch)
+{
+    bool fOverflow = false;
+    CBigNum bn;
+    try {
+        bn = CastToBigNum(vch);
+    } catch (std::runtime_error &e) {
+        fOverflow = true;
+    }
+    try {
+        CScriptNum num(vch);
+        BOOST_CHECK(!fOverflow);
+        BOOST_CHECK_MESSAGE(num.getvch() == bn.getvch(), HexStr(vch));
+        BOOST_CHECK_EQUAL(num.getint(), bn.getint());
+    } catch (std::runtime_error &e) {
+        BOOST_CHECK(fOverflow);
+    }
+}
+}
+
+BOOST_AUTO_TEST_SUITE(scriptnum_tests)
+
+BOOST_AUTO_TEST_CASE(scriptnum_encoding)
+{
+    static const int64 values[] = { 0, 1, -1, 2, -2, 127, -127, 128, -128, 255, -255, 256, -256,
+                                    32767, -32767, 32768, -32768, 65535, -65535, 65536, -65536,
+                                    0x7fffffff, -0x7fffffff, 0x80000000LL, -0x80000000LL,
+                                    0xffffffffLL, -0xffffffffLL, 0x100000000LL, -0x100000000LL,
+                                    0x7fffffffffffffffLL, -0x7fffffffffffffffLL };
+    for (unsigned int i = 0; i < sizeof(values)/sizeof(values[0]); i++)
+        CheckEncoding(values[i]);
+    for (int i = 0; i < 1000; i++)
+        CheckEncoding((int64)(((uint64)insecure_rand() << 32) | insecure_rand()) >> (insecure_rand() % 64));
+}
+
+BOOST_AUTO_TEST_CASE(scriptnum_decoding)
+{
+    // Negative zero, excess padding, and operands that are too long
+    CheckDecoding(ParseHex(""));
+    CheckDecoding(ParseHex("80"));
+    CheckDecoding(ParseHex("0080"));
+    CheckDecoding(ParseHex("000080"));
+    CheckDecoding(ParseHex("0100"));
+    CheckDecoding(ParseHex("ff00"));
+    CheckDecoding(ParseHex("ff80"));
+    CheckDecoding(ParseHex("ffffffff"));
+    CheckDecoding(ParseHex("ffffff7f"));
+    CheckDecoding(ParseHex("0000000000"));
+    for (int i = 0; i < 1000; i++) {
+        vector<unsigned char> vch(insecure_rand() % 6);
+        for (unsigned int j = 0; j < vch.size(); j++)
+            vch[j] = insecure_rand();
+        CheckDecoding(vch);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,325 @@
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+
+#include "key.h"
+#include "script.h"
+#include "secp256k1.h"
+#include "util.h"
+
+using namespace std;
+
+namespace
+{
+// What CPubKey::Verify used to do: OpenSSL's own parsing and verification.
+// The OpenSSL this is built against insists on DER, so it only serves as a
+// reference for canonically encoded signatures.
+bool ReferenceVerify(const uint256 &hash, const vector<unsigned char> &vchSig, const vector<unsigned char> &vchPubKey)
+{
+    EC_KEY *pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    assert(pkey != NULL);
+    unsigned char dummy = 0;
+    const unsigned char *pbegin = vchPubKey.empty() ? &dummy : &vchPubKey[0];
+    bool fValid = !vchPubKey.empty() && o2i_ECPublicKey(&pkey, &pbegin, vchPubKey.size()) &&
+                  ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), vchSig.empty() ? &dummy : &vchSig[0], vchSig.size(), pkey) == 1;
+    EC_KEY_free(pkey);
+    return fValid;
+}
+
+// What ECDSA_verify did before OpenSSL 1.0.0p/1.0.1k: the BER decoder of
+// d2i_ECDSA_SIG without the check that the signature re-encodes to the same
+// bytes. This is the reference for the lax encodings that consensus accepts.
+bool LaxReferenceVerify(const uint256 &hash, const vector<unsigned char> &vchSig, const vector<unsigned char> &vchPubKey)
+{
+    EC_KEY *pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    assert(pkey != NULL);
+    unsigned char dummy = 0;
+    const unsigned char *pbegin = vchPubKey.empty() ? &dummy : &vchPubKey[0];
+    const unsigned char *psig = vchSig.empty() ? &dummy : &vchSig[0];
+    ECDSA_SIG *sig = d2i_ECDSA_SIG(NULL, &psig, vchSig.size());
+    bool fValid = !vchPubKey.empty() && o2i_ECPublicKey(&pkey, &pbegin, vchPubKey.size()) &&
+                  sig != NULL && ECDSA_do_verify((unsigned char*)&hash, sizeof(hash), sig, pkey) == 1;
+    if (sig != NULL)
+        ECDSA_SIG_free(sig);
+    EC_KEY_free(pkey);
+    return fValid;
+}
+
+bool FastVerify(const uint256 &hash, const vector<unsigned char> &vchSig, const vector<unsigned char> &vchPubKey)
+{
+    return ECDSAVerify(hash, vchSig.empty() ? NULL : &vchSig[0], vchSig.size(),
+                       vchPubKey.empty() ? NULL : &vchPubKey[0], vchPubKey.size());
+}
+
+bool IsCanonical(const vector<unsigned char> &vchSig)
+{
+    vector<unsigned char> vchSigHashType(vchSig);
+    vchSigHashType.push_back(SIGHASH_ALL);
+    return IsCanonicalSignature(vchSigHashType);
+}
+
+void CheckSame(const uint256 &hash, const vector<unsigned char> &vchSig, const vector<unsigned char> &vchPubKey)
+{
+    bool fValid = FastVerify(hash, vchSig, vchPubKey);
+    BOOST_CHECK_MESSAGE(fValid == LaxReferenceVerify(hash, vchSig, vchPubKey),
+                        "sig=" + HexStr(vchSig) + " pubkey=" + HexStr(vchPubKey));
+    // Strict DER only differs for encodings that are not canonical
+    if (IsCanonical(vchSig))
+        BOOST_CHECK(fValid == ReferenceVerify(hash, vchSig, vchPubKey));
+    else
+        BOOST_CHECK(!ReferenceVerify(hash, vchSig, vchPubKey));
+}
+
+// DER signature from raw integer encodings, which need not be valid DER integers
+vector<unsigned char> MakeSig(const vector<unsigned char> &r, const vector<unsigned char> &s)
+{
+    vector<unsigned char> vchSig;
+    vchSig.push_back(0x30);
+    vchSig.push_back(4 + r.size() + s.size());
+    vchSig.push_back(0x02);
+    vchSig.push_back(r.size());
+    vchSig.insert(vchSig.end(), r.begin(), r.end());
+    vchSig.push_back(0x02);
+    vchSig.push_back(s.size());
+    vchSig.insert(vchSig.end(), s.begin(), s.end());
+    return vchSig;
+}
+
+// Split a valid signature into its integers
+void SplitSig(const vector<unsigned char> &vchSig, vector<unsigned char> &r, vector<unsigned char> &s)
+{
+    unsigned int nLenR = vchSig[3];
+    r.assign(vchSig.begin() + 4, vchSig.begin() + 4 + nLenR);
+    unsigned int nLenS = vchSig[5 + nLenR];
+    s.assign(vchSig.begin() + 6 + nLenR, vchSig.begin() + 6 + nLenR + nLenS);
+}
+}
+
+BOOST_AUTO_TEST_SUITE(secp256k1_tests)
+
+BOOST_AUTO_TEST_CASE(secp256k1_valid)
+{
+    for (int i = 0; i < 50; i++) {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        CPubKey pubkey = key.GetPubKey();
+        vector<unsigned char> vchPubKey(pubkey.begin(), pubkey.end());
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+
+        BOOST_CHECK(ReferenceVerify(hash, vchSig, vchPubKey));
+        BOOST_CHECK(FastVerify(hash, vchSig, vchPubKey));
+        BOOST_CHECK(pubkey.Verify(hash, vchSig));
+        BOOST_CHECK(!pubkey.Verify(GetRandHash(), vchSig));
+        BOOST_CHECK(!pubkey.Verify(hash, vector<unsigned char>()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_mutations)
+{
+    for (int i = 0; i < 200; i++) {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        CPubKey pubkey = key.GetPubKey();
+        vector<unsigned char> vchPubKey(pubkey.begin(), pubkey.end());
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vchSig;
+        key.Sign(hash, vchSig);
+
+        // Flip a bit of the signature
+        vector<unsigned char> vchMutated = vchSig;
+        vchMutated[insecure_rand() % vchMutated.size()] ^= 1 << (insecure_rand() % 8);
+        CheckSame(hash, vchMutated, vchPubKey);
+
+        // Flip a bit of the hash
+        uint256 hashMutated = hash;
+        hashMutated.begin()[insecure_rand() % 32] ^= 1 << (insecure_rand() % 8);
+        CheckSame(hashMutated, vchSig, vchPubKey);
+
+        // Flip a bit of the public key, which is usually no longer on the curve
+        vchMutated = vchPubKey;
+        vchMutated[insecure_rand() % vchMutated.size()] ^= 1 << (insecure_rand() % 8);
+        CheckSame(hash, vchSig, vchMutated);
+
+        // Truncate or extend the signature
+        vchMutated = vchSig;
+        vchMutated.resize(insecure_rand() % (vchSig.size() + 4));
+        CheckSame(hash, vchMutated, vchPubKey);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_encodings)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    vector<unsigned char> vchPubKey(pubkey.begin(), pubkey.end());
+    // A signature whose r has the high bit set, and so a zero byte in front
+    uint256 hash;
+    vector<unsigned char> vchSig, r, s;
+    do {
+        hash = GetRandHash();
+        key.Sign(hash, vchSig);
+        SplitSig(vchSig, r, s);
+    } while (r[0] != 0x00);
+    BOOST_CHECK(MakeSig(r, s) == vchSig);
+
+    BOOST_CHECK(IsCanonical(vchSig));
+
+    // Encodings that OpenSSL accepted before it insisted on DER. Blocks may
+    // contain these, so they must verify, but they are not relayed.
+    vector<vector<unsigned char> > vLax;
+    // Trailing garbage
+    vLax.push_back(vchSig);
+    vLax.back().push_back(0x00);
+    vLax.push_back(vchSig);
+    vLax.back().push_back(0x30);
+    vLax.back().push_back(0x02);
+    vLax.back().push_back(0x02);
+    vLax.back().push_back(0x00);
+    // Superfluous zero padding
+    vector<unsigned char> rPadded(r);
+    rPadded.insert(rPadded.begin(), 0x00);
+    vLax.push_back(MakeSig(rPadded, s));
+    // Missing zero byte in front of the high bit; the integers are unsigned
+    vLax.push_back(MakeSig(vector<unsigned char>(r.begin() + 1, r.end()), s));
+    // Long form sequence length
+    vLax.push_back(vchSig);
+    vLax.back().insert(vLax.back().begin() + 1, 0x81);
+    // Long form integer length, with a superfluous zero byte
+    vLax.push_back(vchSig);
+    vLax.back()[1] += 2;
+    vLax.back().insert(vLax.back().begin() + 3, 0x82);
+    vLax.back().insert(vLax.back().begin() + 4, 0x00);
+    // Long form integer length of five bytes, four of them zero
+    vLax.push_back(vchSig);
+    vLax.back()[1] += 5;
+    vLax.back().insert(vLax.back().begin() + 3, 5, 0x00);
+    vLax.back()[3] = 0x85;
+    // Indefinite sequence length, with the end-of-contents marker
+    vector<unsigned char> vchIndefinite(vchSig);
+    vchIndefinite[1] = 0x80;
+    vchIndefinite.push_back(0x00);
+    vchIndefinite.push_back(0x00);
+    vLax.push_back(vchIndefinite);
+    // ... and trailing garbage after it
+    vLax.push_back(vchIndefinite);
+    vLax.back().push_back(0x01);
+
+    BOOST_FOREACH(const vector<unsigned char> &vchLax, vLax) {
+        BOOST_CHECK_MESSAGE(FastVerify(hash, vchLax, vchPubKey), "sig=" + HexStr(vchLax));
+        BOOST_CHECK(pubkey.Verify(hash, vchLax));
+        BOOST_CHECK(!FastVerify(GetRandHash(), vchLax, vchPubKey));
+        BOOST_CHECK(!IsCanonical(vchLax));
+        CheckSame(hash, vchLax, vchPubKey);
+    }
+
+    vector<vector<unsigned char> > vSigs;
+    // Indefinite sequence length without the end-of-contents marker, with
+    // something else in its place, or with data in front of it
+    vSigs.push_back(vchSig);
+    vSigs.back()[1] = 0x80;
+    vSigs.push_back(vchIndefinite);
+    vSigs.back()[vSigs.back().size() - 1] = 0x01;
+    vSigs.push_back(vchIndefinite);
+    vSigs.back().insert(vSigs.back().end() - 2, 0x05);
+    vSigs.back().insert(vSigs.back().end() - 2, 0x00);
+    // Indefinite integer length
+    vSigs.push_back(vchIndefinite);
+    vSigs.back()[3] = 0x80;
+    // Zero r, empty r
+    vSigs.push_back(MakeSig(vector<unsigned char>(1, 0x00), s));
+    vSigs.push_back(MakeSig(vector<unsigned char>(), s));
+    // r equal to and above the curve order
+    vector<unsigned char> vchOrder = ParseHex("00fffffffffffffffffffffffffffffffebaaedce6af48a03bbfd25e8cd0364141");
+    vSigs.push_back(MakeSig(vchOrder, s));
+    vchOrder[vchOrder.size() - 1]++;
+    vSigs.push_back(MakeSig(r, vchOrder));
+    // r wider than 256 bits
+    vector<unsigned char> rWide(r);
+    rWide.insert(rWide.begin(), 0x01);
+    vSigs.push_back(MakeSig(rWide, s));
+    // Wrong tags
+    vSigs.push_back(vchSig);
+    vSigs.back()[0] = 0x31;
+    vSigs.push_back(vchSig);
+    vSigs.back()[2] = 0x03;
+    // Integer runs past the end
+    vSigs.push_back(vchSig);
+    vSigs.back().resize(vchSig.size() - 1);
+    // Sequence length that does not match the contents
+    vSigs.push_back(vchSig);
+    vSigs.back()[1]--;
+    vSigs.push_back(vchSig);
+    vSigs.back()[1]++;
+    vSigs.back().push_back(0x00);
+
+    BOOST_FOREACH(const vector<unsigned char> &vchBad, vSigs) {
+        BOOST_CHECK_MESSAGE(!FastVerify(hash, vchBad, vchPubKey), "sig=" + HexStr(vchBad));
+        CheckSame(hash, vchBad, vchPubKey);
+    }
+
+    // Hybrid public key encoding (0x06/0x07 prefix) is accepted by both
+    CKey keyUncompressed;
+    keyUncompressed.MakeNewKey(false);
+    CPubKey pubkeyUncompressed = keyUncompressed.GetPubKey();
+    vector<unsigned char> vchHybrid(pubkeyUncompressed.begin(), pubkeyUncompressed.end());
+    vchHybrid[0] = 0x06 | (vchHybrid[64] & 1);
+    keyUncompressed.Sign(hash, vchSig);
+    CheckSame(hash, vchSig, vchHybrid);
+    vchHybrid[0] ^= 1;
+    CheckSame(hash, vchSig, vchHybrid);
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_batch)
+{
+    vector<vector<unsigned char> > vSigs, vPubKeys;
+    vector<uint256> vHashes;
+    for (int i = 0; i < 40; i++) {
+        CKey key;
+        key.MakeNewKey(i % 3 == 0);
+        CPubKey pubkey = key.GetPubKey();
+        vPubKeys.push_back(vector<unsigned char>(pubkey.begin(), pubkey.end()));
+        vHashes.push_back(GetRandHash());
+        vSigs.push_back(vector<unsigned char>());
+        key.Sign(vHashes.back(), vSigs.back());
+    }
+    // Lax encodings are accepted as by ECDSAVerify
+    vSigs[5].push_back(0x00);
+    vSigs[6][1] = 0x80;
+    vSigs[6].push_back(0x00);
+    vSigs[6].push_back(0x00);
+
+    vector<CECDSAVerifyJob> vJobs;
+    for (unsigned int i = 0; i < vSigs.size(); i++)
+        vJobs.push_back(CECDSAVerifyJob(vHashes[i], &vSigs[i][0], vSigs[i].size(), &vPubKeys[i][0], vPubKeys[i].size()));
+    BOOST_CHECK(ECDSAVerifyBatch(vJobs));
+    BOOST_FOREACH(const CECDSAVerifyJob &job, vJobs)
+        BOOST_CHECK(job.fValid);
+
+    // Break some of them in different ways; the rest must stay valid
+    vSigs[3][10] ^= 0x01;
+    vSigs[7][1] = 0x80;
+    vHashes[11] = GetRandHash();
+    vPubKeys[20] = vPubKeys[21];
+    vSigs[30][4] ^= 0x40;
+    vJobs.clear();
+    for (unsigned int i = 0; i < vSigs.size(); i++)
+        vJobs.push_back(CECDSAVerifyJob(vHashes[i], &vSigs[i][0], vSigs[i].size(), &vPubKeys[i][0], vPubKeys[i].size()));
+    BOOST_CHECK(!ECDSAVerifyBatch(vJobs));
+    for (unsigned int i = 0; i < vJobs.size(); i++) {
+        BOOST_CHECK_EQUAL(vJobs[i].fValid, FastVerify(vHashes[i], vSigs[i], vPubKeys[i]));
+        BOOST_CHECK_EQUAL(vJobs[i].fValid, LaxReferenceVerify(vHashes[i], vSigs[i], vPubKeys[i]));
+        BOOST_CHECK_EQUAL(vJobs[i].fValid, i != 3 && i != 7 && i != 11 && i != 20 && i != 30);
+    }
+
+    vector<CECDSAVerifyJob> vEmpty;
+    BOOST_CHECK(ECDSAVerifyBatch(vEmpty));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,242 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+#include "test/testnode.h"
+
+using namespace std;
+
+// The parts of a snapshot file, to write back changed with a valid checksum
+struct CSnapshotFile
+{
+    CSnapshotHeader header;
+    vector<CBlockHeader> vHeaders;
+    vector<pair<uint256, CCoins> > vCoins;
+
+    void Read(const boost::filesystem::path &path)
+    {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        unsigned char pchMagic[4];
+        filein >> FLATDATA(pchMagic) >> header;
+        vHeaders.resize(header.nHeight + 1);
+        for (unsigned int i = 0; i < vHeaders.size(); i++)
+            filein >> vHeaders[i];
+        vCoins.resize(header.nTransactions);
+        for (unsigned int i = 0; i < vCoins.size(); i++)
+            filein >> vCoins[i].first >> vCoins[i].second;
+    }
+
+    void Write(const boost::filesystem::path &path)
+    {
+        CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+        fileout << FLATDATA(pchMessageStart) << header;
+        hasher << FLATDATA(pchMessageStart) << header;
+        for (unsigned int i = 0; i < vHeaders.size(); i++) {
+            fileout << vHeaders[i];
+            hasher << vHeaders[i];
+        }
+        for (unsigned int i = 0; i < vCoins.size(); i++) {
+            fileout << vCoins[i].first << vCoins[i].second;
+            hasher << vCoins[i].first << vCoins[i].second;
+        }
+        fileout << hasher.GetHash();
+    }
+};
+
+static vector<char> ReadAll(const boost::filesystem::path &path)
+{
+    vector<char> data(boost::filesystem::file_size(path));
+    FILE *file = fopen(path.string().c_str(), "rb");
+    BOOST_CHECK(fread(&data[0], 1, data.size(), file) == data.size());
+    fclose(file);
+    return data;
+}
+
+static void WriteAll(const boost::filesystem::path &path, const vector<char> &data, size_t nSize)
+{
+    FILE *file = fopen(path.string().c_str(), "wb");
+    BOOST_CHECK(fwrite(&data[0], 1, nSize, file) == nSize);
+    fclose(file);
+}
+
+BOOST_AUTO_TEST_SUITE(snapshot_tests)
+
+BOOST_AUTO_TEST_CASE(snapshot_dump)
+{
+    boost::filesystem::path path = GetDataDir() / "snapshot_test.dat";
+    CSnapshotHeader header;
+    BOOST_CHECK(DumpSnapshot(path, header));
+
+    CCoinsStats stats;
+    BOOST_CHECK(pcoinsTip->GetStats(stats));
+    BOOST_CHECK(header.hashBlock == hashBestChain);
+    BOOST_CHECK_EQUAL(header.nHeight, nBestHeight);
+    BOOST_CHECK_EQUAL(header.nTransactions, stats.nTransactions);
+    BOOST_CHECK_EQUAL(header.nTransactionOutputs, stats.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(header.nTotalAmount, stats.nTotalAmount);
+    BOOST_CHECK(header.hashSet == stats.hashSet.GetHash());
+    BOOST_CHECK(header.nTransactions > 0);
+
+    CSnapshotHeader header2;
+    BOOST_CHECK(VerifySnapshot(path, header2));
+    BOOST_CHECK(header2.hashBlock == header.hashBlock);
+    BOOST_CHECK(header2.hashSet == header.hashSet);
+    BOOST_CHECK_EQUAL(header2.nTransactions, header.nTransactions);
+
+    // A snapshot of the genesis block has nothing to skip, and the chain is left alone
+    BOOST_CHECK(!LoadSnapshot(path, header2));
+    BOOST_CHECK(pcoinsTip->GetStats(stats));
+    BOOST_CHECK(stats.hashSet.GetHash() == header.hashSet);
+    int nHeightSnapshot, nHeightValidated;
+    BOOST_CHECK(!GetSnapshotValidationProgress(nHeightSnapshot, nHeightValidated));
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_corrupt)
+{
+    boost::filesystem::path path = GetDataDir() / "snapshot_test.dat";
+    boost::filesystem::path pathBad = GetDataDir() / "snapshot_bad.dat";
+    CSnapshotHeader header;
+    BOOST_CHECK(DumpSnapshot(path, header));
+    vector<char> data = ReadAll(path);
+    BOOST_CHECK(data.size() > 100);
+
+    // Magic, header, block header, coins and checksum
+    size_t pos[] = { 0, 4, 10, 60, data.size() / 2, data.size() - 40, data.size() - 1 };
+    for (unsigned int i = 0; i < sizeof(pos)/sizeof(pos[0]); i++) {
+        vector<char> bad = data;
+        bad[pos[i]] ^= 1;
+        WriteAll(pathBad, bad, bad.size());
+        BOOST_CHECK_MESSAGE(!VerifySnapshot(pathBad, header), strprintf("byte %" PRIszu, pos[i]));
+    }
+
+    // Truncated files
+    WriteAll(pathBad, data, data.size() - 1);
+    BOOST_CHECK(!VerifySnapshot(pathBad, header));
+    WriteAll(pathBad, data, data.size() / 2);
+    BOOST_CHECK(!VerifySnapshot(pathBad, header));
+
+    BOOST_CHECK(!VerifySnapshot(GetDataDir() / "snapshot_missing.dat", header));
+
+    boost::filesystem::remove(path);
+    boost::filesystem::remove(pathBad);
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_load)
+{
+    SetMockReplay(true);
+    boost::filesystem::path path = GetDataDir() / "snapshot_test.dat";
+    boost::filesystem::path pathBad = GetDataDir() / "snapshot_bad.dat";
+    vector<CBlock> vBlocks;
+    CSnapshotHeader header, headerBad;
+    {
+        // A short chain and its snapshot
+        CTestNode node;
+        for (int i = 0; i < 5; i++) {
+            LOCK(cs_main);
+            CBlock block = CreateBlock();
+            CValidationState state;
+            BOOST_CHECK(ProcessBlock(state, NULL, &block));
+            vBlocks.push_back(block);
+        }
+        BOOST_CHECK_EQUAL(nBestHeight, 5);
+        BOOST_CHECK(DumpSnapshot(path, header));
+        BOOST_CHECK_EQUAL(header.nHeight, 5);
+        BOOST_CHECK(header.hashBlock == vBlocks.back().GetHash());
+
+        // One coin changed: the snapshot is consistent in itself, but its
+        // coins are not the ones the blocks lead to
+        {
+            LOCK(cs_main);
+            uint256 txid = vBlocks[2].vtx[0].GetHash();
+            CCoins coins;
+            BOOST_CHECK(pcoinsTip->GetCoins(txid, coins));
+            coins.vout[0].nValue += COIN;
+            pcoinsTip->SetCoins(txid, coins);
+        }
+        BOOST_CHECK(DumpSnapshot(pathBad, headerBad));
+        BOOST_CHECK(headerBad.hashBlock == header.hashBlock);
+        BOOST_CHECK(headerBad.hashSet != header.hashSet);
+    }
+
+    // Block headers that are only found out when they are loaded: one too
+    // early for its parents, and one with a slower proof of play than its
+    // target allows
+    for (int nCase = 0; nCase < 2; nCase++) {
+        boost::filesystem::path pathHeaders = GetDataDir() / "snapshot_headers.dat";
+        CSnapshotFile file;
+        file.Read(path);
+        if (nCase == 0)
+            file.vHeaders[3].nTime = file.vHeaders[0].nTime;
+        else
+            file.vHeaders[3].Nonce.NumFrames = (file.vHeaders[3].nBits & MOTO_TARGET_MASK) + 1;
+        for (unsigned int i = 4; i < file.vHeaders.size(); i++)
+            file.vHeaders[i].hashPrevBlock = file.vHeaders[i-1].GetHash();
+        file.header.hashBlock = file.vHeaders.back().GetHash();
+        file.Write(pathHeaders);
+
+        CTestNode node;
+        CSnapshotHeader header2;
+        BOOST_CHECK(VerifySnapshot(pathHeaders, header2));
+        BOOST_CHECK(!LoadSnapshot(pathHeaders, header2));
+        boost::filesystem::remove(pathHeaders);
+    }
+
+    // Load into a new node, and give it the blocks below the snapshot
+    for (int nCase = 0; nCase < 2; nCase++) {
+        CTestNode node;
+        CSnapshotHeader header2;
+        BOOST_CHECK(LoadSnapshot(nCase ? pathBad : path, header2));
+        BOOST_CHECK_EQUAL(nBestHeight, 5);
+        BOOST_CHECK(hashBestChain == header.hashBlock);
+        int nHeightSnapshot, nHeightValidated;
+        BOOST_CHECK(GetSnapshotValidationProgress(nHeightSnapshot, nHeightValidated));
+        BOOST_CHECK_EQUAL(nHeightSnapshot, 5);
+        BOOST_CHECK_EQUAL(nHeightValidated, -1);
+        {
+            LOCK(cs_main);
+            CCoinsStats stats;
+            BOOST_CHECK(pcoinsTip->GetStats(stats));
+            BOOST_CHECK(stats.hashSet.GetHash() == (nCase ? headerBad.hashSet : header.hashSet));
+            BOOST_CHECK(pcoinsTip->HaveCoins(vBlocks[4].vtx[0].GetHash()));
+        }
+
+        BOOST_FOREACH(CBlock &block, vBlocks) {
+            LOCK(cs_main);
+            CBlockIndex* pindex = mapBlockIndex[block.GetHash()];
+            BOOST_CHECK(!(pindex->nStatus & BLOCK_HAVE_DATA));
+            CValidationState state;
+            BOOST_CHECK(ProcessBlock(state, NULL, &block));
+            BOOST_CHECK(pindex->nStatus & BLOCK_HAVE_DATA);
+        }
+        BOOST_CHECK_EQUAL(nBestHeight, 5);
+
+        CCoinsViewDB viewdb(1 << 20, true);
+        CCoinsViewCache view(viewdb);
+        string strError;
+        if (nCase == 0) {
+            // The history leads to the coins of the snapshot
+            BOOST_CHECK(ValidateSnapshotBlocks(viewdb, view, strError));
+            BOOST_CHECK(strError.empty());
+            BOOST_CHECK(!GetSnapshotValidationProgress(nHeightSnapshot, nHeightValidated));
+        } else {
+            // All blocks are valid, but the coins are not theirs
+            BOOST_CHECK(!ValidateSnapshotBlocks(viewdb, view, strError));
+            BOOST_CHECK(!strError.empty());
+            BOOST_CHECK(GetSnapshotValidationProgress(nHeightSnapshot, nHeightValidated));
+            BOOST_CHECK_EQUAL(nHeightValidated, 5);
+        }
+        CCoinsStats stats;
+        BOOST_CHECK(viewdb.GetStats(stats));
+        BOOST_CHECK(stats.hashSet.GetHash() == header.hashSet);
+    }
+
+    boost::filesystem::remove(path);
+    boost::filesystem::remove(pathBad);
+    SetMockReplay(false);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
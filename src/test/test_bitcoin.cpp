@@ -15,13 +15,13 @@ extern bool fPrintToConsole;
 extern void noui_connect();
 
 struct TestingSetup {
-    CCoinsViewDB *pcoinsdbview;
     boost::filesystem::path pathTemp;
     boost::thread_group threadGroup;
 
     TestingSetup() {
         fPrintToDebugger = true; // don't want to write to debug.log file
         noui_connect();
+        InitSignatureCache();
         bitdb.MakeMock();
         pathTemp = GetTempPath() / strprintf("test_motocoin_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
         boost::filesystem::create_directories(pathTemp);
@@ -64,3 +64,11 @@ void StartShutdown()
   exit(0);
 }
 
+// Set by tests that interrupt work which stops on a shutdown request
+volatile bool fRequestShutdown = false;
+
+bool ShutdownRequested()
+{
+  return fRequestShutdown;
+}
+
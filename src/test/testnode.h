@@ -0,0 +1,72 @@
+#ifndef BITCOIN_TEST_TESTNODE_H
+#define BITCOIN_TEST_TESTNODE_H
+
+#include "main.h"
+#include "txdb.h"
+
+// Empty block and coin databases with only the genesis block, in place of
+// those of the test setup, as in a node started in a new data directory
+class CTestNode
+{
+private:
+    CBlockTreeDB *pblocktreeSaved;
+    CCoinsViewDB *pcoinsdbviewSaved;
+
+public:
+    CTestNode()
+    {
+        LOCK(cs_main);
+        pcoinsTip->Flush();
+        delete pcoinsTip;
+        pblocktreeSaved = pblocktree;
+        pcoinsdbviewSaved = pcoinsdbview;
+        UnloadBlockIndex();
+        pblocktree = new CBlockTreeDB(1 << 20, true);
+        pcoinsdbview = new CCoinsViewDB(1 << 23, true);
+        pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+        InitBlockIndex();
+    }
+
+    ~CTestNode()
+    {
+        LOCK(cs_main);
+        delete pcoinsTip;
+        delete pcoinsdbview;
+        delete pblocktree;
+        pblocktree = pblocktreeSaved;
+        pcoinsdbview = pcoinsdbviewSaved;
+        pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+        UnloadBlockIndex();
+        LoadBlockIndex();
+    }
+};
+
+// A block on top of the best block with a coinbase paying to scriptPubKey.
+// Its proof of play passes the cheap checks only, so it needs SetMockReplay.
+inline CBlock CreateBlock(const CScript& scriptPubKey = CScript() << OP_TRUE)
+{
+    CBlock block;
+    block.hashPrevBlock = hashBestChain;
+    block.nTime = pindexBest->nTime + 60;
+    block.nBits = pindexBest->nBits;
+
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.SetNull();
+    tx.vin[0].scriptSig = CScript() << (nBestHeight + 1) << OP_0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 10 * COIN;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    block.vtx.push_back(tx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    motoInitPoW(&block.Nonce);
+    block.Nonce.NumFrames = 50;
+    block.Nonce.NumUpdates = 1;
+    block.Nonce.Updates[0] = 10*12 + MOTO_GAS_LEFT;
+    while (!block.CheckPoWFast())
+        block.Nonce.Nonce++;
+    return block;
+}
+
+#endif
@@ -1,6 +1,8 @@
 #include <vector>
+#include <fstream>
 #include <boost/test/unit_test.hpp>
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
 
 #include "main.h"
 #include "wallet.h"
@@ -302,4 +304,77 @@ BOOST_AUTO_TEST_CASE(util_TimingResistantEqual)
     BOOST_CHECK(!TimingResistantEqual(std::string("abc"), std::string("aba")));
 }
 
+static void CheckLogCategories(bool* pfNet, bool* pfMempool, bool* pfNull)
+{
+    // LogAcceptCategory caches -debug per thread, so this runs in a fresh one
+    *pfNet = LogAcceptCategory("net");
+    *pfMempool = LogAcceptCategory("mempool");
+    *pfNull = LogAcceptCategory(NULL);
+}
+
+BOOST_AUTO_TEST_CASE(util_LogAcceptCategory)
+{
+    bool fDebugSave = fDebug;
+    std::vector<std::string> vSave = mapMultiArgs["-debug"];
+    bool fNet, fMempool, fNull;
+
+    fDebug = true;
+    mapMultiArgs["-debug"] = std::vector<std::string>(1, "net");
+    boost::thread(boost::bind(&CheckLogCategories, &fNet, &fMempool, &fNull)).join();
+    BOOST_CHECK(fNet);
+    BOOST_CHECK(!fMempool);
+    BOOST_CHECK(fNull);
+
+    mapMultiArgs["-debug"] = std::vector<std::string>(1, "");
+    boost::thread(boost::bind(&CheckLogCategories, &fNet, &fMempool, &fNull)).join();
+    BOOST_CHECK(fNet);
+    BOOST_CHECK(fMempool);
+
+    fDebug = false;
+    boost::thread(boost::bind(&CheckLogCategories, &fNet, &fMempool, &fNull)).join();
+    BOOST_CHECK(!fNet);
+    BOOST_CHECK(!fMempool);
+    BOOST_CHECK(fNull);
+
+    fDebug = fDebugSave;
+    mapMultiArgs["-debug"] = vSave;
+}
+
+BOOST_AUTO_TEST_CASE(util_debug_log_queue)
+{
+    // Without its thread the writer keeps everything queued, so the queue
+    // fills up: 8 MB hold exactly 128 messages of 64 kB
+    fPrintToDebugger = false;
+    StartDebugLogWriter(false);
+    for (int i = 0; i < 150; i++)
+    {
+        std::string str = strprintf("queued %03d ", i);
+        str.resize(65535, 'x');
+        printf("%s\n", str.c_str());
+    }
+    StopDebugLogWriter();
+    printf("after the writer\n");
+    fPrintToDebugger = true;
+
+    std::ifstream file((GetDataDir() / "debug.log").string().c_str());
+    std::string strLog((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    // What fit is written in order, then the number of messages dropped
+    size_t nPos = 0;
+    for (int i = 0; i < 128; i++)
+    {
+        size_t nNext = strLog.find(strprintf("queued %03d ", i));
+        BOOST_CHECK(nNext != std::string::npos && nNext >= nPos);
+        nPos = nNext;
+    }
+    BOOST_CHECK(strLog.find("queued 128 ") == std::string::npos);
+    BOOST_CHECK(strLog.find("queued 149 ") == std::string::npos);
+    size_t nDropped = strLog.find("*** debug log queue full, 22 messages dropped");
+    BOOST_CHECK(nDropped != std::string::npos && nDropped > nPos);
+    size_t nStopped = strLog.find("Debug log writer stopped: 128 messages written, 22 dropped");
+    BOOST_CHECK(nStopped != std::string::npos && nStopped > nDropped);
+    size_t nAfter = strLog.find("after the writer");
+    BOOST_CHECK(nAfter != std::string::npos && nAfter > nStopped);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -1,7 +1,11 @@
 #include <boost/test/unit_test.hpp>
 
+#include <boost/bind.hpp>
+
 #include "main.h"
 #include "wallet.h"
+#include "walletdb.h"
+#include "test/testnode.h"
 
 // how many times to run all the tests to have a chance to catch errors that only show up with particular random shuffles
 #define RUN_TESTS 100
@@ -14,6 +18,8 @@ using namespace std;
 
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
+extern volatile bool fRequestShutdown;
+
 BOOST_AUTO_TEST_SUITE(wallet_tests)
 
 static CWallet wallet;
@@ -247,14 +253,23 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         BOOST_CHECK_EQUAL(nValueRet, 1.01 * COIN);   // we should get 1 + 0.01
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
 
+        // an exact match that random subsets rarely hit: 31 * 3 + 7 = 100 cents
+        empty_wallet();
+        for (int i2 = 0; i2 < 40; i2++)
+            add_coin(3 * CENT);
+        add_coin(7 * CENT);
+        BOOST_CHECK( wallet.SelectCoinsMinConf(100 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 100 * CENT);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 32U);
+
         // test randomness
         {
             empty_wallet();
             for (int i2 = 0; i2 < 100; i2++)
                 add_coin(COIN);
 
-            // picking 50 from 100 coins doesn't depend on the shuffle,
-            // but does depend on randomness in the stochastic approximation code
+            // picking 50 from 100 coins depends on the shuffle, which
+            // decides which of the identical coins the exact search finds first
             BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet , nValueRet));
             BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet2, nValueRet));
             BOOST_CHECK(!equal_sets(setCoinsRet, setCoinsRet2));
@@ -292,4 +307,158 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(incremental_balances)
+{
+    CWallet keywallet("wallet_balance_test.dat");
+    bool fFirstRun;
+    keywallet.LoadWallet(fFirstRun);
+    CKey key;
+    key.MakeNewKey(true);
+    keywallet.AddKey(key);
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    BOOST_CHECK(keywallet.CheckBalances());
+
+    // Unconfirmed payment from someone else
+    CTransaction tx1;
+    tx1.vin.resize(1);
+    tx1.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx1.vout.resize(2);
+    tx1.vout[0].nValue = 10 * COIN;
+    tx1.vout[0].scriptPubKey = scriptPubKey;
+    tx1.vout[1].nValue = 3 * COIN;
+    BOOST_CHECK(keywallet.AddToWallet(CWalletTx(&keywallet, tx1)));
+    BOOST_CHECK(keywallet.CheckBalances());
+    BOOST_CHECK_EQUAL(keywallet.GetBalance(), 0);
+    BOOST_CHECK_EQUAL(keywallet.GetUnconfirmedBalance(), 10 * COIN);
+    BOOST_CHECK_EQUAL(keywallet.GetImmatureBalance(), 0);
+
+    // Spending it marks the output spent; the change stays unconfirmed
+    CTransaction tx2;
+    tx2.vin.resize(1);
+    tx2.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx2.vout.resize(2);
+    tx2.vout[0].nValue = 4 * COIN;
+    tx2.vout[0].scriptPubKey = scriptPubKey;
+    tx2.vout[1].nValue = 6 * COIN;
+    BOOST_CHECK(keywallet.AddToWallet(CWalletTx(&keywallet, tx2)));
+    BOOST_CHECK(keywallet.CheckBalances());
+    BOOST_CHECK_EQUAL(keywallet.GetUnconfirmedBalance(), 4 * COIN);
+
+    // Only the unspent output of ours is available, once its transaction is
+    // in the memory pool
+    vector<COutput> vAvailable;
+    keywallet.AvailableCoins(vAvailable, false);
+    BOOST_CHECK(vAvailable.empty());
+    mempool.addUnchecked(tx2.GetHash(), tx2);
+    keywallet.AvailableCoins(vAvailable, false);
+    BOOST_CHECK_EQUAL(vAvailable.size(), 1U);
+    if (!vAvailable.empty())
+    {
+        BOOST_CHECK(vAvailable[0].tx->GetHash() == tx2.GetHash());
+        BOOST_CHECK_EQUAL(vAvailable[0].i, 0);
+    }
+    keywallet.AvailableCoins(vAvailable, true);
+    BOOST_CHECK(vAvailable.empty());
+    mempool.remove(tx2);
+
+    // Spent flags learnt from a transaction that is not ours
+    CTransaction tx3;
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    tx3.vout.resize(1);
+    tx3.vout[0].nValue = 4 * COIN;
+    keywallet.WalletUpdateSpent(tx3);
+    BOOST_CHECK(keywallet.CheckBalances());
+    BOOST_CHECK_EQUAL(keywallet.GetUnconfirmedBalance(), 0);
+    keywallet.AvailableCoins(vAvailable, false);
+    BOOST_CHECK(vAvailable.empty());
+
+    BOOST_CHECK(keywallet.EraseFromWallet(tx2.GetHash()));
+    BOOST_CHECK(keywallet.CheckBalances());
+    BOOST_CHECK_EQUAL(keywallet.GetUnconfirmedBalance(), 0);
+
+    // The coinbase of a block that is not in the main chain counts nowhere
+    CTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].nValue = 50 * COIN;
+    txCoinBase.vout[0].scriptPubKey = scriptPubKey;
+    CWalletTx wtxCoinBase(&keywallet, txCoinBase);
+    wtxCoinBase.hashBlock = GetRandHash();
+    wtxCoinBase.nIndex = 0;
+    BOOST_CHECK(keywallet.AddToWallet(wtxCoinBase));
+    BOOST_CHECK(keywallet.CheckBalances());
+    BOOST_CHECK_EQUAL(keywallet.GetImmatureBalance(), 0);
+    BOOST_CHECK_EQUAL(keywallet.GetUnconfirmedBalance(), 0);
+
+    keywallet.MarkDirty();
+    BOOST_CHECK(keywallet.CheckBalances());
+}
+
+// Requests a shutdown once the rescan has added hashStop to the wallet
+static void InterruptRescan(const uint256& hashStop, CWallet* wallet, const uint256& hashTx, ChangeType status)
+{
+    if (hashTx == hashStop)
+        fRequestShutdown = true;
+}
+
+BOOST_AUTO_TEST_CASE(rescan_resume)
+{
+    SetMockReplay(true);
+    {
+        CTestNode node;
+        CWallet scanwallet("wallet_rescan_test.dat");
+        bool fFirstRun;
+        scanwallet.LoadWallet(fFirstRun);
+        CScript scriptPubKey;
+        scriptPubKey.SetDestination(scanwallet.GenerateNewKey().GetID());
+
+        // A chain longer than a rescan batch, where every tenth coinbase
+        // pays the wallet and the others, which the prefilter skips, pay
+        // anyone
+        vector<uint256> vMine;
+        for (int nHeight = 1; nHeight <= 130; nHeight++)
+        {
+            CBlock block = CreateBlock(nHeight % 10 == 0 ? scriptPubKey : CScript() << OP_TRUE);
+            CValidationState state;
+            BOOST_CHECK(ProcessBlock(state, NULL, &block));
+            if (nHeight % 10 == 0)
+                vMine.push_back(block.vtx[0].GetHash());
+        }
+        BOOST_CHECK_EQUAL(nBestHeight, 130);
+
+        // The wallet was up to date when a full rescan was started
+        scanwallet.SetBestChain(CBlockLocator(pindexBest));
+
+        // Shut down while the first batch is added: the batch is finished,
+        // its last block saved, and the second batch is not started
+        boost::signals2::connection conn = scanwallet.NotifyTransactionChanged.connect(boost::bind(&InterruptRescan, vMine[4], _1, _2, _3));
+        BOOST_CHECK_EQUAL(scanwallet.ScanForWalletTransactions(pindexGenesisBlock, true), 12);
+        conn.disconnect();
+        fRequestShutdown = false;
+        BOOST_CHECK_EQUAL(scanwallet.mapWallet.size(), 12U);
+        BOOST_CHECK(!scanwallet.mapWallet.count(vMine[12]));
+
+        CBlockLocator locator;
+        BOOST_CHECK(CWalletDB("wallet_rescan_test.dat").ReadRescanBlock(locator));
+        BOOST_CHECK_EQUAL(locator.GetBlockIndex()->nHeight, 127);
+
+        // The next start resumes from the saved block rather than from the
+        // wallet's best block, and only finds the transaction after it
+        CBlockIndex* pindexRescan = scanwallet.GetRescanStart();
+        BOOST_CHECK_EQUAL(pindexRescan->nHeight, 127);
+        BOOST_CHECK_EQUAL(scanwallet.ScanForWalletTransactions(pindexRescan, true), 1);
+        BOOST_CHECK_EQUAL(scanwallet.mapWallet.size(), 13U);
+        BOOST_FOREACH(const uint256& hash, vMine)
+            BOOST_CHECK(scanwallet.mapWallet.count(hash));
+
+        // A finished rescan leaves nothing to resume
+        BOOST_CHECK(!CWalletDB("wallet_rescan_test.dat").ReadRescanBlock(locator));
+        BOOST_CHECK(scanwallet.GetRescanStart() == pindexBest);
+    }
+    SetMockReplay(false);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
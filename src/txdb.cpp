@@ -20,7 +20,62 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+CCoinsViewDB *pcoinsdbview = NULL;
+
+// Hash of an unspent output, as an element of the set hash
+static uint256 GetOutputHash(const uint256 &txid, unsigned int n, const CCoins &coins, const CTxOut &out) {
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << txid << VARINT(n) << VARINT(coins.nHeight) << (coins.fCoinBase ? 'c' : 'n') << out;
+    return ss.GetHash();
+}
+
+// Move the statistics from the old version of the coins of txid (if any) to
+// the new one. Only the outputs that differ are hashed.
+void static UpdateStats(CCoinsStats &stats, const uint256 &txid, const CCoins *pcoinsOld, const CCoins &coinsNew) {
+    if (pcoinsOld && pcoinsOld->IsPruned())
+        pcoinsOld = NULL;
+    const CCoins *pcoinsNew = coinsNew.IsPruned() ? NULL : &coinsNew;
+
+    if (pcoinsOld) {
+        stats.nTransactions--;
+        stats.nSerializedSize -= 32 + ::GetSerializeSize(*pcoinsOld, SER_DISK, CLIENT_VERSION);
+    }
+    if (pcoinsNew) {
+        stats.nTransactions++;
+        stats.nSerializedSize += 32 + ::GetSerializeSize(*pcoinsNew, SER_DISK, CLIENT_VERSION);
+    }
+
+    // If the transaction itself was replaced, all of its outputs differ
+    bool fSameTx = pcoinsOld && pcoinsNew && pcoinsOld->nHeight == pcoinsNew->nHeight &&
+                   pcoinsOld->fCoinBase == pcoinsNew->fCoinBase;
+    unsigned int nOutputs = std::max(pcoinsOld ? pcoinsOld->vout.size() : 0, pcoinsNew ? pcoinsNew->vout.size() : 0);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        const CTxOut *poutOld = (pcoinsOld && pcoinsOld->IsAvailable(i)) ? &pcoinsOld->vout[i] : NULL;
+        const CTxOut *poutNew = (pcoinsNew && pcoinsNew->IsAvailable(i)) ? &pcoinsNew->vout[i] : NULL;
+        if (fSameTx && poutOld && poutNew && *poutOld == *poutNew)
+            continue;
+        if (poutOld) {
+            stats.nTransactionOutputs--;
+            stats.nTotalAmount -= poutOld->nValue;
+            stats.hashSet.Remove(GetOutputHash(txid, i, *pcoinsOld, *poutOld));
+        }
+        if (poutNew) {
+            stats.nTransactionOutputs++;
+            stats.nTotalAmount += poutNew->nValue;
+            stats.hashSet.Insert(GetOutputHash(txid, i, *pcoinsNew, *poutNew));
+        }
+    }
+}
+
+CCoinsViewDB::CCoinsViewDB(const CLevelDBOptions &dboptions, bool fMemory, bool fWipe, const char *pszDir) : db(GetDataDir() / pszDir, dboptions, fMemory, fWipe), fStatsValid(false) {
+    // An empty database starts with empty statistics
+    uint256 hashBestChain;
+    if (!db.Read('B', hashBestChain))
+        fStatsValid = true;
+    else if (db.Read('S', stats) && stats.hashBlock == hashBestChain)
+        fStatsValid = true;
+    else
+        stats = CCoinsStats();
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) { 
@@ -28,9 +83,15 @@ bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) {
 }
 
 bool CCoinsViewDB::SetCoins(const uint256 &txid, const CCoins &coins) {
-    CLevelDBBatch batch;
-    BatchWriteCoins(batch, txid, coins);
-    return db.WriteBatch(batch);
+    CCoinsMap mapCoins;
+    CCoinsCacheEntry &entry = mapCoins[txid];
+    entry.coins = coins;
+    entry.flags = CCoinsCacheEntry::DIRTY;
+    if (GetCoins(txid, entry.coinsBase))
+        entry.flags |= CCoinsCacheEntry::BASE;
+    else
+        entry.flags |= CCoinsCacheEntry::FRESH;
+    return BatchWrite(mapCoins, NULL);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) {
@@ -48,24 +109,55 @@ CBlockIndex *CCoinsViewDB::GetBestBlock() {
 }
 
 bool CCoinsViewDB::SetBestBlock(CBlockIndex *pindex) {
-    CLevelDBBatch batch;
-    BatchWriteHashBestChain(batch, pindex->GetBlockHash()); 
-    return db.WriteBatch(batch);
+    CCoinsMap mapCoins;
+    return BatchWrite(mapCoins, pindex);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    printf("Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
-
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    LOCK(cs_stats);
     CLevelDBBatch batch;
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        BatchWriteCoins(batch, it->first, it->second);
-    if (pindex)
+    CCoinsStats statsNew = stats;
+    bool fStatsValidNew = fStatsValid;
+    unsigned int nChanged = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        // Never written to disk, and now spent: nothing to erase either
+        if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned())
+            continue;
+        if (fStatsValidNew) {
+            // Fresh coins have no earlier version on disk to take out. Coins
+            // set without looking at the earlier version leave the statistics
+            // to be counted again.
+            if (it->second.flags & CCoinsCacheEntry::FRESH)
+                UpdateStats(statsNew, it->first, NULL, it->second.coins);
+            else if (it->second.flags & CCoinsCacheEntry::BASE)
+                UpdateStats(statsNew, it->first, &it->second.coinsBase, it->second.coins);
+            else
+                fStatsValidNew = false;
+        }
+        BatchWriteCoins(batch, it->first, it->second.coins);
+        nChanged++;
+    }
+    printf("Committing %u changed transactions (out of %u) to coin database...\n", nChanged, (unsigned int)mapCoins.size());
+
+    if (pindex) {
         BatchWriteHashBestChain(batch, pindex->GetBlockHash());
+        statsNew.hashBlock = pindex->GetBlockHash();
+    }
+    if (fStatsValidNew)
+        batch.Write('S', statsNew);
+    else if (fStatsValid)
+        batch.Erase('S');
 
-    return db.WriteBatch(batch);
+    if (!db.WriteBatch(batch))
+        return false;
+    stats = statsNew;
+    fStatsValid = fStatsValidNew;
+    return true;
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+CBlockTreeDB::CBlockTreeDB(const CLevelDBOptions &dboptions, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "blocks" / "index", dboptions, fMemory, fWipe) {
 }
 
 bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
@@ -73,6 +165,11 @@ bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
 }
 
+bool CBlockTreeDB::ReadBlockIndex(const uint256 &hash, CDiskBlockIndex& blockindex)
+{
+    return Read(make_pair('b', hash), blockindex);
+}
+
 bool CBlockTreeDB::ReadBestInvalidWork(CBigNum& bnBestInvalidWork)
 {
     return Read('I', bnBestInvalidWork);
@@ -111,14 +208,30 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
+bool CCoinsViewDB::GetStats(CCoinsStats &statsRet) {
+    LOCK(cs_stats);
+    if (!fStatsValid) {
+        // Written by an older version: count once, and keep them from now on
+        CCoinsStats statsScan;
+        if (!ScanStats(statsScan))
+            return false;
+        if (!db.Write('S', statsScan))
+            return false;
+        stats = statsScan;
+        fStatsValid = true;
+    }
+    statsRet = stats;
+    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(stats.hashBlock);
+    statsRet.nHeight = (it == mapBlockIndex.end()) ? 0 : it->second->nHeight;
+    return true;
+}
+
+bool CCoinsViewDB::ScanStats(CCoinsStats &statsRet) {
     leveldb::Iterator *pcursor = db.NewIterator();
     pcursor->SeekToFirst();
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock()->GetBlockHash();
-    ss << stats.hashBlock;
-    int64 nTotalAmount = 0;
+    statsRet = CCoinsStats();
+    db.Read('B', statsRet.hashBlock);
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
@@ -133,32 +246,48 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
                 ssValue >> coins;
                 uint256 txhash;
                 ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n'); 
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+                UpdateStats(statsRet, txhash, NULL, coins);
             }
             pcursor->Next();
         } catch (std::exception &e) {
+            delete pcursor;
             return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
     }
     delete pcursor;
-    stats.nHeight = GetBestBlock()->nHeight;
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(statsRet.hashBlock);
+    statsRet.nHeight = (it == mapBlockIndex.end()) ? 0 : it->second->nHeight;
+    return true;
+}
+
+CCoinsViewDBCursor *CCoinsViewDB::Cursor() {
+    return new CCoinsViewDBCursor(db.NewIterator());
+}
+
+CCoinsViewDBCursor::CCoinsViewDBCursor(leveldb::Iterator *pcursorIn) : pcursor(pcursorIn) {
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << 'c';
+    pcursor->Seek(ssKeySet.str());
+}
+
+CCoinsViewDBCursor::~CCoinsViewDBCursor() {
+    delete pcursor;
+}
+
+bool CCoinsViewDBCursor::Next(uint256 &txid, CCoins &coins) {
+    if (!pcursor->Valid())
+        return false;
+    leveldb::Slice slKey = pcursor->key();
+    CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+    char chType;
+    ssKey >> chType;
+    if (chType != 'c')
+        return false;
+    ssKey >> txid;
+    leveldb::Slice slValue = pcursor->value();
+    CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+    ssValue >> coins;
+    pcursor->Next();
     return true;
 }
 
@@ -173,6 +302,61 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::ReadAddrIndex(const CAddrIndexKey &key, CAddrIndexValue &value) {
+    return Read(make_pair('a', key), value);
+}
+
+bool CBlockTreeDB::WriteAddrIndex(const CAddrIndexUpdate &update) {
+    CLevelDBBatch batch;
+    for (std::map<CAddrIndexKey, CAddrIndexValue>::const_iterator it = update.mapEntries.begin(); it != update.mapEntries.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('a', it->first));
+        else
+            batch.Write(make_pair('a', it->first), it->second);
+    }
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadAddrIndex(const uint160 &hashScript, bool fUnspentOnly, unsigned int nSkip, unsigned int nCount,
+                                 std::vector<std::pair<CAddrIndexKey, CAddrIndexValue> > &vEntries) {
+    vEntries.clear();
+    leveldb::Iterator *pcursor = NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('a', hashScript);
+    std::string strPrefix = ssKeySet.str();
+    pcursor->Seek(strPrefix);
+
+    while (pcursor->Valid() && vEntries.size() < nCount) {
+        boost::this_thread::interruption_point();
+        leveldb::Slice slKey = pcursor->key();
+        if (!slKey.starts_with(strPrefix))
+            break;
+        try {
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddrIndexKey key;
+            ssKey >> chType >> key;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddrIndexValue value;
+            ssValue >> value;
+            if (!fUnspentOnly || !value.IsSpent()) {
+                if (nSkip > 0)
+                    nSkip--;
+                else
+                    vEntries.push_back(std::make_pair(key, value));
+            }
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+        pcursor->Next();
+    }
+    delete pcursor;
+    return true;
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
 }
@@ -185,6 +369,23 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+bool CBlockTreeDB::WriteSnapshotBase(const uint256 &hashBlock, const uint256 &hashSet) {
+    return Write('U', std::make_pair(hashBlock, hashSet));
+}
+
+bool CBlockTreeDB::ReadSnapshotBase(uint256 &hashBlock, uint256 &hashSet) {
+    std::pair<uint256, uint256> base;
+    if (!Read('U', base))
+        return false;
+    hashBlock = base.first;
+    hashSet = base.second;
+    return true;
+}
+
+bool CBlockTreeDB::EraseSnapshotBase() {
+    return Erase('U');
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     leveldb::Iterator *pcursor = NewIterator();
@@ -218,7 +419,8 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
                 pindexNew->nTime          = diskindex.nTime;
                 pindexNew->nBits          = diskindex.nBits;
-                pindexNew->Nonce          = diskindex.Nonce;
+                pindexNew->nNonce         = diskindex.Nonce.Nonce;
+                pindexNew->nFrames        = diskindex.Nonce.NumFrames;
                 pindexNew->nStatus        = diskindex.nStatus;
                 pindexNew->nTx            = diskindex.nTx;
 
@@ -8,33 +8,68 @@
 #include "main.h"
 #include "leveldb.h"
 
+class CCoinsViewDBCursor;
+
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDB db;
+
+    // Statistics of what is in db, updated with every write. Databases
+    // written by older versions do not have them until GetStats() is called.
+    CCriticalSection cs_stats;
+    CCoinsStats stats;
+    bool fStatsValid;
+
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(const CLevelDBOptions &dboptions, bool fMemory = false, bool fWipe = false, const char *pszDir = "chainstate");
 
     bool GetCoins(const uint256 &txid, CCoins &coins);
     bool SetCoins(const uint256 &txid, const CCoins &coins);
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
+    // Compute the statistics from scratch by reading the whole database
+    bool ScanStats(CCoinsStats &stats);
+    void GetDBStats(CLevelDBStats &stats) { db.GetStats(stats); }
+    // Iterate over the coins as they are at the time of the call
+    CCoinsViewDBCursor *Cursor();
+};
+
+/** Walks the coins of a CCoinsViewDB in the order of their keys. Later
+ *  writes to the database are not seen. */
+class CCoinsViewDBCursor
+{
+private:
+    leveldb::Iterator *pcursor;
+
+    CCoinsViewDBCursor(const CCoinsViewDBCursor&);
+    void operator=(const CCoinsViewDBCursor&);
+
+public:
+    CCoinsViewDBCursor(leveldb::Iterator *pcursorIn);
+    ~CCoinsViewDBCursor();
+
+    // Read the next entry; returns false at the end. Throws on corrupt entries.
+    bool Next(uint256 &txid, CCoins &coins);
 };
 
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CLevelDB
 {
 public:
-    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CBlockTreeDB(const CLevelDBOptions &dboptions, bool fMemory = false, bool fWipe = false);
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
 public:
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool ReadBlockIndex(const uint256 &hash, CDiskBlockIndex& blockindex);
     bool ReadBestInvalidWork(CBigNum& bnBestInvalidWork);
     bool WriteBestInvalidWork(const CBigNum& bnBestInvalidWork);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
@@ -45,8 +80,19 @@ public:
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    bool ReadAddrIndex(const CAddrIndexKey &key, CAddrIndexValue &value);
+    bool WriteAddrIndex(const CAddrIndexUpdate &update);
+    // Read the entries for a script, in order of height, skipping the first nSkip
+    // and returning at most nCount. Spent outputs are left out if fUnspentOnly.
+    bool ReadAddrIndex(const uint160 &hashScript, bool fUnspentOnly, unsigned int nSkip, unsigned int nCount,
+                       std::vector<std::pair<CAddrIndexKey, CAddrIndexValue> > &vEntries);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    // The block a UTXO snapshot was loaded at and the hash_set it claimed,
+    // kept until the blocks below it have been validated
+    bool WriteSnapshotBase(const uint256 &hashBlock, const uint256 &hashSet);
+    bool ReadSnapshotBase(uint256 &hashBlock, uint256 &hashSet);
+    bool EraseSnapshotBase();
     bool LoadBlockIndexGuts();
 };
 
@@ -15,6 +15,30 @@
 typedef long long  int64;
 typedef unsigned long long  uint64;
 
+// Bob Jenkins' lookup3 mixing steps, used by uint256::GetHash
+#define UINT256_HASH_ROT(x, k) (((x) << (k)) | ((x) >> (32 - (k))))
+
+#define UINT256_HASH_MIX(a, b, c) \
+    do { \
+        a -= c; a ^= UINT256_HASH_ROT(c, 4); c += b; \
+        b -= a; b ^= UINT256_HASH_ROT(a, 6); a += c; \
+        c -= b; c ^= UINT256_HASH_ROT(b, 8); b += a; \
+        a -= c; a ^= UINT256_HASH_ROT(c,16); c += b; \
+        b -= a; b ^= UINT256_HASH_ROT(a,19); a += c; \
+        c -= b; c ^= UINT256_HASH_ROT(b, 4); b += a; \
+    } while (0)
+
+#define UINT256_HASH_FINAL(a, b, c) \
+    do { \
+        c ^= b; c -= UINT256_HASH_ROT(b,14); \
+        a ^= c; a -= UINT256_HASH_ROT(c,11); \
+        b ^= a; b -= UINT256_HASH_ROT(a,25); \
+        c ^= b; c -= UINT256_HASH_ROT(b,16); \
+        a ^= c; a -= UINT256_HASH_ROT(c, 4); \
+        b ^= a; b -= UINT256_HASH_ROT(a,14); \
+        c ^= b; c -= UINT256_HASH_ROT(b,24); \
+    } while (0)
+
 
 inline int Testuint256AdHoc(std::vector<std::string> vArg);
 
@@ -587,6 +611,28 @@ public:
         else
             *this = 0;
     }
+
+    // Salted 64-bit hash for use as a hash table key (lookup3 mixing).
+    // The salt keeps peers from predicting bucket placement.
+    uint64 GetHash(const uint256& salt) const
+    {
+        unsigned int a, b, c;
+        a = b = c = 0xdeadbeef + (WIDTH << 2);
+
+        a += pn[0] ^ salt.pn[0];
+        b += pn[1] ^ salt.pn[1];
+        c += pn[2] ^ salt.pn[2];
+        UINT256_HASH_MIX(a, b, c);
+        a += pn[3] ^ salt.pn[3];
+        b += pn[4] ^ salt.pn[4];
+        c += pn[5] ^ salt.pn[5];
+        UINT256_HASH_MIX(a, b, c);
+        a += pn[6] ^ salt.pn[6];
+        b += pn[7] ^ salt.pn[7];
+        UINT256_HASH_FINAL(a, b, c);
+
+        return ((((uint64)b) << 32) | c);
+    }
 };
 
 inline bool operator==(const uint256& a, uint64 b)                           { return (base_uint256)a == b; }
@@ -37,9 +37,12 @@ namespace boost {
 #include <boost/filesystem/fstream.hpp>
 #include <boost/foreach.hpp>
 #include <boost/thread.hpp>
+#include <boost/atomic.hpp>
+#include <boost/lockfree/queue.hpp>
 #include <openssl/crypto.h>
 #include <openssl/rand.h>
 #include <stdarg.h>
+#include <set>
 
 #ifdef WIN32
 #ifdef _MSC_VER
@@ -222,6 +225,32 @@ static boost::once_flag debugPrintInitFlag = BOOST_ONCE_INIT;
 static FILE* fileout = NULL;
 static boost::mutex* mutexDebugLog = NULL;
 
+// Once StartDebugLogWriter() has been called, OutputDebugStringF only formats
+// the message and pushes it onto a lock-free queue; a single writer thread
+// drains the queue and writes whole batches to debug.log. The queue is bounded
+// in bytes: if the writer falls behind, new messages are dropped and counted
+// rather than letting memory grow without limit.
+struct CDebugLogMessage
+{
+    int64 nTime;
+    std::string str;
+};
+
+static const size_t MAX_DEBUG_LOG_QUEUE_BYTES = 8 * 1024 * 1024;
+// Wake the writer early once this much output is pending
+static const size_t DEBUG_LOG_WAKEUP_BYTES = 64 * 1024;
+
+static boost::lockfree::queue<CDebugLogMessage*>* pqueueDebugLog = NULL;
+static boost::condition_variable* pcondDebugLog = NULL;
+static boost::thread* pthreadDebugLog = NULL;
+static boost::atomic<bool> fDebugLogAsync(false);
+static boost::atomic<size_t> nDebugLogQueuedBytes(0);
+static boost::atomic<uint64> nDebugLogWritten(0);
+static boost::atomic<uint64> nDebugLogDropped(0);
+// Protected by mutexDebugLog
+static bool fStartedNewLine = true;
+static uint64 nDebugLogDroppedReported = 0;
+
 static void DebugPrintInit()
 {
     assert(fileout == NULL);
@@ -232,6 +261,152 @@ static void DebugPrintInit()
     if (fileout) setbuf(fileout, NULL); // unbuffered
 
     mutexDebugLog = new boost::mutex();
+    pqueueDebugLog = new boost::lockfree::queue<CDebugLogMessage*>(1024);
+    pcondDebugLog = new boost::condition_variable();
+}
+
+// Both of these must be called with mutexDebugLog held
+static void ReopenDebugLogIfRequested()
+{
+    if (fReopenDebugLog) {
+        fReopenDebugLog = false;
+        boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
+        if (freopen(pathDebug.string().c_str(),"a",fileout) != NULL)
+            setbuf(fileout, NULL); // unbuffered
+    }
+}
+
+static void AppendDebugLogMessage(std::string& strBuf, int64 nTime, const std::string& str)
+{
+    if (str.empty())
+        return;
+
+    // Debug print useful for profiling
+    if (fLogTimestamps && fStartedNewLine)
+    {
+        // Messages arrive in bursts, so formatting the same second over and over is common
+        static int64 nLastTime = -1;
+        static std::string strLastTime;
+        if (nTime != nLastTime)
+        {
+            strLastTime = DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nTime);
+            nLastTime = nTime;
+        }
+        strBuf += strLastTime;
+        strBuf += ' ';
+    }
+    fStartedNewLine = (str[str.size() - 1] == '\n');
+    strBuf += str;
+}
+
+static void FlushDebugLogQueue()
+{
+    boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+
+    std::string strBuf;
+    CDebugLogMessage* pmsg;
+    while (pqueueDebugLog->pop(pmsg))
+    {
+        nDebugLogQueuedBytes -= pmsg->str.size();
+        AppendDebugLogMessage(strBuf, pmsg->nTime, pmsg->str);
+        delete pmsg;
+        nDebugLogWritten++;
+    }
+
+    uint64 nDropped = nDebugLogDropped;
+    if (nDropped != nDebugLogDroppedReported)
+    {
+        if (!fStartedNewLine)
+            strBuf += '\n';
+        fStartedNewLine = true;
+        AppendDebugLogMessage(strBuf, GetTime(), strprintf("*** debug log queue full, %" PRI64u " messages dropped\n", nDropped - nDebugLogDroppedReported));
+        nDebugLogDroppedReported = nDropped;
+    }
+
+    if (strBuf.empty())
+        return;
+
+    // reopen the log file, if requested
+    ReopenDebugLogIfRequested();
+    fwrite(strBuf.data(), 1, strBuf.size(), fileout);
+}
+
+static void ThreadDebugLogWriter()
+{
+    RenameThread("bitcoin-logwriter");
+
+    boost::mutex mutexWait;
+    while (fDebugLogAsync)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutexWait);
+            pcondDebugLog->timed_wait(lock, boost::posix_time::milliseconds(100));
+        }
+        FlushDebugLogQueue();
+    }
+    FlushDebugLogQueue();
+}
+
+void StartDebugLogWriter(bool fThread)
+{
+    if (fPrintToConsole || fPrintToDebugger)
+        return;
+    boost::call_once(&DebugPrintInit, debugPrintInitFlag);
+    if (fileout == NULL || fDebugLogAsync)
+        return;
+
+    fDebugLogAsync = true;
+    if (fThread)
+        pthreadDebugLog = new boost::thread(&ThreadDebugLogWriter);
+}
+
+void StopDebugLogWriter()
+{
+    if (!fDebugLogAsync)
+        return;
+
+    fDebugLogAsync = false;
+    if (pthreadDebugLog != NULL)
+    {
+        pcondDebugLog->notify_one();
+        pthreadDebugLog->join();
+        delete pthreadDebugLog;
+        pthreadDebugLog = NULL;
+    }
+
+    // Pick up anything pushed while the writer was exiting
+    FlushDebugLogQueue();
+    printf("Debug log writer stopped: %" PRI64u " messages written, %" PRI64u " dropped\n",
+           (uint64)nDebugLogWritten, (uint64)nDebugLogDropped);
+}
+
+bool LogAcceptCategory(const char* category)
+{
+    if (category != NULL)
+    {
+        if (!fDebug)
+            return false;
+
+        // Give each thread quick access to -debug settings.
+        // This helps prevent issues debugging global destructors,
+        // where mapMultiArgs might be deleted before another
+        // global destructor calls LogPrint()
+        static boost::thread_specific_ptr<set<string> > ptrCategory;
+        if (ptrCategory.get() == NULL)
+        {
+            const vector<string>& categories = mapMultiArgs["-debug"];
+            ptrCategory.reset(new set<string>(categories.begin(), categories.end()));
+            // thread_specific_ptr automatically deletes the set when the thread ends.
+        }
+        const set<string>& setCategories = *ptrCategory.get();
+
+        // if not debugging everything and not debugging specific category, LogPrint does nothing.
+        if (setCategories.count(string("")) == 0 &&
+            setCategories.count(string("1")) == 0 &&
+            setCategories.count(string(category)) == 0)
+            return false;
+    }
+    return true;
 }
 
 int OutputDebugStringF(const char* pszFormat, ...)
@@ -247,34 +422,47 @@ int OutputDebugStringF(const char* pszFormat, ...)
     }
     else if (!fPrintToDebugger)
     {
-        static bool fStartedNewLine = true;
         boost::call_once(&DebugPrintInit, debugPrintInitFlag);
 
         if (fileout == NULL)
             return ret;
 
-        boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+        va_list arg_ptr;
+        va_start(arg_ptr, pszFormat);
+        std::string str = vstrprintf(pszFormat, arg_ptr);
+        va_end(arg_ptr);
+        ret += str.size();
 
-        // reopen the log file, if requested
-        if (fReopenDebugLog) {
-            fReopenDebugLog = false;
-            boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
-            if (freopen(pathDebug.string().c_str(),"a",fileout) != NULL)
-                setbuf(fileout, NULL); // unbuffered
+        if (fDebugLogAsync)
+        {
+            size_t nSize = str.size();
+            if (nDebugLogQueuedBytes + nSize > MAX_DEBUG_LOG_QUEUE_BYTES)
+            {
+                nDebugLogDropped++;
+                return 0;
+            }
+            CDebugLogMessage* pmsg = new CDebugLogMessage();
+            pmsg->nTime = GetTime();
+            pmsg->str.swap(str);
+            size_t nQueued = (nDebugLogQueuedBytes += nSize);
+            pqueueDebugLog->push(pmsg);
+            if (nQueued >= DEBUG_LOG_WAKEUP_BYTES && nQueued - nSize < DEBUG_LOG_WAKEUP_BYTES)
+                pcondDebugLog->notify_one();
+            // The writer may have made its final flush since the check above
+            if (!fDebugLogAsync)
+                FlushDebugLogQueue();
         }
-
-        // Debug print useful for profiling
-        if (fLogTimestamps && fStartedNewLine)
-            ret += fprintf(fileout, "%s ", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", GetTime()).c_str());
-        if (pszFormat[strlen(pszFormat) - 1] == '\n')
-            fStartedNewLine = true;
         else
-            fStartedNewLine = false;
+        {
+            boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
 
-        va_list arg_ptr;
-        va_start(arg_ptr, pszFormat);
-        ret += vfprintf(fileout, pszFormat, arg_ptr);
-        va_end(arg_ptr);
+            // reopen the log file, if requested
+            ReopenDebugLogIfRequested();
+
+            std::string strBuf;
+            AppendDebugLogMessage(strBuf, GetTime(), str);
+            fwrite(strBuf.data(), 1, strBuf.size(), fileout);
+        }
     }
 
 #ifdef WIN32
@@ -1363,7 +1551,7 @@ void AddTimeData(const CNetAddr& ip, int64 nTime)
                 }
             }
         }
-        if (fDebug) {
+        if (LogAcceptCategory("net")) {
             BOOST_FOREACH(int64 n, vSorted)
                 printf("%+" PRI64d "  ", n);
             printf("|  ");
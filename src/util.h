@@ -179,6 +179,17 @@ bool ATTR_WARN_PRINTF(1,2) error(const char *format, ...);
  */
 #define printf OutputDebugStringF
 
+/** Return true if messages of the given -debug=<category> should be logged. A NULL category is always logged. */
+bool LogAcceptCategory(const char* category);
+/** Like printf, but the message is only formatted and logged if its category is enabled. */
+#define LogPrint(category, ...) (LogAcceptCategory(category) ? OutputDebugStringF(__VA_ARGS__) : 0)
+/** Hand debug.log writes to a background thread (see OutputDebugStringF).
+ *  Without fThread, messages stay queued until StopDebugLogWriter(); tests
+ *  use this to fill the queue. */
+void StartDebugLogWriter(bool fThread = true);
+/** Drain outstanding messages and return to synchronous debug.log writes. */
+void StopDebugLogWriter();
+
 void LogException(std::exception* pex, const char* pszThread);
 void PrintException(std::exception* pex, const char* pszThread);
 void PrintExceptionContinue(std::exception* pex, const char* pszThread);
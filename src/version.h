@@ -25,7 +25,7 @@ extern const std::string CLIENT_DATE;
 // network protocol versioning
 //
 
-static const int PROTOCOL_VERSION = 70002;
+static const int PROTOCOL_VERSION = 70003;
 
 // intial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 70002;
@@ -33,6 +33,9 @@ static const int INIT_PROTO_VERSION = 70002;
 // disconnect from peers older than this proto version
 static const int MIN_PEER_PROTO_VERSION = 70002;
 
+// "cmpctblock", "getblocktxn" and "blocktxn" messages, requested with MSG_CMPCT_BLOCK
+static const int COMPACT_BLOCKS_VERSION = 70003;
+
 // only request blocks from nodes outside this range of versions
 static const int NOBLKS_VERSION_START = 32000;
 static const int NOBLKS_VERSION_END = 32400;
@@ -5,7 +5,9 @@
 
 #include "wallet.h"
 #include "walletdb.h"
+#include "bloom.h"
 #include "crypter.h"
+#include "init.h"
 #include "ui_interface.h"
 #include "base58.h"
 #include "coincontrol.h"
@@ -344,6 +346,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                 {
                     printf("WalletUpdateSpent found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
+                    setTxDirty.insert(txin.prevout.hash);
                     wtx.WriteToDisk();
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
@@ -358,6 +361,7 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        fTxCacheValid = false;
     }
 }
 
@@ -445,6 +449,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
             fUpdated |= wtx.UpdateSpent(wtxIn.vfSpent);
         }
+        setTxDirty.insert(hash);
 
         //// debug print
         printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
@@ -520,8 +525,16 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            if ((*mi).second.fBalanceCached)
+                balanceTotal -= (*mi).second.balanceCached;
+            UpdateTxSpendable((*mi).second, true);
+            setTxVolatile.erase(hash);
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return true;
 }
@@ -771,37 +784,207 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+// Bloom filter of the data pushes that can make an output ours: public keys,
+// key hashes and the hashes of our P2SH scripts. Outputs that push none of
+// them are skipped without the exact (and locking) IsMine check.
+CBloomFilter CWallet::GetScriptFilter() const
+{
+    std::set<CKeyID> setKeys;
+    GetKeys(setKeys);
+
+    LOCK(cs_KeyStore);
+    CBloomFilter filter(std::max((size_t)1, 2 * setKeys.size() + mapScripts.size()), 0.0001, GetRand(0xFFFFFFFF), BLOOM_UPDATE_NONE);
+    BOOST_FOREACH(const CKeyID& keyID, setKeys)
+    {
+        filter.insert(vector<unsigned char>(keyID.begin(), keyID.end()));
+        CPubKey pubkey;
+        if (GetPubKey(keyID, pubkey))
+            filter.insert(vector<unsigned char>(pubkey.begin(), pubkey.end()));
+    }
+    for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); ++it)
+        filter.insert(vector<unsigned char>((*it).first.begin(), (*it).first.end()));
+    return filter;
+}
+
+static bool ScriptMayBeMine(const CBloomFilter& filter, const CScript& script)
+{
+    CScript::const_iterator pc = script.begin();
+    vector<unsigned char> vData;
+    opcodetype opcode;
+    while (pc < script.end())
+    {
+        if (!script.GetOp(pc, opcode, vData))
+            break;
+        if (!vData.empty() && filter.contains(vData))
+            return true;
+    }
+    return false;
+}
+
+namespace {
+
+/** A block read by the rescan, with the hashes of its transactions and which
+ *  of them have an output that passed the script filter */
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    CBlock block;
+    bool fRead;
+    vector<uint256> vHash;
+    vector<char> vfMatch;
+};
+
+} // anon namespace
+
+static void ReadRescanBlocks(vector<CRescanBlock>* pvBlocks, const CBloomFilter* pfilter, unsigned int nThread, unsigned int nThreads)
+{
+    for (unsigned int i = nThread; i < pvBlocks->size(); i += nThreads)
+    {
+        CRescanBlock& rb = (*pvBlocks)[i];
+        // Blocks in the index have been fully checked already; matching the
+        // hash is enough, the proof of play is not replayed again
+        rb.fRead = rb.block.ReadFromDisk(rb.pindex, false);
+        if (!rb.fRead)
+            continue;
+        rb.vHash.resize(rb.block.vtx.size());
+        rb.vfMatch.assign(rb.block.vtx.size(), false);
+        for (unsigned int j = 0; j < rb.block.vtx.size(); j++)
+        {
+            const CTransaction& tx = rb.block.vtx[j];
+            rb.vHash[j] = tx.GetHash();
+            BOOST_FOREACH(const CTxOut& txout, tx.vout)
+            {
+                if (ScriptMayBeMine(*pfilter, txout.scriptPubKey))
+                {
+                    rb.vfMatch[j] = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+//
+// Blocks are read and filtered in parallel, a batch at a time, and the
+// matches are then added to the wallet in chain order. After each batch the
+// position is saved in the wallet, so that a rescan that is interrupted by a
+// shutdown resumes from there on the next start.
+//
+// Returns the number of transactions added or updated, or -1 if a block
+// could not be read, in which case the wallet may be missing transactions.
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, bool fShowProgress)
 {
+    static const unsigned int RESCAN_BATCH = 128;
+
     int ret = 0;
 
-    CBlockIndex* pindex = pindexStart;
+    vector<CBlockIndex*> vChain;
     {
-        LOCK(cs_wallet);
-        while (pindex)
+        LOCK(cs_main);
+        // Blocks below a loaded UTXO snapshot reach the wallet when the
+        // background validation connects them
+        for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
+            if (pindex->nStatus & BLOCK_HAVE_DATA)
+                vChain.push_back(pindex);
+    }
+    if (vChain.empty())
+        return 0;
+
+    CBloomFilter filter = GetScriptFilter();
+    unsigned int nThreads = std::min(std::max(boost::thread::hardware_concurrency(), 1U), 8U);
+    int64 nLastProgress = GetTime();
+
+    for (unsigned int nBegin = 0; nBegin < vChain.size(); nBegin += RESCAN_BATCH)
+    {
+        if (ShutdownRequested())
+        {
+            printf("ScanForWalletTransactions() : interrupted at height %d\n", vChain[nBegin]->nHeight);
+            return ret;
+        }
+
+        unsigned int nEnd = std::min((unsigned int)vChain.size(), nBegin + RESCAN_BATCH);
+        vector<CRescanBlock> vBlocks(nEnd - nBegin);
+        for (unsigned int i = 0; i < vBlocks.size(); i++)
+            vBlocks[i].pindex = vChain[nBegin + i];
+
+        boost::thread_group threadGroup;
+        for (unsigned int t = 1; t < nThreads; t++)
+            threadGroup.create_thread(boost::bind(&ReadRescanBlocks, &vBlocks, &filter, t, nThreads));
+        ReadRescanBlocks(&vBlocks, &filter, 0, nThreads);
+        threadGroup.join_all();
+
         {
-            CBlock block;
-            block.ReadFromDisk(pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            LOCK2(cs_main, cs_wallet);
+            BOOST_FOREACH(CRescanBlock& rb, vBlocks)
             {
-                if (AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, fUpdate))
-                    ret++;
+                if (!rb.fRead)
+                {
+                    printf("ScanForWalletTransactions() : failed to read block %s\n", rb.pindex->GetBlockHash().ToString().c_str());
+                    return -1;
+                }
+                for (unsigned int j = 0; j < rb.block.vtx.size(); j++)
+                {
+                    const CTransaction& tx = rb.block.vtx[j];
+                    // Besides outputs that may be ours, look at everything
+                    // that spends from the wallet or is already in it
+                    bool fRelevant = rb.vfMatch[j] || (fUpdate && mapWallet.count(rb.vHash[j]));
+                    for (unsigned int k = 0; !fRelevant && k < tx.vin.size(); k++)
+                        fRelevant = mapWallet.count(tx.vin[k].prevout.hash) > 0;
+                    if (fRelevant && AddToWalletIfInvolvingMe(rb.vHash[j], tx, &rb.block, fUpdate))
+                        ret++;
+                }
             }
-            pindex = pindex->pnext;
+
+            if (fFileBacked && nEnd < vChain.size())
+                CWalletDB(strWalletFile).WriteRescanBlock(CBlockLocator(vChain[nEnd - 1]));
+        }
+
+        if (GetTime() - nLastProgress >= 10 || nEnd == vChain.size())
+        {
+            nLastProgress = GetTime();
+            int nPercent = (int)(100 * (uint64)nEnd / vChain.size());
+            printf("Rescanning: height %d, %d%% done\n", vChain[nEnd - 1]->nHeight, nPercent);
+            if (fShowProgress)
+                uiInterface.InitMessage(strprintf(_("Rescanning... %d%%"), nPercent));
         }
     }
+
+    if (fFileBacked)
+        CWalletDB(strWalletFile).EraseRescanBlock();
     return ret;
 }
 
+// The block the rescan at startup begins with: the best block the wallet
+// saw, or the block an interrupted rescan got to if that is earlier.
+CBlockIndex* CWallet::GetRescanStart()
+{
+    CWalletDB walletdb(strWalletFile);
+    CBlockLocator locator;
+    CBlockIndex* pindexRescan;
+    if (walletdb.ReadBestBlock(locator))
+        pindexRescan = locator.GetBlockIndex();
+    else
+        pindexRescan = pindexGenesisBlock;
+
+    // Resume a rescan that was interrupted
+    if (walletdb.ReadRescanBlock(locator))
+    {
+        CBlockIndex* pindexResume = locator.GetBlockIndex();
+        if (pindexResume && pindexResume->nHeight < pindexRescan->nHeight)
+            pindexRescan = pindexResume;
+    }
+    return pindexRescan;
+}
+
 void CWallet::ReacceptWalletTransactions()
 {
     bool fRepeat = true;
     while (fRepeat)
     {
-        LOCK(cs_wallet);
+        LOCK2(cs_main, cs_wallet);
         fRepeat = false;
         bool fMissing = false;
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
@@ -831,6 +1014,7 @@ void CWallet::ReacceptWalletTransactions()
                 {
                     printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkDirty();
+                    setTxDirty.insert(wtx.GetHash());
                     wtx.WriteToDisk();
                 }
             }
@@ -844,7 +1028,7 @@ void CWallet::ReacceptWalletTransactions()
         if (fMissing)
         {
             // TODO: optimize this to scan just part of the block chain?
-            if (ScanForWalletTransactions(pindexGenesisBlock))
+            if (ScanForWalletTransactions(pindexGenesisBlock) > 0)
                 fRepeat = true;  // Found missing transactions: re-do re-accept.
         }
     }
@@ -922,49 +1106,153 @@ void CWallet::ResendWalletTransactions()
 //
 
 
-int64 CWallet::GetBalance() const
-{
-    int64 nTotal = 0;
+// Contribution of one transaction to the balance buckets. fVolatile is set
+// when it can change without the transaction itself changing: while it is
+// unconfirmed or non-final, and while a coinbase in the main chain matures.
+static CWalletBalance GetTxBalance(const CWalletTx& wtx, bool& fVolatile)
+{
+    CWalletBalance balance;
+    bool fFinal = wtx.IsFinal();
+    bool fConfirmed = wtx.IsConfirmed();
+    int64 nAvailable = wtx.GetAvailableCredit();
+    if (fConfirmed)
+        balance.nConfirmed = nAvailable;
+    if (!fFinal || !fConfirmed)
+        balance.nUnconfirmed = nAvailable;
+    balance.nImmature = wtx.GetImmatureCredit();
+    int nDepth = wtx.GetDepthInMainChain();
+    // A coinbase that is off the main chain never enters the memory pool, so
+    // only a reorganization can bring it back, and that starts the caches over
+    if (wtx.IsCoinBase() && nDepth < 0)
+        fVolatile = false;
+    else
+        fVolatile = !fFinal || nDepth < 1 || wtx.GetBlocksToMaturity() > 0;
+    return balance;
+}
+
+void CWallet::UpdateTxSpendable(const CWalletTx& wtx, bool fErase) const
+{
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
+        const CTxOut& txout = wtx.vout[i];
+        pair<int64, pair<const CWalletTx*, unsigned int> > coin = make_pair(txout.nValue, make_pair(&wtx, i));
+        if (!fErase && !wtx.IsSpent(i) && IsMine(txout))
+            setSpendable.insert(coin);
+        else
+            setSpendable.erase(coin);
     }
+}
 
-    return nTotal;
+void CWallet::UpdateTxBalance(const uint256& hash, const CWalletTx& wtx) const
+{
+    if (wtx.fBalanceCached)
+        balanceTotal -= wtx.balanceCached;
+    bool fVolatile;
+    wtx.balanceCached = GetTxBalance(wtx, fVolatile);
+    wtx.fBalanceCached = true;
+    balanceTotal += wtx.balanceCached;
+    if (fVolatile)
+        setTxVolatile.insert(hash);
+    else
+        setTxVolatile.erase(hash);
 }
 
-int64 CWallet::GetUnconfirmedBalance() const
+// Requires cs_wallet
+void CWallet::UpdateTxCaches() const
 {
-    int64 nTotal = 0;
+    CBlockIndex* pindexTip = pindexBest;
+
+    // Transactions that were confirmed at pindexTxCacheTip stay confirmed as
+    // long as that block is still in the main chain
+    if (fTxCacheValid && pindexTxCacheTip && !pindexTxCacheTip->IsInMainChain())
+        fTxCacheValid = false;
+
+    if (!fTxCacheValid)
     {
-        LOCK(cs_wallet);
+        balanceTotal = CWalletBalance();
+        setSpendable.clear();
+        setTxDirty.clear();
+        setTxVolatile.clear();
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
+            (*it).second.fBalanceCached = false;
+            UpdateTxBalance((*it).first, (*it).second);
+            UpdateTxSpendable((*it).second);
         }
     }
-    return nTotal;
+    else
+    {
+        // Which outputs are spendable only depends on the transaction itself
+        std::set<uint256> setUpdate;
+        setUpdate.swap(setTxDirty);
+        BOOST_FOREACH(const uint256& hash, setUpdate)
+        {
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+            if (mi != mapWallet.end())
+                UpdateTxSpendable((*mi).second);
+        }
+        setUpdate.insert(setTxVolatile.begin(), setTxVolatile.end());
+        BOOST_FOREACH(const uint256& hash, setUpdate)
+        {
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+            if (mi != mapWallet.end())
+                UpdateTxBalance(hash, (*mi).second);
+        }
+    }
+
+    // If a block was connected meanwhile some contributions may be computed
+    // against it; start over next time rather than trust them
+    fTxCacheValid = (pindexBest == pindexTip);
+    pindexTxCacheTip = pindexTip;
+}
+
+CWalletBalance CWallet::GetBalances() const
+{
+    LOCK(cs_wallet);
+    UpdateTxCaches();
+    return balanceTotal;
+}
+
+int64 CWallet::GetBalance() const
+{
+    return GetBalances().nConfirmed;
+}
+
+int64 CWallet::GetUnconfirmedBalance() const
+{
+    return GetBalances().nUnconfirmed;
 }
 
 int64 CWallet::GetImmatureBalance() const
 {
-    int64 nTotal = 0;
+    return GetBalances().nImmature;
+}
+
+bool CWallet::CheckBalances() const
+{
+    LOCK(cs_wallet);
+    UpdateTxCaches();
+
+    CWalletBalance balance;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
+        const CWalletTx* pcoin = &(*it).second;
+        if (pcoin->IsConfirmed())
+            balance.nConfirmed += pcoin->GetAvailableCredit(false);
+        if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
+            balance.nUnconfirmed += pcoin->GetAvailableCredit(false);
+        balance.nImmature += pcoin->GetImmatureCredit(false);
     }
-    return nTotal;
+
+    if (!(balance == balanceTotal))
+    {
+        printf("CheckBalances() : mismatch, confirmed %s/%s unconfirmed %s/%s immature %s/%s\n",
+               FormatMoney(balanceTotal.nConfirmed).c_str(), FormatMoney(balance.nConfirmed).c_str(),
+               FormatMoney(balanceTotal.nUnconfirmed).c_str(), FormatMoney(balance.nUnconfirmed).c_str(),
+               FormatMoney(balanceTotal.nImmature).c_str(), FormatMoney(balance.nImmature).c_str());
+        return false;
+    }
+    return true;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -974,29 +1262,38 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!pcoin->IsFinal())
-                continue;
-
-            if (fOnlyConfirmed && !pcoin->IsConfirmed())
-                continue;
+        UpdateTxCaches();
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+        // Depth of the transactions whose outputs may be spent, -1 for the others
+        map<const CWalletTx*, int> mapDepth;
+        // -mininput can change at runtime, so it is applied here rather than in the index
+        pair<int64, pair<const CWalletTx*, unsigned int> > coinMin(nMinimumInputValue, make_pair((const CWalletTx*)NULL, 0));
+        for (set<pair<int64, pair<const CWalletTx*, unsigned int> > >::const_iterator it = setSpendable.lower_bound(coinMin); it != setSpendable.end(); ++it)
+        {
+            const CWalletTx* pcoin = (*it).second.first;
+            unsigned int i = (*it).second.second;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
+            map<const CWalletTx*, int>::iterator mi = mapDepth.find(pcoin);
+            if (mi == mapDepth.end())
+            {
+                int nDepth = -1;
+                if (pcoin->IsFinal() && (!fOnlyConfirmed || pcoin->IsConfirmed()) &&
+                    !(pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0))
+                    nDepth = pcoin->GetDepthInMainChain();
+                mi = mapDepth.insert(make_pair(pcoin, nDepth)).first;
+            }
+            if ((*mi).second < 0)
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue >= nMinimumInputValue &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i))) 
-                    vCoins.push_back(COutput(pcoin, i, nDepth));
+            if (!setLockedCoins.empty() || (coinControl && coinControl->HasSelected()))
+            {
+                uint256 hash = pcoin->GetHash();
+                if (IsLockedCoin(hash, i))
+                    continue;
+                if (coinControl && coinControl->HasSelected() && !coinControl->IsSelected(hash, i))
+                    continue;
             }
+            vCoins.push_back(COutput(pcoin, i, (*mi).second));
         }
     }
 }
@@ -1047,6 +1344,57 @@ static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsig
     }
 }
 
+// Depth-first search for a subset of vValue (sorted by decreasing value) that
+// adds up to exactly nTargetValue, so that no change output is needed.
+// Branches are cut as soon as they overshoot the target or cannot reach it with
+// the coins that are left, and after excluding a coin, coins of the same value
+// are not tried in its place.
+static bool SelectCoinsBnB(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTargetValue,
+                           vector<char>& vfBest, int nMaxTries = 100000)
+{
+    unsigned int nCoins = vValue.size();
+    vector<int64> vRemaining(nCoins + 1, 0);
+    for (unsigned int i = nCoins; i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
+
+    vector<char> vfIncluded(nCoins, false);
+    int64 nTotal = 0;
+    unsigned int i = 0;
+    for (int nTries = 0; nTries < nMaxTries; nTries++)
+    {
+        if (nTotal == nTargetValue)
+        {
+            vfBest = vfIncluded;
+            return true;
+        }
+
+        if (nTotal > nTargetValue || nTotal + vRemaining[i] < nTargetValue)
+        {
+            // Backtrack: exclude the last coin included so far
+            while (i > 0 && !vfIncluded[i - 1])
+                i--;
+            if (i == 0)
+                return false;
+            i--;
+            vfIncluded[i] = false;
+            nTotal -= vValue[i].first;
+            i++;
+        }
+        else if (i > 0 && !vfIncluded[i - 1] && vValue[i].first == vValue[i - 1].first)
+        {
+            // Same as the coin just excluded
+            i++;
+        }
+        else
+        {
+            vfIncluded[i] = true;
+            nTotal += vValue[i].first;
+            i++;
+        }
+    }
+    return false;
+}
+
 bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
 {
@@ -1110,14 +1458,19 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
+    // Look for an exact match, otherwise solve subset sum by stochastic approximation
     sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     int64 nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    if (SelectCoinsBnB(vValue, nTargetValue, vfBest))
+        nBest = nTargetValue;
+    else
+    {
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+        if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    }
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -1295,9 +1648,10 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend,
                     wtxNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
 
                 // Sign
+                CSignatureHashCache sighashCache(wtxNew);
                 int nIn = 0;
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
+                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++, SIGHASH_ALL, &sighashCache))
                     {
                         strFailReason = _("Signing transaction failed");
                         return false;
@@ -1367,6 +1721,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 CWalletTx &coin = mapWallet[txin.prevout.hash];
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
+                setTxDirty.insert(txin.prevout.hash);
                 coin.WriteToDisk();
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
@@ -25,6 +25,7 @@ class CWalletTx;
 class CReserveKey;
 class COutput;
 class CCoinControl;
+class CBloomFilter;
 
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
@@ -62,6 +63,38 @@ public:
     )
 };
 
+/** Balance buckets, of the whole wallet or of a single transaction */
+class CWalletBalance
+{
+public:
+    int64 nConfirmed;
+    int64 nUnconfirmed;
+    int64 nImmature;
+
+    CWalletBalance() : nConfirmed(0), nUnconfirmed(0), nImmature(0) {}
+
+    CWalletBalance& operator+=(const CWalletBalance& b)
+    {
+        nConfirmed += b.nConfirmed;
+        nUnconfirmed += b.nUnconfirmed;
+        nImmature += b.nImmature;
+        return *this;
+    }
+
+    CWalletBalance& operator-=(const CWalletBalance& b)
+    {
+        nConfirmed -= b.nConfirmed;
+        nUnconfirmed -= b.nUnconfirmed;
+        nImmature -= b.nImmature;
+        return *this;
+    }
+
+    friend bool operator==(const CWalletBalance& a, const CWalletBalance& b)
+    {
+        return a.nConfirmed == b.nConfirmed && a.nUnconfirmed == b.nUnconfirmed && a.nImmature == b.nImmature;
+    }
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -78,6 +111,25 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // Balance totals and the index of spendable outputs, kept up to date
+    // incrementally instead of walking mapWallet on every query. Transactions
+    // marked dirty since the last query are re-evaluated, and so are those
+    // whose balance can change without the wallet touching them (unconfirmed,
+    // non-final or immature); everything is recomputed after a reorg.
+    // Guarded by cs_wallet.
+    mutable CWalletBalance balanceTotal;
+    mutable std::set<std::pair<int64, std::pair<const CWalletTx*, unsigned int> > > setSpendable; // unspent outputs of ours, by value
+    mutable std::set<uint256> setTxDirty;
+    mutable std::set<uint256> setTxVolatile;
+    mutable CBlockIndex* pindexTxCacheTip;
+    mutable bool fTxCacheValid;
+
+    void UpdateTxCaches() const;
+    void UpdateTxBalance(const uint256& hash, const CWalletTx& wtx) const;
+    void UpdateTxSpendable(const CWalletTx& wtx, bool fErase = false) const;
+
+    CBloomFilter GetScriptFilter() const;
+
 public:
     mutable CCriticalSection cs_wallet;
 
@@ -99,6 +151,8 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        pindexTxCacheTip = NULL;
+        fTxCacheValid = false;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -109,6 +163,8 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        pindexTxCacheTip = NULL;
+        fTxCacheValid = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -172,12 +228,16 @@ public:
     bool AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout);
-    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false, bool fShowProgress = false);
+    CBlockIndex* GetRescanStart();
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
     int64 GetBalance() const;
     int64 GetUnconfirmedBalance() const;
     int64 GetImmatureBalance() const;
+    CWalletBalance GetBalances() const;
+    // Compare the incremental balances with a full walk of mapWallet (for tests)
+    bool CheckBalances() const;
     bool CreateTransaction(const std::vector<std::pair<CScript, int64> >& vecSend,
                            CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet, std::string& strFailReason, const CCoinControl *coinControl=NULL);
     bool CreateTransaction(CScript scriptPubKey, int64 nValue,
@@ -391,6 +451,8 @@ public:
     mutable int64 nImmatureCreditCached;
     mutable int64 nAvailableCreditCached;
     mutable int64 nChangeCached;
+    mutable bool fBalanceCached; // balanceCached is included in the wallet's totals
+    mutable CWalletBalance balanceCached;
 
     CWalletTx()
     {
@@ -434,6 +496,8 @@ public:
         nImmatureCreditCached = 0;
         nAvailableCreditCached = 0;
         nChangeCached = 0;
+        fBalanceCached = false;
+        balanceCached = CWalletBalance();
         nOrderPos = -1;
     }
 
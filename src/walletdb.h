@@ -92,6 +92,23 @@ public:
         return Read(std::string("bestblock"), locator);
     }
 
+    bool WriteRescanBlock(const CBlockLocator& locator)
+    {
+        nWalletDBUpdated++;
+        return Write(std::string("rescanblock"), locator);
+    }
+
+    bool ReadRescanBlock(CBlockLocator& locator)
+    {
+        return Read(std::string("rescanblock"), locator);
+    }
+
+    bool EraseRescanBlock()
+    {
+        nWalletDBUpdated++;
+        return Erase(std::string("rescanblock"));
+    }
+
     bool WriteOrderPosNext(int64 nOrderPosNext)
     {
         nWalletDBUpdated++;